@@ -0,0 +1,240 @@
+/*****************************************************************************/
+//
+//  @file: fits_direct.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Writes the data unit of FITS files with `pwrite', bypassing
+//         CFITSIO, from the threads of an `ska_io_queue'. See
+//         `fits_direct_writer' in fits_local.h.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+// Core includes
+#include "kdu_messaging.h"
+// FITS includes
+#include "fits_local.h"
+
+#define FITS_BLOCK 2880
+// Buffers per writer thread, so one can be filled while another is written
+#define FITS_JOBS_PER_THREAD 2
+
+struct fits_write_job : public ska_io_job {
+  kdu_long offset; // From the start of the data unit
+  int num_samples;
+  int max_samples; // Allocated in `buf'
+  kdu_uint32 *buf; // Big-endian samples
+  fits_write_job *next; // In `free_jobs'
+};
+
+/*****************************************************************************/
+/* STATIC                        copy_big_endian                             */
+/*****************************************************************************/
+
+static void
+  copy_big_endian(kdu_uint32 *dst, const float *src, int num)
+  /* FITS stores IEEE floats big-endian. */
+{
+  kdu_uint32 probe = 1;
+  if (*((kdu_byte *) &probe) == 0)
+    { memcpy(dst,src,((size_t) num) << 2); return; } // Big-endian host
+  const kdu_uint32 *sp = (const kdu_uint32 *) src;
+#if defined(__SSE2__)
+  for (; num >= 4; num-=4, sp+=4, dst+=4)
+    { // Swap the bytes of each 16-bit half, then swap the halves
+      __m128i v = _mm_loadu_si128((const __m128i *) sp);
+      v = _mm_or_si128(_mm_slli_epi16(v,8),_mm_srli_epi16(v,8));
+      v = _mm_shufflelo_epi16(v,_MM_SHUFFLE(2,3,0,1));
+      v = _mm_shufflehi_epi16(v,_MM_SHUFFLE(2,3,0,1));
+      _mm_storeu_si128((__m128i *) dst,v);
+    }
+#endif // __SSE2__
+  for (; num > 0; num--, sp++, dst++)
+    { kdu_uint32 v = *sp;
+      *dst = (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) |
+        (v << 24); }
+}
+
+/* ========================================================================= */
+/*                            fits_direct_writer                             */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                  fits_direct_writer::fits_direct_writer                   */
+/*****************************************************************************/
+
+fits_direct_writer::fits_direct_writer()
+{
+  fd = -1;
+  fname = NULL;
+  data_start = 0;
+  num_jobs = 0;
+  jobs = NULL;
+  free_jobs = NULL;
+}
+
+/*****************************************************************************/
+/*                  fits_direct_writer::~fits_direct_writer                  */
+/*****************************************************************************/
+
+fits_direct_writer::~fits_direct_writer()
+{
+  finish();
+  for (int j=0; j < num_jobs; j++)
+    delete[] jobs[j].buf;
+  delete[] jobs;
+  delete[] fname;
+}
+
+/*****************************************************************************/
+/* STATIC                  fits_direct_writer::create                        */
+/*****************************************************************************/
+
+fits_direct_writer *
+  fits_direct_writer::create(const char *fname, const char *header,
+      int header_bytes, kdu_long data_bytes, int num_threads)
+{
+  fits_direct_writer *obj = new fits_direct_writer;
+  obj->fname = new char[strlen(fname)+1];
+  strcpy(obj->fname,fname);
+  obj->fd = open(fname,O_WRONLY|O_CREAT|O_TRUNC,0666);
+  if (obj->fd < 0)
+    { kdu_error e; e << "Unable to create FITS file, \"" << fname << "\": "
+      << strerror(errno) << "."; }
+
+  // Header records are padded with spaces, the data unit with zeros
+  obj->data_start = ((header_bytes + FITS_BLOCK-1) / FITS_BLOCK) * FITS_BLOCK;
+  char *padded = new char[(size_t) obj->data_start];
+  memcpy(padded,header,header_bytes);
+  memset(padded+header_bytes,' ',(size_t)(obj->data_start-header_bytes));
+  int err = ska_pwrite_fully(obj->fd,padded,(size_t) obj->data_start,0);
+  delete[] padded;
+  kdu_long file_bytes = obj->data_start +
+    ((data_bytes + FITS_BLOCK-1) / FITS_BLOCK) * FITS_BLOCK;
+#if defined(__linux__)
+  // Reserve the blocks now, so the file is not fragmented by writes
+  // arriving out of order; this may fail on file systems which can't
+  if ((err == 0) && (file_bytes > obj->data_start))
+    posix_fallocate(obj->fd,(off_t) obj->data_start,
+                    (off_t)(file_bytes - obj->data_start));
+#endif
+  if ((err == 0) && (ftruncate(obj->fd,(off_t) file_bytes) != 0))
+    err = errno;
+  if (err != 0)
+    { kdu_error e; e << "Unable to write FITS file, \"" << fname << "\": "
+      << strerror(err) << "."; }
+
+  if (num_threads < 1)
+    num_threads = 1;
+  obj->num_jobs = num_threads * FITS_JOBS_PER_THREAD;
+  obj->jobs = new fits_write_job[obj->num_jobs];
+  for (int j=0; j < obj->num_jobs; j++)
+    {
+      obj->jobs[j].num_samples = obj->jobs[j].max_samples = 0;
+      obj->jobs[j].buf = NULL;
+      obj->jobs[j].next = obj->free_jobs;
+      obj->free_jobs = obj->jobs + j;
+    }
+  if (obj->writers.start(num_threads,do_write,write_done,obj) == 0)
+    { kdu_error e; e << "Unable to start FITS writer threads."; }
+  return obj;
+}
+
+/*****************************************************************************/
+/*                       fits_direct_writer::write                           */
+/*****************************************************************************/
+
+void
+  fits_direct_writer::write(kdu_long offset, const float *samples, int num)
+{
+  if (num <= 0)
+    return;
+  writers.lock();
+  while ((free_jobs == NULL) && (writers.get_error() == 0))
+    writers.wait_done();
+  fits_write_job *job = free_jobs;
+  if (writers.get_error() == 0)
+    free_jobs = job->next;
+  writers.unlock();
+  check_error();
+
+  // Conversion happens here, while the writer threads get on with the I/O
+  if (job->max_samples < num)
+    {
+      delete[] job->buf;
+      job->buf = new kdu_uint32[num];
+      job->max_samples = num;
+    }
+  copy_big_endian(job->buf,samples,num);
+  job->offset = offset;
+  job->num_samples = num;
+  job->next = NULL;
+
+  writers.lock();
+  writers.push(job);
+  writers.unlock();
+}
+
+/*****************************************************************************/
+/*                       fits_direct_writer::finish                          */
+/*****************************************************************************/
+
+void
+  fits_direct_writer::finish()
+{
+  if (fd < 0)
+    return;
+  writers.stop(); // Lets the threads finish every queued write
+  int err = (close(fd) == 0)?0:errno;
+  fd = -1;
+  writers.set_error(err);
+  check_error();
+}
+
+/*****************************************************************************/
+/*                    fits_direct_writer::check_error                        */
+/*****************************************************************************/
+
+void
+  fits_direct_writer::check_error()
+{
+  int err = writers.get_error();
+  if (err != 0)
+    { kdu_error e; e << "Unable to write FITS file, \"" << fname << "\": "
+      << strerror(err) << "."; }
+}
+
+/*****************************************************************************/
+/* STATIC                   fits_direct_writer::do_write                     */
+/*****************************************************************************/
+
+int
+  fits_direct_writer::do_write(void *context, ska_io_job *job)
+{
+  fits_direct_writer *obj = (fits_direct_writer *) context;
+  fits_write_job *wj = (fits_write_job *) job;
+  return ska_pwrite_fully(obj->fd,wj->buf,((size_t) wj->num_samples)<<2,
+                          obj->data_start + wj->offset);
+}
+
+/*****************************************************************************/
+/* STATIC                  fits_direct_writer::write_done                    */
+/*****************************************************************************/
+
+void
+  fits_direct_writer::write_done(void *context, ska_io_job *job)
+{
+  fits_direct_writer *obj = (fits_direct_writer *) context;
+  fits_write_job *wj = (fits_write_job *) job;
+  wj->next = obj->free_jobs;
+  obj->free_jobs = wj;
+}
@@ -32,32 +32,9 @@
 // FITS includes
 #include "fitsio.h"
 #include "fits_local.h"
+#include "ska_wcs.h"
 #include "sample_converter.h"
 
-/*****************************************************************************/
-/* STATIC                   irreversible_normalize                           */
-/*****************************************************************************/
-
-static void
-  irreversible_normalize(float *buf, int buf_length, 
-    bool is_signed, double minval, double maxval, bool cerr_samples)
-{
-  //TODO: add normalization domain
-  
-  float factor, scale, offset=0.0;
-  float limmin=-0.75, limmax=0.75;
-  offset = -0.5;
-  scale = 1.0 / fabs(maxval-minval);
-
-  for (int i = 0; i < buf_length; i++)
-  {
-    float fval = (buf[i]-minval) * scale + offset;
-    fval = (fval > limmin)?fval:limmin;
-    fval = (fval < limmax)?fval:limmax;
-    buf[i] = fval;
-  }
-}
-
 /*****************************************************************************/
 /* STATIC                  convert_TFLOAT_to_ints                          */
 /*****************************************************************************/
@@ -97,90 +74,6 @@ convert_TFLOAT_to_ints(float *src, kdu_sample32 *dest,  int num,
       assert(0);
 }
 
-/*****************************************************************************/
-/* Determine min and max - TODO clean up this code                           */
-/*****************************************************************************/
-void fits_in::determine_min_and_max(ska_source_file* const source_file, int component) {
-    int height = 1;
-    float min = FLT_MAX;
-    float max = FLT_MIN;
-    int num_unread_rows = source_file->crop.height * source_file->crop.depth;
-    
-    std::cout << "Starting search for min and max values..." << std::endl;
-    
-    int anynul = 0;
-    unsigned char nulval = 0;
-    LONGLONG stripe_elements = source_file->crop.width;
-    LONGLONG *fpixel_copy = (LONGLONG*) malloc(sizeof(LONGLONG) * naxis);   
-    
-    fpixel_copy[0] = source_file->crop.x + 1; // read from the begining of line
-    fpixel_copy[1] = 1; // read from first row
-    fpixel_copy[2] = component+1; // select plane
-    
-    while(num_unread_rows > 0) {      
-        float *buf = new float[stripe_elements];
-        double *double_buffer = new double[stripe_elements];
-        switch (bitpix) {
-            case FLOAT_IMG:
-                fits_read_pixll(in, TFLOAT, fpixel_copy, stripe_elements, &nulval, buf,
-                                &anynul, &status);
-                break;
-            case DOUBLE_IMG:
-                fits_read_pixll(in, TDOUBLE, fpixel_copy, stripe_elements, &nulval, double_buffer,
-                               &anynul, &status);
-                for(int index = 0; index < stripe_elements; index++) {
-                    buf[index] = (float) double_buffer[index];
-                }
-                break;
-            default:
-                kdu_error e; e << "Unsupport FITS image type!";
-        }
-        
-        if (status != 0) {
-            kdu_error e; e << "FITS file terminated prematurely!";
-            return;
-        }
-        
-        fpixel_copy[1]++;
-
-        // If not NaN, check min and max
-        // for undefined pixels the buffer is being filled with -nan,
-        // with my current compiler isnan(-nan) is returning false.
-        // I identified -nan to be 4294967295 in binary, so thats how i'm
-        // testing for this case...
-        // TODO: show this horrible snippet of code to someone for better ideas
-        
-        for(int i = 0; i < height * stripe_elements; i++) {
-            union ufloat {
-                float f;
-                unsigned b;
-            } uf;
-            uf.f = buf[i];
-            
-            if (uf.b != 4294967295) {
-                if(buf[i] > max) {
-                    max = buf[i];
-                }
-                if(buf[i] < min) {
-                    min = buf[i];
-                }
-            }
-        }
-        
-        // Increment the position in FITS file
-        num_unread_rows -= height;
-    }
-    
-    // Update Min and max values
-    std::cout << "min: " << min << ", max: " << max << std::endl;
-    if(source_file->float_minvals > min) {
-        source_file->float_minvals = min;
-    }
-    if(source_file->float_maxvals < max) {
-        source_file->float_maxvals = max;
-    }
-}
-
 /* ========================================================================= */
 /*                                   fits_in                                 */
 /* ========================================================================= */
@@ -239,6 +132,24 @@ fits_in::read_header(jp2_family_tgt &tgt, kdu_args &args,
   for(int i = 0; i < naxis; i++) 
     std::cout << naxes[i] << " ";
   std::cout << std::endl;
+
+  // Planes and Stokes parameters are the 3rd and 4th axes, if present
+  file_depth = (naxis > 2)?((int) naxes[2]):1;
+  file_stokes = (naxis > 3)?((int) naxes[3]):1;
+  if (source_file->crop.num_stokes == 0)
+    source_file->crop.num_stokes = file_stokes - source_file->crop.stokes;
+  if ((source_file->crop.num_stokes < 1) || (source_file->crop.stokes +
+        source_file->crop.num_stokes > file_stokes))
+    { kdu_error e; e << "Requested Stokes parameters are not compatible "
+      "with the FITS image, which has " << file_stokes << " of them."; }
+
+  // Tile-compressed images are decompressed by us, in parallel, if we can
+  tiles = fits_tile_reader::create(in, bitpix, naxis, naxes);
+  if (tiles != NULL) {
+    std::cout << "Tile-compressed image; tiles will be decompressed in "
+      "parallel." << std::endl;
+    source_file->block_height = tiles->get_tile_height();
+  }
   
   // Prepare initial fpixel for CFITSIO. Will be used in fits_in::get
   fpixel = (LONGLONG*) malloc(sizeof(LONGLONG) * naxis);
@@ -258,10 +169,10 @@ fits_in::read_header(jp2_family_tgt &tgt, kdu_args &args,
       fpixel[2] = 1;
     source_file->crop.width = naxes[0];
     source_file->crop.height = naxes[1];
-    source_file->crop.depth = naxes[2];
+    source_file->crop.depth = file_depth;
   }
-  if (naxis > 3)
-    fpixel[3] = 1;
+  for (int d=3; d < naxis; d++)
+    fpixel[d] = 1;
   free(naxes);
 
   double scale = 1.0;
@@ -310,7 +221,6 @@ fits_in::read_header(jp2_family_tgt &tgt, kdu_args &args,
   bool has_premultiplied_alpha=false;  //at this stage we declare "no alpha components"
   bool has_unassociated_alpha=false;
 
-  bool has_min_max_in_header = true; // Check if the FITS header contains DATAMIN and DATATMAX values
   bool align_lsbs = false;
   if (source_file->forced_prec > 0) 
     source_file->precision = source_file->forced_prec;
@@ -318,36 +228,33 @@ fits_in::read_header(jp2_family_tgt &tgt, kdu_args &args,
   source_file->bytes_per_sample = source_file->precision / 8;
 
   //total number ot rows to read
-  num_unread_rows = source_file->crop.height * 
-    source_file->crop.depth;
+  int num_components = source_file->crop.depth * source_file->crop.num_stokes;
+  num_unread_rows = source_file->crop.height * num_components;
 
   // Read header
   fits_get_hdrspace(in, &nkeys, NULL, &status);
   if (status != 0)
     { kdu_error e; e << "Unable to get the number of keywords in FITS file."; }
 
-  source_file->metadata_buffer = new kdu_byte [BUFSIZ];
+  // Each record is at most FLEN_CARD-1 characters, plus our separator
+  source_file->metadata_buffer = new kdu_byte [nkeys*FLEN_CARD + 1];
   int buf_idx = 0; 
+  bool has_datamin = false, has_datamax = false;
   for (int i=1; i<=nkeys; i++) {
     // read for data min and max value
     fits_read_keyn(in,i,keyname,keyvalue,keycomment, &status);
     if (status != 0)
     { kdu_error e; e << "Error reading keyword number " << i; }
     
-    // overwrite default min and max values for the entire image
-    if (!fits.minmax) {
-      if (!strcmp(keyname, "DATAMIN")) {
-        sscanf(keyvalue, "%lf", &source_file->float_minvals);
-      } else {
-        has_min_max_in_header = false;
-        source_file->float_maxvals = FLT_MAX;
-      }
-      if (!strcmp(keyname, "DATAMAX")) {
-        sscanf(keyvalue, "%lf", &source_file->float_maxvals);
-      } else {
-          source_file->float_maxvals = FLT_MIN;
-        has_min_max_in_header = false;
-      }
+    // overwrite default min and max values for the entire image, unless
+    // they were given on the command line
+    if (!source_file->range_known) {
+      if (!strcmp(keyname, "DATAMIN"))
+        has_datamin =
+          (sscanf(keyvalue, "%lf", &source_file->float_minvals) == 1);
+      if (!strcmp(keyname, "DATAMAX"))
+        has_datamax =
+          (sscanf(keyvalue, "%lf", &source_file->float_maxvals) == 1);
     }
 
     // put all the header data into metadata (in case we ever convert back to
@@ -362,19 +269,17 @@ fits_in::read_header(jp2_family_tgt &tgt, kdu_args &args,
   }
   
   source_file->metadata_length = buf_idx;
-  source_file->metadata_buffer[buf_idx--] = '\0';
-
-  frame_fheight = new long [source_file->crop.depth];
-  for(int i = 0; i < source_file->crop.depth; ++i) {
+  source_file->metadata_buffer[buf_idx] = '\0';
+  // The reference pixels must follow the cube if it was cropped
+  ska_wcs::shift_records(source_file->metadata_buffer,
+      source_file->metadata_length, source_file->crop.x, source_file->crop.y,
+      source_file->crop.z, 0);
+  if (has_datamin && has_datamax)
+    source_file->range_known = true; // Otherwise the cube will be scanned
+
+  frame_fheight = new long [num_components];
+  for(int i = 0; i < num_components; ++i)
     frame_fheight[i] = 0;
-    if(!has_min_max_in_header) {
-        determine_min_and_max(source_file, i);
-    }
-  }
-    
-  std::cout << "\nThe following values of MIN and MAX will be used:\n";
-  std::cout << "DATAMIN = " << source_file->float_minvals << "\n";
-  std::cout << "DATAMAX = " << source_file->float_maxvals << "\n";
 }
 
 /*****************************************************************************/
@@ -385,6 +290,7 @@ fits_in::~fits_in()
 {
   if (num_unread_rows > 0)
     { kdu_warning w; w << "Not all rows were read!"; }
+  delete tiles;
   fits_close_file(in, &status);
   if (status != 0)
     { kdu_error e; e << "Unable to close FITS image!"; }
@@ -399,52 +305,67 @@ void
 fits_in::read_stripe(int height, float *buf, ska_source_file* const source_file,
     int component)
 {
+  read_raw_stripe(height, buf, source_file, component);
+
+  // normalize input samples between specified range (usually -0.5 and 0.5);
+  // undefined (NaN) pixels are set to the bottom of the range
+  source_file->norm.normalize(buf, source_file->crop.width * height,
+      component);
+}
+
+/*****************************************************************************/
+/*                          fits_in::read_raw_stripe                         */
+/*****************************************************************************/
+
+void
+fits_in::read_raw_stripe(int height, float *buf,
+    ska_source_file* const source_file, int component)
+{
+  // Components run through the planes of each selected Stokes parameter
+  int plane = component % source_file->crop.depth;
+  int stokes = source_file->crop.stokes + component / source_file->crop.depth;
+  if (tiles != NULL) {
+    tiles->read_rows(source_file->crop.x,
+        source_file->crop.y + frame_fheight[component],
+        stokes * file_depth + source_file->crop.z + plane,
+        source_file->crop.width, height, source_file->crop.depth - plane,
+        buf, source_file->env);
+    frame_fheight[component] += height;
+    num_unread_rows -= height;
+    return;
+  }
+
   int anynul = 0;
-  unsigned char nulval = 0;
   LONGLONG stripe_elements = source_file->crop.width;
   fpixel[0] = source_file->crop.x + 1; // read from the begining of line
-  fpixel[1] = frame_fheight[component]+1;
-  fpixel[2] = component+1;
+  fpixel[1] = source_file->crop.y + frame_fheight[component] + 1;
+  if (naxis > 2)
+    fpixel[2] = source_file->crop.z + plane + 1;
+  if (naxis > 3)
+    fpixel[3] = stokes + 1;
 
-  double *double_buffer = new double[stripe_elements];
+  // A NULL `nulval' leaves undefined pixels as NaNs
+  double *double_buffer = NULL;
+  if (bitpix == DOUBLE_IMG)
+    double_buffer = new double[stripe_elements];
   for(int i = 0; i < height; i++, buf+=source_file->crop.width, fpixel[1]++) {
     switch (bitpix) { 
-      case FLOAT_IMG: 
-        fits_read_pixll(in, TFLOAT, fpixel, stripe_elements, &nulval, buf, 
-            &anynul, &status);
-        break;
       case DOUBLE_IMG:
-        fits_read_pixll(in, TDOUBLE, fpixel, stripe_elements, &nulval, double_buffer,
-                        &anynul, &status);
+        fits_read_pixll(in, TDOUBLE, fpixel, stripe_elements, NULL,
+            double_buffer, &anynul, &status);
         for(int index = 0; index < stripe_elements; index++) {
           buf[index] = (float) double_buffer[index];
         }
         break;
-      default:
-        kdu_error e; e << "Unsupport FITS image type!";
+      default: // CFITSIO converts every other BITPIX to floats for us
+        fits_read_pixll(in, TFLOAT, fpixel, stripe_elements, NULL, buf, 
+            &anynul, &status);
+        break;
     }
     if (status != 0)
       { kdu_error e; e << "FITS file terminated prematurely!"; }
   }
-  buf -= source_file->crop.width * height;
-
-  // for undefined pixels the buffer is being filled with -nan,
-  // with my current compiler isnan(-nan) is returning false.
-  // I identified -nan to be 4294967295 in binary, so thats how i'm 
-  // testing for this case...
-  // TODO: show this horrible snippet of code to someone for better ideas
-  union ufloat {
-    float f;
-    unsigned b;
-  } uf; 
-  uf.f = buf[0];
-  // set undefined pixels to the minimum float value in the image
-  if (uf.b == 4294967295)
-    buf[0] = source_file->float_minvals;
-
-  // normalize input samples between specified range (usually -0.5 and 0.5)
-  irreversible_normalize(buf, stripe_elements*height, source_file->is_signed, 
-      source_file->float_minvals, source_file->float_maxvals, false);
+  delete[] double_buffer;
 
   // increment the position in FITS file
   frame_fheight[component] += height;
@@ -505,82 +426,7 @@ bool fits_in::parse_fits_parameters(kdu_args &args)
       fits.writeNoiseField = true;
       args.advance();
     }
-    if (args.find("-K") != NULL){ // should a lossless version be written
-      // Main benchmarks
-      fits.benchmarkQualityParameters.fidelity = true;
-      fits.benchmarkQualityParameters.maximumAbsoluteDistortion = true;
-      fits.benchmarkQualityParameters.meanAbsoluteError = true;
-      fits.benchmarkQualityParameters.meanSquaredError = true;
-      fits.benchmarkQualityParameters.peakSignalToNoiseRatio = true;
-      fits.benchmarkQualityParameters.rootMeanSquaredError = true;
-      fits.benchmarkQualityParameters.performQualityBenchmarking = true;
-
-      // Intermediate values
-      fits.benchmarkQualityParameters.squaredError = true;
-      fits.benchmarkQualityParameters.absoluteError = true;
-      fits.benchmarkQualityParameters.squaredIntensitySum = true;
-      args.advance();
-    }
-    if (args.find("-N") != NULL){ /* Should all quality benchmark tests be 
-                                   * performed - but no intermediate results 
-                                   * shown? This is the same as the above 
-                                   * case, but without the intermediate 
-                                   * values printed.
-                                   */
-      fits.benchmarkQualityParameters.fidelity = true;
-      fits.benchmarkQualityParameters.maximumAbsoluteDistortion = true;
-      fits.benchmarkQualityParameters.meanAbsoluteError = true;
-      fits.benchmarkQualityParameters.meanSquaredError = true;
-      fits.benchmarkQualityParameters.peakSignalToNoiseRatio = true;
-      fits.benchmarkQualityParameters.rootMeanSquaredError = true;
-      fits.benchmarkQualityParameters.performQualityBenchmarking = true;
-      args.advance();
-    }
-    if (args.find("-B") != NULL){ // Fidelity benchmarking
-      fits.benchmarkQualityParameters.fidelity = true;
-      fits.benchmarkQualityParameters.performQualityBenchmarking = true;
-      args.advance();
-    }
-    if (args.find("-D") != NULL){ // PSNR benchmarking
-      fits.benchmarkQualityParameters.peakSignalToNoiseRatio = true;
-      fits.benchmarkQualityParameters.performQualityBenchmarking = true;
-      args.advance();
-    }
-    if (args.find("-G") != NULL){ // Maximum absolute distortion
-      fits.benchmarkQualityParameters.maximumAbsoluteDistortion = true;
-      fits.benchmarkQualityParameters.performQualityBenchmarking = true;
-      args.advance();
-    }
-    if (args.find("-H") != NULL){ // Mean squared error
-      fits.benchmarkQualityParameters.meanSquaredError = true;
-      fits.benchmarkQualityParameters.performQualityBenchmarking = true;
-      args.advance();
-    }
-    if (args.find("-L") != NULL){ // Root mean squared error
-      fits.benchmarkQualityParameters.rootMeanSquaredError = true;
-      fits.benchmarkQualityParameters.performQualityBenchmarking = true;
-      args.advance();
-    }
-    if (args.find("-U") != NULL){ // Mean absolute error
-      fits.benchmarkQualityParameters.meanAbsoluteError = true;
-      fits.benchmarkQualityParameters.performQualityBenchmarking = true;
-      args.advance();
-    }
-    if (args.find("-V") != NULL){ // Squared error
-      fits.benchmarkQualityParameters.squaredError = true;
-      fits.benchmarkQualityParameters.performQualityBenchmarking = true;
-      args.advance();
-    }
-    if (args.find("-Y") != NULL){ // Absolute error
-      fits.benchmarkQualityParameters.absoluteError = true;
-      fits.benchmarkQualityParameters.performQualityBenchmarking = true;
-      args.advance();
-    }
-    if (args.find("-X") != NULL){ // Squared uncompressed image intensity sum
-      fits.benchmarkQualityParameters.squaredIntensitySum = true;
-      fits.benchmarkQualityParameters.performQualityBenchmarking = true;
-      args.advance();
-    }
+    parse_quality_benchmark_args(args, fits.benchmarkQualityParameters);
     if (args.find("-Z") != NULL){ // Should a residual image be written
       fits.benchmarkQualityParameters.writeResidual = true;
       args.advance();
@@ -593,31 +439,7 @@ bool fits_in::parse_fits_parameters(kdu_args &args)
       fits.meta = true;
       args.advance();
     }
-
-    if (args.find("-minmax") != NULL)
-    {
-      for (int i = 0; i < 2; ++i) {
-        const char *string = args.advance();
-        bool succ = true;
-        for (int j = 0; j < strlen(string); ++j) {
-          if (! (std::isdigit(string[j]) || 
-                string[j] == '.' || string[j] == '-'))
-            succ = false;
-        }
-        if (!succ || (i == 0 && (sscanf(string, "%f", &fits.deafult_min) != 1)))
-          succ = false;
-        else if (!succ || (i == 1 && 
-              (sscanf(string, "%f", &fits.deafult_max) != 1)))
-          succ = false;
-
-        if (!succ)
-        { kdu_error e; e << "\"-minmax\" argument contains "
-          "malformed specification. Expected to find two comma-"
-            "separated float numbers, enclosed by curly braces. "
-            "Example: -minmax {-1.0,1.0}"; }
-      }
-      args.advance();
-    }
+    // "-minmax" is handled by ska_source_file, for every format
 
   }
 
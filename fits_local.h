@@ -12,42 +12,15 @@
 /*****************************************************************************/
 
 #include <stdio.h> // C I/O functions can be quite a bit faster than C++ ones
+#include <string.h>
 #include "kdu_elementary.h"
 #include "kdu_file_io.h"
 #include "kdu_args.h"
 #include "fitsio.h"
 #include "ska_local.h"
-
-/**
- * Structure allowing parameters for quality benchmarking to be specified
- * by the user.  Currently, numerous different quality benchmarks can be
- * specified by the user at the command line and information on these is
- * recorded in here.
- *
- * The last three metrics are not really of interest in their own right, but
- * are integer intermediate building blocks of some of the other metrics that
- * might be useful if integer, rather than floating point, raw data is desired.
- *
- * The last field specifies whether a residual iamge should be written to a
- * file.  This can be used even if no other quality benchmarks are specified.
- */
-
-typedef struct {
-  bool meanSquaredError; // Mean squared error
-  bool rootMeanSquaredError; // Root mean squared error
-  bool peakSignalToNoiseRatio; // Peak signal to noise ratio
-  bool meanAbsoluteError; // Mean absolute error
-  bool fidelity; // Fidelity
-  bool maximumAbsoluteDistortion; // Maximum absolute distortion
-  bool squaredError; // Squared error
-  bool absoluteError; // Absolute error
-  bool squaredIntensitySum; // Sum of squared uncompressed image intensities    
-  bool performQualityBenchmarking; // Is at least one quality benchmark 
-  // selected?  Intended to provide a quick check.  
-  // Client code must keep this up to date
-  bool writeResidual; // Should the residual image be written to a file?
-} quality_benchmark_info;
-
+#include "ska_quality.h" // For `quality_benchmark_info'
+#include "ska_threads.h"
+#include <map>
 
 /**
  * Enumerated type defining the transformations that may be performed
@@ -147,6 +120,112 @@ typedef struct {
 
 class fits_in;
 class fits_out;
+class fits_tile_reader;
+struct fits_tile;
+class fits_direct_writer;
+struct fits_write_job;
+
+/*****************************************************************************/
+/*                          class fits_tile_reader                           */
+/*****************************************************************************/
+
+class fits_tile_reader {
+  /* Reads tile-compressed (fpack) images without CFITSIO's image routines,
+   * which decompress every tile a row touches, one row at a time and on a
+   * single thread. The tile index and the compressed bytes of each tile are
+   * read through CFITSIO, serially; the tiles are then decompressed in
+   * parallel with a `ska_job_batch' and kept until every plane has read past
+   * them. RICE_1, GZIP_1 and GZIP_2 are handled, including quantized
+   * (and dithered) floating point images. */
+  public: // Member functions
+    static fits_tile_reader *create(fitsfile *in, int bitpix, int naxis,
+        LONGLONG *naxes);
+    /* Returns NULL unless the current HDU of `in' is a compressed image
+     * which we can decompress; CFITSIO must then be used instead. This is
+     * the case for HCOMPRESS_1 and PLIO_1, for example. */
+    ~fits_tile_reader();
+    int get_tile_height() { return tile_dims[1]; }
+    void read_rows(int x, int y, int z, int width, int height, int planes,
+        float *buf, kdu_thread_env *env);
+    /* Writes `height' rows of `width' samples, starting at column `x' and
+     * row `y' of plane `z', to `buf'. Rows must be read in order, with every
+     * plane read at one set of rows before moving on to the next; `planes'
+     * is the number of planes, from `z' on, still to be read at these rows.
+     * Their tiles are decompressed together. `env' may be NULL. Any axes
+     * after the 3rd are folded into it, so the planes of the second Stokes
+     * parameter follow on from those of the first. */
+  private: // Helper functions
+    fits_tile_reader();
+    kdu_long get_row(int tx, int ty, int tz)
+      { return 1 + tx + (kdu_long) num_tiles[0] *
+          (ty + (kdu_long) num_tiles[1] * tz); }
+    void fetch(int tx0, int tx1, int ty0, int ty1, int z, int planes,
+        kdu_thread_env *env);
+    void read_tile(fits_tile *tile);
+    static void decompress_tile(void *context, int task_idx,
+        kdu_thread_env *env);
+  private: // Data
+    fitsfile *in;
+    int compression;
+    int bitpix;
+    int dims[3], tile_dims[3], num_tiles[3];
+    int blocksize, bytepix; // RICE_1 parameters
+    bool quantized; // Floating point samples were stored as integers
+    int dither; // 0, or the SUBTRACTIVE_DITHER_n method
+    int dither_seed; // ZDITHER0
+    double zscale, zzero; // Used if there are no ZSCALE/ZZERO columns
+    bool has_blank;
+    int blank; // Used if there is no ZBLANK column
+    int data_col, gzip_col, raw_col, scale_col, zero_col, blank_col;
+    std::map<kdu_long,fits_tile *> cache; // Decompressed tiles, by row
+    fits_tile **pending; // Tiles being decompressed by `fetch'
+    int num_pending, max_pending;
+    ska_job_batch batch;
+};
+
+/*****************************************************************************/
+/*                         class fits_direct_writer                          */
+/*****************************************************************************/
+
+class fits_direct_writer {
+  /* Writes the data unit of a FITS file ourselves, rather than through
+   * CFITSIO, which writes one row at a time through its own buffers. The
+   * file is created with the header supplied by `fits_out' and the data unit
+   * is preallocated, so stripes can be written straight to their offsets with
+   * `pwrite'. Each stripe is converted to big-endian into a buffer of our
+   * own (with SSE2 where available) and written by the threads of an
+   * `ska_io_queue', so the writes of different planes overlap with each
+   * other and with decompression. */
+  public: // Member functions
+    static fits_direct_writer *create(const char *fname, const char *header,
+        int header_bytes, kdu_long data_bytes, int num_threads);
+    /* `header' holds `header_bytes' of 80 character records, ending with
+     * END; it is padded to a whole number of 2880 byte blocks, as is the
+     * `data_bytes' long data unit which follows it. Generates an error if
+     * the file cannot be created. */
+    ~fits_direct_writer();
+    void write(kdu_long offset, const float *samples, int num);
+    /* Queues `num' samples for writing at `offset' bytes into the data
+     * unit. `samples' may be reused as soon as we return; we only block if
+     * every buffer is waiting to be written. */
+    void finish();
+    /* Waits for every queued write and closes the file, generating an error
+     * if any of them failed. */
+  private: // Helper functions
+    fits_direct_writer();
+    static int do_write(void *context, ska_io_job *job);
+    static void write_done(void *context, ska_io_job *job);
+    /* Returns the job to `free_jobs'. */
+    void check_error();
+  private: // Data
+    int fd;
+    char *fname;
+    kdu_long data_start; // Offset of the data unit within the file
+    int num_jobs;
+    fits_write_job *jobs;
+    fits_write_job *free_jobs; // Guarded by the mutex of `writers'
+    ska_io_queue writers;
+};
 
 /*****************************************************************************/
 /*                             class fits_in                                  */
@@ -154,14 +233,21 @@ class fits_out;
 
 class fits_in : public ska_source_file_base {
   public: // Member functions
+    fits_in() {
+      tiles = NULL;
+      status = 0; // CFITSIO calls do nothing if this is already non-zero
+      memset(&fits, 0, sizeof(fits)); // All options off
+      fits.startPlane = fits.endPlane = -1;
+      fits.startStoke = fits.endStoke = -1;
+    }
     ~fits_in();
     void read_header(jp2_family_tgt &tgt, kdu_args &args,
         ska_source_file* const source_file);
     void read_stripe(int height, float *buf,
         ska_source_file* const source_file, int component);
+    void read_raw_stripe(int height, float *buf,
+        ska_source_file* const source_file, int component);
   private: // Members describing the organization of the FITS data
-    void determine_min_and_max(ska_source_file* const source_file, int component);
-    
     fitsfile *in;     //pointer to open FITS image
     int status;    // returned status of FITS functions
     fits_param fits;  // specific FITS parameters
@@ -177,8 +263,11 @@ class fits_in : public ska_source_file_base {
     int bitpix;
     int type;
     int naxis;
+    int file_depth; // Planes (3rd axis) in the file
+    int file_stokes; // Stokes parameters (4th axis) in the file
     long* frame_fheight;
     int num_unread_rows;
+    fits_tile_reader *tiles; // NULL unless CFITSIO decompresses the image
 };
 
 /*****************************************************************************/
@@ -187,6 +276,12 @@ class fits_in : public ska_source_file_base {
 
 class fits_out : public ska_dest_file_base {
   public: // Public functions
+    fits_out() {
+      out = NULL;
+      writer = NULL;
+      frame_fheight = NULL;
+      num_unwritten_rows = 0;
+    }
     ~fits_out();
     void write_header(jp2_family_src &src, kdu_args &args,
         ska_dest_file* const dest_file);
@@ -195,15 +290,15 @@ class fits_out : public ska_dest_file_base {
   private: // Private functions
     bool parse_fits_parameters(kdu_args &args);
   private: // FITS file descriptions 
-    fitsfile *out;     //pointer to open FITS image
+    fitsfile *out;     // In-memory file, used to build the header
     int status;    // returned status of FITS functions
-    LONGLONG *fpixel; // array used by CFITSIO to specify starting pixel to read from.
+    fits_direct_writer *writer; // Writes the data unit
     int nkeys;  //fits keywords
     int scale;
     int bitpix;
     int type;
     int naxis;
-    long* frame_fheight;
+    long* frame_fheight; // Next row (from 0) of each plane
     char keyname[FLEN_CARD];  //fits
     char keyvalue[FLEN_CARD];  //fits
     char keycomment[FLEN_CARD];  //fits
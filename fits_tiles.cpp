@@ -0,0 +1,645 @@
+/*****************************************************************************/
+//
+//  @file: fits_tiles.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Parallel reader for tile-compressed (fpack) FITS images. The tile
+//         index of the binary table is read through CFITSIO, but the tiles
+//         themselves are decompressed here, many at once, on the threads of
+//         the encoder's Kakadu environment.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <zlib.h>
+// Core includes
+#include "kdu_messaging.h"
+// FITS includes
+#include "fitsio.h"
+#include "fits_local.h"
+
+// Upper bound on the decompressed tiles fetched by a single `read_rows'
+#define FITS_TILE_FETCH_BYTES (64<<20)
+
+// Values reserved by CFITSIO's quantization of floating point tiles
+#define FITS_TILE_ZERO_VALUE -2147483646
+#define FITS_TILE_N_RANDOM 10000
+
+static float fits_rand_values[FITS_TILE_N_RANDOM];
+static bool fits_rand_values_ready = false;
+
+enum {
+  FITS_TILE_RICE, FITS_TILE_GZIP_1, FITS_TILE_GZIP_2
+};
+
+enum { // Where the data of a tile came from
+  FITS_TILE_COMPRESSED, // COMPRESSED_DATA column, with `compression'
+  FITS_TILE_GZIPPED, // GZIP_COMPRESSED_DATA column (unquantized floats)
+  FITS_TILE_RAW // UNCOMPRESSED_DATA column; already converted
+};
+
+/*****************************************************************************/
+/*                              struct fits_tile                             */
+/*****************************************************************************/
+
+struct fits_tile {
+  public: // Member functions
+    fits_tile() { cdata = NULL; samples = NULL; failed = false; }
+    ~fits_tile() { delete[] cdata; delete[] samples; }
+  public: // Data
+    kdu_long row; // Row of the binary table, starting from 1
+    int x0, y0, z0; // Position of the tile in the image
+    int width, height, depth;
+    int source; // One of FITS_TILE_COMPRESSED, _GZIPPED or _RAW
+    kdu_byte *cdata; // Compressed bytes; deleted once decompressed
+    int clen;
+    double zscale, zzero; // Quantization of floating point tiles
+    int blank; // Quantized value of blank (NaN) samples
+    float *samples; // Decompressed samples
+    bool failed;
+};
+
+/*****************************************************************************/
+/* STATIC                       init_rand_values                             */
+/*****************************************************************************/
+
+static void
+  init_rand_values()
+  /* Same sequence as CFITSIO's `fits_init_randoms', with which quantized
+   * floating point tiles are dithered. Called before any threads start
+   * decompressing. */
+{
+  if (fits_rand_values_ready)
+    return;
+  double a = 16807.0, m = 2147483647.0, seed = 1.0;
+  for (int i=0; i < FITS_TILE_N_RANDOM; i++) {
+    double temp = a * seed;
+    seed = temp - m * ((int)(temp / m));
+    fits_rand_values[i] = (float)(seed / m);
+  }
+  fits_rand_values_ready = true;
+}
+
+/*****************************************************************************/
+/* STATIC                         rice_decode                                */
+/*****************************************************************************/
+
+static bool
+  rice_decode(const kdu_byte *c, int clen, kdu_int32 *out, int nx,
+      int nblock, int bytepix)
+  /* Decodes a RICE_1 tile of `nx' pixels, each `bytepix' bytes wide, as
+   * written by CFITSIO's `fits_rcomp' family. Returns false if the stream
+   * is damaged. */
+{
+  int fsbits, fsmax;
+  if (bytepix == 1)
+    { fsbits = 3; fsmax = 6; }
+  else if (bytepix == 2)
+    { fsbits = 4; fsmax = 14; }
+  else
+    { fsbits = 5; fsmax = 25; bytepix = 4; }
+  int bbits = 1 << fsbits;
+  if (clen < bytepix + 1)
+    return false;
+
+  const kdu_byte *cend = c + clen;
+  kdu_uint32 lastpix = 0;
+  for (int n=0; n < bytepix; n++)
+    lastpix = (lastpix << 8) | *(c++);
+  kdu_uint32 mask = (bytepix == 4)?0xFFFFFFFF:((1u << (8*bytepix)) - 1);
+
+  kdu_uint32 b = *(c++); // Bit buffer
+  int nbits = 8; // Number of bits of `b' which are yet to be used
+  for (int i=0; i < nx; ) {
+    nbits -= fsbits;
+    while (nbits < 0) {
+      if (c >= cend) return false;
+      b = (b << 8) | *(c++);
+      nbits += 8;
+    }
+    int fs = (int)(b >> nbits) - 1;
+    b &= (1u << nbits) - 1;
+    int imax = (nx - i > nblock)?(i + nblock):nx;
+    if (fs < 0) { // Every difference in the block is zero
+      for (; i < imax; i++)
+        out[i] = (kdu_int32) lastpix;
+    }
+    else if (fs == fsmax) { // Differences are stored verbatim
+      for (; i < imax; i++) {
+        int k = bbits - nbits;
+        kdu_uint32 diff = (k < 32)?(b << k):0;
+        for (k -= 8; k >= 0; k -= 8) {
+          if (c >= cend) return false;
+          diff |= ((kdu_uint32) *(c++)) << k;
+        }
+        if (nbits > 0) {
+          if (c >= cend) return false;
+          b = *(c++);
+          diff |= b >> (-k);
+          b &= (1u << nbits) - 1;
+        }
+        else
+          b = 0;
+        diff = ((diff & 1) == 0)?(diff >> 1):~(diff >> 1);
+        lastpix = (diff + lastpix) & mask;
+        out[i] = (kdu_int32) lastpix;
+      }
+    }
+    else { // Differences are Rice coded with `fs' low order bits
+      for (; i < imax; i++) {
+        while (b == 0) {
+          if (c >= cend) return false;
+          nbits += 8;
+          b = *(c++);
+        }
+        int top = 7; // `b' holds fewer than 8 unused bits here
+        while (!(b & (1u << top)))
+          top--;
+        int nzero = nbits - top - 1;
+        nbits -= nzero + 1;
+        b ^= 1u << nbits;
+        nbits -= fs;
+        while (nbits < 0) {
+          if (c >= cend) return false;
+          b = (b << 8) | *(c++);
+          nbits += 8;
+        }
+        kdu_uint32 diff = (((kdu_uint32) nzero) << fs) | (b >> nbits);
+        b &= (1u << nbits) - 1;
+        diff = ((diff & 1) == 0)?(diff >> 1):~(diff >> 1);
+        lastpix = (diff + lastpix) & mask;
+        out[i] = (kdu_int32) lastpix;
+      }
+    }
+  }
+
+  if (bytepix == 2) // 16-bit pixels are signed
+    for (int i=0; i < nx; i++)
+      out[i] = (kdu_int16) out[i];
+  return true;
+}
+
+/*****************************************************************************/
+/* STATIC                         gzip_decode                                */
+/*****************************************************************************/
+
+static bool
+  gzip_decode(const kdu_byte *c, int clen, kdu_byte *out, kdu_long out_len)
+  /* Inflates a gzip (or zlib) stream into exactly `out_len' bytes. */
+{
+  z_stream strm;
+  memset(&strm,0,sizeof(strm));
+  if (inflateInit2(&strm,15+32) != Z_OK) // 32: detect the header type
+    return false;
+  strm.next_in = (Bytef *) c;
+  strm.avail_in = (uInt) clen;
+  strm.next_out = (Bytef *) out;
+  strm.avail_out = (uInt) out_len;
+  int result = inflate(&strm,Z_FINISH);
+  bool ok = ((result == Z_STREAM_END) || (result == Z_OK)) &&
+    (strm.total_out == (uLong) out_len);
+  inflateEnd(&strm);
+  return ok;
+}
+
+/*****************************************************************************/
+/* STATIC                          get_big_endian                            */
+/*****************************************************************************/
+
+static inline unsigned long long
+  get_big_endian(const kdu_byte *src, int i, int num, int bytepix,
+      bool shuffled)
+  /* Returns value `i' of `num' big-endian values. GZIP_2 tiles hold all of
+   * the most significant bytes first, then the next byte of every value,
+   * and so on. */
+{
+  unsigned long long val = 0;
+  if (shuffled)
+    for (int b=0; b < bytepix; b++)
+      val = (val << 8) | src[b*num + i];
+  else
+    for (int b=0; b < bytepix; b++)
+      val = (val << 8) | src[i*bytepix + b];
+  return val;
+}
+
+/* ========================================================================= */
+/*                              fits_tile_reader                             */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                          fits_tile_reader::create                         */
+/*****************************************************************************/
+
+fits_tile_reader *
+  fits_tile_reader::create(fitsfile *in, int bitpix, int naxis,
+      LONGLONG *naxes)
+{
+  int status = 0, is_compressed = fits_is_compressed_image(in,&status);
+  if ((status != 0) || !is_compressed)
+    return NULL;
+
+  char value[FLEN_VALUE];
+  if (fits_read_key(in,TSTRING,"ZCMPTYPE",value,NULL,&status) != 0)
+    return NULL;
+  int compression;
+  if ((strcmp(value,"RICE_1") == 0) || (strcmp(value,"RICE_ONE") == 0))
+    compression = FITS_TILE_RICE;
+  else if (strcmp(value,"GZIP_1") == 0)
+    compression = FITS_TILE_GZIP_1;
+  else if (strcmp(value,"GZIP_2") == 0)
+    compression = FITS_TILE_GZIP_2;
+  else
+    return NULL; // E.g. HCOMPRESS_1, whose CFITSIO decoder is not reentrant
+  if ((bitpix == LONGLONG_IMG) || (naxis < 2))
+    return NULL;
+
+  fits_tile_reader *reader = new fits_tile_reader;
+  reader->in = in;
+  reader->compression = compression;
+  reader->bitpix = bitpix;
+  for (int d=0; d < 3; d++) {
+    char key[FLEN_KEYWORD];
+    long tile = (d == 0)?((long) naxes[0]):1; // Rows, by default
+    reader->dims[d] = (d < naxis)?((int) naxes[d]):1;
+    sprintf(key,"ZTILE%d",d+1);
+    status = 0;
+    if ((d < naxis) && (fits_read_key(in,TLONG,key,&tile,NULL,&status) != 0))
+      status = 0;
+    reader->tile_dims[d] = (tile < 1)?1:(int) tile;
+    reader->num_tiles[d] =
+      (reader->dims[d] + reader->tile_dims[d] - 1) / reader->tile_dims[d];
+  }
+
+  // Further axes (Stokes) are folded into the 3rd, which keeps the tile
+  // numbering intact so long as no tile spans two of their planes
+  for (int d=3; d < naxis; d++) {
+    char key[FLEN_KEYWORD];
+    long tile = 1;
+    sprintf(key,"ZTILE%d",d+1);
+    if (fits_read_key(in,TLONG,key,&tile,NULL,&status) != 0)
+      status = 0;
+    if ((tile > 1) || ((reader->dims[2] % reader->tile_dims[2]) != 0))
+      { delete reader; return NULL; }
+  }
+  if (naxis > 3) {
+    for (int d=3; d < naxis; d++)
+      reader->dims[2] *= (int) naxes[d];
+    reader->num_tiles[2] = reader->dims[2] / reader->tile_dims[2];
+  }
+
+  // Algorithm parameters, as ZNAMEi/ZVALi pairs
+  reader->blocksize = 32;
+  reader->bytepix = (bitpix < 0)?4:(bitpix / 8);
+  for (int i=1; ; i++) {
+    char key[FLEN_KEYWORD];
+    int val;
+    sprintf(key,"ZNAME%d",i);
+    if (fits_read_key(in,TSTRING,key,value,NULL,&status) != 0)
+      break;
+    sprintf(key,"ZVAL%d",i);
+    if (fits_read_key(in,TINT,key,&val,NULL,&status) != 0)
+      { status = 0; continue; }
+    if (strcmp(value,"BLOCKSIZE") == 0)
+      reader->blocksize = val;
+    else if (strcmp(value,"BYTEPIX") == 0)
+      reader->bytepix = val;
+  }
+  status = 0;
+
+  // Columns of the binary table
+  char data_name[] = "COMPRESSED_DATA", gzip_name[] = "GZIP_COMPRESSED_DATA";
+  char raw_name[] = "UNCOMPRESSED_DATA", scale_name[] = "ZSCALE";
+  char zero_name[] = "ZZERO", blank_name[] = "ZBLANK";
+  int *cols[6] = { &reader->data_col, &reader->gzip_col, &reader->raw_col,
+                   &reader->scale_col, &reader->zero_col, &reader->blank_col };
+  char *names[6] = { data_name, gzip_name, raw_name, scale_name, zero_name,
+                     blank_name };
+  for (int c=0; c < 6; c++) {
+    status = 0;
+    if (fits_get_colnum(in,CASEINSEN,names[c],cols[c],&status) != 0)
+      *(cols[c]) = 0;
+  }
+  status = 0;
+  if (reader->data_col == 0)
+    { delete reader; return NULL; }
+
+  // Quantization of floating point images
+  reader->quantized = false;
+  reader->dither = 0;
+  reader->dither_seed = 1;
+  reader->zscale = 1.0;
+  reader->zzero = 0.0;
+  if (bitpix < 0) {
+    reader->quantized = (reader->scale_col > 0) ||
+      (fits_read_key(in,TDOUBLE,"ZSCALE",&reader->zscale,NULL,&status) == 0);
+    status = 0;
+    fits_read_key(in,TDOUBLE,"ZZERO",&reader->zzero,NULL,&status);
+    status = 0;
+    if (fits_read_key(in,TSTRING,"ZQUANTIZ",value,NULL,&status) == 0) {
+      if (strcmp(value,"SUBTRACTIVE_DITHER_1") == 0)
+        reader->dither = 1;
+      else if (strcmp(value,"SUBTRACTIVE_DITHER_2") == 0)
+        reader->dither = 2;
+      else if (strcmp(value,"NONE") == 0)
+        reader->quantized = false;
+    }
+    status = 0;
+    fits_read_key(in,TINT,"ZDITHER0",&reader->dither_seed,NULL,&status);
+    status = 0;
+    if (!reader->quantized && (compression == FITS_TILE_RICE))
+      { delete reader; return NULL; } // Not something CFITSIO writes
+  }
+  reader->has_blank = (reader->blank_col > 0) ||
+    (fits_read_key(in,TINT,"ZBLANK",&reader->blank,NULL,&status) == 0);
+  status = 0;
+
+  init_rand_values();
+  return reader;
+}
+
+/*****************************************************************************/
+/*                    fits_tile_reader::fits_tile_reader                     */
+/*****************************************************************************/
+
+fits_tile_reader::fits_tile_reader()
+{
+  in = NULL;
+  blank = 0;
+  pending = NULL;
+  num_pending = max_pending = 0;
+}
+
+/*****************************************************************************/
+/*                    fits_tile_reader::~fits_tile_reader                    */
+/*****************************************************************************/
+
+fits_tile_reader::~fits_tile_reader()
+{
+  std::map<kdu_long,fits_tile *>::iterator it;
+  for (it=cache.begin(); it != cache.end(); it++)
+    delete it->second;
+  delete[] pending;
+}
+
+/*****************************************************************************/
+/*                        fits_tile_reader::read_rows                        */
+/*****************************************************************************/
+
+void
+  fits_tile_reader::read_rows(int x, int y, int z, int width, int height,
+      int planes, float *buf, kdu_thread_env *env)
+{
+  // Every plane has been read down to row `y' already
+  std::map<kdu_long,fits_tile *>::iterator it;
+  for (it=cache.begin(); it != cache.end(); ) {
+    fits_tile *tile = it->second;
+    if (tile->y0 + tile->height <= y)
+      { delete tile; cache.erase(it++); }
+    else
+      it++;
+  }
+
+  int tx0 = x / tile_dims[0], tx1 = (x + width - 1) / tile_dims[0];
+  int ty0 = y / tile_dims[1], ty1 = (y + height - 1) / tile_dims[1];
+  int tz = z / tile_dims[2];
+  bool have_all = true;
+  for (int ty=ty0; have_all && (ty <= ty1); ty++)
+    for (int tx=tx0; have_all && (tx <= tx1); tx++)
+      have_all = (cache.find(get_row(tx,ty,tz)) != cache.end());
+  if (!have_all)
+    fetch(tx0,tx1,ty0,ty1,z,planes,env);
+
+  for (int ty=ty0; ty <= ty1; ty++)
+    for (int tx=tx0; tx <= tx1; tx++) {
+      fits_tile *tile = cache[get_row(tx,ty,tz)];
+      int c0 = (x > tile->x0)?x:tile->x0;
+      int c1 = (x+width < tile->x0+tile->width)?(x+width):
+        (tile->x0+tile->width);
+      int r0 = (y > tile->y0)?y:tile->y0;
+      int r1 = (y+height < tile->y0+tile->height)?(y+height):
+        (tile->y0+tile->height);
+      for (int r=r0; r < r1; r++) {
+        float *src = tile->samples + ((kdu_long)(z - tile->z0) *
+            tile->height + (r - tile->y0)) * tile->width + (c0 - tile->x0);
+        memcpy(buf + (kdu_long)(r - y) * width + (c0 - x),src,
+            sizeof(float) * (c1 - c0));
+      }
+    }
+}
+
+/*****************************************************************************/
+/*                          fits_tile_reader::fetch                          */
+/*****************************************************************************/
+
+void
+  fits_tile_reader::fetch(int tx0, int tx1, int ty0, int ty1, int z,
+      int planes, kdu_thread_env *env)
+{
+  // Decompress the same rows of as many of the following planes as our
+  // memory budget allows, so there are plenty of tiles to share out even
+  // when each one is a single row (fpack's default).
+  kdu_long plane_bytes = sizeof(float) * (kdu_long)(tx1-tx0+1) *
+    tile_dims[0] * (ty1-ty0+1) * tile_dims[1];
+  kdu_long max_planes = FITS_TILE_FETCH_BYTES / plane_bytes;
+  if (planes > max_planes)
+    planes = (max_planes < 1)?1:(int) max_planes;
+  if (z + planes > dims[2])
+    planes = dims[2] - z;
+  int tz0 = z / tile_dims[2], tz1 = (z + planes - 1) / tile_dims[2];
+
+  num_pending = 0;
+  int needed = (tx1-tx0+1) * (ty1-ty0+1) * (tz1-tz0+1);
+  if (needed > max_pending) {
+    delete[] pending;
+    max_pending = needed;
+    pending = new fits_tile *[max_pending];
+  }
+
+  // The table can only be read by one thread at a time
+  for (int tz=tz0; tz <= tz1; tz++)
+    for (int ty=ty0; ty <= ty1; ty++)
+      for (int tx=tx0; tx <= tx1; tx++) {
+        kdu_long row = get_row(tx,ty,tz);
+        if (cache.find(row) != cache.end())
+          continue;
+        fits_tile *tile = new fits_tile;
+        tile->row = row;
+        tile->x0 = tx * tile_dims[0];
+        tile->y0 = ty * tile_dims[1];
+        tile->z0 = tz * tile_dims[2];
+        tile->width = dims[0] - tile->x0;
+        tile->width = (tile->width < tile_dims[0])?tile->width:tile_dims[0];
+        tile->height = dims[1] - tile->y0;
+        tile->height = (tile->height<tile_dims[1])?tile->height:tile_dims[1];
+        tile->depth = dims[2] - tile->z0;
+        tile->depth = (tile->depth < tile_dims[2])?tile->depth:tile_dims[2];
+        cache[row] = tile;
+        read_tile(tile);
+        if (tile->source != FITS_TILE_RAW)
+          pending[num_pending++] = tile;
+      }
+
+  batch.run(num_pending,decompress_tile,this,env,"FITS tiles");
+  for (int t=0; t < num_pending; t++)
+    if (pending[t]->failed)
+      { kdu_error e; e << "Tile " << (int) pending[t]->row << " of the "
+        "tile-compressed FITS image is corrupt."; }
+  num_pending = 0;
+}
+
+/*****************************************************************************/
+/*                        fits_tile_reader::read_tile                        */
+/*****************************************************************************/
+
+void
+  fits_tile_reader::read_tile(fits_tile *tile)
+{
+  int status = 0, anynul = 0;
+  LONGLONG length = 0, offset = 0;
+  kdu_long num = ((kdu_long) tile->width) * tile->height * tile->depth;
+  tile->source = FITS_TILE_COMPRESSED;
+  int col = data_col;
+  fits_read_descriptll(in,col,tile->row,&length,&offset,&status);
+  if ((status == 0) && (length == 0) && (gzip_col > 0)) {
+    tile->source = FITS_TILE_GZIPPED;
+    col = gzip_col;
+    fits_read_descriptll(in,col,tile->row,&length,&offset,&status);
+  }
+  if ((status == 0) && (length == 0) && (raw_col > 0)) {
+    tile->source = FITS_TILE_RAW; // A NULL `nulval' leaves NaNs as they are
+    tile->samples = new float[num];
+    fits_read_col(in,TFLOAT,raw_col,tile->row,1,num,NULL,tile->samples,
+        &anynul,&status);
+  }
+  else if ((status == 0) && (length > 0)) {
+    tile->clen = (int) length;
+    tile->cdata = new kdu_byte[tile->clen];
+    fits_read_col(in,TBYTE,col,tile->row,1,length,NULL,tile->cdata,&anynul,
+        &status);
+  }
+  else if (status == 0)
+    { kdu_error e; e << "Tile " << (int) tile->row << " of the "
+      "tile-compressed FITS image holds no data."; }
+
+  tile->zscale = zscale;
+  tile->zzero = zzero;
+  tile->blank = blank;
+  if ((status == 0) && (scale_col > 0))
+    fits_read_col(in,TDOUBLE,scale_col,tile->row,1,1,NULL,&tile->zscale,
+        &anynul,&status);
+  if ((status == 0) && (zero_col > 0))
+    fits_read_col(in,TDOUBLE,zero_col,tile->row,1,1,NULL,&tile->zzero,
+        &anynul,&status);
+  if ((status == 0) && (blank_col > 0))
+    fits_read_col(in,TINT,blank_col,tile->row,1,1,NULL,&tile->blank,
+        &anynul,&status);
+  if (status != 0)
+    { kdu_error e; e << "Unable to read tile " << (int) tile->row << " of "
+      "the tile-compressed FITS image."; }
+}
+
+/*****************************************************************************/
+/* STATIC                fits_tile_reader::decompress_tile                   */
+/*****************************************************************************/
+
+void
+  fits_tile_reader::decompress_tile(void *context, int task_idx,
+      kdu_thread_env *env)
+{
+  fits_tile_reader *obj = (fits_tile_reader *) context;
+  fits_tile *tile = obj->pending[task_idx];
+  int num = tile->width * tile->height * tile->depth;
+  float *out = tile->samples = new float[num];
+
+  // Unquantized floating point data, stored as bytes
+  int gz_bytepix = obj->bytepix;
+  bool floats = (obj->bitpix < 0) &&
+    (!obj->quantized || (tile->source == FITS_TILE_GZIPPED));
+  if (floats)
+    gz_bytepix = -obj->bitpix / 8;
+  else if (obj->bitpix > 0)
+    gz_bytepix = obj->bitpix / 8;
+  else
+    gz_bytepix = 4;
+
+  kdu_int32 *ints = NULL;
+  bool ok = true;
+  if ((tile->source == FITS_TILE_COMPRESSED) &&
+      (obj->compression == FITS_TILE_RICE)) {
+    ints = new kdu_int32[num];
+    ok = rice_decode(tile->cdata,tile->clen,ints,num,obj->blocksize,
+        obj->bytepix);
+  }
+  else {
+    bool shuffled = (tile->source == FITS_TILE_COMPRESSED) &&
+      (obj->compression == FITS_TILE_GZIP_2);
+    kdu_byte *bytes = new kdu_byte[(kdu_long) num * gz_bytepix];
+    ok = gzip_decode(tile->cdata,tile->clen,bytes,(kdu_long) num*gz_bytepix);
+    if (ok && floats) {
+      for (int i=0; i < num; i++) {
+        unsigned long long val = get_big_endian(bytes,i,num,gz_bytepix,shuffled);
+        if (gz_bytepix == 4)
+          { kdu_uint32 v32 = (kdu_uint32) val; float f;
+            memcpy(&f,&v32,4); out[i] = f; }
+        else
+          { double d; memcpy(&d,&val,8); out[i] = (float) d; }
+      }
+    }
+    else if (ok) {
+      ints = new kdu_int32[num];
+      for (int i=0; i < num; i++) {
+        unsigned long long val = get_big_endian(bytes,i,num,gz_bytepix,shuffled);
+        if (gz_bytepix == 1)
+          ints[i] = (kdu_int32) val; // Bytes are unsigned
+        else if (gz_bytepix == 2)
+          ints[i] = (kdu_int16) val;
+        else
+          ints[i] = (kdu_int32)(kdu_uint32) val;
+      }
+    }
+    delete[] bytes;
+  }
+  delete[] tile->cdata;
+  tile->cdata = NULL;
+  if (!ok) {
+    tile->failed = true;
+    delete[] ints;
+    return;
+  }
+  if (ints == NULL)
+    return;
+
+  if (obj->bitpix > 0) // Integer images are returned unscaled
+    for (int i=0; i < num; i++)
+      out[i] = (float) ints[i];
+  else if (obj->dither == 0) {
+    for (int i=0; i < num; i++)
+      out[i] = (obj->has_blank && (ints[i] == tile->blank))?NAN:
+        (float)(ints[i] * tile->zscale + tile->zzero);
+  }
+  else { // Undo CFITSIO's subtractive dithering
+    int iseed = (int)((tile->row + obj->dither_seed - 2) % FITS_TILE_N_RANDOM);
+    int next = (int)(fits_rand_values[iseed] * 500);
+    for (int i=0; i < num; i++) {
+      if (obj->has_blank && (ints[i] == tile->blank))
+        out[i] = NAN;
+      else if ((obj->dither == 2) && (ints[i] == FITS_TILE_ZERO_VALUE))
+        out[i] = 0.0F;
+      else
+        out[i] = (float)(((double) ints[i] - fits_rand_values[next] + 0.5) *
+            tile->zscale + tile->zzero);
+      if (++next == FITS_TILE_N_RANDOM) {
+        if (++iseed == FITS_TILE_N_RANDOM)
+          iseed = 0;
+        next = (int)(fits_rand_values[iseed] * 500);
+      }
+    }
+  }
+  delete[] ints;
+}
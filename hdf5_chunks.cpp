@@ -0,0 +1,398 @@
+/*****************************************************************************/
+//
+//  @file: hdf5_chunks.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Parallel reader for chunked, deflate (and shuffle) compressed HDF5
+//         datasets. Chunks are located through HDF5, but their raw bytes are
+//         read with pread and inflated here, many at once, on the threads of
+//         the encoder's Kakadu environment, rather than one at a time behind
+//         the HDF5 library's global lock.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+// Core includes
+#include "kdu_messaging.h"
+// HDF5 includes
+#include "hdf5_local.h"
+
+// Upper bound on the inflated chunks fetched by a single `read_rows'
+#define HDF5_CHUNK_FETCH_BYTES (64<<20)
+
+/*****************************************************************************/
+/*                             struct hdf5_chunk                             */
+/*****************************************************************************/
+
+struct hdf5_chunk {
+  public: // Member functions
+    hdf5_chunk() { samples = NULL; failed = false; }
+    ~hdf5_chunk() { delete[] samples; }
+  public: // Data
+    kdu_long key;
+    int x0, y0, z0; // Position of the chunk in the dataset
+    kdu_long addr; // File offset of the raw bytes, or -1 if not allocated
+    kdu_long size; // Number of raw bytes
+    unsigned filter_mask; // Bit `n' set if filter `n' was skipped
+    float *samples; // A whole chunk, including any padding past the edges
+    bool failed;
+};
+
+/*****************************************************************************/
+/* STATIC                         inflate_bytes                              */
+/*****************************************************************************/
+
+static bool
+  inflate_bytes(const kdu_byte *c, kdu_long clen, kdu_byte *out,
+      kdu_long out_len)
+  /* Inflates the zlib stream written by HDF5's deflate filter into exactly
+   * `out_len' bytes. */
+{
+  z_stream strm;
+  memset(&strm,0,sizeof(strm));
+  if (inflateInit(&strm) != Z_OK)
+    return false;
+  strm.next_in = (Bytef *) c;
+  strm.avail_in = (uInt) clen;
+  strm.next_out = (Bytef *) out;
+  strm.avail_out = (uInt) out_len;
+  int result = inflate(&strm,Z_FINISH);
+  bool ok = ((result == Z_STREAM_END) || (result == Z_OK)) &&
+    (strm.total_out == (uLong) out_len);
+  inflateEnd(&strm);
+  return ok;
+}
+
+/*****************************************************************************/
+/* STATIC                          unshuffle_bytes                           */
+/*****************************************************************************/
+
+static void
+  unshuffle_bytes(const kdu_byte *src, kdu_byte *dst, kdu_long num,
+      int bytes_per_sample)
+  /* Undoes HDF5's shuffle filter, which stores the first byte of every
+   * sample, then the second byte of every sample, and so on. */
+{
+  for (int b=0; b < bytes_per_sample; b++, src += num)
+    for (kdu_long i=0; i < num; i++)
+      dst[i*bytes_per_sample + b] = src[i];
+}
+
+/* ========================================================================= */
+/*                             hdf5_chunk_reader                             */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                         hdf5_chunk_reader::create                         */
+/*****************************************************************************/
+
+hdf5_chunk_reader *
+  hdf5_chunk_reader::create(const char *fname, hid_t file, hid_t dataset)
+{
+#if H5_VERSION_GE(1,10,5)
+  hid_t dcpl = H5Dget_create_plist(dataset);
+  if (dcpl < 0)
+    return NULL;
+  hid_t space = H5Dget_space(dataset);
+  hid_t type = H5Dget_type(dataset);
+  hsize_t dims[3], chunk_dims[3];
+  int bytes = (int) H5Tget_size(type);
+  H5T_order_t order = H5Tget_order(type);
+  bool usable = (H5Pget_layout(dcpl) == H5D_CHUNKED) &&
+    (H5Sget_simple_extent_ndims(space) == 3) &&
+    (H5Sget_simple_extent_dims(space,dims,NULL) == 3) &&
+    (H5Pget_chunk(dcpl,3,chunk_dims) == 3) &&
+    ((H5Tequal(type,H5T_IEEE_F32LE) > 0) ||
+     (H5Tequal(type,H5T_IEEE_F32BE) > 0) ||
+     (H5Tequal(type,H5T_IEEE_F64LE) > 0) ||
+     (H5Tequal(type,H5T_IEEE_F64BE) > 0));
+  H5Sclose(space);
+  H5Tclose(type);
+
+  // Only deflate and shuffle are undone here; any other filter (e.g. szip
+  // or a checksum) leaves the dataset to H5Dread
+  int num_filters = (usable)?H5Pget_nfilters(dcpl):0;
+  if ((num_filters < 0) || (num_filters > HDF5_MAX_CHUNK_FILTERS))
+    usable = false;
+  int filters[HDF5_MAX_CHUNK_FILTERS];
+  for (int f=0; usable && (f < num_filters); f++) {
+    unsigned flags, filter_config;
+    size_t num_values = 0;
+    filters[f] = (int) H5Pget_filter2(dcpl,(unsigned) f,&flags,&num_values,
+        NULL,0,NULL,&filter_config);
+    usable = (filters[f] == H5Z_FILTER_DEFLATE) ||
+      (filters[f] == H5Z_FILTER_SHUFFLE);
+  }
+  float fill = 0.0F;
+  if (usable && (H5Pget_fill_value(dcpl,H5T_NATIVE_FLOAT,&fill) < 0))
+    fill = 0.0F;
+
+  // Chunk addresses are relative to the end of any user block
+  hsize_t userblock = 0;
+  hid_t fcpl = (usable)?H5Fget_create_plist(file):-1;
+  if ((fcpl < 0) || (H5Pget_userblock(fcpl,&userblock) < 0))
+    usable = false;
+  if (fcpl >= 0)
+    H5Pclose(fcpl);
+  H5Pclose(dcpl);
+  if (!usable)
+    return NULL;
+
+  int fd = open(fname,O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  hdf5_chunk_reader *reader = new hdf5_chunk_reader;
+  reader->fd = fd;
+  reader->dataset = dataset;
+  reader->base = (kdu_long) userblock;
+  for (int d=0; d < 3; d++) { // HDF5 lists the slowest varying axis first
+    reader->dims[d] = (int) dims[2-d];
+    reader->chunk_dims[d] = (int) chunk_dims[2-d];
+    reader->num_chunks[d] =
+      (reader->dims[d] + reader->chunk_dims[d] - 1) / reader->chunk_dims[d];
+  }
+  reader->chunk_samples = ((kdu_long) reader->chunk_dims[0]) *
+    reader->chunk_dims[1] * reader->chunk_dims[2];
+  reader->bytes_per_sample = bytes;
+  reader->swap = (order != H5Tget_order(H5T_NATIVE_FLOAT));
+  reader->num_filters = num_filters;
+  for (int f=0; f < num_filters; f++)
+    reader->filters[f] = filters[f];
+  reader->fill = fill;
+  return reader;
+#else // No `H5Dget_chunk_info_by_coord' before HDF5 1.10.5
+  return NULL;
+#endif
+}
+
+/*****************************************************************************/
+/*                    hdf5_chunk_reader::hdf5_chunk_reader                   */
+/*****************************************************************************/
+
+hdf5_chunk_reader::hdf5_chunk_reader()
+{
+  fd = -1;
+  dataset = -1;
+  pending = NULL;
+  num_pending = max_pending = 0;
+}
+
+/*****************************************************************************/
+/*                   hdf5_chunk_reader::~hdf5_chunk_reader                   */
+/*****************************************************************************/
+
+hdf5_chunk_reader::~hdf5_chunk_reader()
+{
+  std::map<kdu_long,hdf5_chunk *>::iterator it;
+  for (it=cache.begin(); it != cache.end(); it++)
+    delete it->second;
+  delete[] pending;
+  if (fd >= 0)
+    close(fd);
+}
+
+/*****************************************************************************/
+/*                       hdf5_chunk_reader::read_rows                        */
+/*****************************************************************************/
+
+void
+  hdf5_chunk_reader::read_rows(int x, int y, int z, int width, int height,
+      int planes, float *buf, kdu_thread_env *env)
+{
+  // Every plane has been read down to row `y' already
+  std::map<kdu_long,hdf5_chunk *>::iterator it;
+  for (it=cache.begin(); it != cache.end(); ) {
+    hdf5_chunk *chunk = it->second;
+    if (chunk->y0 + chunk_dims[1] <= y)
+      { delete chunk; cache.erase(it++); }
+    else
+      it++;
+  }
+
+  int cx0 = x / chunk_dims[0], cx1 = (x + width - 1) / chunk_dims[0];
+  int cy0 = y / chunk_dims[1], cy1 = (y + height - 1) / chunk_dims[1];
+  int cz = z / chunk_dims[2];
+  bool have_all = true;
+  for (int cy=cy0; have_all && (cy <= cy1); cy++)
+    for (int cx=cx0; have_all && (cx <= cx1); cx++)
+      have_all = (cache.find(get_key(cx,cy,cz)) != cache.end());
+  if (!have_all)
+    fetch(cx0,cx1,cy0,cy1,z,planes,env);
+
+  for (int cy=cy0; cy <= cy1; cy++)
+    for (int cx=cx0; cx <= cx1; cx++) {
+      hdf5_chunk *chunk = cache[get_key(cx,cy,cz)];
+      int c0 = (x > chunk->x0)?x:chunk->x0;
+      int c1 = (x+width < chunk->x0+chunk_dims[0])?(x+width):
+        (chunk->x0+chunk_dims[0]);
+      int r0 = (y > chunk->y0)?y:chunk->y0;
+      int r1 = (y+height < chunk->y0+chunk_dims[1])?(y+height):
+        (chunk->y0+chunk_dims[1]);
+      for (int r=r0; r < r1; r++) {
+        float *src = chunk->samples + ((kdu_long)(z - chunk->z0) *
+            chunk_dims[1] + (r - chunk->y0)) * chunk_dims[0] +
+          (c0 - chunk->x0);
+        memcpy(buf + (kdu_long)(r - y) * width + (c0 - x),src,
+            sizeof(float) * (c1 - c0));
+      }
+    }
+}
+
+/*****************************************************************************/
+/*                         hdf5_chunk_reader::fetch                          */
+/*****************************************************************************/
+
+void
+  hdf5_chunk_reader::fetch(int cx0, int cx1, int cy0, int cy1, int z,
+      int planes, kdu_thread_env *env)
+{
+  // Inflate the same rows of as many of the following planes as our memory
+  // budget allows, so there are plenty of chunks to share out even when
+  // each one holds a single plane.
+  kdu_long plane_bytes = sizeof(float) * (kdu_long)(cx1-cx0+1) *
+    chunk_dims[0] * (cy1-cy0+1) * chunk_dims[1];
+  kdu_long max_planes = HDF5_CHUNK_FETCH_BYTES / plane_bytes;
+  if (planes > max_planes)
+    planes = (max_planes < 1)?1:(int) max_planes;
+  if (z + planes > dims[2])
+    planes = dims[2] - z;
+  int cz0 = z / chunk_dims[2], cz1 = (z + planes - 1) / chunk_dims[2];
+
+  num_pending = 0;
+  int needed = (cx1-cx0+1) * (cy1-cy0+1) * (cz1-cz0+1);
+  if (needed > max_pending) {
+    delete[] pending;
+    max_pending = needed;
+    pending = new hdf5_chunk *[max_pending];
+  }
+
+  // Only the lookups go through the HDF5 library, which is not re-entrant
+  for (int cz=cz0; cz <= cz1; cz++)
+    for (int cy=cy0; cy <= cy1; cy++)
+      for (int cx=cx0; cx <= cx1; cx++) {
+        kdu_long key = get_key(cx,cy,cz);
+        if (cache.find(key) != cache.end())
+          continue;
+        hdf5_chunk *chunk = new hdf5_chunk;
+        chunk->key = key;
+        chunk->x0 = cx * chunk_dims[0];
+        chunk->y0 = cy * chunk_dims[1];
+        chunk->z0 = cz * chunk_dims[2];
+        cache[key] = chunk;
+        locate_chunk(chunk);
+        pending[num_pending++] = chunk;
+      }
+
+  batch.run(num_pending,read_chunk,this,env,"HDF5 chunks");
+  for (int c=0; c < num_pending; c++)
+    if (pending[c]->failed)
+      { kdu_error e; e << "Unable to read the HDF5 chunk at plane "
+        << pending[c]->z0 << ", row " << pending[c]->y0 << ", column "
+        << pending[c]->x0 << "; it may be corrupt."; }
+  num_pending = 0;
+}
+
+/*****************************************************************************/
+/*                      hdf5_chunk_reader::locate_chunk                      */
+/*****************************************************************************/
+
+void
+  hdf5_chunk_reader::locate_chunk(hdf5_chunk *chunk)
+{
+#if H5_VERSION_GE(1,10,5)
+  hsize_t coords[3] = { (hsize_t) chunk->z0, (hsize_t) chunk->y0,
+                        (hsize_t) chunk->x0 };
+  unsigned filter_mask = 0;
+  haddr_t addr = HADDR_UNDEF;
+  hsize_t size = 0;
+  if (H5Dget_chunk_info_by_coord(dataset,coords,&filter_mask,&addr,
+        &size) < 0)
+    { kdu_error e; e << "Unable to locate the HDF5 chunk at plane "
+      << chunk->z0 << ", row " << chunk->y0 << ", column " << chunk->x0
+      << "."; }
+  chunk->filter_mask = filter_mask;
+  chunk->size = (kdu_long) size;
+  chunk->addr = (addr == HADDR_UNDEF)?-1:(base + (kdu_long) addr);
+#endif
+}
+
+/*****************************************************************************/
+/* STATIC                  hdf5_chunk_reader::read_chunk                     */
+/*****************************************************************************/
+
+void
+  hdf5_chunk_reader::read_chunk(void *context, int task_idx,
+      kdu_thread_env *env)
+{
+  hdf5_chunk_reader *obj = (hdf5_chunk_reader *) context;
+  hdf5_chunk *chunk = obj->pending[task_idx];
+  kdu_long num = obj->chunk_samples;
+  float *out = chunk->samples = new float[num];
+  if (chunk->addr < 0) { // Never written; holds the fill value
+    for (kdu_long i=0; i < num; i++)
+      out[i] = obj->fill;
+    return;
+  }
+
+  // Read the raw bytes, then run the filters backwards, from the last one
+  // applied when the chunk was written
+  kdu_long num_bytes = num * obj->bytes_per_sample;
+  kdu_long buf_bytes = (chunk->size > num_bytes)?chunk->size:num_bytes;
+  kdu_byte *data = new kdu_byte[buf_bytes]; // The buffers are swapped
+  kdu_byte *spare = new kdu_byte[buf_bytes];
+  kdu_long length = 0;
+  while (length < chunk->size) {
+    ssize_t got = pread(obj->fd,data+length,(size_t)(chunk->size-length),
+        (off_t)(chunk->addr+length));
+    if (got <= 0)
+      break;
+    length += got;
+  }
+  bool ok = (length == chunk->size);
+  for (int f=obj->num_filters-1; ok && (f >= 0); f--) {
+    if (chunk->filter_mask & (1u << f))
+      continue;
+    if (obj->filters[f] == H5Z_FILTER_DEFLATE) {
+      ok = inflate_bytes(data,length,spare,num_bytes);
+      length = num_bytes;
+    }
+    else if (length == num_bytes)
+      unshuffle_bytes(data,spare,num,obj->bytes_per_sample);
+    else
+      ok = false;
+    kdu_byte *tmp = data; data = spare; spare = tmp;
+  }
+  if (ok && (length != num_bytes))
+    ok = false;
+  if (ok && (obj->bytes_per_sample == 4)) {
+    if (obj->swap)
+      for (kdu_long i=0; i < num; i++) {
+        kdu_byte *s = data + 4*i;
+        kdu_byte t = s[0]; s[0] = s[3]; s[3] = t;
+        t = s[1]; s[1] = s[2]; s[2] = t;
+      }
+    memcpy(out,data,(size_t) num_bytes);
+  }
+  else if (ok) {
+    for (kdu_long i=0; i < num; i++) {
+      kdu_byte *s = data + 8*i;
+      if (obj->swap)
+        for (int b=0; b < 4; b++)
+          { kdu_byte t = s[b]; s[b] = s[7-b]; s[7-b] = t; }
+      double d;
+      memcpy(&d,s,8);
+      out[i] = (float) d;
+    }
+  }
+  chunk->failed = !ok;
+  delete[] data;
+  delete[] spare;
+}
@@ -74,29 +74,6 @@
 // HDF5 includes
 #include "hdf5_local.h"
 
-/*****************************************************************************/
-/* STATIC                   irreversible_normalize                           */
-/*****************************************************************************/
-
-static void
-  irreversible_normalize(float *buf, int buf_length, 
-    bool is_signed, double minval, double maxval, bool cerr_samples)
-{
-  //TODO: add normalization domain
-  
-  float factor, scale, offset=0.0;
-  float limmin=-0.75, limmax=0.75;
-  offset = -0.5;
-  scale = 1.0 / fabs(maxval-minval);
-
-  for (int i = 0; i < buf_length; i++) {
-    float fval = (buf[i]-minval) * scale + offset;
-    fval = (fval > limmin)?fval:limmin;
-    fval = (fval < limmax)?fval:limmax;
-    buf[i] = fval;
-  }
-}
-
 /*****************************************************************************/
 /* STATIC                    convert_TFLOAT_to_ints                          */
 /*****************************************************************************/
@@ -248,11 +225,18 @@ void
   /* Input dimensions (FREQ,DEC,RA) as (x,y,z)
    * Output  dimensions (RA,DEC,FREQ) as (x,y,z) */
 
+  if (source_file->crop.naxis != 3)
+    { kdu_error e; e << "Only 3 dimensional HDF5 cubes are supported."; }
+  if ((source_file->crop.stokes != 0) || (source_file->crop.num_stokes > 1))
+    { kdu_error e; e << "HDF5 cubes have no Stokes axis; only Stokes "
+      "parameter 0 may be selected."; }
+  source_file->crop.num_stokes = 1;
+
   std::cout << "HDF5 image dimensions:\n"
     "rank = " << (unsigned int)(source_file->crop.naxis) << "\n" << 
-    "rows = " << (unsigned int)(dims_dataset[2]) << "\n" << 
-    "cols = " << (unsigned int)(dims_dataset[2]) << "\n";  
-  free(dims_dataset);
+    "rows = " << (unsigned int)(dims_dataset[1]) << "\n" << 
+    "cols = " << (unsigned int)(dims_dataset[2]) << "\n" <<
+    "depth = " << (unsigned int)(dims_dataset[0]) << "\n";
 
   // Now we handle the cropping parameter
 
@@ -262,24 +246,49 @@ void
   extent = (hsize_t*) malloc(sizeof(hsize_t) * source_file->crop.naxis);
 
   if (source_file->crop.specified) {
-    if ((source_file->crop.x + source_file->crop.width) > dims_dataset[2])
+    if ((source_file->crop.x < 0) || (source_file->crop.y < 0) ||
+        (source_file->crop.z < 0) || (source_file->crop.width <= 0) ||
+        (source_file->crop.height <= 0) || (source_file->crop.depth <= 0))
+    { kdu_error e; e << "Requested input file cropping parameters must "
+      "have non-negative offsets and strictly positive dimensions."; }
+    if ((hsize_t)(source_file->crop.x + source_file->crop.width) >
+        dims_dataset[2])
     { kdu_error e; e << "Requested input file cropping parameters are "
       "not compatible with actual image dimensions.  The cropping "
         "region would cross the right hand boundary of the image."; }
-      if ((source_file->crop.y + source_file->crop.height) > dims_dataset[1])
+      if ((hsize_t)(source_file->crop.y + source_file->crop.height) >
+          dims_dataset[1])
       { kdu_error e; e << "Requested input file cropping parameters are "
         "not compatible with actual image dimensions. The cropping "
           "region would cross the the lower hand boundary of the image."; }
+      if ((hsize_t)(source_file->crop.z + source_file->crop.depth) >
+          dims_dataset[0])
+      { kdu_error e; e << "Requested input file cropping parameters are "
+        "not compatible with actual image dimensions. The cropping "
+          "region would cross the last frame of the image."; }
         offset[0] = source_file->crop.x; extent[0] = source_file->crop.width;         
         offset[1] = source_file->crop.y; extent[1] = source_file->crop.height;
         offset[2] = source_file->crop.z; extent[2] = 1;
   }
   else { // No cropping specified, default is the whole image
+    source_file->crop.x = source_file->crop.y = source_file->crop.z = 0;
+    source_file->crop.width = dims_dataset[2];
+    source_file->crop.height = dims_dataset[1];
+    source_file->crop.depth = dims_dataset[0];
     offset[0] = offset[1] = offset[2] = 0;
     extent[0] = source_file->crop.width;
     extent[1] = source_file->crop.height;
     extent[2] = 1;
   }
+  free(dims_dataset);
+
+  // Chunks compressed with deflate are inflated by us, in parallel, if we can
+  chunks = hdf5_chunk_reader::create(source_file->fname, file, dataset);
+  if (chunks != NULL) {
+    std::cout << "Chunked dataset; chunks will be inflated in parallel."
+      << std::endl;
+    source_file->block_height = chunks->get_chunk_height();
+  }
 
   // Define the memory space that will be used by get
   // Each call of get returns an image row. So memspace needs to be the size
@@ -329,11 +338,12 @@ hdf5_in::~hdf5_in()
   free(dims_mem);
   free(offset_out);
   free(offset_mem);
+  delete chunks;
 
   if (H5Tclose(datatype) < 0 || 
       H5Dclose(dataset) < 0 ||
       H5Sclose(dataspace) < 0 || 
-      H5Sclose(memspace) < 0 || 
+      ((memspace >= 0) && (H5Sclose(memspace) < 0)) || 
       H5Fclose(file) < 0)
   { kdu_error e; e << "Unable to close HDF5 file succesflly."; }
 }
@@ -345,12 +355,55 @@ hdf5_in::~hdf5_in()
 void
   hdf5_in::read_stripe(int height, float *buf,
     ska_source_file * const source_file, int component)
+{
+  read_raw_stripe(height, buf, source_file, component);
+  if (source_file->reversible)
+    { kdu_error e; e << "reversible compression is unimplemented."; }
+  source_file->norm.normalize(buf, source_file->crop.width*height,
+      component);
+}
+
+/*****************************************************************************/
+/*                          hdf5_in::read_raw_stripe                         */
+/*****************************************************************************/
+
+void
+  hdf5_in::read_raw_stripe(int height, float *buf,
+    ska_source_file * const source_file, int component)
 /* Reads in a stripe from the image and places it into buf. We make the rather
  * dangerous assumption that the stripe height provided will never exceed the
  * bounds of the image from our current index in the cube. */
 {
-  int width = source_file->crop.width; // Number of samples in the line
-  int length = width*height;
+  if (chunks != NULL)
+    chunks->read_rows(offset[0], offset_out[1], offset[2] + component,
+        extent[0], height, source_file->crop.depth - component, buf,
+        source_file->env);
+  else
+    read_hyperslab(height, buf, source_file, component);
+
+  /* Incremement position in HDF5 file
+   * Indices represent: 0 col, 1 row. Every component is read at the same
+   * rows, so we only move on once the last component has been read. */
+  offset_out[0] = offset[0]; // set col to beginning of next line
+  if (component < source_file->crop.depth - 1)
+    return;
+  if (offset_out[1] + height >= offset[1] + extent[1]) // read last rows
+    offset_out[1] = offset[1]; // set row to beginning of frame
+  else 
+    offset_out[1] += height; // otherwise just go to next row
+  num_unread_rows -= height;
+}
+
+/*****************************************************************************/
+/*                          hdf5_in::read_hyperslab                          */
+/*****************************************************************************/
+
+void
+  hdf5_in::read_hyperslab(int height, float *buf,
+    ska_source_file * const source_file, int component)
+/* Reads the stripe through H5Dread, for datasets `hdf5_chunk_reader' cannot
+ * handle. */
+{
   dims_mem[1] = height;
 
   // We select the hyperslab (cropped image cube) that will be encoded
@@ -358,6 +411,9 @@ void
   // Select the length of the z dimension of the hdf5 image, this will become 
   // a row (x dim) in our jpeg2000 image.
 
+  offset_out[2] = offset[2] + component;
+  if (memspace >= 0)
+    H5Sclose(memspace);
   memspace = H5Screate_simple(source_file->crop.naxis, dims_mem, NULL);
   if (memspace < 0)
     { kdu_error e; e << "Unable to create dataspace (memspace)."; }
@@ -380,27 +436,12 @@ void
       if (H5Dread(dataset, H5T_NATIVE_FLOAT, memspace, dataspace,
             H5P_DEFAULT, buf) < 0)
         { kdu_error e; e << "Unable to read FLOAT HDF5 dataset."; }
-
-      if (source_file->reversible)
-        { kdu_error e; e << "reversible compression is unimplemented."; }
-      else
-        irreversible_normalize(buf, length, source_file->is_signed, 
-            source_file->float_minvals, source_file->float_maxvals, true);
       break;
     }
     default: 
       kdu_error e; e << "Unimplemented class type."; 
       break; 
   }
-
-  /* Incremement position in HDF5 file
-   * Indices represent: 0 col, 1 row */
-  offset_out[0] = offset[0]; // set col to beginning of next line
-  if (offset_out[1] == offset[1] + extent[1] - 1) // just read last row in frame
-    offset_out[1] = offset[1]; // set row to beginning of next frame
-  else 
-    offset_out[1] += height; // otherwise just go to next row
-  num_unread_rows -= height;
 }
 
 /*****************************************************************************/
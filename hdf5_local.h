@@ -65,9 +65,71 @@
 #include "kdu_args.h"
 #include "hdf5.h"
 #include "ska_local.h"
+#include "ska_threads.h"
+#include <map>
+
+// Longest filter pipeline `hdf5_chunk_reader' will look at
+#define HDF5_MAX_CHUNK_FILTERS 8
 
 class hdf5_in;
 class hdf5_out;
+class hdf5_chunk_reader;
+struct hdf5_chunk;
+
+/*****************************************************************************/
+/*                          class hdf5_chunk_reader                          */
+/*****************************************************************************/
+
+class hdf5_chunk_reader {
+  /* Reads chunked datasets without HDF5's filter pipeline, which inflates
+   * every chunk a hyperslab touches on a single thread, since the library
+   * serializes all calls behind a global lock. Each chunk is located through
+   * HDF5 (`H5Dget_chunk_info_by_coord'), serially; its raw bytes are then
+   * read with `pread', inflated and unshuffled in parallel with a
+   * `ska_job_batch', and the chunk kept until every plane has read past it.
+   * Only IEEE floating point datasets whose filters are deflate and shuffle
+   * are handled, and only with HDF5 1.10.5 or later. */
+  public: // Member functions
+    static hdf5_chunk_reader *create(const char *fname, hid_t file,
+        hid_t dataset);
+    /* Returns NULL unless `dataset', of the open `file' named `fname', is a
+     * 3 dimensional chunked dataset which we can read; H5Dread must then be
+     * used instead. `dataset' must stay open while the reader is used. */
+    ~hdf5_chunk_reader();
+    int get_chunk_height() { return chunk_dims[1]; }
+    void read_rows(int x, int y, int z, int width, int height, int planes,
+        float *buf, kdu_thread_env *env);
+    /* Writes `height' rows of `width' samples, starting at column `x' and
+     * row `y' of plane `z', to `buf'. Rows must be read in order, with every
+     * plane read at one set of rows before moving on to the next; `planes'
+     * is the number of planes, from `z' on, still to be read at these rows.
+     * Their chunks are inflated together. `env' may be NULL. */
+  private: // Helper functions
+    hdf5_chunk_reader();
+    kdu_long get_key(int cx, int cy, int cz)
+      { return cx + (kdu_long) num_chunks[0] *
+          (cy + (kdu_long) num_chunks[1] * cz); }
+    void fetch(int cx0, int cx1, int cy0, int cy1, int z, int planes,
+        kdu_thread_env *env);
+    void locate_chunk(hdf5_chunk *chunk);
+    static void read_chunk(void *context, int task_idx,
+        kdu_thread_env *env);
+  private: // Data
+    int fd; // Our own descriptor for the file, for `pread'
+    hid_t dataset;
+    kdu_long base; // Size of the user block, to which addresses are relative
+    int dims[3], chunk_dims[3], num_chunks[3]; // Columns, rows, planes
+    kdu_long chunk_samples;
+    int bytes_per_sample; // 4 or 8
+    bool swap; // Byte order of the file differs from ours
+    int num_filters;
+    int filters[HDF5_MAX_CHUNK_FILTERS]; // In the order they were applied
+    float fill; // Value of chunks which were never written
+    std::map<kdu_long,hdf5_chunk *> cache; // Inflated chunks
+    hdf5_chunk **pending; // Chunks being read by `fetch'
+    int num_pending, max_pending;
+    ska_job_batch batch;
+};
 
 /*****************************************************************************/
 /*                             class hdf5_in                                 */
@@ -75,11 +137,14 @@ class hdf5_out;
 
 class hdf5_in : public ska_source_file_base {
   public: // Member functions
+    hdf5_in() { memspace = -1; chunks = NULL; }
     ~hdf5_in();
     void read_header(jp2_family_tgt &tgt, kdu_args &args, 
         ska_source_file * const source_file);
     void read_stripe(int height, float *buf, 
         ska_source_file * const source_file, int component);
+    void read_raw_stripe(int height, float *buf,
+        ska_source_file * const source_file, int component);
   private: // Members describing the organization of the HDF5 data
     hid_t file; // File handle for the HDF5 handle
     hid_t dataset;
@@ -104,8 +169,11 @@ class hdf5_in : public ska_source_file_base {
 
     int num_unread_rows; // Always starts at `rows', even with cropping
     int total_rows; // Used for progress bar
+    hdf5_chunk_reader *chunks; // NULL unless HDF5 inflates the chunks
   private: // Members which are affected by (or support) cropping
     bool parse_hdf5_parameters(jp2_family_tgt &tgt, kdu_args &args);
+    void read_hyperslab(int height, float *buf,
+        ska_source_file * const source_file, int component);
 };
 
 /*****************************************************************************/
@@ -63,8 +63,12 @@ A Kakadu demo application, demonstrating use of the powerful
 #include "kdu_args.h"
 #include "kdu_file_io.h"
 #include "jp2.h"
+#include "jpx.h"
 // SKA includes
 #include "../ska_local.h"
+#include "../ska_append.h"
+#include "../ska_threads.h"
+#include "../ska_flush.h"
 
 /* ========================================================================= */
 /*                         Set up messaging services                         */
@@ -173,6 +177,25 @@ print_usage(char *prog, bool comprehensive=false)
       "will be identified as auxiliary undefined components in the JP2 "
       "file.  For other options in writing JP2 files, refer to the "
       "more sophisticated \"kdu_compress\" application.\n";
+  out << "-append -- add the planes to an existing \".jpx\" cube\n";
+  if (comprehensive)
+    out << "\tInstead of creating the output file, the planes of the input "
+      "cube are added to those already in the JPX file named by `-o', "
+      "after its last plane, as a new group of codestreams (one for each "
+      "Stokes parameter). Nothing already in the file is re-encoded or "
+      "rewritten, so the cost is that of encoding the new planes alone.  "
+      "The planes must have the same dimensions and the same Stokes "
+      "parameters as those in the file, and are normalized in the same way; "
+      "with the global normalization mode, the range of the existing cube "
+      "is used.\n";
+  out << "-huge_pages -- hold code-blocks' data in 2 MB huge pages\n";
+  if (comprehensive)
+    out << "\tAllocates the memory in which each codestream buffers its "
+      "compressed code-block data in 2 MB slabs, asking the kernel to back "
+      "each with a huge page, so that fewer TLB misses are taken while "
+      "a large cube is encoded.  `-cpu' also reports how many slabs were "
+      "allocated and how often threads went to the shared buffering "
+      "service for memory.\n";
   out << "-rate -|<max bits/pel>[,<min bits/pel>]\n";
   if (comprehensive)
     out << "\tUse this argument to control the maximum bit-rate and/or the "
@@ -196,6 +219,16 @@ print_usage(char *prog, bool comprehensive=false)
       "meaning that the actual bit-rate(s) may be as much as 2% smaller "
       "than the specified target(s).  Specify `-tolerance 0' if you "
       "want the most precise rate control.\n";
+  out << "-pass_prediction <margin (bit-planes)>\n";
+  if (comprehensive)
+    out << "\tWith `-rate', predicts how many bit-planes of each code-block "
+      "are worth coding, from the rate-distortion slope threshold estimated "
+      "so far and from the code-blocks already coded in the same subband, "
+      "and codes no further than `margin' bit-planes below that, rather "
+      "than coding bit-planes which rate allocation will throw away.  This "
+      "saves most at low bit-rates.  A margin of 1 is recommended; the "
+      "compressed size then stays within about 1% of the target.  Without "
+      "`-rate' the option has no effect.\n";
   out << "-tolerance <percent tolerance on layer sizes given using `-rate'>\n";
   if (comprehensive)
     out << "\tThis argument affects the behaviour of the `-rate' argument "
@@ -265,6 +298,28 @@ print_usage(char *prog, bool comprehensive=false)
       "precinct dimensions would be a good choice for use with 32x32 "
       "code-blocks: `Cprecincts={256,256},{128,128},{64,64},{32,64},"
       "{16,64},{8,64},{4,64}'.\n";
+  out << "-write_behind -- write the codestream from a thread of its own\n";
+  if (comprehensive)
+    out << "\tCopies the codestream into 4 MB buffers as it is flushed, and "
+      "leaves the writing of each full buffer to a dedicated writer thread, "
+      "so that the threads which flush the codestream (with "
+      "`-flush_period', the coding threads) never wait for the disk.  Up to "
+      "256 MB may be waiting to be written before they do.  TLM marker "
+      "segments and box lengths are filled in as usual.  Cannot be used "
+      "with `-append'.\n";
+  out << "-write_direct -- `-write_behind', bypassing the page cache\n";
+  if (comprehensive)
+    out << "\tAs `-write_behind', but the buffers are written with O_DIRECT, "
+      "so that a large cube does not push everything else out of the page "
+      "cache.  A warning is given if the file system does not support it, "
+      "in which case the file is written as with `-write_behind'.\n";
+  out << "-write_sync <MB>\n";
+  if (comprehensive)
+    out << "\tAs `-write_behind', but the writer thread also calls "
+      "`fdatasync' each time this many megabytes have been written, so "
+      "that dirty pages are retired in batches by the writer thread, rather "
+      "than all at once when the file is closed or by the kernel throttling "
+      "whichever thread next writes.\n";
   siz_params siz; siz.describe_attributes(out,comprehensive);
   cod_params cod; cod.describe_attributes(out,comprehensive);
   qcd_params qcd; qcd.describe_attributes(out,comprehensive);
@@ -314,6 +369,14 @@ print_usage(char *prog, bool comprehensive=false)
       "something which cannot always be accurately determined through "
       "system calls.  The default value might also not yield the "
       "best possible throughput.\n";
+  out << "-numa -- spread the threads and the work over the NUMA nodes\n";
+  if (comprehensive)
+    out << "\tOn machines with more than one NUMA node, binds the threads to "
+      "the processors of each node in turn, and has each Stokes parameter "
+      "(or, for a single Stokes parameter, each tile of a row of tiles) "
+      "encoded by the threads of one node, so that its sample and code "
+      "buffers are allocated in, and used from, that node's memory.  "
+      "Without effect on machines with uniform memory access.\n";
   out << "-double_buffering <num double buffered rows>\n";
   if (comprehensive)
     out << "\tThis option is intended to be used in conjunction with "
@@ -423,8 +486,11 @@ parse_simple_args(kdu_args &args, char * &ofname, float &max_rate,
     float &min_rate, double &rate_tolerance,
     int &preferred_min_stripe_height,
     int &absolute_max_stripe_height, int &flush_period,
-    int &num_threads, int &double_buffering_height,
-    bool &cpu, jp2_family_tgt jp2_ultimate_tgt)
+    int &num_threads, int &double_buffering_height, bool &numa,
+    bool &cpu, bool &append, bool &huge_pages,
+    int &pass_prediction, bool &write_behind, bool &write_direct,
+    int &write_sync,
+    jp2_family_tgt jp2_ultimate_tgt)
 /* Parses all command line arguments whose names include a dash.  Returns
    a list of open input files. */
 {
@@ -474,6 +540,12 @@ parse_simple_args(kdu_args &args, char * &ofname, float &max_rate,
   else if ((num_threads = kdu_get_num_processors()) < 2)
     num_threads = 0;
 
+  numa = false;
+  if (args.find("-numa") != NULL) {
+    numa = true;
+    args.advance();
+  }
+
   if (args.find("-double_buffering") != NULL) {
     if (num_threads == 0)
       { kdu_error e; e << "\"-double_buffering\" may only be used with " 
@@ -543,6 +615,16 @@ parse_simple_args(kdu_args &args, char * &ofname, float &max_rate,
     args.advance();
   }
 
+  pass_prediction = -1;
+  if (args.find("-pass_prediction") != NULL) {
+    char *string = args.advance();
+    if ((string == NULL) || (sscanf(string,"%d",&pass_prediction) != 1) ||
+        (pass_prediction < 0))
+      { kdu_error e; e << "\"-pass_prediction\" argument requires a "
+        "non-negative integer (bit-planes)."; }
+    args.advance();
+  }
+
   if (args.find("-tolerance") != NULL) { 
     char *string = args.advance();
     if ((string == NULL) || (sscanf(string,"%lf",&rate_tolerance) != 1) ||
@@ -553,6 +635,18 @@ parse_simple_args(kdu_args &args, char * &ofname, float &max_rate,
     args.advance();
   }
 
+  append = false;
+  if (args.find("-append") != NULL) {
+    append = true;
+    args.advance();
+  }
+
+  huge_pages = false;
+  if (args.find("-huge_pages") != NULL) {
+    huge_pages = true;
+    args.advance();
+  }
+
   if (args.find("-flush_period") != NULL) {
     char *string = args.advance();
     if ((string == NULL) || (sscanf(string,"%d",&flush_period) != 1) ||
@@ -564,6 +658,30 @@ parse_simple_args(kdu_args &args, char * &ofname, float &max_rate,
     args.advance();
   }
 
+  write_behind = write_direct = false;
+  write_sync = 0;
+  if (args.find("-write_behind") != NULL) {
+    write_behind = true;
+    args.advance();
+  }
+  if (args.find("-write_direct") != NULL) {
+    write_behind = write_direct = true;
+    args.advance();
+  }
+  if (args.find("-write_sync") != NULL) {
+    char *string = args.advance();
+    if ((string == NULL) || (sscanf(string,"%d",&write_sync) != 1) ||
+        (write_sync < 1))
+      { kdu_error e; e << "\"-write_sync\" argument requires a positive "
+        "number of megabytes."; }
+    write_behind = true;
+    args.advance();
+  }
+  if (write_behind && append)
+    { kdu_error e; e << "\"-append\" writes to the end of an existing file "
+      "itself, so cannot be used with \"-write_behind\", \"-write_direct\" "
+      "or \"-write_sync\"."; }
+
   if (args.find("-i") != NULL) {
     const char *string = args.advance();
     if (string == NULL)
@@ -610,6 +728,25 @@ check_jp2_suffix(const char *fname)
 }
 
 
+/*****************************************************************************/
+/* STATIC                      check_jpx_suffix                              */
+/*****************************************************************************/
+
+  static bool
+check_jpx_suffix(const char *fname)
+  /* Returns true if the file-name has the suffix, ".jpx", where the
+     check is case insensitive.  Only JPX files can hold more than one
+     codestream. */
+{
+  const char *cp = strrchr(fname,'.');
+  if (cp == NULL)
+    return false;
+  return (((cp[1] == 'j') || (cp[1] == 'J')) &&
+          ((cp[2] == 'p') || (cp[2] == 'P')) &&
+          ((cp[3] == 'x') || (cp[3] == 'X')) && (cp[4] == '\0'));
+}
+
+
 /* ========================================================================= */
 /*                            External Functions                             */
 /* ========================================================================= */
@@ -630,31 +767,116 @@ int main(int argc, char *argv[])
   double rate_tolerance;
   int preferred_min_stripe_height, absolute_max_stripe_height;
   int num_threads, env_dbuf_height, flush_period;
-  bool cpu;
+  bool numa, cpu;
   kdu_compressed_target *output = NULL;
   kdu_simple_file_target file_out;
+  ska_flush_target flush_out; // Used instead, with `-write_behind'
   jp2_family_tgt jp2_ultimate_tgt;
   jp2_target jp2_out;
+  jpx_target jpx_out;
+  ska_jpx_appender appender;
+  bool append, huge_pages, write_behind, write_direct;
+  int pass_prediction, write_sync;
   ska_source_file *ifile =
     parse_simple_args(args,ofname,max_rate,min_rate,rate_tolerance,
         preferred_min_stripe_height,
         absolute_max_stripe_height,flush_period,
-        num_threads,env_dbuf_height,cpu,jp2_ultimate_tgt);
+        num_threads,env_dbuf_height,numa,cpu,append,huge_pages,
+        pass_prediction,write_behind,write_direct,write_sync,
+        jp2_ultimate_tgt);
+
+  // Every selected Stokes parameter becomes a codestream of its own, which
+  // only JPX files can hold; other files get the first one by default.
+  bool jpx_output = check_jpx_suffix(ofname);
+  if (append) {
+    if (!jpx_output)
+      { kdu_error e; e << "\"-append\" requires a JPX output file (\".jpx\" "
+        "suffix)."; }
+    appender.open(ofname);
+    appender.prepare(ifile);
+  }
+  else if (!jpx_output)
+    ifile->crop.num_stokes = 1;
 
-  // Create appropriate output file
-  if (check_jp2_suffix(ofname)) {
+  // Construct multi-threaded processing environment, if requested.  Note that
+  // all we have to do to leverage the presence of multiple physical processors
+  // is to create the multi-threaded environment with at least one thread for
+  // each processor, pass a reference (`env_ref') to this environment into
+  // `kdu_stripe_decompressor::start', and destroy the environment once we are
+  // all done.
+  //    If you are going to run the processing within a try/catch
+  // environment, with an error handler which throws exceptions rather than
+  // exiting the process, the only extra thing you need to do to realize
+  // robust multi-threaded processing, is to arrange for your `catch' clause
+  // to invoke `kdu_thread_entity::handle_exception' -- i.e., call
+  // `env.handle_exception(exc)', where `exc' is the exception code which you
+  // catch, of type `kdu_exception'.  Even this is not necessary if you are
+  // happy for the `kdu_thread_env' object to be destroyed when an
+  // error/exception occurs.
+  kdu_thread_env env, *env_ref=NULL;
+  if (num_threads > 0) {
+    num_threads = ska_create_threads(env,num_threads,numa);
+    env_ref = &env;
+  }
+  ifile->env = env_ref; // Lets the reader decompress tiles in parallel, and
+                        // the normalization pre-scan measure planes in parallel
+
+  ifile->read_header(jp2_ultimate_tgt, args); 
+  if (append)
+    appender.check(ifile);
+  int s, num_stokes = ifile->crop.num_stokes;
+  if ((num_stokes > 1) && !jpx_output)
+    { kdu_error e; e << "Several Stokes parameters can only be written to a "
+      "JPX file (\".jpx\" suffix); use `-stokes' to select one of them."; }
+  if ((num_stokes > 1) && (flush_period > 0))
+    { kdu_error e; e << "\"-flush_period\" cannot be used when several "
+      "Stokes parameters are encoded, since their codestreams are only "
+      "written to the JPX file, one after the other, once all of them have "
+      "been compressed."; }
+
+  // Create appropriate output file. JPX files are always written through
+  // `jpx_target', with box lengths known, so that planes can be appended.
+  //    With `-write_behind', the file itself is written by `flush_out', and
+  // JP2 family files are written to it through `jp2_ultimate_tgt'.
+  if (write_behind) {
+    flush_out.open(ofname,write_direct,((kdu_long) write_sync)<<20);
+    if (write_direct && !flush_out.uses_direct_io())
+      { kdu_warning w; w << "The file system does not support O_DIRECT; "
+        "\"-write_direct\" writes through the page cache instead."; }
+  }
+  jpx_codestream_target *jpx_streams = new jpx_codestream_target[num_stokes];
+  kdu_compressed_target **stream_tgts = new kdu_compressed_target *[num_stokes];
+  if (append) {
+    for (s=0; s < num_stokes; s++)
+      stream_tgts[s] = appender.access_stream(s);
+  }
+  else if (jpx_output) {
+    if (write_behind)
+      jp2_ultimate_tgt.open(&flush_out);
+    else
+      jp2_ultimate_tgt.open(ofname);
+    jpx_out.open(&jp2_ultimate_tgt);
+    for (s=0; s < num_stokes; s++) {
+      jpx_streams[s] = jpx_out.add_codestream();
+      stream_tgts[s] = jpx_streams[s].access_stream();
+    }
+  }
+  else if (check_jp2_suffix(ofname)) {
     output = &jp2_out;
-    jp2_ultimate_tgt.open(ofname);
+    if (write_behind)
+      jp2_ultimate_tgt.open(&flush_out);
+    else
+      jp2_ultimate_tgt.open(ofname);
     jp2_out.open(&jp2_ultimate_tgt);
   }
+  else if (write_behind)
+    output = &flush_out;
   else {
     output = &file_out;
     file_out.open(ofname);
   }
   delete[] ofname;
 
-  ifile->read_header(jp2_ultimate_tgt, args); 
-
   // Collect any dimensioning/tiling parameters supplied on the command line;
   // need dimensions for raw files, if any.
   siz_params siz;
@@ -718,6 +940,7 @@ int main(int argc, char *argv[])
     siz.get(Sprecision,i,0,test, true, true, true);
     std::cout << "siz: s precision: " << test << std::endl;
   }
+  total_samples *= num_stokes; // Every codestream has the same dimensions
 
   int c_components=0;
   if (!siz.get(Scomponents,0,0,c_components))
@@ -728,18 +951,50 @@ int main(int argc, char *argv[])
   kdu_clock timer;
   double processing_time=0.0, reading_time=0.0;
 
-  // Construct the `kdu_codestream' object and parse all remaining args
-  kdu_codestream codestream;
-  codestream.create(&siz,output);
-  for (string=args.get_first(); string != NULL; )
-    string = args.advance(codestream.access_siz()->parse_string(string));
+  // Construct a `kdu_codestream' object for each Stokes parameter and parse
+  // all remaining args into every one of them. JPX codestreams can be
+  // compressed before their boxes are opened, so long as nothing is flushed.
+  kdu_codestream *codestreams = new kdu_codestream[num_stokes];
+  for (s=0; s < num_stokes; s++) {
+    codestreams[s].create(&siz,(output == NULL)?stream_tgts[s]:output);
+    codestreams[s].set_huge_page_buffers(huge_pages);
+  }
+  for (string=args.get_first(); string != NULL; ) {
+    bool parsed = false;
+    for (s=0; s < num_stokes; s++)
+      parsed = codestreams[s].access_siz()->parse_string(string) || parsed;
+    string = args.advance(parsed);
+  }
   if (args.show_unrecognized(pretty_cout) != 0)
     { kdu_error e; e << "There were unrecognized command line arguments!"; }
-  codestream.change_appearance(false,true,false);
-  codestream.access_siz()->finalize_all();
+  for (s=0; s < num_stokes; s++) {
+    codestreams[s].change_appearance(false,true,false);
+    codestreams[s].access_siz()->finalize_all();
+    codestreams[s].set_pass_prediction(pass_prediction);
+  }
+  kdu_codestream codestream = codestreams[0];
+
+  // Write the JPX header, with a compositing layer for each Stokes parameter
+  // which shows its first plane
+  if (append)
+    appender.write_headers(codestreams,num_stokes);
+  else if (jpx_output) {
+    for (s=0; s < num_stokes; s++) {
+      jp2_dimensions dimensions = jpx_streams[s].access_dimensions();
+      dimensions.init(codestreams[s].access_siz());
+      jpx_layer_target layer = jpx_out.add_layer();
+      jp2_colour colour = layer.add_colour();
+      colour.init(JP2_sLUM_SPACE);
+      jp2_channels channels = layer.access_channels();
+      channels.init(1);
+      channels.set_colour_mapping(0,0,-1,s);
+    }
+    jpx_out.write_headers();
+    ifile->write_metadata(jp2_ultimate_tgt);
+  }
 
   // Write the JP2 header, if necessary
-  if (jp2_ultimate_tgt.exists()) { 
+  else if (jp2_ultimate_tgt.exists()) { 
     // Do minimal JP2 file initialization, for demonstration purposes
     jp2_dimensions dimensions = jp2_out.access_dimensions();
     dimensions.init(codestream.access_siz());
@@ -761,11 +1016,21 @@ int main(int argc, char *argv[])
     jp2_out.open_codestream(true);
   }
 
+  // A single codestream box can be opened now, so that the codestream can be
+  // flushed incrementally; several are opened in turn, as they are finished
+  jp2_output_box *stream_box = NULL;
+  if (jpx_output && (num_stokes == 1))
+    stream_box = (append)?appender.open_stream(0):jpx_streams[0].open_stream();
+
   // Determine the desired cumulative layer sizes
   int num_layer_sizes;
   kdu_params *cod = codestream.access_siz()->access_cluster(COD_params);
-  if (!(cod->get(Clayers,0,0,num_layer_sizes) && (num_layer_sizes > 0)))
-    cod->set(Clayers,0,0,num_layer_sizes=1);
+  if (!(cod->get(Clayers,0,0,num_layer_sizes) && (num_layer_sizes > 0))) {
+    num_layer_sizes = 1;
+    for (s=0; s < num_stokes; s++)
+      codestreams[s].access_siz()->access_cluster(COD_params)->
+        set(Clayers,0,0,num_layer_sizes);
+  }
   kdu_long *layer_sizes = new kdu_long[num_layer_sizes];
   memset(layer_sizes,0,sizeof(kdu_long)*num_layer_sizes);
   if ((min_rate > 0.0F) && (num_layer_sizes < 2))
@@ -779,30 +1044,6 @@ int main(int argc, char *argv[])
     layer_sizes[num_layer_sizes-1] =
       (kdu_long)(total_pixels*max_rate*0.125);
 
-  // Construct multi-threaded processing environment, if requested.  Note that
-  // all we have to do to leverage the presence of multiple physical processors
-  // is to create the multi-threaded environment with at least one thread for
-  // each processor, pass a reference (`env_ref') to this environment into
-  // `kdu_stripe_decompressor::start', and destroy the environment once we are
-  // all done.
-  //    If you are going to run the processing within a try/catch
-  // environment, with an error handler which throws exceptions rather than
-  // exiting the process, the only extra thing you need to do to realize
-  // robust multi-threaded processing, is to arrange for your `catch' clause
-  // to invoke `kdu_thread_entity::handle_exception' -- i.e., call
-  // `env.handle_exception(exc)', where `exc' is the exception code which you
-  // catch, of type `kdu_exception'.  Even this is not necessary if you are
-  // happy for the `kdu_thread_env' object to be destroyed when an
-  // error/exception occurs.
-  kdu_thread_env env, *env_ref=NULL;
-  if (num_threads > 0) {
-    env.create();
-    for (int nt=1; nt < num_threads; nt++)
-      if (!env.add_thread())
-        num_threads = nt; // Unable to create all the threads requested
-    env_ref = &env;
-  }
-
   // Construct the stripe-compressor object (this does all the work) and
   // assign stripe buffers for incremental processing.  Note that nothing stops
   // you from passing in stripes of an image you have in memory, produced by
@@ -816,28 +1057,48 @@ int main(int argc, char *argv[])
   // on the efficiency with which the image is compressed (a fundamental
   // issue, not a Kakadu implementation issue).  For more on this, see the
   // extensive documentation provided for `kdu_stripe_compressor::push_stripe'.
+  //    There is one stripe compressor for each Stokes parameter; their
+  // stripes are held one Stokes parameter after another, as the components
+  // of `ifile' are. The compressors share the threads of `env', so the
+  // tiles of one Stokes parameter are encoded while the stripes of the next
+  // are being read.
+  int num_bufs = num_components * num_stokes;
   int *precisions = new int[num_components];
-  int *stripe_heights = new int[num_components];
-  int *max_stripe_heights = new int[num_components];
-  float **stripe_bufs = new float *[num_components];
+  int *stripe_heights = new int[num_bufs];
+  int *max_stripe_heights = new int[num_bufs];
+  float **stripe_bufs = new float *[num_bufs];
   bool *is_signed = new bool [num_components];
 
-  kdu_stripe_compressor compressor;
-  compressor.start(codestream,num_layer_sizes,layer_sizes,NULL,0,false,
-      false,true,rate_tolerance,num_components,
-      false,env_ref,NULL,env_dbuf_height);
-  compressor.get_recommended_stripe_heights(preferred_min_stripe_height,
-      absolute_max_stripe_height,
-      stripe_heights,max_stripe_heights);
+  // With `-numa', each Stokes parameter is encoded on one NUMA node, by
+  // attaching its compressor beneath a queue of that node
+  kdu_thread_queue *node_queues = NULL;
+  int num_nodes = (env_ref == NULL)?0:env.get_num_numa_nodes();
+  if ((num_nodes > 1) && (num_stokes > 1)) {
+    node_queues = new kdu_thread_queue[num_stokes];
+    for (s=0; s < num_stokes; s++) {
+      node_queues[s].set_numa_node(s % num_nodes);
+      env.attach_queue(node_queues+s,NULL,NULL);
+    }
+  }
+
+  kdu_stripe_compressor *compressors = new kdu_stripe_compressor[num_stokes];
+  for (s=0; s < num_stokes; s++) {
+    compressors[s].start(codestreams[s],num_layer_sizes,layer_sizes,NULL,0,
+        false,false,true,rate_tolerance,num_components,false,env_ref,
+        (node_queues == NULL)?NULL:(node_queues+s),env_dbuf_height);
+    compressors[s].get_recommended_stripe_heights(preferred_min_stripe_height,
+        absolute_max_stripe_height,
+        stripe_heights+s*num_components,max_stripe_heights+s*num_components);
+  }
 
   int n = 0;
-  for (n=0; n < num_components; n++) {
+  for (n=0; n < num_bufs; n++) {
     if ((stripe_bufs[n]=new float[ifile->crop.width*max_stripe_heights[n]])==NULL)
       { kdu_error e; e << "Insufficient memory to allocate stripe buffers."; }
-    else {
-      precisions[n] = ifile->precision > 32 ? 32 : ifile->precision;
-      is_signed[n] = ifile->is_signed;
-    }
+  }
+  for (n=0; n < num_components; n++) {
+    precisions[n] = ifile->precision > 32 ? 32 : ifile->precision;
+    is_signed[n] = ifile->is_signed;
   }
 
   if (ifile->reversible) {
@@ -845,22 +1106,32 @@ int main(int argc, char *argv[])
       << "mini-tool\n";
   }
   else {
-    // Now for the incremental processing
-    do {
-      compressor.get_recommended_stripe_heights(preferred_min_stripe_height,
-          absolute_max_stripe_height,
-          stripe_heights,NULL);
-
-      if (cpu)
-        processing_time += timer.get_ellapsed_seconds();
-      for (n=0; n < num_components; n++) {
-        assert(stripe_heights[n] <= max_stripe_heights[n]);
-        ifile->read_stripe(stripe_heights[n],stripe_bufs[n],n);
+    // Now for the incremental processing. Every codestream has the same
+    // dimensions and coding parameters, so the compressors ask for the same
+    // stripe heights and finish together; the file is read in a single
+    // pass, with the same rows of every Stokes parameter read together.
+    bool more = true;
+    while (more) {
+      more = false;
+      for (s=0; s < num_stokes; s++) {
+        int c0 = s*num_components;
+        compressors[s].get_recommended_stripe_heights(
+            preferred_min_stripe_height,absolute_max_stripe_height,
+            stripe_heights+c0,NULL);
+
+        if (cpu)
+          processing_time += timer.get_ellapsed_seconds();
+        for (n=c0; n < c0+num_components; n++) {
+          assert(stripe_heights[n] <= max_stripe_heights[n]);
+          ifile->read_stripe(stripe_heights[n],stripe_bufs[n],n);
+        }
+        if (cpu)
+          reading_time += timer.get_ellapsed_seconds();
+        if (compressors[s].push_stripe(stripe_bufs+c0,stripe_heights+c0,
+              NULL,NULL,NULL,is_signed,flush_period))
+          more = true;
       }
-      if (cpu)
-        reading_time += timer.get_ellapsed_seconds();
-    } while (compressor.push_stripe(stripe_bufs,stripe_heights,NULL,NULL,
-          NULL,is_signed,flush_period));
+    }
   }
 
   if (cpu)
@@ -881,25 +1152,65 @@ int main(int argc, char *argv[])
         "(see `-num_threads')\n";
   }
 
-  // Clean up
-  compressor.finish();
+  // Clean up. Each JPX codestream box is opened only as its codestream is
+  // flushed, so that the boxes are written one after the other.
+  for (s=0; s < num_stokes; s++) {
+    jp2_output_box *box = stream_box;
+    if (num_stokes > 1)
+      box = (append)?appender.open_stream(s):jpx_streams[s].open_stream();
+    compressors[s].finish();
+    if (box != NULL)
+      box->close();
+  }
   if (env.exists())
     env.destroy(); // Note: there is no need to call `env.cs_terminate' here,
   // because: a) it has already been called inside
   // `compressor.finish'; and b) we are calling `env.destroy'
   // first.
-  codestream.destroy();
+  if (node_queues != NULL)
+    delete[] node_queues; // Detached by `env.destroy'
+  if (cpu) { // Report the work of the code-buffer allocators
+    kdu_long heap_total=0, transfer_total=0, contended_total=0;
+    for (s=0; s < num_stokes; s++) {
+      kdu_long heap, transfers, contended;
+      codestreams[s].get_buffer_stats(heap,transfers,contended);
+      heap_total += heap;
+      transfer_total += transfers;
+      contended_total += contended;
+    }
+    pretty_cout << "Code-buffer memory: " << heap_total
+      << " heap allocations, " << transfer_total
+      << " shared transactions (" << contended_total
+      << " contended).\n";
+  }
+  for (s=0; s < num_stokes; s++)
+    codestreams[s].destroy();
 
-  output->close();
+  if (append)
+    appender.finish(ifile);
+  else if (jpx_output)
+    jpx_out.close();
+  else
+    output->close();
   if (jp2_ultimate_tgt.exists())
     jp2_ultimate_tgt.close();
-  for (n=0; n < num_components; n++)
+  if (write_behind) {
+    flush_out.close(); // Waits for the writer thread, unless closed above
+    if (cpu)
+      pretty_cout << "Codestream writes waited for the writer thread "
+        << flush_out.get_stalls() << " times.\n";
+  }
+  for (n=0; n < num_bufs; n++)
     delete[] stripe_bufs[n];
   delete[] stripe_bufs;
   delete[] precisions;
   delete[] stripe_heights;
   delete[] max_stripe_heights;
   delete[] layer_sizes;
+  delete[] compressors;
+  delete[] codestreams;
+  delete[] jpx_streams;
+  delete[] stream_tgts;
   delete ifile; 
   return 0;
 }
@@ -51,6 +51,7 @@ Description:
 #include <stdio.h>
 #include <iostream>
 #include <assert.h>
+#include <limits.h>
 // Kakadu core includes
 #include "kdu_arch.h"
 #include "kdu_elementary.h"
@@ -63,8 +64,13 @@ Description:
 #include "kdu_args.h"
 #include "kdu_file_io.h"
 #include "jp2.h"
+#include "jpx.h"
 // SKA includes
 #include "../ska_local.h"
+#include "../ska_quality.h"
+#include "../ska_wcs.h"
+#include "../ska_threads.h"
+#include "../ska_prefetch.h"
 
 /* ========================================================================= */
 /*                         Set up messaging services                         */
@@ -127,6 +133,28 @@ static void
            "wrapped in any JP2 compatible file format.  The file signature "
            "is used to check whether or not the file is a raw codestream, "
            "rather than relying upon a file name suffix.\n";
+  out << "-mmap -- read the input file through a memory mapping\n";
+  if (comprehensive)
+    out << "\tMaps the whole input file into memory, so that code-block bytes "
+           "are parsed straight from the mapping, with neither a system call "
+           "nor a copy for each read.  The kernel is told to read ahead when "
+           "everything is decompressed, and to read only the pages touched "
+           "when a region (`-int_region' or a WCS cutout), a reduced "
+           "resolution or a subset of the planes is decompressed, which "
+           "suits region requests on large archives.  Not available on "
+           "Windows.\n";
+  out << "-prefetch -- read the precincts to be decompressed ahead\n";
+  if (comprehensive)
+    out << "\tAs soon as the packet length (PLT) markers of a tile have been "
+           "read, every precinct which the region, resolution, planes and "
+           "layers to be decompressed need is requested from the input file "
+           "in one batch, through an io_uring on Linux kernels which have "
+           "one, or else by a small pool of reader threads, so that the "
+           "reads overlap with each other and with decompression rather "
+           "than being made one at a time as each precinct is needed.  This "
+           "helps most on cold caches, fast SSDs and network file systems.  "
+           "Files without PLT markers (see `ORGgen_plt') are read as "
+           "usual.  May not be combined with `-mmap'.\n";
   out << "-o <PGM/raw file 1>[,<PGM/raw file 2>[,...]]\n";
   if (comprehensive)
     out << "\tIf you omit this argument, all image components will be fully "
@@ -173,6 +201,13 @@ static void
            "as many remaining image components as can be stored in the "
            "output image file(s) specified with \"-o\" (or all remaining "
            "components, if no \"-o\" argument is supplied).\n";
+  out << "-stokes <Stokes parameter to decompress>\n";
+  if (comprehensive)
+    out << "\tSelects one of the Stokes parameters (counting from 0, as for "
+           "the encoder's `-stokes' argument) in a JPX file which holds "
+           "several of them.  Each was encoded as a codestream of its own, so "
+           "only the selected one is read.  By default, the first Stokes "
+           "parameter in the file is decompressed.\n";
   out << "-layers <max layers to decode>\n";
   if (comprehensive)
     out << "\tSet an upper bound on the number of quality layers to actually "
@@ -202,6 +237,27 @@ static void
            "the `-region' argument offered by the \"kdu_expand\" application "
            "is similar, except that it accepts normalized region coordinates, "
            "in the range 0 to 1.\n";
+  out << "-wcs_region {<lon1>,<lon2>},{<lat1>,<lat2>}\n";
+  if (comprehensive)
+    out << "\tDecompresses a cutout holding every pixel which overlaps the "
+           "given box of sky, in degrees, in the celestial coordinate system "
+           "of the cube (e.g. RA and Dec).  The box runs eastward from "
+           "<lon1> to <lon2>, so it may straddle 0.  The world coordinates "
+           "are read from the FITS header kept in the file, whose reference "
+           "pixels (CRPIXi) are corrected for the cutout in the output.  "
+           "Only the code-blocks which affect the cutout are decoded; if the "
+           "cube was encoded with precincts, a position-major progression and "
+           "PLT markers (e.g. `ORGgen_plt=yes Corder=RPCL "
+           "Cprecincts={128,128}'), the packets of other precincts are not "
+           "even read.  May not be combined with `-int_region' or "
+           "`-skip_components'.\n";
+  out << "-wcs_spectral {<first>,<last>}\n";
+  if (comprehensive)
+    out << "\tAs above, for the planes of the cube, in the units of its "
+           "spectral axis (CUNIT3; e.g. Hz for a FREQ axis).  Plane groups "
+           "added with the encoder's `-append' which lie outside the range "
+           "are not read at all.  May be used with or without "
+           "`-wcs_region'.\n";
   out << "-min_height <preferred minimum stripe height>\n";
   if (comprehensive)
     out << "\tAllows you to control the processing stripe height which is "
@@ -260,6 +316,12 @@ static void
            "something which cannot always be accurately determined through "
            "system calls.  The default value might also not yield the "
            "best possible throughput.\n";
+  out << "-numa -- spread the threads and the work over the NUMA nodes\n";
+  if (comprehensive)
+    out << "\tOn machines with more than one NUMA node, binds the threads "
+           "to the processors of each node in turn, and has each tile of a "
+           "row of tiles decoded by the threads of one node.  Without effect "
+           "on machines with uniform memory access.\n";
   out << "-double_buffering <num double buffered rows>\n";
   if (comprehensive)
     out << "\tThis option may be used only in conjunction with a non-zero "
@@ -305,6 +367,43 @@ static void
            "buffers to disk files is skipped.  This can have a huge impact "
            "on timing, depending on your platform, and many applications "
            "do not need to write the results to disk.\n";
+  out << "-verify <original FITS/HDF5 cube>\n";
+  if (comprehensive)
+    out << "\tCompares the decompressed samples with those of the original "
+           "cube, stripe by stripe, and reports the quality metrics selected "
+           "with the flags below (or those of `-N' if none are selected).  "
+           "The original is cropped to the same components (see "
+           "`-skip_components') and region (see `-int_region') as the "
+           "decompressed image.  Nothing needs to be written to disk, so "
+           "this may be combined with the omission of `-o'.  May not be "
+           "combined with `-reduce'.\n";
+  out << "-K -- all quality metrics, including intermediate sums\n";
+  out << "-N -- MSE, RMSE, PSNR, MAE, fidelity and maximum abs distortion\n";
+  out << "-B -- fidelity\n";
+  out << "-D -- peak signal to noise ratio\n";
+  out << "-G -- maximum absolute distortion\n";
+  out << "-H -- mean squared error\n";
+  out << "-L -- root mean squared error\n";
+  out << "-U -- mean absolute error\n";
+  out << "-V -- squared error\n";
+  out << "-Y -- absolute error\n";
+  out << "-X -- sum of squared original intensities\n";
+  out << "-Z <residual cube>\n";
+  if (comprehensive)
+    out << "\tWrites the difference between the decompressed and the "
+           "original samples to a new cube.  Requires `-verify'.\n";
+  out << "-rd_sweep\n";
+  if (comprehensive)
+    out << "\tRequires `-verify'.  Decompresses the image once for every "
+           "number of quality layers (all of them, or up to `-layers'), "
+           "and prints a rate-distortion table giving the compressed size "
+           "needed for that many layers, the bits per voxel, the quality "
+           "metrics and the decompression time.  The codestream is parsed "
+           "only once and kept in memory (persistent mode), so a single "
+           "encode with many `Clayers' (e.g. `-rate' with a list of rates) "
+           "replaces a separate encode for every rate of interest.  Any "
+           "residual cube (`-Z') is for the full set of layers.  May not be "
+           "combined with `-o'.\n";
   out << "-version -- print core system version I was compiled against.\n";
   out << "-v -- abbreviation of `-version'\n";
   out << "-usage -- print a comprehensive usage statement.\n";
@@ -324,7 +423,7 @@ static ska_dest_file*
                     int &max_layers, int &discard_levels,
                     kdu_dims &region, int &preferred_min_stripe_height,
                     int &absolute_max_stripe_height, bool &force_precise,
-                    bool &want_fastest, int &num_threads,
+                    bool &want_fastest, int &num_threads, bool &numa,
                     int &double_buffering_height, bool &cpu)
   /* Parses all command line arguments whose names include a dash.  Returns
      a list of open output files.
@@ -353,7 +452,7 @@ static ska_dest_file*
   num_threads = 0; // This is not actually the default -- see below.
   double_buffering_height = 0; // i.e., no double buffering
   cpu = false;
-  ska_dest_file *ofile;
+  ska_dest_file *ofile = new ska_dest_file; // No file name means no output
 
   if (args.find("-i") != NULL)
     {
@@ -373,7 +472,6 @@ static ska_dest_file*
       const char *string = args.advance();
       if (string == NULL)
         { kdu_error e; e << "\"-o\" argument requires a parameter string."; }
-      ofile = new ska_dest_file;
       ofile->fname = new char[strlen(string)+1];
       strcpy(ofile->fname,string);
       args.advance();
@@ -421,6 +519,15 @@ static ska_dest_file*
           "non-negative integer parameter!"; }
       args.advance();
     }
+  if (args.find("-stokes") != NULL)
+    {
+      const char *string = args.advance();
+      if ((string == NULL) || (sscanf(string,"%d",&ofile->crop.stokes) != 1) ||
+          (ofile->crop.stokes < 0))
+        { kdu_error e; e << "\"-stokes\" argument requires a non-negative "
+          "integer parameter!"; }
+      args.advance();
+    }
   if (args.find("-layers") != NULL)
     {
       const char *string = args.advance();
@@ -452,6 +559,13 @@ static ska_dest_file*
   else if ((num_threads = kdu_get_num_processors()) < 2)
     num_threads = 0;
 
+  numa = false;
+  if (args.find("-numa") != NULL)
+    {
+      numa = true;
+      args.advance();
+    }
+
   if (args.find("-double_buffering") != NULL)
     {
       if (num_threads == 0)
@@ -556,6 +670,46 @@ static kdu_long
   return ((kdu_long) max_height) * ((kdu_long) max_width);
 }
 
+/*****************************************************************************/
+/* STATIC                     measure_layer_bytes                            */
+/*****************************************************************************/
+
+static int
+  measure_layer_bytes(kdu_codestream codestream, int discard_levels,
+                      kdu_thread_env *env, kdu_long * &layer_bytes)
+  /* Parses every packet which is relevant to the current input restrictions
+     and returns the number of quality layers, allocating `layer_bytes' to
+     hold the cumulative number of codestream bytes (including the main
+     header) needed to decompress each number of layers.  The codestream
+     must be persistent, so that the parsed packets can be decompressed
+     afterwards without being read again. */
+{
+  kdu_dims valid_tiles; codestream.get_valid_tiles(valid_tiles);
+  kdu_coords idx;
+  int num_layers = 0;
+  layer_bytes = NULL;
+  for (idx.y=0; idx.y < valid_tiles.size.y; idx.y++)
+    for (idx.x=0; idx.x < valid_tiles.size.x; idx.x++)
+      {
+        kdu_tile tile = codestream.open_tile(valid_tiles.pos+idx,env);
+        if (layer_bytes == NULL)
+          {
+            num_layers = tile.get_num_layers();
+            layer_bytes = new kdu_long[num_layers];
+            memset(layer_bytes,0,sizeof(kdu_long)*num_layers);
+          }
+        tile.parse_all_relevant_packets(false,env);
+        tile.get_parsed_packet_stats(-1,discard_levels,num_layers,
+                                     layer_bytes);
+        tile.close(env);
+      }
+  kdu_long cumulative = codestream.get_total_bytes() -
+    codestream.get_total_bytes(true); // Main header
+  for (int l=0; l < num_layers; l++)
+    layer_bytes[l] = (cumulative += layer_bytes[l]);
+  return num_layers;
+}
+
 
 /* ========================================================================= */
 /*                            External Functions                             */
@@ -578,85 +732,288 @@ int main(int argc, char *argv[])
   int preferred_min_stripe_height, absolute_max_stripe_height;
   kdu_dims region;
   int num_threads, env_dbuf_height;
-  bool force_precise, want_fastest, simulate_parsing, cpu;
+  bool force_precise, want_fastest, simulate_parsing, numa, cpu;
   ska_dest_file *ofile =
     parse_simple_args(args,ifname,max_bpp,simulate_parsing,skip_components,
                       max_layers,discard_levels,
                       region,preferred_min_stripe_height,
                       absolute_max_stripe_height,force_precise,want_fastest,
-                      num_threads,env_dbuf_height,cpu);
+                      num_threads,numa,env_dbuf_height,cpu);
+  ska_quality_checker checker;
+  bool verify = checker.parse_args(args);
+  bool rd_sweep = false;
+  if (args.find("-rd_sweep") != NULL)
+    {
+      if (!verify)
+        { kdu_error e; e << "\"-rd_sweep\" requires the original cube, "
+          "supplied via \"-verify\"."; }
+      if (ofile->fname != NULL)
+        { kdu_error e; e << "\"-rd_sweep\" decompresses the image many "
+          "times, so it may not be combined with \"-o\"."; }
+      rd_sweep = true;
+      args.advance();
+    }
+  bool use_mmap = false;
+  if (args.find("-mmap") != NULL)
+    {
+      use_mmap = true;
+      args.advance();
+    }
+  bool use_prefetch = false;
+  if (args.find("-prefetch") != NULL)
+    {
+      if (use_mmap)
+        { kdu_error e; e << "\"-prefetch\" may not be combined with "
+          "\"-mmap\"."; }
+      use_prefetch = true;
+      args.advance();
+    }
+  double wcs_sky[4], wcs_spectral[2];
+  bool have_wcs_sky = false, have_wcs_spectral = false;
+  if (args.find("-wcs_region") != NULL)
+    {
+      const char *string = args.advance();
+      if ((string == NULL) ||
+          (sscanf(string,"{%lf,%lf},{%lf,%lf}",wcs_sky,wcs_sky+1,wcs_sky+2,
+                  wcs_sky+3) != 4))
+        { kdu_error e; e << "\"-wcs_region\" argument requires "
+          "{<lon1>,<lon2>},{<lat1>,<lat2>}, in degrees."; }
+      have_wcs_sky = true;
+      args.advance();
+    }
+  if (args.find("-wcs_spectral") != NULL)
+    {
+      const char *string = args.advance();
+      if ((string == NULL) ||
+          (sscanf(string,"{%lf,%lf}",wcs_spectral,wcs_spectral+1) != 2))
+        { kdu_error e; e << "\"-wcs_spectral\" argument requires "
+          "{<first>,<last>}, in the units of the spectral axis."; }
+      have_wcs_spectral = true;
+      args.advance();
+    }
+  bool wcs_cutout = have_wcs_sky || have_wcs_spectral;
+  if (wcs_cutout && ((region.area() > 0) || (skip_components > 0)))
+    { kdu_error e; e << "\"-wcs_region\" and \"-wcs_spectral\" may not be "
+      "combined with \"-int_region\" or \"-skip_components\"."; }
+  if (verify && (discard_levels > 0))
+    { kdu_error e; e << "\"-verify\" cannot be combined with \"-reduce\", "
+      "since the original cube is only available at full resolution."; }
   if (args.show_unrecognized(pretty_cout) != 0)
     { kdu_error e; e << "There were unrecognized command line arguments!"; }
 
-  // Create appropriate output file
-  kdu_compressed_source *input = NULL;
+  // Create appropriate output file. A JPX file holds one codestream for each
+  // Stokes parameter in every plane group (see `ska_jpx_appender'), so
+  // codestream g*S+idx holds group g of Stokes parameter idx; the groups of
+  // the selected Stokes parameter are decompressed together, as one cube.
   kdu_simple_file_source file_in;
-  jp2_family_src jp2_ultimate_src;
-  jp2_source jp2_in;
+  kdu_mapped_file_source mapped_in; // Must outlive `jp2_ultimate_src'
+  ska_prefetch_source prefetch_in; // Likewise
+  jp2_pread_family_src jp2_ultimate_src; // Groups read concurrently
+  jpx_source jpx_in;
+  int g, num_groups = 1;
+  int max_components = 0; // 0 means all of those after `skip_components'
+  kdu_compressed_source **inputs = NULL;
+  int *group_skip = NULL; // Components skipped in each group
+  int *group_comps = NULL; // Components decompressed from each group
   if (check_jp2_family_file(ifname))
     {
-      input = &jp2_in;
-      jp2_ultimate_src.open(ifname);
-      if (!jp2_in.open(&jp2_ultimate_src))
-        { kdu_error e; e << "Supplied input file, \"" << ifname << "\", does "
-          "not appear to contain any boxes."; }
-      jp2_in.read_header();
+      if (use_mmap)
+        {
+          mapped_in.open(ifname);
+          jp2_ultimate_src.open(&mapped_in);
+        }
+      else if (use_prefetch)
+        {
+          prefetch_in.open(ifname);
+          jp2_ultimate_src.open(&prefetch_in);
+        }
+      else
+        jp2_ultimate_src.open(ifname);
+      if (jpx_in.open(&jp2_ultimate_src,true) <= 0)
+        { kdu_error e; e << "Supplied input file, \"" << ifname << "\", is "
+          "not a compatible JP2/JPX file."; }
+      int stokes_idx = ofile->select_stokes(jp2_ultimate_src);
+      int num_stokes = ofile->norm.num_stokes;
+      int num_codestreams = 0;
+      jpx_in.count_codestreams(num_codestreams);
+      if (num_codestreams <= stokes_idx)
+        { kdu_error e; e << "Supplied input file, \"" << ifname << "\", "
+          "does not contain the codestream of Stokes parameter "
+          << ofile->crop.stokes << "."; }
+      num_groups = num_codestreams / num_stokes;
+      if (num_groups < 1)
+        num_groups = 1; // Raw JP2 file holding a single codestream
+
+      if (wcs_cutout)
+        { // Turn the cutout into a region and a range of planes
+          ska_wcs wcs;
+          if (!wcs.init((const char *) ofile->metadata_buffer))
+            { kdu_error e; e << "Cannot make a cutout of \"" << ifname
+              << "\": " << wcs.get_problem(); }
+          kdu_coords size = jpx_in.access_codestream(stokes_idx).
+            access_dimensions().get_size();
+          int depth = 0;
+          for (g=0; g < num_groups; g++)
+            depth += jpx_in.access_codestream(g*num_stokes+stokes_idx).
+              access_dimensions().get_num_components();
+          ska_cutout cutout;
+          if (!wcs.find_cutout((have_wcs_sky)?wcs_sky:NULL,
+                               (have_wcs_spectral)?wcs_spectral:NULL,
+                               size.x,size.y,depth,cutout))
+            { kdu_error e; e << "Cannot make a cutout of \"" << ifname
+              << "\": " << wcs.get_problem(); }
+          skip_components = cutout.first_plane;
+          max_components = cutout.num_planes;
+          // Codestream rows are flipped, and `region' is at the resolution
+          // which is decompressed
+          int x1 = cutout.x + cutout.width;
+          int y0 = size.y - cutout.y - cutout.height, y1 = size.y - cutout.y;
+          region.pos.x = cutout.x >> discard_levels;
+          region.pos.y = y0 >> discard_levels;
+          region.size.x = ((x1 + (1<<discard_levels) - 1) >> discard_levels) -
+            region.pos.x;
+          region.size.y = ((y1 + (1<<discard_levels) - 1) >> discard_levels) -
+            region.pos.y;
+          pretty_cout << "Cutout: " << cutout.width << " x "
+                      << cutout.height << " pixels from (" << cutout.x
+                      << "," << cutout.y << "), " << cutout.num_planes
+                      << " planes from " << cutout.first_plane << "\n";
+        }
+
+      // Groups with no components to decompress are not opened at all
+      inputs = new kdu_compressed_source *[num_groups];
+      group_skip = new int[num_groups];
+      group_comps = new int[num_groups];
+      int active = 0, remaining_skip = skip_components;
+      int remaining = (max_components > 0)?max_components:INT_MAX;
+      for (g=0; g < num_groups; g++)
+        {
+          int idx = g*num_stokes + stokes_idx;
+          int comps = jpx_in.access_codestream(idx).access_dimensions().
+            get_num_components();
+          int skip = (remaining_skip < comps)?remaining_skip:comps;
+          remaining_skip -= skip;
+          comps -= skip;
+          comps = (remaining < comps)?remaining:comps;
+          remaining -= comps;
+          if (comps == 0)
+            continue;
+          group_skip[active] = skip;
+          group_comps[active] = comps;
+          inputs[active++] = jpx_in.access_codestream(idx).open_stream();
+        }
+      if (active == 0)
+        { kdu_error e; e << "\"-skip_components\" leaves no components to "
+          "decompress."; }
+      num_groups = active;
     }
   else
     {
-      input = &file_in;
-      file_in.open(ifname);
+      if (wcs_cutout)
+        { kdu_error e; e << "Cutouts need the FITS header, which is only "
+          "kept in JP2/JPX files."; }
+      inputs = new kdu_compressed_source *[1];
+      group_skip = new int[1];
+      group_comps = new int[1];
+      group_skip[0] = skip_components;
+      group_comps[0] = 0; // All of them
+      if (use_mmap)
+        {
+          inputs[0] = &mapped_in;
+          mapped_in.open(ifname);
+        }
+      else if (use_prefetch)
+        {
+          inputs[0] = &prefetch_in;
+          prefetch_in.open(ifname);
+        }
+      else
+        {
+          inputs[0] = &file_in;
+          file_in.open(ifname);
+        }
+      ofile->select_stokes(jp2_ultimate_src); // Only the first is allowed
     }
   delete[] ifname;
 
-  // Create the code-stream, and apply any restrictions/transformations
-  kdu_codestream codestream;
-  codestream.create(input);
-  if ((max_bpp > 0.0F) || simulate_parsing)
+  // Create the code-streams, and apply any restrictions/transformations
+  kdu_codestream *codestreams = new kdu_codestream[num_groups];
+  for (g=0; g < num_groups; g++)
     {
-      kdu_long max_bytes = KDU_LONG_MAX;
-      if (max_bpp > 0.0F)
-        max_bytes = (kdu_long)
-          (0.125 * max_bpp * get_bpp_dims(codestream.access_siz()));
-      codestream.set_max_bytes(max_bytes,simulate_parsing);
+      kdu_codestream cs;
+      cs.create(inputs[g]);
+      codestreams[g] = cs;
+      if (rd_sweep)
+        cs.set_persistent(); // Parse once, decompress once per layer
+      if ((max_bpp > 0.0F) || simulate_parsing)
+        {
+          kdu_long max_bytes = KDU_LONG_MAX;
+          if (max_bpp > 0.0F)
+            max_bytes = (kdu_long)
+              (0.125 * max_bpp * get_bpp_dims(cs.access_siz()));
+          cs.set_max_bytes(max_bytes,simulate_parsing);
+        }
+      cs.apply_input_restrictions(group_skip[g],group_comps[g],
+                                  discard_levels,max_layers,NULL,
+                                  KDU_WANT_OUTPUT_COMPONENTS);
     }
-  codestream.apply_input_restrictions(skip_components,0,
-                                      discard_levels,max_layers,NULL,
-                                      KDU_WANT_OUTPUT_COMPONENTS);
+  kdu_codestream codestream = codestreams[0];
 
+  // Every plane group has the same dimensions, so the region is mapped once
   kdu_dims *reg_ptr = NULL;
+  kdu_dims image_dims, decoded_region; // Used to line up the original cube
+  codestream.get_dims(0,image_dims,true);
   if (region.area() > 0)
     {
       kdu_dims dims; codestream.get_dims(0,dims,true);
       dims &= region;
+      decoded_region = dims;
       if (!dims)
         { kdu_error e; e << "Region supplied via `-int_region' argument "
           "has no intersection with the first image component to be "
           "decompressed, at the resolution selected."; }
       codestream.map_region(0,dims,region,true);
       reg_ptr = &region;
-      codestream.apply_input_restrictions(skip_components,0,
-                                          discard_levels,max_layers,reg_ptr,
-                                          KDU_WANT_OUTPUT_COMPONENTS);
+      for (g=0; g < num_groups; g++)
+        codestreams[g].apply_input_restrictions(group_skip[g],group_comps[g],
+                                                discard_levels,max_layers,
+                                                reg_ptr,
+                                                KDU_WANT_OUTPUT_COMPONENTS);
+    }
+  if (mapped_in.exists())
+    { // Whole-file decodes read the mapping in order; the rest skip about
+      bool partial = (reg_ptr != NULL) || (discard_levels > 0) ||
+        (skip_components > 0) || (max_components > 0) ||
+        (jpx_in.exists() && (ofile->norm.num_stokes > 1));
+      mapped_in.set_access_pattern(!partial);
     }
 
   // If you wish to have rotation/transposition folded into the
   // decompression process automatically, this is the place to call
   // `kdu_codestream::change_appearance'.
 
-  // Find the dimensions of each image component we will be decompressing
-  int n, num_components = codestream.get_num_components(true);
+  // Find the dimensions of each image component we will be decompressing;
+  // those of each plane group follow those of the one before
+  int n, num_components = 0;
+  int *group_first = new int[num_groups]; // First component of each group
+  for (g=0; g < num_groups; g++)
+    {
+      group_first[g] = num_components;
+      group_comps[g] = codestreams[g].get_num_components(true);
+      num_components += group_comps[g];
+    }
   kdu_dims *comp_dims = new kdu_dims[num_components];
-  for (n=0; n < num_components; n++)
-    codestream.get_dims(n,comp_dims[n],true);
-  if (ofile->crop.width == -1) {
-    ofile->crop.width = comp_dims[0].size.x;
-    ofile->crop.height = comp_dims[0].size.y;
-    ofile->crop.depth = num_components;
-    ofile->crop.x = 0;
-    ofile->crop.y = 0;
-    ofile->crop.z = 0;
-  }
+  for (g=0; g < num_groups; g++)
+    for (n=0; n < group_comps[g]; n++)
+      codestreams[g].get_dims(n,comp_dims[group_first[g]+n],true);
+  // The region may have been clipped to the image; `x' and `y' locate it
+  // in the encoded cube, for the world coordinates of the output
+  ofile->crop.width = comp_dims[0].size.x;
+  ofile->crop.height = comp_dims[0].size.y;
+  ofile->crop.x = comp_dims[0].pos.x - image_dims.pos.x;
+  ofile->crop.y = (image_dims.pos.y + image_dims.size.y) -
+    (comp_dims[0].pos.y + comp_dims[0].size.y);
+  ofile->discard_levels = discard_levels;
 
   // Next, prepare the output file
   // Since we are treating each component as a frame, the first frame should
@@ -667,14 +1024,20 @@ int main(int argc, char *argv[])
 
   if (num_components == 0)
     { kdu_error e; e << "Input image has no components!"; }
-  ofile->precision = codestream.get_bit_depth(n,true);
-  ofile->is_signed = codestream.get_signed(n,true);
+  ofile->precision = codestream.get_bit_depth(0,true);
+  ofile->is_signed = codestream.get_signed(0,true);
   ofile->write_header(jp2_ultimate_src, args);
-  codestream.apply_input_restrictions(skip_components,num_components,
-                                    discard_levels,max_layers,reg_ptr,
-                                    KDU_WANT_OUTPUT_COMPONENTS);
-  if (flip_vertically)
-    codestream.change_appearance(false,true,false);
+  if (verify)
+    checker.start(jp2_ultimate_src,args,ofile,image_dims,decoded_region);
+  for (g=0; g < num_groups; g++)
+    {
+      codestreams[g].apply_input_restrictions(group_skip[g],group_comps[g],
+                                              discard_levels,max_layers,
+                                              reg_ptr,
+                                              KDU_WANT_OUTPUT_COMPONENTS);
+      if (flip_vertically)
+        codestreams[g].change_appearance(false,true,false);
+    }
 
   // Start the timer
   kdu_clock timer;
@@ -698,10 +1061,7 @@ int main(int argc, char *argv[])
   kdu_thread_env env, *env_ref=NULL;
   if (num_threads > 0)
     {
-      env.create();
-      for (int nt=1; nt < num_threads; nt++)
-        if (!env.add_thread())
-          num_threads = nt; // Unable to create all the threads requested
+      num_threads = ska_create_threads(env,num_threads,numa);
       env_ref = &env;
     }
 
@@ -716,65 +1076,173 @@ int main(int argc, char *argv[])
   // fundamental issue, not a Kakadu implementation issue).  For more on this,
   // see the extensive documentation provided for
   // `kdu_stripe_decompressor::pull_stripe'.
+  //    There is one stripe decompressor for each plane group; their stripes
+  // are held one group after another, as the components of `ofile' are, and
+  // all of them are given the same stripe height, so the rows of every plane
+  // are pulled together.
   int *precisions = new int[num_components];
   int *stripe_heights = new int[num_components];
   int *max_stripe_heights = new int[num_components];
 
-  kdu_stripe_decompressor decompressor;
-  decompressor.start(codestream,force_precise,want_fastest,
-                     env_ref,NULL,env_dbuf_height);
-  decompressor.get_recommended_stripe_heights(preferred_min_stripe_height,
-                                              absolute_max_stripe_height,
-                                              stripe_heights,
-                                              max_stripe_heights);
-  precisions[0] = ofile->precision;
-  if(ofile->reversible) {
-    std::cout << "reversible compression unimplemented" << std::endl;
-  }
-  else {
-    n=0;
-    float** stripe_bufs = new float *[num_components];
-
-    for(n = 0; n < num_components; ++n)
-      if ((stripe_bufs[n] =
-           new float[comp_dims[n].size.x*max_stripe_heights[n]]) == NULL)
-        { kdu_error e; e << "Insufficient memory to allocate stripe buffers."; }
-
-    // Now for the incremental processing
-    bool continues=true;
-    int total_stripes = ofile->crop.height;
-    while (continues)
-      { 
-        decompressor.get_recommended_stripe_heights(preferred_min_stripe_height,
-                                                    absolute_max_stripe_height,
-                                                    stripe_heights,NULL);
-        continues = decompressor.pull_stripe(stripe_bufs,stripe_heights,
-                                             NULL,NULL,NULL);
-        // Attempt to discount file writing time; note, however, that this
-        // does not account for the fact that writing large stripes can
-        // tie up a disk in the background, dramatically increasing the
-        // time taken to read new compressed data while the next stripe
-        // is being decompressed.  To avoid excessive skewing of timing
-        // results due to disk I/O time, it is recommended that you run
-        // the application without any output files for timing purposes.
-        // All the stripes still get fully decompressed into memory
-        // buffers, but the only disk I/O is that due to reading of the
-        // compressed source.
-
-        if (cpu)
-          processing_time += timer.get_ellapsed_seconds();
-        for(n = 0; n < num_components; ++n)
-        ofile->write_stripe(stripe_heights[n],stripe_bufs[n], n);
-        if (cpu)
-          writing_time += timer.get_ellapsed_seconds();
+  // With `-rd_sweep', the persistent codestream is decompressed once for
+  // every number of quality layers, starting with all of them, so the first
+  // pass is just the usual decompression.  Later passes only re-run block
+  // decoding and the DWT on the packets parsed by `measure_layer_bytes'.
+  int pass, num_passes = 1, pass_layers = max_layers;
+  kdu_long *layer_bytes = NULL;
+  ska_quality_stats *rd_stats = NULL;
+  double *rd_seconds = NULL;
+  if (rd_sweep)
+    { // Only the layers which every group has can be swept; their bytes
+      // are those of all the groups together
+      for (g=0; g < num_groups; g++)
+        {
+          kdu_long *group_bytes;
+          int group_passes = measure_layer_bytes(codestreams[g],
+                                                 discard_levels,env_ref,
+                                                 group_bytes);
+          if ((g == 0) || (group_passes < num_passes))
+            num_passes = group_passes;
+          if (g == 0)
+            layer_bytes = group_bytes;
+          else
+            {
+              for (int l=0; l < num_passes; l++)
+                layer_bytes[l] += group_bytes[l];
+              delete[] group_bytes;
+            }
+        }
+      if ((max_layers > 0) && (max_layers < num_passes))
+        num_passes = max_layers;
+      pass_layers = num_passes;
+      rd_stats = new ska_quality_stats[num_passes];
+      rd_seconds = new double[num_passes];
+    }
+  for (pass=0; pass < num_passes; pass++, pass_layers--)
+    {
+      kdu_clock pass_timer;
+      if (pass > 0)
+        {
+          for (g=0; g < num_groups; g++)
+            codestreams[g].apply_input_restrictions(group_skip[g],
+                                                    group_comps[g],
+                                                    discard_levels,
+                                                    pass_layers,reg_ptr,
+                                                  KDU_WANT_OUTPUT_COMPONENTS);
+          checker.restart();
+        }
+
+      kdu_stripe_decompressor *decompressors =
+        new kdu_stripe_decompressor[num_groups];
+      for (g=0; g < num_groups; g++)
+        {
+          decompressors[g].start(codestreams[g],force_precise,want_fastest,
+                                 env_ref,NULL,env_dbuf_height);
+          decompressors[g].get_recommended_stripe_heights(
+              preferred_min_stripe_height,absolute_max_stripe_height,
+              stripe_heights+group_first[g],
+              max_stripe_heights+group_first[g]);
+        }
+      precisions[0] = ofile->precision;
+      if(ofile->reversible) {
+        std::cout << "reversible compression unimplemented" << std::endl;
+        break;
       }
-      decompressor.finish();
+      n=0;
+      float** stripe_bufs = new float *[num_components];
+
+      for(n = 0; n < num_components; ++n)
+        if ((stripe_bufs[n] =
+             new float[comp_dims[n].size.x*max_stripe_heights[n]]) == NULL)
+          { kdu_error e; e << "Insufficient memory to allocate stripe buffers."; }
+
+      // Now for the incremental processing
+      bool continues=true;
+      while (continues)
+        { 
+          int height = 0;
+          for (g=0; g < num_groups; g++)
+            {
+              int *heights = stripe_heights+group_first[g];
+              decompressors[g].get_recommended_stripe_heights(
+                  preferred_min_stripe_height,absolute_max_stripe_height,
+                  heights,NULL);
+              if ((g == 0) || (heights[0] < height))
+                height = heights[0];
+            }
+          for (n=0; n < num_components; n++)
+            stripe_heights[n] = height;
+          continues = false;
+          for (g=0; g < num_groups; g++)
+            if (decompressors[g].pull_stripe(stripe_bufs+group_first[g],
+                                             stripe_heights+group_first[g],
+                                             NULL,NULL,NULL))
+              continues = true;
+          // Attempt to discount file writing time; note, however, that this
+          // does not account for the fact that writing large stripes can
+          // tie up a disk in the background, dramatically increasing the
+          // time taken to read new compressed data while the next stripe
+          // is being decompressed.  To avoid excessive skewing of timing
+          // results due to disk I/O time, it is recommended that you run
+          // the application without any output files for timing purposes.
+          // All the stripes still get fully decompressed into memory
+          // buffers, but the only disk I/O is that due to reading of the
+          // compressed source.
+
+          if (cpu)
+            processing_time += timer.get_ellapsed_seconds();
+          for(n = 0; n < num_components; ++n)
+          ofile->write_stripe(stripe_heights[n],stripe_bufs[n], n);
+          if (verify)
+            checker.process_stripe(stripe_bufs,stripe_heights,env_ref);
+          if (cpu)
+            writing_time += timer.get_ellapsed_seconds();
+        }
+      for (g=0; g < num_groups; g++)
+        decompressors[g].finish();
+      delete[] decompressors;
       std::cout << "decomp fin" << std::endl;
+      if (rd_sweep)
+        {
+          checker.get_totals(rd_stats[pass_layers-1]);
+          rd_seconds[pass_layers-1] = pass_timer.get_ellapsed_seconds();
+        }
+      else if (verify)
+        checker.report(pretty_cout);
 
       for (n=0; n < num_components; n++)
         delete[] stripe_bufs[n];
       delete[] stripe_bufs;
     }
+
+  if (rd_sweep)
+    { // Report the rate-distortion curve, from the fewest layers up
+      kdu_long voxels = ((kdu_long) ofile->crop.width) *
+        ((kdu_long) ofile->crop.height) * ((kdu_long) num_components);
+      char line[160]; // Rows are too wide for `pretty_cout' to leave alone
+      pretty_cout << "\nRate-distortion sweep (" << num_passes
+                  << " quality layers):\n";
+      pretty_cout.flush();
+      sprintf(line,"%6s %14s %10s %14s %10s %14s %14s %12s %9s\n",
+              "Layers","Bytes","Bits/vox","MSE","PSNR(dB)","MAE",
+              "MaxAbsErr","Fidelity","Time(s)");
+      std::cout << line;
+      for (int l=0; l < num_passes; l++)
+        {
+          ska_quality_stats &st = rd_stats[l];
+          sprintf(line,"%6d %14lld %10.5f %14.7g %10.4f %14.7g %14.7g "
+                  "%12.9f %9.3f\n",l+1,(long long) layer_bytes[l],
+                  (voxels > 0)?(8.0*layer_bytes[l]/voxels):0.0,
+                  st.get_mse(),st.get_psnr(),st.get_mae(),
+                  (double) st.max_abs_distortion,st.get_fidelity(),
+                  rd_seconds[l]);
+          std::cout << line;
+        }
+      std::cout.flush();
+      delete[] layer_bytes;
+      delete[] rd_stats;
+      delete[] rd_seconds;
+    }
   
   if (cpu)
     { // Report processing time
@@ -798,15 +1266,27 @@ int main(int argc, char *argv[])
 
   // Clean up
   if (env.exists())
-    env.cs_terminate(codestream); // This is not really necessary here, because
-      // we are about to destroy the multi-threaded environment.  However,
-      // if you need to keep the multi-threaded processing environment alive
-      // and destroy the codestream first, you should always precede the call
-      // to `codestream.destroy' with one to `env.cs_terminate'.
+    for (g=0; g < num_groups; g++)
+      env.cs_terminate(codestreams[g]); // This is not really necessary here,
+      // because we are about to destroy the multi-threaded environment.
+      // However, if you need to keep the multi-threaded processing
+      // environment alive and destroy the codestream first, you should always
+      // precede the call to `codestream.destroy' with one to
+      // `env.cs_terminate'.
   if (env.exists())
     env.destroy();
-  codestream.destroy();
-  input->close();
+  for (g=0; g < num_groups; g++)
+    {
+      codestreams[g].destroy();
+      inputs[g]->close();
+    }
+  delete[] codestreams;
+  delete[] inputs;
+  delete[] group_skip;
+  delete[] group_comps;
+  delete[] group_first;
+  if (jpx_in.exists())
+    jpx_in.close();
   if (jp2_ultimate_src.exists())
     jp2_ultimate_src.close();
   if (precisions != NULL)
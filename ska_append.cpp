@@ -0,0 +1,326 @@
+/*****************************************************************************/
+//
+//  @file: ska_append.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Implements `ska_jpx_appender', declared in ska_append.h
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <iostream>
+// Core includes
+#include "kdu_messaging.h"
+#include "kdu_file_io.h"
+// SKA includes
+#include "jpx.h"
+#include "ska_append.h"
+
+/*****************************************************************************/
+/* STATIC                        update_record                               */
+/*****************************************************************************/
+
+static int
+  update_record(char *dst, const char *record, int length, double minval,
+      double maxval, int depth)
+  /* Copies the `length' byte metadata `record' to `dst', replacing the
+   * values of the keywords which change as planes are added, and returns
+   * the number of bytes written. */
+{
+  if (strncmp(record,"DATAMIN =",9) == 0)
+    return sprintf(dst,"%-8s= %20.17G","DATAMIN",minval);
+  if (strncmp(record,"DATAMAX =",9) == 0)
+    return sprintf(dst,"%-8s= %20.17G","DATAMAX",maxval);
+  if (strncmp(record,"NAXIS3  =",9) == 0)
+    return sprintf(dst,"%-8s= %20d","NAXIS3",depth);
+  memcpy(dst,record,length);
+  return length;
+}
+
+/* ========================================================================= */
+/*                              ska_jpx_appender                             */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                     ska_jpx_appender::ska_jpx_appender                    */
+/*****************************************************************************/
+
+ska_jpx_appender::ska_jpx_appender()
+{
+  fname = NULL;
+  fp = NULL;
+  original_length = cur_pos = end_pos = 0;
+  width = height = 0;
+  num_groups = planes_per_stokes = 0;
+  num_streams = 0;
+  streams = NULL;
+}
+
+/*****************************************************************************/
+/*                    ska_jpx_appender::~ska_jpx_appender                    */
+/*****************************************************************************/
+
+ska_jpx_appender::~ska_jpx_appender()
+{
+  tgt.close();
+  if (fp != NULL)
+    fclose(fp);
+  delete[] streams;
+  delete[] fname;
+}
+
+/*****************************************************************************/
+/*                         ska_jpx_appender::open                            */
+/*****************************************************************************/
+
+void
+  ska_jpx_appender::open(const char *fname)
+{
+  this->fname = new char[strlen(fname)+1];
+  strcpy(this->fname,fname);
+
+  jp2_family_src src;
+  jpx_source jpx_in;
+  src.open(fname);
+  if (jpx_in.open(&src,true) <= 0)
+    { kdu_error e; e << "Cannot append to \"" << fname << "\", which is not "
+      "a JPX file."; }
+
+  // A box which runs to the end of the file would swallow anything after it
+  jp2_input_box box;
+  for (box.open(&src); box.exists(); box.close(), box.open_next())
+    if (box.get_remaining_bytes() < 0)
+      { kdu_error e; e << "Cannot append to \"" << fname << "\", whose last "
+        "box runs to the end of the file. Only JPX files written by this "
+        "version of skuareview-encode (with a \".jpx\" suffix) can be "
+        "appended to."; }
+  existing.read_metadata(src);
+
+  int num_codestreams = 0;
+  jpx_in.count_codestreams(num_codestreams);
+  int num_stokes = existing.norm.num_stokes;
+  if ((num_codestreams < num_stokes) || (num_codestreams % num_stokes))
+    { kdu_error e; e << "Cannot append to \"" << fname << "\": it holds "
+      << num_codestreams << " codestreams, which cannot be split between "
+      << num_stokes << " Stokes parameters."; }
+  num_groups = num_codestreams / num_stokes;
+  planes_per_stokes = 0;
+  for (int g=0; g < num_groups; g++) {
+    jp2_dimensions dims =
+      jpx_in.access_codestream(g*num_stokes).access_dimensions();
+    kdu_coords size = dims.get_size();
+    if (g == 0)
+      { width = size.x; height = size.y; }
+    planes_per_stokes += dims.get_num_components();
+  }
+  jpx_in.close();
+  src.close();
+
+  if ((fp = fopen(fname,"r+b")) == NULL)
+    { kdu_error e; e << "Unable to open \"" << fname << "\" for appending."; }
+  kdu_fseek(fp,0,SEEK_END);
+  original_length = cur_pos = end_pos = kdu_ftell(fp);
+  tgt.open(this);
+}
+
+/*****************************************************************************/
+/*                        ska_jpx_appender::prepare                          */
+/*****************************************************************************/
+
+void
+  ska_jpx_appender::prepare(ska_source_file *cube)
+{
+  ska_normalizer &norm = existing.norm;
+  cube->crop.stokes = norm.first_stokes;
+  cube->crop.num_stokes = norm.num_stokes;
+  cube->norm.mode = norm.mode;
+  cube->norm.domain = norm.domain;
+  cube->norm.stretch = norm.stretch;
+  cube->norm.clip_low = norm.clip_low;
+  cube->norm.clip_high = norm.clip_high;
+}
+
+/*****************************************************************************/
+/*                         ska_jpx_appender::check                           */
+/*****************************************************************************/
+
+void
+  ska_jpx_appender::check(ska_source_file *cube)
+{
+  ska_normalizer &norm = existing.norm;
+  if ((cube->crop.width != width) || (cube->crop.height != height))
+    { kdu_error e; e << "The planes to be appended are " << cube->crop.width
+      << " x " << cube->crop.height << ", but those of \"" << fname
+      << "\" are " << width << " x " << height << "."; }
+  if ((cube->crop.stokes != norm.first_stokes) ||
+      (cube->crop.num_stokes != norm.num_stokes))
+    { kdu_error e; e << "\"" << fname << "\" holds Stokes parameters "
+      << norm.first_stokes << " to " << norm.first_stokes+norm.num_stokes-1
+      << "; the same ones must be appended."; }
+  if ((cube->norm.mode != norm.mode) || (cube->norm.domain != norm.domain) ||
+      (cube->norm.stretch != norm.stretch) ||
+      ((norm.mode == SKA_NORM_PERCENTILE) &&
+       ((cube->norm.clip_low != norm.clip_low) ||
+        (cube->norm.clip_high != norm.clip_high))))
+    { kdu_error e; e << "Planes must be appended with the normalization "
+      "used for the rest of the cube; leave out the \"-norm\" arguments."; }
+  if (norm.mode == SKA_NORM_GLOBAL) {
+    double minval, maxval, new_min, new_max;
+    norm.get_range(minval,maxval);
+    cube->norm.get_range(new_min,new_max);
+    if ((new_min < minval) || (new_max > maxval))
+      { kdu_warning w; w << "The appended planes range from " << new_min
+        << " to " << new_max << ", but the cube was normalized for samples "
+        "from " << minval << " to " << maxval << "; samples outside that "
+        "range will be clipped. Use \"-norm plane\" for cubes which are to "
+        "be appended to."; }
+    cube->norm.set_global_range(minval,maxval);
+    cube->norm.first_stokes = norm.first_stokes;
+    cube->norm.num_stokes = norm.num_stokes;
+  }
+  num_streams = cube->crop.num_stokes;
+  streams = new jp2_output_box[num_streams];
+  std::cout << "Appending " << cube->crop.depth << " planes to the "
+            << planes_per_stokes << " of \"" << fname << "\"" << std::endl;
+}
+
+/*****************************************************************************/
+/*                      ska_jpx_appender::write_headers                      */
+/*****************************************************************************/
+
+void
+  ska_jpx_appender::write_headers(kdu_codestream *codestreams,
+      int num_codestreams)
+{
+  int n;
+  assert(num_codestreams == num_streams);
+  for (n=0; n < num_streams; n++) {
+    // Each codestream gets its own image header, since the number of planes
+    // may differ from that in the JP2 header of the file
+    kdu_codestream cs = codestreams[n];
+    int bit_depth = cs.get_bit_depth(0);
+    jp2_output_box box, sub;
+    box.open(&tgt,jp2_codestream_header_4cc);
+    sub.open(&box,jp2_image_header_4cc);
+    kdu_dims dims;
+    cs.get_dims(0,dims);
+    sub.write((kdu_uint32) dims.size.y);
+    sub.write((kdu_uint32) dims.size.x);
+    sub.write((kdu_uint16) cs.get_num_components());
+    sub.write((kdu_byte)((bit_depth-1) | (cs.get_signed(0)?0x80:0)));
+    sub.write((kdu_byte) 7); // JPEG2000 compression
+    sub.write((kdu_byte) 1); // Colour space is not known
+    sub.write((kdu_byte) 0); // No intellectual property box
+    sub.close();
+    if (!box.close())
+      { kdu_error e; e << "Unable to append to \"" << fname << "\"."; }
+  }
+  for (n=0; n < num_streams; n++) {
+    // Layers take the colour space of the JP2 header and use the codestream
+    // with the same index, like those written by `jpx_target'
+    jp2_output_box box;
+    box.open(&tgt,jp2_compositing_layer_hdr_4cc);
+    if (!box.close())
+      { kdu_error e; e << "Unable to append to \"" << fname << "\"."; }
+  }
+}
+
+/*****************************************************************************/
+/*                       ska_jpx_appender::open_stream                       */
+/*****************************************************************************/
+
+jp2_output_box *
+  ska_jpx_appender::open_stream(int idx)
+{
+  jp2_output_box *box = streams + idx;
+  box->open(&tgt,jp2_codestream_4cc);
+  box->write_header_last(); // Rather than holding the codestream in memory
+  return box;
+}
+
+/*****************************************************************************/
+/*                         ska_jpx_appender::finish                          */
+/*****************************************************************************/
+
+void
+  ska_jpx_appender::finish(ska_source_file *cube)
+{
+  // The metadata of the original cube still describes the whole cube,
+  // apart from its depth and range
+  cube->norm.prepend(existing.norm);
+  double minval, maxval;
+  cube->norm.get_range(minval,maxval);
+  int depth = planes_per_stokes + cube->crop.depth;
+  int length = 0;
+  kdu_byte *buffer = new kdu_byte[existing.metadata_length+3*81+1];
+  const char *record = (const char *) existing.metadata_buffer;
+  while ((record != NULL) && (*record != '\0')) {
+    const char *next = strchr(record,'\n');
+    int record_length = (next == NULL)?(int)strlen(record):(int)(next-record);
+    length += update_record((char *)(buffer+length),record,record_length,
+        minval,maxval,depth);
+    buffer[length++] = '\n';
+    record = (next == NULL)?NULL:(next+1);
+  }
+  buffer[length] = '\0';
+  delete[] cube->metadata_buffer;
+  cube->metadata_buffer = buffer;
+  cube->metadata_length = length;
+  cube->write_metadata(tgt);
+
+  tgt.close();
+  if (fflush(fp) != 0)
+    { kdu_error e; e << "Unable to append to \"" << fname << "\"."; }
+  fclose(fp);
+  fp = NULL;
+  std::cout << "\"" << fname << "\" now holds " << depth << " planes, in "
+            << num_groups+1 << " plane groups" << std::endl;
+}
+
+/*****************************************************************************/
+/*                          ska_jpx_appender::write                          */
+/*****************************************************************************/
+
+bool
+  ska_jpx_appender::write(const kdu_byte *buf, int num_bytes)
+{
+  if (fwrite(buf,1,(size_t) num_bytes,fp) != (size_t) num_bytes)
+    return false;
+  cur_pos += num_bytes;
+  if (cur_pos > end_pos)
+    end_pos = cur_pos;
+  return true;
+}
+
+/*****************************************************************************/
+/*                      ska_jpx_appender::start_rewrite                      */
+/*****************************************************************************/
+
+bool
+  ska_jpx_appender::start_rewrite(kdu_long backtrack)
+{
+  // Only box headers we have written ourselves are ever rewritten
+  if ((fp == NULL) || (cur_pos != end_pos) ||
+      (cur_pos - backtrack < original_length))
+    return false;
+  cur_pos -= backtrack;
+  return (kdu_fseek(fp,cur_pos) == 0);
+}
+
+/*****************************************************************************/
+/*                       ska_jpx_appender::end_rewrite                       */
+/*****************************************************************************/
+
+bool
+  ska_jpx_appender::end_rewrite()
+{
+  if ((fp == NULL) || (cur_pos == end_pos))
+    return false;
+  cur_pos = end_pos;
+  return (kdu_fseek(fp,end_pos) == 0);
+}
@@ -0,0 +1,86 @@
+/*****************************************************************************/
+//
+//  @file: ska_append.h
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Appends further spectral planes to a JPX cube written by
+//         skuareview-encode, as new codestreams at the end of the file, so
+//         that nothing which is already in the file need be re-encoded or
+//         rewritten.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+#ifndef SKA_APPEND_H
+#define SKA_APPEND_H
+
+#include <stdio.h>
+#include "kdu_compressed.h"
+#include "jp2.h"
+#include "ska_local.h"
+
+/*****************************************************************************/
+/*                            class ska_jpx_appender                         */
+/*****************************************************************************/
+
+class ska_jpx_appender : public kdu_compressed_target {
+  /* A JPX cube holds one codestream for each Stokes parameter encoded. Each
+   * append adds a further plane group: one codestream per Stokes parameter,
+   * holding the new planes, with a codestream header box (for its own image
+   * header) and a compositing layer header box for each. Codestream `n' of
+   * the file therefore holds group n / S of Stokes parameter n % S, where S
+   * is the number of Stokes parameters. New SKA metadata and normalization
+   * boxes, covering the whole cube, are written after the codestreams;
+   * readers use the last of each. The object is itself the target to which
+   * the `jp2_family_tgt' returned by `access_tgt' writes; it only ever
+   * writes past the original end of the file. */
+  public: // Member functions
+    ska_jpx_appender();
+    ~ska_jpx_appender();
+    void open(const char *fname);
+    /* Reads the layout, metadata and normalization of the existing cube and
+     * positions the file for appending. Generates an error if the file was
+     * not written by skuareview-encode as a JPX file. */
+    void prepare(ska_source_file *cube);
+    /* Call before `cube->read_header'. Selects the Stokes parameters and
+     * the normalization used by the existing cube, unless the command line
+     * asks for others, in which case `check' will complain. */
+    void check(ska_source_file *cube);
+    /* Call after `cube->read_header'. Checks that the new planes can be
+     * added to the existing cube. With the global normalization mode the
+     * existing range is used for the new planes too, since the decoder
+     * only has the one. Also sets up the targets of the new codestreams. */
+    jp2_family_tgt &access_tgt() { return tgt; }
+    void write_headers(kdu_codestream *codestreams, int num_codestreams);
+    /* Writes the codestream and compositing layer header boxes of the new
+     * codestreams, which must be finalized. */
+    jp2_output_box *open_stream(int idx);
+    /* Opens the box of the `idx'th new codestream, which is only written to
+     * the file as the codestream is flushed. The boxes must be opened (and
+     * closed) in order. */
+    jp2_output_box *access_stream(int idx) { return streams + idx; }
+    /* Target for the `idx'th new codestream; nothing is written until the
+     * box is opened with `open_stream'. */
+    void finish(ska_source_file *cube);
+    /* Writes the metadata and normalization boxes of the whole cube, once
+     * all of the codestreams have been written, and closes the file. */
+  public: // kdu_compressed_target functions
+    bool write(const kdu_byte *buf, int num_bytes);
+    bool start_rewrite(kdu_long backtrack);
+    bool end_rewrite();
+  private: // Data
+    char *fname;
+    FILE *fp;
+    kdu_long original_length; // Nothing before this is ever written
+    kdu_long cur_pos, end_pos;
+    jp2_family_tgt tgt;
+    ska_dest_file existing; // Metadata and normalization of the cube so far
+    int width, height; // Dimensions of every plane
+    int num_groups; // Plane groups already in the file
+    int planes_per_stokes; // In all of those groups
+    int num_streams; // New codestreams; one per Stokes parameter
+    jp2_output_box *streams;
+};
+
+#endif
@@ -0,0 +1,877 @@
+/*****************************************************************************/
+//
+//  @file: ska_bench.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Reproducible benchmark suite. Generates synthetic radio astronomy
+//         cubes (FITS and HDF5), runs skuareview-encode and skuareview-decode
+//         over a grid of thread counts, stripe heights and rates, and records
+//         throughput, peak memory, bits per voxel and PSNR/MAE to a CSV file.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+// Core includes
+#include "kdu_elementary.h"
+#include "kdu_messaging.h"
+#include "kdu_compressed.h"
+// Application includes
+#include "kdu_args.h"
+// Format includes
+#include "fitsio.h"
+#include "hdf5.h"
+
+/* ========================================================================= */
+/*                         Set up messaging services                         */
+/* ========================================================================= */
+
+class kdu_stream_message : public kdu_thread_safe_message {
+  public: // Member classes
+    kdu_stream_message(std::ostream *stream)
+      { this->stream = stream; }
+    void put_text(const char *string)
+      { (*stream) << string; }
+    void flush(bool end_of_message=false)
+      { stream->flush();
+        kdu_thread_safe_message::flush(end_of_message); }
+  private: // Data
+    std::ostream *stream;
+};
+
+static kdu_stream_message cout_message(&std::cout);
+static kdu_stream_message cerr_message(&std::cerr);
+static kdu_message_formatter pretty_cout(&cout_message);
+static kdu_message_formatter pretty_cerr(&cerr_message);
+
+/* ========================================================================= */
+/*                             Internal Classes                              */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                               bench_config                                */
+/*****************************************************************************/
+
+struct bench_config {
+  int width, height, depth;
+  int bitpix; // FLOAT_IMG or DOUBLE_IMG
+  int num_sources; // Number of point sources in the field
+  double nan_fraction; // Fraction of the field (beam edge) that is blanked
+  unsigned long seed;
+  int repeats; // Number of timed runs of each configuration
+  bool keep_files;
+  std::vector<std::string> formats; // "fits" and/or "h5"
+  std::vector<int> threads;
+  std::vector<int> stripe_heights;
+  std::vector<std::string> rates; // Kept as strings, passed to `-rate'
+  std::string workdir;
+  std::string csv_fname;
+  std::string encoder, decoder;
+};
+
+/*****************************************************************************/
+/*                               bench_random                                */
+/*****************************************************************************/
+
+class bench_random {
+  /* Small xorshift generator, used instead of `rand' so that the synthetic
+     cubes are bit-identical across platforms and C libraries for a given
+     seed. */
+  public:
+    bench_random(unsigned long seed)
+      { state = 0x9E3779B97F4A7C15ULL ^ (unsigned long long) seed;
+        if (state == 0) state = 1;
+        have_spare = false; }
+    double uniform()
+      { state ^= state >> 12; state ^= state << 25; state ^= state >> 27;
+        unsigned long long val = state * 0x2545F4914F6CDD1DULL;
+        return ((double)(val >> 11) + 0.5) * (1.0 / 9007199254740992.0); }
+    double gaussian()
+      { // Box-Muller, keeping the second deviate for the next call
+        if (have_spare)
+          { have_spare = false; return spare; }
+        double u = uniform(), v = uniform();
+        double r = sqrt(-2.0*log(u)), theta = 2.0*M_PI*v;
+        spare = r*sin(theta);  have_spare = true;
+        return r*cos(theta); }
+  private:
+    unsigned long long state;
+    double spare;
+    bool have_spare;
+};
+
+/*****************************************************************************/
+/*                               bench_source                                */
+/*****************************************************************************/
+
+struct bench_source {
+  double x, y; // Position in pixels
+  double sigma; // Spatial extent in pixels (beam for point sources)
+  double flux; // Peak flux density
+  double spectral_index; // Continuum slope across the band
+  double line_centre, line_width, line_flux; // Gaussian spectral line
+};
+
+/* ========================================================================= */
+/*                            Internal Functions                             */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/* STATIC                        print_usage                                 */
+/*****************************************************************************/
+
+static void
+  print_usage(char *prog, bool comprehensive=false)
+{
+  kdu_message_formatter out(&cout_message);
+
+  out << "Usage:\n  \"" << prog << " ...\n";
+  out.set_master_indent(3);
+  out << "-o <CSV file receiving one row per benchmark run>\n";
+  out << "-workdir <directory for synthetic cubes and compressed files>\n";
+  if (comprehensive)
+    out << "\tDefaults to the current directory.  Synthetic cubes are "
+      "regenerated on every invocation from the `-seed' value, so results "
+      "are reproducible across machines and Kakadu versions.\n";
+  out << "-dims {<width>,<height>,<depth>}\n";
+  if (comprehensive)
+    out << "\tDimensions of the synthetic cube.  Default is {256,256,32}.\n";
+  out << "-bitpix <-32|-64>\n";
+  if (comprehensive)
+    out << "\tFITS BITPIX of the synthetic cube.  HDF5 cubes are always "
+      "written as 32-bit floats.  Default is -32.\n";
+  out << "-formats <fits|h5>[,...]\n";
+  out << "-threads <num threads>[,...]\n";
+  if (comprehensive)
+    out << "\tThread counts passed to `-num_threads' of the encoder and "
+      "decoder.  0 selects the single-threaded environment.  Default is "
+      "1,2,4.\n";
+  out << "-stripes <stripe height>[,...]\n";
+  if (comprehensive)
+    out << "\tPreferred stripe heights passed to `-min_height'.  Default is "
+      "8,64.\n";
+  out << "-rates <bits per voxel>[,...]\n";
+  if (comprehensive)
+    out << "\tTarget bit-rates passed to `-rate'.  Use `-' for an "
+      "unconstrained rate.  Default is 0.5,1,2.\n";
+  out << "-sources <number of point sources>\n";
+  out << "-nan_fraction <fraction of each plane blanked with NaNs>\n";
+  if (comprehensive)
+    out << "\tBlanked pixels are placed outside a circular primary beam, as "
+      "in a mosaic edge.  A block of fully flagged channels is also "
+      "produced when the fraction is non-zero.  Default is 0.05.\n";
+  out << "-seed <random seed>\n";
+  out << "-repeat <number of timed runs per configuration>\n";
+  out << "-encoder <path to skuareview-encode>\n";
+  out << "-decoder <path to skuareview-decode>\n";
+  out << "-keep -- keep compressed and decoded files after each run\n";
+  out << "-usage -- print a comprehensive usage statement.\n";
+  out << "-u -- print a brief usage statement.\"\n\n";
+  out.flush();
+  exit(0);
+}
+
+/*****************************************************************************/
+/* STATIC                         parse_list                                 */
+/*****************************************************************************/
+
+static void
+  parse_list(const char *string, std::vector<std::string> &list)
+{
+  list.clear();
+  std::string item;
+  for (; *string != '\0'; string++)
+    if (*string == ',')
+      { if (!item.empty()) list.push_back(item); item.clear(); }
+    else
+      item += *string;
+  if (!item.empty())
+    list.push_back(item);
+}
+
+static void
+  parse_int_list(const char *string, std::vector<int> &list,
+                 const char *arg_name, int min_val)
+{
+  std::vector<std::string> items;
+  parse_list(string,items);
+  list.clear();
+  for (size_t i=0; i < items.size(); i++)
+    {
+      int val;
+      if ((sscanf(items[i].c_str(),"%d",&val) != 1) || (val < min_val))
+        { kdu_error e; e << "\"" << arg_name << "\" argument requires a "
+          "comma-separated list of integers, no smaller than " << min_val
+          << "."; }
+      list.push_back(val);
+    }
+  if (list.empty())
+    { kdu_error e; e << "\"" << arg_name << "\" argument requires at least "
+      "one value."; }
+}
+
+/*****************************************************************************/
+/* STATIC                      parse_bench_args                              */
+/*****************************************************************************/
+
+static void
+  parse_bench_args(kdu_args &args, bench_config &cfg)
+{
+  if ((args.get_first() == NULL) || (args.find("-u") != NULL))
+    print_usage(args.get_prog_name());
+  if (args.find("-usage") != NULL)
+    print_usage(args.get_prog_name(),true);
+
+  cfg.width = cfg.height = 256;
+  cfg.depth = 32;
+  cfg.bitpix = FLOAT_IMG;
+  cfg.num_sources = 40;
+  cfg.nan_fraction = 0.05;
+  cfg.seed = 1;
+  cfg.repeats = 1;
+  cfg.keep_files = false;
+  cfg.formats.push_back("fits");
+  cfg.formats.push_back("h5");
+  cfg.threads.push_back(1); cfg.threads.push_back(2); cfg.threads.push_back(4);
+  cfg.stripe_heights.push_back(8); cfg.stripe_heights.push_back(64);
+  cfg.rates.push_back("0.5"); cfg.rates.push_back("1");
+  cfg.rates.push_back("2");
+  cfg.workdir = ".";
+  cfg.encoder = "./skuareview-encode";
+  cfg.decoder = "./skuareview-decode";
+
+  const char *string;
+  if (args.find("-o") != NULL)
+    {
+      if ((string = args.advance()) == NULL)
+        { kdu_error e; e << "\"-o\" argument requires a file name!"; }
+      cfg.csv_fname = string;
+      args.advance();
+    }
+  else
+    { kdu_error e; e << "You must supply an output CSV file name."; }
+
+  if (args.find("-workdir") != NULL)
+    {
+      if ((string = args.advance()) == NULL)
+        { kdu_error e; e << "\"-workdir\" argument requires a directory!"; }
+      cfg.workdir = string;
+      args.advance();
+    }
+
+  if (args.find("-dims") != NULL)
+    {
+      if (((string = args.advance()) == NULL) ||
+          (sscanf(string,"{%d,%d,%d}",&cfg.width,&cfg.height,
+                  &cfg.depth) != 3) ||
+          (cfg.width <= 0) || (cfg.height <= 0) || (cfg.depth <= 0))
+        { kdu_error e; e << "\"-dims\" argument requires three strictly "
+          "positive integers, enclosed by curly braces.  Example: "
+          "-dims {512,512,64}"; }
+      args.advance();
+    }
+
+  if (args.find("-bitpix") != NULL)
+    {
+      if (((string = args.advance()) == NULL) ||
+          (sscanf(string,"%d",&cfg.bitpix) != 1) ||
+          ((cfg.bitpix != FLOAT_IMG) && (cfg.bitpix != DOUBLE_IMG)))
+        { kdu_error e; e << "\"-bitpix\" argument must be -32 or -64."; }
+      args.advance();
+    }
+
+  if (args.find("-formats") != NULL)
+    {
+      if ((string = args.advance()) == NULL)
+        { kdu_error e; e << "\"-formats\" argument requires a list!"; }
+      parse_list(string,cfg.formats);
+      for (size_t i=0; i < cfg.formats.size(); i++)
+        if ((cfg.formats[i] != "fits") && (cfg.formats[i] != "h5"))
+          { kdu_error e; e << "Unrecognized format, \"" << cfg.formats[i].c_str()
+            << "\", supplied to \"-formats\".  Valid formats are fits "
+            "and h5."; }
+      args.advance();
+    }
+
+  if (args.find("-threads") != NULL)
+    {
+      if ((string = args.advance()) == NULL)
+        { kdu_error e; e << "\"-threads\" argument requires a list!"; }
+      parse_int_list(string,cfg.threads,"-threads",0);
+      args.advance();
+    }
+
+  if (args.find("-stripes") != NULL)
+    {
+      if ((string = args.advance()) == NULL)
+        { kdu_error e; e << "\"-stripes\" argument requires a list!"; }
+      parse_int_list(string,cfg.stripe_heights,"-stripes",1);
+      args.advance();
+    }
+
+  if (args.find("-rates") != NULL)
+    {
+      if ((string = args.advance()) == NULL)
+        { kdu_error e; e << "\"-rates\" argument requires a list!"; }
+      parse_list(string,cfg.rates);
+      for (size_t i=0; i < cfg.rates.size(); i++)
+        {
+          float val;
+          if ((cfg.rates[i] != "-") &&
+              ((sscanf(cfg.rates[i].c_str(),"%f",&val) != 1) || (val <= 0)))
+            { kdu_error e; e << "\"-rates\" argument requires strictly "
+              "positive bit-rates, or `-'."; }
+        }
+      args.advance();
+    }
+
+  if (args.find("-sources") != NULL)
+    {
+      if (((string = args.advance()) == NULL) ||
+          (sscanf(string,"%d",&cfg.num_sources) != 1) ||
+          (cfg.num_sources < 0))
+        { kdu_error e; e << "\"-sources\" argument requires a non-negative "
+          "integer."; }
+      args.advance();
+    }
+
+  if (args.find("-nan_fraction") != NULL)
+    {
+      if (((string = args.advance()) == NULL) ||
+          (sscanf(string,"%lf",&cfg.nan_fraction) != 1) ||
+          (cfg.nan_fraction < 0.0) || (cfg.nan_fraction >= 1.0))
+        { kdu_error e; e << "\"-nan_fraction\" argument requires a value "
+          "in the range [0,1)."; }
+      args.advance();
+    }
+
+  if (args.find("-seed") != NULL)
+    {
+      if (((string = args.advance()) == NULL) ||
+          (sscanf(string,"%lu",&cfg.seed) != 1))
+        { kdu_error e; e << "\"-seed\" argument requires an integer."; }
+      args.advance();
+    }
+
+  if (args.find("-repeat") != NULL)
+    {
+      if (((string = args.advance()) == NULL) ||
+          (sscanf(string,"%d",&cfg.repeats) != 1) || (cfg.repeats < 1))
+        { kdu_error e; e << "\"-repeat\" argument requires a positive "
+          "integer."; }
+      args.advance();
+    }
+
+  if (args.find("-encoder") != NULL)
+    {
+      if ((string = args.advance()) == NULL)
+        { kdu_error e; e << "\"-encoder\" argument requires a path!"; }
+      cfg.encoder = string;
+      args.advance();
+    }
+
+  if (args.find("-decoder") != NULL)
+    {
+      if ((string = args.advance()) == NULL)
+        { kdu_error e; e << "\"-decoder\" argument requires a path!"; }
+      cfg.decoder = string;
+      args.advance();
+    }
+
+  if (args.find("-keep") != NULL)
+    {
+      cfg.keep_files = true;
+      args.advance();
+    }
+}
+
+/*****************************************************************************/
+/* STATIC                      generate_sources                              */
+/*****************************************************************************/
+
+static void
+  generate_sources(bench_config &cfg, bench_random &rng,
+                   std::vector<bench_source> &sources)
+  /* Builds a sky model of unresolved continuum and line sources, plus a few
+     extended emission regions a few beams across.  Fluxes follow a steep
+     power law so that most sources sit near the noise floor and a handful
+     dominate the dynamic range -- which is what stresses the normalization
+     and rate control. */
+{
+  sources.clear();
+  for (int n=0; n < cfg.num_sources; n++)
+    {
+      bench_source src;
+      src.x = rng.uniform() * cfg.width;
+      src.y = rng.uniform() * cfg.height;
+      src.sigma = 1.5;
+      src.flux = 3.0 * pow(rng.uniform(),-1.5); // In units of the noise rms
+      src.spectral_index = -0.7 + 0.3*rng.gaussian();
+      src.line_flux = (rng.uniform() < 0.3)?(5.0*rng.uniform()):0.0;
+      src.line_centre = rng.uniform() * cfg.depth;
+      src.line_width = 1.0 + 0.05*cfg.depth*rng.uniform();
+      sources.push_back(src);
+    }
+  int num_extended = 1 + cfg.num_sources / 20;
+  for (int n=0; n < num_extended; n++)
+    {
+      bench_source src;
+      src.x = rng.uniform() * cfg.width;
+      src.y = rng.uniform() * cfg.height;
+      src.sigma = (0.05 + 0.1*rng.uniform()) * ((cfg.width<cfg.height)?
+                                                cfg.width:cfg.height);
+      src.flux = 0.5 + 2.0*rng.uniform();
+      src.spectral_index = -0.2 + 0.2*rng.gaussian();
+      src.line_flux = 0.0;
+      src.line_centre = src.line_width = 0.0;
+      sources.push_back(src);
+    }
+}
+
+/*****************************************************************************/
+/* STATIC                       generate_plane                               */
+/*****************************************************************************/
+
+static void
+  generate_plane(bench_config &cfg, bench_random &rng,
+                 std::vector<bench_source> &sources, int z, double *plane,
+                 double &minval, double &maxval)
+  /* Renders plane `z' of the synthetic cube into `plane', updating
+     `minval' and `maxval' with the finite samples. */
+{
+  int width=cfg.width, height=cfg.height;
+  double nu = 1.0 + 0.5 * ((cfg.depth > 1)?((double) z)/(cfg.depth-1):0.0);
+  for (int i=0; i < width*height; i++)
+    plane[i] = rng.gaussian();
+
+  for (size_t n=0; n < sources.size(); n++)
+    {
+      bench_source &src = sources[n];
+      double amp = src.flux * pow(nu,src.spectral_index);
+      if (src.line_flux > 0.0)
+        {
+          double d = (z - src.line_centre) / src.line_width;
+          amp += src.line_flux * exp(-0.5*d*d);
+        }
+      int radius = (int) ceil(4.0*src.sigma);
+      int x0 = (int) src.x - radius, x1 = (int) src.x + radius;
+      int y0 = (int) src.y - radius, y1 = (int) src.y + radius;
+      x0 = (x0 < 0)?0:x0;  x1 = (x1 >= width)?(width-1):x1;
+      y0 = (y0 < 0)?0:y0;  y1 = (y1 >= height)?(height-1):y1;
+      double inv_var = 1.0 / (2.0*src.sigma*src.sigma);
+      for (int y=y0; y <= y1; y++)
+        for (int x=x0; x <= x1; x++)
+          {
+            double dx = x - src.x, dy = y - src.y;
+            plane[y*width+x] += amp * exp(-(dx*dx + dy*dy)*inv_var);
+          }
+    }
+
+  // Blank everything outside a circular primary beam whose area leaves
+  // `nan_fraction' of the plane uncovered, and flag a block of channels.
+  if (cfg.nan_fraction > 0.0)
+    {
+      double cx = 0.5*width, cy = 0.5*height;
+      double radius2 = (1.0-cfg.nan_fraction) * width*height / M_PI;
+      int flagged_start = cfg.depth / 3;
+      int flagged_end = flagged_start + (int)(cfg.depth*cfg.nan_fraction);
+      bool flagged = (z >= flagged_start) && (z < flagged_end);
+      for (int y=0; y < height; y++)
+        for (int x=0; x < width; x++)
+          {
+            double dx = x+0.5-cx, dy = y+0.5-cy;
+            if (flagged || ((dx*dx + dy*dy) > radius2))
+              plane[y*width+x] = NAN;
+          }
+    }
+
+  for (int i=0; i < width*height; i++)
+    if (plane[i] == plane[i])
+      {
+        minval = (plane[i] < minval)?plane[i]:minval;
+        maxval = (plane[i] > maxval)?plane[i]:maxval;
+      }
+}
+
+/*****************************************************************************/
+/* STATIC                       write_fits_cube                              */
+/*****************************************************************************/
+
+static void
+  write_fits_cube(bench_config &cfg, const std::string &fname)
+{
+  int status = 0;
+  fitsfile *fp;
+  std::string create_name = "!" + fname; // Overwrite existing files
+  fits_create_file(&fp,create_name.c_str(),&status);
+  long naxes[3] = { cfg.width, cfg.height, cfg.depth };
+  fits_create_img(fp,cfg.bitpix,3,naxes,&status);
+  if (status != 0)
+    { kdu_error e; e << "Unable to create synthetic FITS cube, \""
+      << fname.c_str() << "\"."; }
+
+  bench_random rng(cfg.seed);
+  std::vector<bench_source> sources;
+  generate_sources(cfg,rng,sources);
+  double minval=DBL_MAX, maxval=-DBL_MAX;
+  double *plane = new double[cfg.width*cfg.height];
+  float *fplane = new float[cfg.width*cfg.height];
+  LONGLONG fpixel[3] = { 1, 1, 1 };
+  for (int z=0; z < cfg.depth; z++)
+    {
+      generate_plane(cfg,rng,sources,z,plane,minval,maxval);
+      fpixel[2] = z+1;
+      if (cfg.bitpix == DOUBLE_IMG)
+        fits_write_pixll(fp,TDOUBLE,fpixel,(LONGLONG) cfg.width*cfg.height,
+                         plane,&status);
+      else
+        {
+          for (int i=0; i < cfg.width*cfg.height; i++)
+            fplane[i] = (float) plane[i];
+          fits_write_pixll(fp,TFLOAT,fpixel,(LONGLONG) cfg.width*cfg.height,
+                           fplane,&status);
+        }
+      if (status != 0)
+        { kdu_error e; e << "Unable to write plane " << z << " of synthetic "
+          "FITS cube."; }
+    }
+  fits_write_key(fp,TDOUBLE,"DATAMIN",&minval,NULL,&status);
+  fits_write_key(fp,TDOUBLE,"DATAMAX",&maxval,NULL,&status);
+  fits_close_file(fp,&status);
+  if (status != 0)
+    { kdu_error e; e << "Unable to close synthetic FITS cube."; }
+  delete[] plane;
+  delete[] fplane;
+}
+
+/*****************************************************************************/
+/* STATIC                       write_hdf5_cube                              */
+/*****************************************************************************/
+
+static void
+  write_hdf5_cube(bench_config &cfg, const std::string &fname)
+  /* Writes the same sky model as `write_fits_cube' to an ICRAR style HDF5
+     file, with a chunked "full_cube" float dataset of dimensions
+     (depth, height, width). */
+{
+  hid_t file = H5Fcreate(fname.c_str(),H5F_ACC_TRUNC,H5P_DEFAULT,H5P_DEFAULT);
+  if (file < 0)
+    { kdu_error e; e << "Unable to create synthetic HDF5 cube, \""
+      << fname.c_str() << "\"."; }
+  hsize_t dims[3] = { (hsize_t) cfg.depth, (hsize_t) cfg.height,
+                      (hsize_t) cfg.width };
+  hsize_t chunk[3] = { 1, (hsize_t)((cfg.height < 64)?cfg.height:64),
+                       (hsize_t) cfg.width };
+  hid_t filespace = H5Screate_simple(3,dims,NULL);
+  hid_t cparms = H5Pcreate(H5P_DATASET_CREATE);
+  if ((filespace < 0) || (cparms < 0) || (H5Pset_chunk(cparms,3,chunk) < 0))
+    { kdu_error e; e << "Unable to set up synthetic HDF5 dataset."; }
+  hid_t dataset = H5Dcreate2(file,"full_cube",H5T_NATIVE_FLOAT,filespace,
+                             H5P_DEFAULT,cparms,H5P_DEFAULT);
+  if (dataset < 0)
+    { kdu_error e; e << "Unable to create synthetic HDF5 dataset."; }
+
+  bench_random rng(cfg.seed);
+  std::vector<bench_source> sources;
+  generate_sources(cfg,rng,sources);
+  double minval=DBL_MAX, maxval=-DBL_MAX;
+  double *plane = new double[cfg.width*cfg.height];
+  float *fplane = new float[cfg.width*cfg.height];
+  hsize_t plane_dims[3] = { 1, (hsize_t) cfg.height, (hsize_t) cfg.width };
+  hid_t memspace = H5Screate_simple(3,plane_dims,NULL);
+  for (int z=0; z < cfg.depth; z++)
+    {
+      generate_plane(cfg,rng,sources,z,plane,minval,maxval);
+      for (int i=0; i < cfg.width*cfg.height; i++)
+        fplane[i] = (float) plane[i];
+      hsize_t offset[3] = { (hsize_t) z, 0, 0 };
+      if ((H5Sselect_hyperslab(filespace,H5S_SELECT_SET,offset,NULL,
+                               plane_dims,NULL) < 0) ||
+          (H5Dwrite(dataset,H5T_NATIVE_FLOAT,memspace,filespace,
+                    H5P_DEFAULT,fplane) < 0))
+        { kdu_error e; e << "Unable to write plane " << z << " of synthetic "
+          "HDF5 cube."; }
+    }
+  delete[] plane;
+  delete[] fplane;
+  if ((H5Sclose(memspace) < 0) || (H5Sclose(filespace) < 0) ||
+      (H5Pclose(cparms) < 0) || (H5Dclose(dataset) < 0) ||
+      (H5Fclose(file) < 0))
+    { kdu_error e; e << "Unable to close synthetic HDF5 cube."; }
+}
+
+/*****************************************************************************/
+/* STATIC                          run_tool                                  */
+/*****************************************************************************/
+
+static bool
+  run_tool(std::vector<std::string> &argv, const std::string &log_fname,
+           double &seconds, long &peak_rss_kb)
+  /* Runs one of the SkuareView executables to completion, with its output
+     appended to `log_fname'.  Returns false if the process could not be
+     started or did not exit cleanly.  The peak resident set size is taken
+     from the child's own resource usage, so it is not polluted by the
+     benchmark driver. */
+{
+  std::vector<char *> cargv;
+  for (size_t i=0; i < argv.size(); i++)
+    cargv.push_back((char *) argv[i].c_str());
+  cargv.push_back(NULL);
+
+  struct timeval start, end;
+  gettimeofday(&start,NULL);
+  pid_t pid = fork();
+  if (pid < 0)
+    return false;
+  if (pid == 0)
+    {
+      int fd = open(log_fname.c_str(),O_WRONLY|O_CREAT|O_APPEND,0644);
+      if (fd >= 0)
+        { dup2(fd,1); dup2(fd,2); close(fd); }
+      execvp(cargv[0],&(cargv[0]));
+      _exit(127);
+    }
+  int status = 0;
+  struct rusage usage;
+  if (wait4(pid,&status,0,&usage) != pid)
+    return false;
+  gettimeofday(&end,NULL);
+  seconds = (end.tv_sec - start.tv_sec) + 1.0E-6*(end.tv_usec-start.tv_usec);
+  peak_rss_kb = usage.ru_maxrss;
+  return WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+}
+
+/*****************************************************************************/
+/* STATIC                        read_plane                                  */
+/*****************************************************************************/
+
+static bool
+  read_plane(const std::string &fname, bool is_hdf5, int z,
+             int width, int height, float *buf)
+  /* Reads plane `z' of either a FITS or an HDF5 cube as floats, with
+     blank pixels left as NaNs. */
+{
+  if (is_hdf5)
+    {
+      hid_t file = H5Fopen(fname.c_str(),H5F_ACC_RDONLY,H5P_DEFAULT);
+      if (file < 0)
+        return false;
+      hid_t dataset = H5Dopen(file,"full_cube",H5P_DEFAULT);
+      hid_t filespace = H5Dget_space(dataset);
+      hsize_t offset[3] = { (hsize_t) z, 0, 0 };
+      hsize_t count[3] = { 1, (hsize_t) height, (hsize_t) width };
+      hid_t memspace = H5Screate_simple(3,count,NULL);
+      bool ok = (dataset >= 0) && (filespace >= 0) &&
+        (H5Sselect_hyperslab(filespace,H5S_SELECT_SET,offset,NULL,
+                             count,NULL) >= 0) &&
+        (H5Dread(dataset,H5T_NATIVE_FLOAT,memspace,filespace,
+                 H5P_DEFAULT,buf) >= 0);
+      H5Sclose(memspace); H5Sclose(filespace);
+      H5Dclose(dataset); H5Fclose(file);
+      return ok;
+    }
+  int status=0, anynul=0;
+  fitsfile *fp;
+  fits_open_file(&fp,fname.c_str(),READONLY,&status);
+  if (status != 0)
+    return false;
+  LONGLONG fpixel[3] = { 1, 1, z+1 };
+  fits_read_pixll(fp,TFLOAT,fpixel,(LONGLONG) width*height,NULL,buf,
+                  &anynul,&status);
+  int close_status = 0;
+  fits_close_file(fp,&close_status);
+  return (status == 0);
+}
+
+/*****************************************************************************/
+/* STATIC                      measure_quality                               */
+/*****************************************************************************/
+
+static bool
+  measure_quality(bench_config &cfg, const std::string &orig_fname,
+                  bool orig_is_hdf5, const std::string &decoded_fname,
+                  double &psnr, double &mae)
+  /* PSNR is taken with respect to the dynamic range of the finite samples
+     of the original cube.  Pixels that are blank in the original are
+     excluded; pixels that are blank only in the decoded cube count as an
+     error of the full dynamic range. */
+{
+  int plane_size = cfg.width*cfg.height;
+  float *orig = new float[plane_size];
+  float *dec = new float[plane_size];
+  double sum_sq=0.0, sum_abs=0.0, minval=DBL_MAX, maxval=-DBL_MAX;
+  kdu_long count=0, lost=0;
+  bool ok = true;
+  for (int z=0; ok && (z < cfg.depth); z++)
+    {
+      ok = read_plane(orig_fname,orig_is_hdf5,z,cfg.width,cfg.height,orig) &&
+           read_plane(decoded_fname,false,z,cfg.width,cfg.height,dec);
+      for (int i=0; ok && (i < plane_size); i++)
+        {
+          if (orig[i] != orig[i])
+            continue;
+          minval = (orig[i] < minval)?orig[i]:minval;
+          maxval = (orig[i] > maxval)?orig[i]:maxval;
+          if (dec[i] != dec[i])
+            { lost++; continue; }
+          double err = (double) dec[i] - (double) orig[i];
+          sum_sq += err*err;
+          sum_abs += fabs(err);
+          count++;
+        }
+    }
+  delete[] orig;
+  delete[] dec;
+  if ((!ok) || (count == 0))
+    return false;
+  double range = maxval - minval;
+  sum_sq += range*range*lost;
+  sum_abs += range*lost;
+  count += lost;
+  double mse = sum_sq / count;
+  mae = sum_abs / count;
+  psnr = (mse > 0.0)?(10.0*log10(range*range/mse)):INFINITY;
+  return true;
+}
+
+/*****************************************************************************/
+/* STATIC                         file_bytes                                 */
+/*****************************************************************************/
+
+static kdu_long
+  file_bytes(const std::string &fname)
+{
+  struct stat st;
+  if (stat(fname.c_str(),&st) != 0)
+    return -1;
+  return (kdu_long) st.st_size;
+}
+
+/* ========================================================================= */
+/*                            External Functions                             */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                                   main                                    */
+/*****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+  kdu_customize_warnings(&pretty_cout);
+  kdu_customize_errors(&pretty_cerr);
+  kdu_args args(argc,argv,"-s");
+
+  bench_config cfg;
+  parse_bench_args(args,cfg);
+  if (args.show_unrecognized(pretty_cout) != 0)
+    { kdu_error e; e << "There were unrecognized command line arguments!"; }
+
+  FILE *csv = fopen(cfg.csv_fname.c_str(),"a");
+  if (csv == NULL)
+    { kdu_error e; e << "Unable to open CSV file, \"" << cfg.csv_fname.c_str()
+      << "\"."; }
+  if (ftell(csv) == 0)
+    fprintf(csv,"kakadu_version,format,bitpix,width,height,depth,seed,"
+            "threads,stripe_height,rate,run,encode_s,encode_mvox_per_s,"
+            "encode_peak_rss_kb,decode_s,decode_mvox_per_s,"
+            "decode_peak_rss_kb,compressed_bytes,bits_per_voxel,psnr_db,"
+            "mae,status\n");
+
+  kdu_long num_voxels = ((kdu_long) cfg.width) * cfg.height * cfg.depth;
+  std::string log_fname = cfg.workdir + "/bench.log";
+  char tag[64];
+  sprintf(tag,"%dx%dx%d_%d",cfg.width,cfg.height,cfg.depth,-cfg.bitpix);
+
+  for (size_t f=0; f < cfg.formats.size(); f++)
+    {
+      bool is_hdf5 = (cfg.formats[f] == "h5");
+      std::string cube = cfg.workdir + "/bench_" + tag +
+        (is_hdf5?".h5":".fits");
+      pretty_cout << "Generating synthetic cube \"" << cube.c_str() << "\"\n";
+      pretty_cout.flush();
+      if (is_hdf5)
+        write_hdf5_cube(cfg,cube);
+      else
+        write_fits_cube(cfg,cube);
+      std::string jpx = cfg.workdir + "/bench_out.jpx";
+      std::string decoded = cfg.workdir + "/bench_out.fits";
+
+      for (size_t t=0; t < cfg.threads.size(); t++)
+        for (size_t s=0; s < cfg.stripe_heights.size(); s++)
+          for (size_t r=0; r < cfg.rates.size(); r++)
+            for (int run=0; run < cfg.repeats; run++)
+              {
+                char threads[16], stripe[16];
+                sprintf(threads,"%d",cfg.threads[t]);
+                sprintf(stripe,"%d",cfg.stripe_heights[s]);
+                double enc_s=0.0, dec_s=0.0, psnr=0.0, mae=0.0;
+                long enc_rss=0, dec_rss=0;
+                const char *status = "ok";
+
+                std::vector<std::string> enc;
+                enc.push_back(cfg.encoder);
+                enc.push_back("-i"); enc.push_back(cube);
+                enc.push_back("-o"); enc.push_back(jpx);
+                enc.push_back("-num_threads"); enc.push_back(threads);
+                enc.push_back("-min_height"); enc.push_back(stripe);
+                enc.push_back("-rate"); enc.push_back(cfg.rates[r]);
+                std::vector<std::string> dec;
+                dec.push_back(cfg.decoder);
+                dec.push_back("-i"); dec.push_back(jpx);
+                dec.push_back("-o"); dec.push_back(decoded);
+                dec.push_back("-num_threads"); dec.push_back(threads);
+                dec.push_back("-min_height"); dec.push_back(stripe);
+
+                kdu_long bytes = -1;
+                if (!run_tool(enc,log_fname,enc_s,enc_rss))
+                  status = "encode_failed";
+                else if ((bytes = file_bytes(jpx)) <= 0)
+                  status = "no_output";
+                else if (!run_tool(dec,log_fname,dec_s,dec_rss))
+                  status = "decode_failed";
+                else if (!measure_quality(cfg,cube,is_hdf5,decoded,psnr,mae))
+                  status = "compare_failed";
+
+                fprintf(csv,"%s,%s,%d,%d,%d,%d,%lu,%d,%d,%s,%d,%.4f,%.4f,"
+                        "%ld,%.4f,%.4f,%ld,%lld,%.6f,%.4f,%.6g,%s\n",
+                        kdu_get_core_version(),cfg.formats[f].c_str(),
+                        is_hdf5?FLOAT_IMG:cfg.bitpix,cfg.width,cfg.height,
+                        cfg.depth,cfg.seed,cfg.threads[t],
+                        cfg.stripe_heights[s],cfg.rates[r].c_str(),run,
+                        enc_s,(enc_s>0.0)?(num_voxels*1.0E-6/enc_s):0.0,
+                        enc_rss,
+                        dec_s,(dec_s>0.0)?(num_voxels*1.0E-6/dec_s):0.0,
+                        dec_rss,(long long) bytes,
+                        (bytes>0)?(8.0*bytes/num_voxels):0.0,psnr,mae,
+                        status);
+                fflush(csv);
+                pretty_cout << cfg.formats[f].c_str() << " threads="
+                  << threads << " stripe=" << stripe << " rate="
+                  << cfg.rates[r].c_str() << ": " << status << "\n";
+                pretty_cout.flush();
+                if (!cfg.keep_files)
+                  { remove(jpx.c_str()); remove(decoded.c_str()); }
+              }
+      if (!cfg.keep_files)
+        remove(cube.c_str());
+    }
+  fclose(csv);
+  return 0;
+}
@@ -1,22 +1,30 @@
+#include <math.h>
 #include "ska_local.h"
 #include "hdf5_local.h"
 #include "fits_local.h"
+#include "ska_wcs.h"
 
 /*****************************************************************************/
 /*                      ska_dest_file::write_header                         */
 /*****************************************************************************/
 
 void
-ska_dest_file::write_header(jp2_family_src &src, kdu_args &args) 
+ska_dest_file::write_header(jp2_family_src &src, kdu_args &args)
 {
   parse_ska_args(src, args);
+  read_metadata(src);
+  // The header describes the encoded cube, not the part that was decoded
+  ska_wcs::shift_records(metadata_buffer, metadata_length, crop.x, crop.y,
+      crop.z, discard_levels);
   const char *suffix;
   out = NULL;
+  if (fname == NULL)
+    return; // Nothing to write; stripes are only renormalized
   if ((suffix = strchr(fname, '.')) != NULL) {
     if ((strcmp(suffix+1,"h5")==0) || (strcmp(suffix+1,"H5")==0)) {
       //out = new hdf5_out();
       //out->write_header(src, args, this);
-      kdu_error e; 
+      kdu_error e;
       e << "hdf5 out not ported yet!";
     }
     else if ((strcmp(suffix+1,"fits")==0) || (strcmp(suffix+1,"FITS")==0)) {
@@ -30,6 +38,25 @@ ska_dest_file::write_header(jp2_family_src &src, kdu_args &args)
       "case may be used, but must be used consistently."; }
 }
 
+/*****************************************************************************/
+/*                       ska_dest_file::select_stokes                        */
+/*****************************************************************************/
+
+int
+ska_dest_file::select_stokes(jp2_family_src &src)
+{
+  // Each Stokes parameter was encoded as a codestream of its own, in order
+  read_metadata(src);
+  if (crop.stokes < 0)
+    crop.stokes = norm.first_stokes;
+  int idx = crop.stokes - norm.first_stokes;
+  if ((idx < 0) || (idx >= norm.num_stokes))
+  { kdu_error e; e << "Stokes parameter " << crop.stokes << " was not "
+    "encoded; the file holds Stokes parameters " << norm.first_stokes <<
+      " to " << norm.first_stokes + norm.num_stokes - 1 << "."; }
+  return idx;
+}
+
 /*****************************************************************************/
 /*                        ska_dest_file::write_stripe                       */
 /*****************************************************************************/
@@ -37,12 +64,20 @@ ska_dest_file::write_header(jp2_family_src &src, kdu_args &args)
 void
 ska_dest_file::write_stripe(int height, float *buf, int component)
 {
+  // "buf" holds normalized samples straight out of the decompressor; these
+  // are converted back to the original sample values here, rather than in
+  // each file format, so that they can also be used when nothing is written.
+  if (renormalize)
+    norm.renormalize(buf, crop.width * height,
+        norm.get_plane(crop.stokes, crop.z + component));
+
   // "this" is passed as a method of mimicing inheritance
   // the reason why have to do it this way is because "kdu_buffered_compress"
   // won't know which implementation to use for which file format. And we want
   // to minimize any changes we make to the app, as new versions of Kakadu
   // may be released.
-  out->write_stripe(height, buf, this, component);
+  if (out != NULL)
+    out->write_stripe(height, buf, this, component);
 }
 
 /*****************************************************************************/
@@ -52,8 +87,70 @@ ska_dest_file::write_stripe(int height, float *buf, int component)
 void
   ska_dest_file::parse_ska_args(jp2_family_src &src, kdu_args &args)
 {
-
   //TODO: read JP2 header
   samples_min = SAMPLES_MIN;
   samples_max = SAMPLES_MAX;
 }
+
+/*****************************************************************************/
+/*                       ska_dest_file::read_metadata                        */
+/*****************************************************************************/
+
+void
+  ska_dest_file::read_metadata(jp2_family_src &src)
+{
+  kdu_byte ska_uuid[16] = {0x24,0x37,0xE6,0xC0,
+                          0xF2,0xB2,0x11,0xE2,
+                          0xB7,0x78,0x08,0x00,
+                          0x20,0x0C,0x9A,0x66};
+
+  if (!src.exists())
+    return; // Raw codestream, no boxes
+
+  // Look through the top level uuid boxes for ours
+  bool have_norm = false;
+  jp2_input_box meta_box;
+  meta_box.open(&src); //Open the main jp2 box
+  meta_box.close();
+  for (meta_box.open_next(); meta_box.exists();
+       meta_box.close(), meta_box.open_next()) {
+    if (meta_box.get_box_type() != 75756964)
+      continue;
+    if (norm.read_box(meta_box)) {
+      have_norm = true;
+      continue;
+    }
+    meta_box.seek(0);
+    int contents_length = (int) meta_box.get_remaining_bytes();
+    kdu_byte *contents = new kdu_byte[contents_length+1];
+    contents_length = meta_box.read(contents, contents_length);
+    if ((contents_length < 16) || memcmp(contents, ska_uuid, 16) != 0)
+      { delete[] contents; continue; }
+
+    delete[] metadata_buffer;
+    metadata_length = contents_length - 16;
+    metadata_buffer = new kdu_byte[metadata_length+1];
+    memcpy(metadata_buffer, contents+16, metadata_length);
+    metadata_buffer[metadata_length] = '\0';
+    delete[] contents;
+
+    // Pick up the sample range the encoder normalized with
+    char *record = (char *) metadata_buffer;
+    while (*record != '\0') {
+      if (!strncmp(record, "DATAMIN =", 9))
+        sscanf(record+9, "%lf", &samples_min);
+      else if (!strncmp(record, "DATAMAX =", 9))
+        sscanf(record+9, "%lf", &samples_max);
+      char *next = strchr(record, '\n');
+      if (next == NULL)
+        break;
+      record = next+1;
+    }
+  }
+
+  // Files written before the parameters were recorded used a single range
+  if (have_norm)
+    norm.get_range(samples_min, samples_max);
+  else
+    norm.set_global_range(samples_min, samples_max);
+}
@@ -0,0 +1,372 @@
+/*****************************************************************************/
+//
+//  @file: ska_flush.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Writes the codestream from a thread of its own, so that the
+//         threads which flush it never wait for the disk. See
+//         `ska_flush_target' in ska_flush.h.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+// Core includes
+#include "kdu_messaging.h"
+// SKA includes
+#include "ska_flush.h"
+
+struct ska_flush_buffer : public ska_io_job {
+  kdu_long offset; // Of `buf[0]' in the file
+  int num_bytes;
+  bool is_patch; // Allocated for a rewrite, rather than one of the buffers
+  kdu_byte *buf;
+  ska_flush_buffer *next; // In `free_buffers'
+};
+
+/*****************************************************************************/
+/* STATIC                           sync_data                                */
+/*****************************************************************************/
+
+static int
+  sync_data(int fd)
+  /* Returns 0 or the `errno' of the failed call. */
+{
+#if defined(__APPLE__)
+  return (fsync(fd) == 0)?0:errno; // No `fdatasync' declared on OS X
+#else
+  return (fdatasync(fd) == 0)?0:errno;
+#endif
+}
+
+/*****************************************************************************/
+/* STATIC                         open_direct                                */
+/*****************************************************************************/
+
+static int
+  open_direct(const char *fname)
+  /* Opens a second descriptor of the file just created, which bypasses
+   * the page cache, or returns -1. */
+{
+#if defined(O_DIRECT)
+  return ::open(fname,O_WRONLY|O_DIRECT);
+#elif defined(F_NOCACHE)
+  int fd = ::open(fname,O_WRONLY);
+  if ((fd >= 0) && (fcntl(fd,F_NOCACHE,1) == -1))
+    { ::close(fd); fd = -1; }
+  return fd;
+#else
+  return -1;
+#endif
+}
+
+/* ========================================================================= */
+/*                             ska_flush_target                              */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                    ska_flush_target::ska_flush_target                     */
+/*****************************************************************************/
+
+ska_flush_target::ska_flush_target()
+{
+  fd = direct_fd = -1;
+  fname = NULL;
+  sync_bytes = 0;
+  max_bytes = SKA_FLUSH_WINDOW;
+  cur_pos = end_pos = 0;
+  restore_pos = -1;
+  cur = NULL;
+  num_buffers = 0;
+  stalls = 0;
+  free_buffers = NULL;
+  unsynced = 0;
+}
+
+/*****************************************************************************/
+/*                         ska_flush_target::open                            */
+/*****************************************************************************/
+
+bool
+  ska_flush_target::open(const char *fname, bool direct_io,
+                         kdu_long sync_bytes, kdu_long max_bytes,
+                         bool return_on_failure)
+{
+  close();
+  fd = ::open(fname,O_WRONLY|O_CREAT|O_TRUNC,0666);
+  if (fd < 0)
+    {
+      if (return_on_failure)
+        return false;
+      kdu_error e; e << "Unable to open compressed data file, \"" << fname
+        << "\": " << strerror(errno) << ".";
+    }
+  this->fname = new char[strlen(fname)+1];
+  strcpy(this->fname,fname);
+  if (direct_io)
+    direct_fd = open_direct(fname); // Some file systems refuse O_DIRECT
+  this->sync_bytes = (sync_bytes < 0)?0:sync_bytes;
+  this->max_bytes = (max_bytes < 2*SKA_FLUSH_BUFFER)?
+    (2*SKA_FLUSH_BUFFER):max_bytes;
+  cur_pos = end_pos = 0;
+  restore_pos = -1;
+  stalls = 0;
+  unsynced = 0;
+
+  cur = new ska_flush_buffer;
+  cur->offset = 0;
+  cur->num_bytes = 0;
+  cur->is_patch = false;
+  cur->next = NULL;
+  void *mem = NULL;
+  if (posix_memalign(&mem,SKA_FLUSH_ALIGN,SKA_FLUSH_BUFFER) != 0)
+    { kdu_error e; e << "Insufficient memory to stage compressed data."; }
+  cur->buf = (kdu_byte *) mem;
+  num_buffers = 1;
+  if (writer.start(1,do_write,write_done,this) == 0)
+    { kdu_error e; e << "Unable to start the compressed data writer "
+      "thread."; }
+  return true;
+}
+
+/*****************************************************************************/
+/*                         ska_flush_target::write                           */
+/*****************************************************************************/
+
+bool
+  ska_flush_target::write(const kdu_byte *buf, int num_bytes)
+{
+  if (fd < 0)
+    return false;
+  check_error();
+  int write_bytes = num_bytes;
+  if ((restore_pos >= 0) && ((cur_pos+write_bytes) > restore_pos))
+    write_bytes = (int)(restore_pos-cur_pos);
+  int remaining = write_bytes;
+  while (remaining > 0)
+    {
+      int xfer;
+      if (cur_pos < cur->offset)
+        { // Rewriting bytes which have already been queued
+          xfer = remaining;
+          if ((cur_pos+xfer) > cur->offset)
+            xfer = (int)(cur->offset-cur_pos);
+          queue_patch(buf,xfer,cur_pos);
+        }
+      else
+        {
+          int off = (int)(cur_pos - cur->offset);
+          xfer = SKA_FLUSH_BUFFER - off;
+          if (xfer > remaining)
+            xfer = remaining;
+          memcpy(cur->buf+off,buf,(size_t) xfer);
+          if ((off+xfer) > cur->num_bytes)
+            cur->num_bytes = off+xfer;
+        }
+      buf += xfer;  remaining -= xfer;  cur_pos += xfer;
+      if (cur_pos > end_pos)
+        end_pos = cur_pos;
+      if (cur->num_bytes == SKA_FLUSH_BUFFER)
+        hand_off(); // Never during a rewrite, since `cur' fills at the end
+    }
+  return (write_bytes == num_bytes);
+}
+
+/*****************************************************************************/
+/*                     ska_flush_target::start_rewrite                       */
+/*****************************************************************************/
+
+bool
+  ska_flush_target::start_rewrite(kdu_long backtrack)
+{
+  if ((fd < 0) || (restore_pos >= 0) ||
+      (backtrack < 0) || (backtrack > cur_pos))
+    return false;
+  restore_pos = cur_pos;
+  cur_pos -= backtrack;
+  return true;
+}
+
+/*****************************************************************************/
+/*                      ska_flush_target::end_rewrite                        */
+/*****************************************************************************/
+
+bool
+  ska_flush_target::end_rewrite()
+{
+  if (restore_pos < 0)
+    return false;
+  cur_pos = restore_pos;
+  restore_pos = -1;
+  return true;
+}
+
+/*****************************************************************************/
+/*                         ska_flush_target::close                           */
+/*****************************************************************************/
+
+bool
+  ska_flush_target::close()
+{
+  if (fd < 0)
+    return true;
+  restore_pos = -1;
+  if ((cur != NULL) && (cur->num_bytes > 0))
+    { queue(cur); cur = NULL; }
+  writer.stop(); // Lets the thread write everything queued
+
+  int err = 0;
+  if ((direct_fd >= 0) && (ftruncate(fd,(off_t) end_pos) != 0))
+    err = errno; // Drops the padding of the last buffer
+  if ((err == 0) && (sync_bytes > 0))
+    err = sync_data(fd);
+  if ((direct_fd >= 0) && (::close(direct_fd) != 0) && (err == 0))
+    err = errno;
+  if ((::close(fd) != 0) && (err == 0))
+    err = errno;
+  fd = direct_fd = -1;
+  writer.set_error(err);
+
+  if (cur != NULL)
+    { free(cur->buf); delete cur; cur = NULL; }
+  while (free_buffers != NULL)
+    {
+      ska_flush_buffer *job = free_buffers;
+      free_buffers = job->next;
+      free(job->buf);
+      delete job;
+    }
+  num_buffers = 0;
+  check_error();
+  delete[] fname;
+  fname = NULL;
+  return true;
+}
+
+/*****************************************************************************/
+/*                        ska_flush_target::hand_off                         */
+/*****************************************************************************/
+
+void
+  ska_flush_target::hand_off()
+{
+  kdu_long next_offset = cur->offset + cur->num_bytes;
+  queue(cur);
+  writer.lock();
+  while ((free_buffers == NULL) && (writer.get_error() == 0) &&
+         ((((kdu_long) num_buffers)+1)*SKA_FLUSH_BUFFER > max_bytes))
+    { stalls++;  writer.wait_done(); }
+  cur = free_buffers;
+  if (cur != NULL)
+    free_buffers = cur->next;
+  writer.unlock();
+  if (cur == NULL)
+    { // Below the limit, or failed anyway; `check_error' reports the latter
+      void *mem = NULL;
+      if (posix_memalign(&mem,SKA_FLUSH_ALIGN,SKA_FLUSH_BUFFER) != 0)
+        { kdu_error e; e << "Insufficient memory to stage compressed "
+          "data."; }
+      cur = new ska_flush_buffer;
+      cur->buf = (kdu_byte *) mem;
+      cur->is_patch = false;
+      num_buffers++;
+    }
+  cur->offset = next_offset;
+  cur->num_bytes = 0;
+  cur->next = NULL;
+  check_error();
+}
+
+/*****************************************************************************/
+/*                       ska_flush_target::queue_patch                       */
+/*****************************************************************************/
+
+void
+  ska_flush_target::queue_patch(const kdu_byte *buf, int num_bytes,
+                                kdu_long offset)
+{
+  ska_flush_buffer *job = new ska_flush_buffer;
+  job->offset = offset;
+  job->num_bytes = num_bytes;
+  job->is_patch = true;
+  job->buf = new kdu_byte[num_bytes];
+  memcpy(job->buf,buf,(size_t) num_bytes);
+  queue(job);
+}
+
+/*****************************************************************************/
+/*                          ska_flush_target::queue                          */
+/*****************************************************************************/
+
+void
+  ska_flush_target::queue(ska_flush_buffer *job)
+{
+  job->next = NULL;
+  writer.lock();
+  writer.push(job);
+  writer.unlock();
+}
+
+/*****************************************************************************/
+/*                       ska_flush_target::check_error                       */
+/*****************************************************************************/
+
+void
+  ska_flush_target::check_error()
+{
+  int err = writer.get_error();
+  if (err != 0)
+    { kdu_error e; e << "Unable to write compressed data file, \""
+      << fname << "\": " << strerror(err) << "."; }
+}
+
+/*****************************************************************************/
+/* STATIC                    ska_flush_target::do_write                      */
+/*****************************************************************************/
+
+int
+  ska_flush_target::do_write(void *context, ska_io_job *job)
+{
+  ska_flush_target *obj = (ska_flush_target *) context;
+  ska_flush_buffer *fb = (ska_flush_buffer *) job;
+  int err;
+  size_t num_bytes = (size_t) fb->num_bytes;
+  if (fb->is_patch || (obj->direct_fd < 0))
+    err = ska_pwrite_fully(obj->fd,fb->buf,num_bytes,fb->offset);
+  else
+    { // O_DIRECT lengths must be aligned too; `close' truncates the file
+      size_t padded = (num_bytes + SKA_FLUSH_ALIGN-1) &
+        ~((size_t)(SKA_FLUSH_ALIGN-1));
+      memset(fb->buf+num_bytes,0,padded-num_bytes);
+      err = ska_pwrite_fully(obj->direct_fd,fb->buf,padded,fb->offset);
+    }
+  obj->unsynced += (kdu_long) num_bytes;
+  if ((err == 0) && (obj->sync_bytes > 0) &&
+      (obj->unsynced >= obj->sync_bytes))
+    { err = sync_data(obj->fd);  obj->unsynced = 0; }
+  return err;
+}
+
+/*****************************************************************************/
+/* STATIC                   ska_flush_target::write_done                     */
+/*****************************************************************************/
+
+void
+  ska_flush_target::write_done(void *context, ska_io_job *job)
+{
+  ska_flush_target *obj = (ska_flush_target *) context;
+  ska_flush_buffer *fb = (ska_flush_buffer *) job;
+  if (fb->is_patch)
+    { delete[] fb->buf;  delete fb; }
+  else
+    {
+      fb->next = obj->free_buffers;
+      obj->free_buffers = fb;
+    }
+}
@@ -0,0 +1,108 @@
+/*****************************************************************************/
+//
+//  @file: ska_flush.h
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Compressed data target which stages the codestream in large
+//         aligned buffers and leaves the writing of them to a thread of its
+//         own, optionally with O_DIRECT and batched `fdatasync' calls.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+#ifndef SKA_FLUSH_H
+#define SKA_FLUSH_H
+
+#include "kdu_elementary.h"
+#include "kdu_compressed.h"
+#include "ska_threads.h"
+
+// Bytes staged in each buffer before it is handed to the writer thread
+#define SKA_FLUSH_BUFFER (4<<20)
+// Alignment of the buffers, and of their lengths and offsets, for O_DIRECT
+#define SKA_FLUSH_ALIGN 4096
+// Default limit on the bytes staged and not yet written
+#define SKA_FLUSH_WINDOW (256<<20)
+
+struct ska_flush_buffer;
+
+/*****************************************************************************/
+/*                            class ska_flush_target                         */
+/*****************************************************************************/
+
+class ska_flush_target : public kdu_compressed_target {
+  /* Used in place of `kdu_simple_file_target', or as the target beneath a
+   * `jp2_family_tgt', so that whichever thread drives
+   * `kdu_codestream::flush' only copies the codestream into memory. Bytes
+   * are staged in `SKA_FLUSH_BUFFER' byte buffers; each is queued for the
+   * writer thread (the one thread of an `ska_io_queue') as soon as it
+   * fills, and written with `pwrite' at its own offset, so the buffers of
+   * the file are always aligned. The caller only waits if `max_bytes' are
+   * staged and still to be written, i.e. if the disk cannot keep up at
+   * all.
+   *    `start_rewrite' and `end_rewrite' work as for
+   * `kdu_simple_file_target', so TLM marker segments and box lengths can
+   * still be filled in. Bytes rewritten within the buffer being filled are
+   * simply overwritten there; earlier ones are queued as small patches,
+   * which the writer thread writes after the buffer holding them, since it
+   * writes everything in the order it was queued.
+   *    With `direct_io', full buffers are written through a second
+   * descriptor opened with O_DIRECT (F_NOCACHE on OS X), so that gigabytes
+   * of output do not push everything else out of the page cache; patches go
+   * through the ordinary descriptor. The last buffer is padded to
+   * `SKA_FLUSH_ALIGN' bytes and the file truncated to its length on `close'.
+   * If the file system refuses O_DIRECT, the file is written as usual and
+   * `uses_direct_io' returns false. With `sync_bytes' > 0, the writer
+   * thread calls `fdatasync' each time that many bytes have been written
+   * since the last call, and `close' calls it once more, so dirty pages are
+   * retired in large batches by the writer rather than throttling the
+   * coding threads. */
+  public: // Member functions
+    ska_flush_target();
+    ~ska_flush_target() { close(); }
+    bool open(const char *fname, bool direct_io=false, kdu_long sync_bytes=0,
+              kdu_long max_bytes=SKA_FLUSH_WINDOW,
+              bool return_on_failure=false);
+    /* Creates (or truncates) the file. Generates an error if the file
+     * cannot be created, unless `return_on_failure' is true, in which case
+     * we return false. */
+    bool exists() { return (fd >= 0); }
+    bool uses_direct_io() { return (direct_fd >= 0); }
+    int get_stalls() { return stalls; }
+    /* Number of times `write' had to wait for the writer thread, because
+     * `max_bytes' were still to be written. */
+  public: // kdu_compressed_target functions
+    bool write(const kdu_byte *buf, int num_bytes);
+    bool start_rewrite(kdu_long backtrack);
+    bool end_rewrite();
+    bool close();
+    /* Writes whatever remains staged and waits for the writer thread.
+     * Generates an error if any write failed. */
+  private: // Helper functions
+    void hand_off();
+    /* Queues `cur' for the writer thread and replaces it with an empty
+     * buffer which follows it in the file. */
+    void queue_patch(const kdu_byte *buf, int num_bytes, kdu_long offset);
+    void queue(ska_flush_buffer *job);
+    void check_error();
+    static int do_write(void *context, ska_io_job *job);
+    static void write_done(void *context, ska_io_job *job);
+    /* Frees patches and returns buffers to `free_buffers'. */
+  private: // Data
+    int fd;
+    int direct_fd; // -1 unless full buffers are written with O_DIRECT
+    char *fname;
+    kdu_long sync_bytes; // 0 if the writer thread never calls `fdatasync'
+    kdu_long max_bytes; // Limit on the full-size buffers allocated
+    kdu_long cur_pos, end_pos;
+    kdu_long restore_pos; // -ve if not in a rewrite
+    ska_flush_buffer *cur; // Being filled; holds bytes from `cur->offset'
+    int num_buffers; // Full-size buffers allocated
+    int stalls;
+    ska_flush_buffer *free_buffers; // Guarded by the mutex of `writer'
+    kdu_long unsynced; // Written since the last `fdatasync'; writer only
+    ska_io_queue writer;
+};
+
+#endif
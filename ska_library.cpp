@@ -0,0 +1,1084 @@
+/*****************************************************************************/
+//
+//  @file: ska_library.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Implements the libskuareview interface declared in skuareview.h,
+//         driving Kakadu's stripe compressor and decompressor directly with
+//         the caller's buffers.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <limits.h>
+#include <new>
+// Core includes
+#include "kdu_messaging.h"
+#include "kdu_params.h"
+#include "kdu_compressed.h"
+#include "kdu_sample_processing.h"
+#include "kdu_stripe_compressor.h"
+#include "kdu_stripe_decompressor.h"
+// Application includes
+#include "kdu_file_io.h"
+#include "jp2.h"
+#include "jpx.h"
+// SKA includes
+#include "ska_local.h"
+#include "skuareview.h"
+
+#define SKA_ERROR_LENGTH 1024
+// Stripe heights asked of Kakadu; the stripes are never copied, so these
+// only bound the work done between calls to the caller's row function
+#define SKA_MIN_STRIPE_HEIGHT 8
+#define SKA_MAX_STRIPE_HEIGHT 1024
+// Rows requested at a time while scanning a cube for its range
+#define SKA_SCAN_ROWS 64
+
+/* ========================================================================= */
+/*                              Error handling                               */
+/* ========================================================================= */
+
+class ska_error_handler : public kdu_thread_safe_message {
+  /* Keeps the text of the last error and throws, so that a library call
+   * fails rather than ending the process. */
+  public: // Member functions
+    ska_error_handler() { length = 0; text[0] = '\0'; }
+    void start_message()
+      { kdu_thread_safe_message::start_message(); length = 0; }
+    void put_text(const char *string)
+      {
+        int n = (int) strlen(string);
+        if ((length == 0) && (n >= 2) && !strcmp(string+n-2,":\n"))
+          return; // Kakadu's lead-in, e.g. "Kakadu Error:\n"
+        for (; (*string != '\0') && (length < SKA_ERROR_LENGTH-1); string++)
+          text[length++] = (*string == '\n')?' ':*string;
+        text[length] = '\0';
+      }
+    void flush(bool end_of_message=false)
+      {
+        kdu_thread_safe_message::flush(end_of_message);
+        if (end_of_message)
+          throw KDU_ERROR_EXCEPTION;
+      }
+    void get_text(char *buf) const
+      { strcpy(buf,text); }
+  private: // Data
+    int length;
+    char text[SKA_ERROR_LENGTH];
+};
+
+static ska_error_handler error_handler;
+
+/*****************************************************************************/
+/*                                 ska_env                                   */
+/*****************************************************************************/
+
+struct ska_env {
+  public: // Member functions
+    ska_env() { num_threads = 0; error[0] = '\0'; }
+    void start_threads();
+    /* Creates the thread group, if there is to be one. */
+    kdu_thread_env *get_threads()
+      { return (threads.exists())?(&threads):NULL; }
+    void begin() { mutex.lock(); error[0] = '\0'; }
+    void end() { mutex.unlock(); }
+    void fail(kdu_exception exc);
+    /* Keeps the error message and abandons the work of the threads, which
+     * must be done before any codestream they were working on is destroyed.
+     * The thread group is created afresh once those are gone, in
+     * `end_failed'. */
+    void fail(const char *message);
+    void end_failed();
+    /* Use in place of `end' after `fail'. */
+  public: // Data
+    int num_threads;
+    kdu_thread_env threads; // Only exists if `num_threads' > 0
+    kdu_mutex mutex; // Serializes the calls made with the environment
+    char error[SKA_ERROR_LENGTH];
+};
+
+/*****************************************************************************/
+/*                           ska_env::start_threads                          */
+/*****************************************************************************/
+
+void
+  ska_env::start_threads()
+{
+  if (num_threads <= 0)
+    return;
+  threads.create();
+  for (int nt=1; nt < num_threads; nt++)
+    if (!threads.add_thread())
+      break; // Make do with the threads we have
+}
+
+/*****************************************************************************/
+/*                               ska_env::fail                               */
+/*****************************************************************************/
+
+void
+  ska_env::fail(kdu_exception exc)
+{
+  if (exc == KDU_MEMORY_EXCEPTION)
+    strcpy(error,"Out of memory.");
+  else
+    error_handler.get_text(error);
+  if (threads.exists())
+    threads.handle_exception(exc);
+}
+
+void
+  ska_env::fail(const char *message)
+{
+  strncpy(error,message,SKA_ERROR_LENGTH-1);
+  error[SKA_ERROR_LENGTH-1] = '\0';
+  if (threads.exists())
+    threads.handle_exception(KDU_MEMORY_EXCEPTION);
+}
+
+/*****************************************************************************/
+/*                            ska_env::end_failed                            */
+/*****************************************************************************/
+
+void
+  ska_env::end_failed()
+{
+  if (threads.exists())
+    { threads.destroy(); start_threads(); }
+  mutex.unlock();
+}
+
+/* ========================================================================= */
+/*                         In-memory sources and targets                     */
+/* ========================================================================= */
+
+class ska_memory_target : public kdu_compressed_target {
+  /* Grows a buffer (allocated with `malloc', so that the caller can release
+   * it with `ska_free') to hold everything written to it. Box headers are
+   * rewritten once their lengths are known, as in a file. */
+  public: // Member functions
+    ska_memory_target()
+      { buf = NULL; size = max_size = pos = 0; rewriting = false; }
+    ~ska_memory_target() { free(buf); }
+    kdu_byte *detach(size_t &length)
+      { kdu_byte *result = buf; length = (size_t) size;
+        buf = NULL; size = max_size = pos = 0; return result; }
+    int get_capabilities() { return KDU_TARGET_CAP_SEQUENTIAL; }
+    bool write(const kdu_byte *data, int num_bytes)
+      {
+        if (pos + num_bytes > max_size)
+          {
+            kdu_long new_size = max_size + (max_size >> 1) + num_bytes + 4096;
+            kdu_byte *new_buf = (kdu_byte *) realloc(buf,(size_t) new_size);
+            if (new_buf == NULL)
+              return false;
+            buf = new_buf;
+            max_size = new_size;
+          }
+        memcpy(buf+pos,data,(size_t) num_bytes);
+        pos += num_bytes;
+        if (pos > size)
+          size = pos;
+        return true;
+      }
+    bool start_rewrite(kdu_long backtrack)
+      {
+        if (rewriting || (backtrack < 0) || (backtrack > pos))
+          return false;
+        pos -= backtrack;
+        rewriting = true;
+        return true;
+      }
+    bool end_rewrite()
+      {
+        if (!rewriting)
+          return false;
+        pos = size;
+        rewriting = false;
+        return true;
+      }
+  private: // Data
+    kdu_byte *buf;
+    kdu_long size, max_size, pos;
+    bool rewriting;
+};
+
+class ska_memory_source : public kdu_compressed_source {
+  /* Reads a JP2 family file held in the caller's memory.  Being an
+   * in-memory source, its codestreams are parsed in place, without copying. */
+  public: // Member functions
+    ska_memory_source(const void *data, size_t length)
+      { buf = (const kdu_byte *) data; size = (kdu_long) length; pos = 0; }
+    int get_capabilities()
+      { return KDU_SOURCE_CAP_SEQUENTIAL | KDU_SOURCE_CAP_SEEKABLE |
+          KDU_SOURCE_CAP_IN_MEMORY; }
+    kdu_byte *access_memory(kdu_long &pos, kdu_byte * &lim)
+      { // Kakadu only reads through the pointers
+        pos = this->pos;
+        lim = (kdu_byte *)(buf + size);
+        return (kdu_byte *)(buf + this->pos);
+      }
+    int read(kdu_byte *data, int num_bytes)
+      {
+        if (num_bytes > size - pos)
+          num_bytes = (int)(size - pos);
+        memcpy(data,buf+pos,(size_t) num_bytes);
+        pos += num_bytes;
+        return num_bytes;
+      }
+    bool seek(kdu_long offset)
+      { pos = (offset < 0)?0:((offset > size)?size:offset); return true; }
+    kdu_long get_pos() { return pos; }
+  private: // Data
+    const kdu_byte *buf;
+    kdu_long size, pos;
+};
+
+/* ========================================================================= */
+/*                             Internal Functions                            */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/* STATIC                         check_layout                               */
+/*****************************************************************************/
+
+static void
+  check_layout(const ska_layout &in, ska_layout &out)
+  /* Copies `in' to `out', filling in gaps of 0, and checks that the gaps
+   * can be handed to Kakadu, which takes them as `int's. */
+{
+  out = in;
+  if ((out.type != SKA_SAMPLES_FLOAT32) && (out.type != SKA_SAMPLES_INT32))
+    { kdu_error e; e << "Unknown sample type."; }
+  if ((out.width <= 0) || (out.height <= 0) || (out.depth <= 0))
+    { kdu_error e; e << "A cube must have at least one sample; "
+      << out.width << " x " << out.height << " x " << out.depth
+      << " was given."; }
+  if (out.sample_gap == 0)
+    out.sample_gap = 1;
+  if (out.row_gap == 0)
+    out.row_gap = out.sample_gap * out.width;
+  if (out.plane_gap == 0)
+    out.plane_gap = out.row_gap * out.height;
+  if ((out.sample_gap < 0) || (out.row_gap < 0) || (out.plane_gap < 0))
+    { kdu_error e; e << "The gaps between samples, rows and planes must be "
+      "positive."; }
+  if ((out.sample_gap > INT_MAX) || (out.row_gap > INT_MAX))
+    { kdu_error e; e << "The gaps between samples and between rows may not "
+      "exceed " << INT_MAX << " samples."; }
+}
+
+/*****************************************************************************/
+/* STATIC                        power_of_two_range                          */
+/*****************************************************************************/
+
+static int
+  power_of_two_range(double minval, double maxval, bool integers)
+  /* Returns the smallest P for which -2^{P-1} to 2^{P-1} covers the range
+   * (-2^{P-1} to 2^{P-1}-1 for integers). */
+{
+  if (integers)
+    {
+      int p = 1;
+      while ((p < 32) && ((minval < -ldexp(1.0,p-1)) ||
+                          (maxval > ldexp(1.0,p-1)-1.0)))
+        p++;
+      return p;
+    }
+  double maxabs = (-minval > maxval)?-minval:maxval;
+  if (!(maxabs > 0.0))
+    return 0;
+  int e;
+  double m = frexp(maxabs,&e); // maxabs = m * 2^e, with 0.5 <= m < 1
+  int p = (m == 0.5)?e:(e+1);
+  return (p < -63)?-63:((p > 64)?64:p);
+}
+
+/*****************************************************************************/
+/* STATIC                          scan_range                                */
+/*****************************************************************************/
+
+static void
+  scan_range(ska_rows_fn rows, void *context, const ska_layout &layout,
+             double &minval, double &maxval)
+{
+  float fmin = 0.0F, fmax = 0.0F;
+  kdu_int32 imin = 0, imax = 0;
+  bool first = true;
+  for (int z=0; z < layout.depth; z++)
+    for (int y=0; y < layout.height; y+=SKA_SCAN_ROWS)
+      {
+        int num_rows = layout.height - y;
+        num_rows = (num_rows < SKA_SCAN_ROWS)?num_rows:SKA_SCAN_ROWS;
+        ptrdiff_t row_gap = 0;
+        const void *base = rows(context,z,y,num_rows,&row_gap);
+        if (base == NULL)
+          { kdu_error e; e << "Encoding abandoned while reading plane "
+            << z << "."; }
+        for (int r=0; r < num_rows; r++)
+          {
+            if (layout.type == SKA_SAMPLES_FLOAT32)
+              {
+                const float *sp = ((const float *) base) + r*row_gap;
+                if (first)
+                  { fmin = fmax = *sp; first = false; }
+                for (int x=0; x < layout.width; x++, sp+=layout.sample_gap)
+                  {
+                    float v = *sp;
+                    if (v != v)
+                      { kdu_error e; e << "Plane " << z << " holds blank "
+                        "(NaN) samples, which must be replaced before the "
+                        "cube is encoded."; }
+                    fmin = (v < fmin)?v:fmin;
+                    fmax = (v > fmax)?v:fmax;
+                  }
+              }
+            else
+              {
+                const kdu_int32 *sp = ((const kdu_int32 *) base) + r*row_gap;
+                if (first)
+                  { imin = imax = *sp; first = false; }
+                for (int x=0; x < layout.width; x++, sp+=layout.sample_gap)
+                  {
+                    kdu_int32 v = *sp;
+                    imin = (v < imin)?v:imin;
+                    imax = (v > imax)?v:imax;
+                  }
+              }
+          }
+      }
+  if (layout.type == SKA_SAMPLES_FLOAT32)
+    { minval = fmin; maxval = fmax; }
+  else
+    { minval = imin; maxval = imax; }
+}
+
+/*****************************************************************************/
+/* STATIC                         parse_kakadu                               */
+/*****************************************************************************/
+
+static void
+  parse_kakadu(kdu_params *params, const char *args, bool must_parse)
+  /* Parses each of the space separated `args' into `params'. If
+   * `must_parse', every one of them must be recognized. */
+{
+  if (args == NULL)
+    return;
+  char *copy = new char[strlen(args)+1];
+  strcpy(copy,args);
+  char *tok = strtok(copy," \t\n");
+  for (; tok != NULL; tok = strtok(NULL," \t\n"))
+    if (!params->parse_string(tok) && must_parse)
+      {
+        char bad[256];
+        strncpy(bad,tok,255); bad[255] = '\0';
+        delete[] copy;
+        { kdu_error e; e << "Unrecognized Kakadu parameter, \"" << bad
+          << "\"."; }
+      }
+  delete[] copy;
+}
+
+/*****************************************************************************/
+/* STATIC                          encode_cube                               */
+/*****************************************************************************/
+
+static void
+  encode_cube(ska_env *env, ska_rows_fn rows, void *context,
+              const ska_layout &layout, const ska_encode_params &params,
+              jp2_family_tgt &tgt, kdu_codestream &codestream)
+  /* Writes the cube as a JPX file, with a single codestream, to `tgt'. The
+   * codestream is left for the caller to destroy, since that must wait for
+   * `ska_env::fail' if something goes wrong. */
+{
+  bool integers = (layout.type == SKA_SAMPLES_INT32);
+  double minval = params.min, maxval = params.max;
+  if (!(minval < maxval))
+    scan_range(rows,context,layout,minval,maxval);
+  int range_precision = power_of_two_range(minval,maxval,integers);
+  double half_range = ldexp(1.0,range_precision-1);
+
+  // Float samples get the same bit depth as they do from skuareview-encode;
+  // integers are coded at the bit depth they need
+  int c, num_components = layout.depth;
+  siz_params siz;
+  for (c=0; c < num_components; c++)
+    {
+      siz.set(Sdims,c,0,layout.height);
+      siz.set(Sdims,c,1,layout.width);
+      siz.set(Ssigned,c,0,true);
+      siz.set(Sprecision,c,0,(integers)?range_precision:32);
+    }
+  siz.set(Scomponents,0,0,num_components);
+  parse_kakadu(&siz,params.kakadu_args,false);
+  siz.finalize_all();
+
+  jpx_target jpx_out;
+  jpx_out.open(&tgt);
+  jpx_codestream_target jpx_stream = jpx_out.add_codestream();
+  codestream.create(&siz,jpx_stream.access_stream());
+  parse_kakadu(codestream.access_siz(),params.kakadu_args,true);
+  kdu_params *cod = codestream.access_siz()->access_cluster(COD_params);
+  if (params.num_layers > 0)
+    cod->set(Clayers,0,0,params.num_layers);
+  codestream.change_appearance(false,true,false);
+  codestream.access_siz()->finalize_all();
+  codestream.set_pass_prediction(params.pass_prediction);
+
+  jp2_dimensions dimensions = jpx_stream.access_dimensions();
+  dimensions.init(codestream.access_siz());
+  jpx_layer_target layer = jpx_out.add_layer();
+  jp2_colour colour = layer.add_colour();
+  colour.init(JP2_sLUM_SPACE);
+  jp2_channels channels = layer.access_channels();
+  channels.init(1);
+  channels.set_colour_mapping(0,0,-1,0);
+  jpx_out.write_headers();
+
+  // The metadata and normalization boxes are those skuareview-encode writes
+  ska_source_file meta;
+  if (params.header != NULL)
+    {
+      int length = (int) strlen(params.header);
+      meta.metadata_buffer = new kdu_byte[length+2];
+      memcpy(meta.metadata_buffer,params.header,(size_t) length);
+      if ((length > 0) && (params.header[length-1] != '\n'))
+        meta.metadata_buffer[length++] = '\n';
+      meta.metadata_buffer[length] = '\0';
+      meta.metadata_length = length;
+    }
+  meta.norm.set_global_range(-half_range,half_range);
+  meta.write_metadata(tgt);
+  jp2_output_box *box = jpx_stream.open_stream();
+
+  int num_layers = 0;
+  if (!(cod->get(Clayers,0,0,num_layers) && (num_layers > 0)))
+    num_layers = 1;
+  kdu_long *layer_sizes = new kdu_long[num_layers];
+  memset(layer_sizes,0,sizeof(kdu_long)*num_layers);
+  if (params.rate > 0.0)
+    layer_sizes[num_layers-1] = (kdu_long)
+      (((double) layout.width) * layout.height * layout.depth *
+       params.rate * 0.125);
+
+  int *heights = new int[num_components];
+  int *next_row = new int[num_components];
+  int *sample_gaps = new int[num_components];
+  int *row_gaps = new int[num_components];
+  int *precisions = new int[num_components];
+  void **bufs = new void *[num_components];
+  for (c=0; c < num_components; c++)
+    {
+      next_row[c] = 0;
+      sample_gaps[c] = (int) layout.sample_gap;
+      precisions[c] = range_precision;
+      bufs[c] = NULL;
+    }
+
+  kdu_stripe_compressor compressor;
+  compressor.start(codestream,num_layers,layer_sizes,NULL,0,false,false,
+                   true,0.0,num_components,false,env->get_threads());
+  bool more = true;
+  while (more)
+    {
+      compressor.get_recommended_stripe_heights(SKA_MIN_STRIPE_HEIGHT,
+                                                SKA_MAX_STRIPE_HEIGHT,
+                                                heights,NULL);
+      for (c=0; c < num_components; c++)
+        {
+          if (heights[c] == 0)
+            continue;
+          ptrdiff_t row_gap = 0;
+          bufs[c] = (void *) rows(context,c,next_row[c],heights[c],&row_gap);
+          if (bufs[c] == NULL)
+            { kdu_error e; e << "Encoding abandoned at row " << next_row[c]
+              << " of plane " << c << "."; }
+          if ((row_gap <= 0) || (row_gap > INT_MAX))
+            { kdu_error e; e << "Unusable gap between rows (" << (int) row_gap
+              << " samples) given for plane " << c << "."; }
+          row_gaps[c] = (int) row_gap;
+          next_row[c] += heights[c];
+        }
+      if (integers)
+        more = compressor.push_stripe((kdu_int32 **) bufs,heights,
+                                      sample_gaps,row_gaps,precisions);
+      else
+        more = compressor.push_stripe((float **) bufs,heights,sample_gaps,
+                                      row_gaps,precisions);
+    }
+  compressor.finish();
+  box->close();
+  jpx_out.close();
+
+  delete[] layer_sizes;
+  delete[] heights;
+  delete[] next_row;
+  delete[] sample_gaps;
+  delete[] row_gaps;
+  delete[] precisions;
+  delete[] bufs;
+}
+
+/*****************************************************************************/
+/* STATIC                           array_rows                               */
+/*****************************************************************************/
+
+struct ska_array {
+  const kdu_int32 *base; // Samples of either type are 4 bytes
+  ska_layout layout;
+};
+
+static const void *
+  array_rows(void *context, int plane, int first_row, int num_rows,
+             ptrdiff_t *row_gap)
+{
+  ska_array *array = (ska_array *) context;
+  *row_gap = array->layout.row_gap;
+  return array->base + plane*array->layout.plane_gap +
+    first_row*array->layout.row_gap;
+}
+
+/* ========================================================================= */
+/*                                ska_decoder                                */
+/* ========================================================================= */
+
+struct ska_decoder {
+  public: // Member functions
+    ska_decoder() { env = NULL; memory = NULL; width = height = depth = 0; }
+    ~ska_decoder()
+      { if (jpx_in.exists()) jpx_in.close();
+        if (src.exists()) src.close();
+        delete memory; }
+    void open();
+    /* Reads the layout and metadata of the cube, once `src' is open. */
+    void fit(ska_region &region);
+    void decode(const ska_region &region, kdu_byte *buffer,
+                const ska_layout &layout, kdu_codestream &codestream,
+                jpx_input_box &box);
+    /* Decodes the `region' (already fitted), one plane group after another.
+     * The codestream being decoded and its box are the caller's, to be
+     * cleaned up after `ska_env::fail' if something goes wrong. */
+  public: // Data
+    ska_env *env;
+    ska_memory_source *memory;
+    kdu_mapped_file_source mapped; // Files are read through a mapping
+    jp2_family_src src;
+    jpx_source jpx_in;
+    ska_dest_file meta; // Metadata and normalization of the cube
+    int width, height, depth; // Full resolution; planes of each parameter
+    int num_groups; // Plane groups (one per append, plus the first)
+};
+
+/*****************************************************************************/
+/*                              ska_decoder::open                            */
+/*****************************************************************************/
+
+void
+  ska_decoder::open()
+{
+  if (jpx_in.open(&src,true) <= 0)
+    { kdu_error e; e << "Not a JP2/JPX file."; }
+  meta.read_metadata(src);
+  int num_stokes = meta.norm.num_stokes, num_codestreams = 0;
+  jpx_in.count_codestreams(num_codestreams);
+  num_groups = num_codestreams / num_stokes;
+  if (num_groups < 1)
+    { kdu_error e; e << "The file holds " << num_codestreams << " "
+      "codestreams, but " << num_stokes << " Stokes parameters."; }
+  kdu_coords size = jpx_in.access_codestream(0).access_dimensions().
+    get_size();
+  width = size.x;
+  height = size.y;
+  depth = 0;
+  for (int g=0; g < num_groups; g++)
+    depth += jpx_in.access_codestream(g*num_stokes).access_dimensions().
+      get_num_components();
+}
+
+/*****************************************************************************/
+/*                              ska_decoder::fit                             */
+/*****************************************************************************/
+
+void
+  ska_decoder::fit(ska_region &region)
+{
+  if ((region.discard_levels < 0) || (region.discard_levels > 32))
+    { kdu_error e; e << "Cannot discard " << region.discard_levels
+      << " resolution levels."; }
+  int scale = 1 << region.discard_levels;
+  int w = (width + scale - 1) / scale, h = (height + scale - 1) / scale;
+  if (region.stokes < 0)
+    region.stokes = meta.norm.first_stokes;
+  if ((region.stokes < meta.norm.first_stokes) ||
+      (region.stokes >= meta.norm.first_stokes + meta.norm.num_stokes))
+    { kdu_error e; e << "Stokes parameter " << region.stokes << " was not "
+      "encoded; the cube holds Stokes parameters " << meta.norm.first_stokes
+      << " to " << meta.norm.first_stokes+meta.norm.num_stokes-1 << "."; }
+  if ((region.x < 0) || (region.y < 0) || (region.first_plane < 0) ||
+      (region.width < 0) || (region.height < 0) || (region.num_planes < 0))
+    { kdu_error e; e << "Regions may not have negative positions or "
+      "sizes."; }
+  if ((region.width == 0) || (region.width > w - region.x))
+    region.width = w - region.x;
+  if ((region.height == 0) || (region.height > h - region.y))
+    region.height = h - region.y;
+  if ((region.num_planes == 0) ||
+      (region.num_planes > depth - region.first_plane))
+    region.num_planes = depth - region.first_plane;
+  if ((region.width <= 0) || (region.height <= 0) ||
+      (region.num_planes <= 0))
+    { kdu_error e; e << "The region lies outside the " << w << " x " << h
+      << " x " << depth << " cube."; }
+}
+
+/*****************************************************************************/
+/*                             ska_decoder::decode                           */
+/*****************************************************************************/
+
+void
+  ska_decoder::decode(const ska_region &region, kdu_byte *buffer,
+                      const ska_layout &layout, kdu_codestream &codestream,
+                      jpx_input_box &box)
+{
+  // A cube normalized over -2^{P-1} to 2^{P-1} (as `ska_encode_array' does)
+  // is Kakadu's own nominal range at precision P, so the samples can be
+  // written out as they are; any other normalization is undone in place
+  const ska_normalizer &norm = meta.norm;
+  bool integers = (layout.type == SKA_SAMPLES_INT32);
+  bool direct = false;
+  int range_precision = 0;
+  if ((norm.mode == SKA_NORM_GLOBAL) && (norm.domain == SKA_DOMAIN_LINEAR) &&
+      (norm.minvals[0] == -norm.maxvals[0]) && (norm.maxvals[0] > 0.0))
+    {
+      int e;
+      double m = frexp(norm.maxvals[0] - norm.minvals[0],&e);
+      range_precision = e - 1;
+      direct = (m == 0.5) &&
+        ((!integers) || ((range_precision >= 1) && (range_precision <= 32)));
+    }
+
+  int stokes_idx = region.stokes - norm.first_stokes;
+  int remaining_skip = region.first_plane, remaining = region.num_planes;
+  int out_plane = 0; // Of the region
+  for (int g=0; (g < num_groups) && (remaining > 0); g++)
+    {
+      jpx_codestream_source stream =
+        jpx_in.access_codestream(g*norm.num_stokes+stokes_idx);
+      int comps = stream.access_dimensions().get_num_components();
+      int skip = (remaining_skip < comps)?remaining_skip:comps;
+      remaining_skip -= skip;
+      comps -= skip;
+      comps = (remaining < comps)?remaining:comps;
+      remaining -= comps;
+      if (comps == 0)
+        continue;
+
+      // Codestream rows are flipped, so the region is mapped before the
+      // appearance is changed to put them back into FITS order
+      stream.open_stream(&box);
+      codestream.create(&box,env->get_threads());
+      codestream.apply_input_restrictions(skip,comps,region.discard_levels,
+                                          region.max_layers,NULL,
+                                          KDU_WANT_OUTPUT_COMPONENTS);
+      kdu_dims dims, mapped;
+      codestream.get_dims(0,dims,true);
+      kdu_dims wanted;
+      wanted.pos.x = dims.pos.x + region.x;
+      wanted.pos.y = dims.pos.y + dims.size.y - region.y - region.height;
+      wanted.size.x = region.width;
+      wanted.size.y = region.height;
+      codestream.map_region(0,wanted,mapped,true);
+      codestream.apply_input_restrictions(skip,comps,region.discard_levels,
+                                          region.max_layers,&mapped,
+                                          KDU_WANT_OUTPUT_COMPONENTS);
+      codestream.change_appearance(false,true,false);
+      codestream.get_dims(0,dims,true);
+      if ((dims.size.x != region.width) || (dims.size.y != region.height))
+        { kdu_error e; e << "Decoded region is " << dims.size.x << " x "
+          << dims.size.y << " rather than " << region.width << " x "
+          << region.height << "."; }
+
+      int c, *heights = new int[comps];
+      int *next_row = new int[comps];
+      int *sample_gaps = new int[comps];
+      int *row_gaps = new int[comps];
+      int *precisions = new int[comps];
+      void **bufs = new void *[comps];
+      for (c=0; c < comps; c++)
+        {
+          next_row[c] = 0;
+          sample_gaps[c] = (int) layout.sample_gap;
+          row_gaps[c] = (int) layout.row_gap;
+          precisions[c] = range_precision;
+        }
+      kdu_stripe_decompressor decompressor;
+      decompressor.start(codestream,false,false,env->get_threads());
+      bool more = true;
+      while (more)
+        {
+          decompressor.get_recommended_stripe_heights(SKA_MIN_STRIPE_HEIGHT,
+                                                      SKA_MAX_STRIPE_HEIGHT,
+                                                      heights,NULL);
+          for (c=0; c < comps; c++)
+            bufs[c] = buffer + 4 * ((out_plane+c)*layout.plane_gap +
+                                    next_row[c]*layout.row_gap);
+          if (direct && integers)
+            more = decompressor.pull_stripe((kdu_int32 **) bufs,heights,
+                                            sample_gaps,row_gaps,precisions);
+          else
+            more = decompressor.pull_stripe((float **) bufs,heights,
+                                            sample_gaps,row_gaps,
+                                            (direct)?precisions:NULL);
+          for (c=0; (c < comps) && !direct; c++)
+            {
+              int plane = norm.get_plane(region.stokes,
+                                         region.first_plane+out_plane+c);
+              for (int r=0; r < heights[c]; r++)
+                {
+                  float *row = ((float *) bufs[c]) + r*layout.row_gap;
+                  if (layout.sample_gap == 1)
+                    norm.renormalize(row,region.width,plane);
+                  else
+                    for (int x=0; x < region.width; x++)
+                      norm.renormalize(row+x*layout.sample_gap,1,plane);
+                  for (int x=0; (x < region.width) && integers; x++)
+                    { // Rounded into the same four bytes
+                      float *sp = row + x*layout.sample_gap;
+                      double v = floor(*sp + 0.5);
+                      kdu_int32 ival = (v >= 2147483647.0)?INT_MAX:
+                        ((v <= -2147483648.0)?INT_MIN:(kdu_int32) v);
+                      memcpy(sp,&ival,4);
+                    }
+                }
+            }
+          for (c=0; c < comps; c++)
+            next_row[c] += heights[c];
+        }
+      decompressor.finish();
+      codestream.destroy();
+      box.close();
+      out_plane += comps;
+      delete[] heights;
+      delete[] next_row;
+      delete[] sample_gaps;
+      delete[] row_gaps;
+      delete[] precisions;
+      delete[] bufs;
+    }
+}
+
+/* ========================================================================= */
+/*                             External Functions                            */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/* EXTERN                         ska_env_create                             */
+/*****************************************************************************/
+
+ska_env *
+  ska_env_create(int num_threads)
+{
+  kdu_customize_errors(&error_handler);
+  ska_env *env = new(std::nothrow) ska_env;
+  if (env == NULL)
+    return NULL;
+  env->num_threads = (num_threads < 0)?kdu_get_num_processors():num_threads;
+  if (!env->mutex.create())
+    { delete env; return NULL; }
+  env->start_threads();
+  return env;
+}
+
+/*****************************************************************************/
+/* EXTERN                        ska_env_destroy                             */
+/*****************************************************************************/
+
+void
+  ska_env_destroy(ska_env *env)
+{
+  if (env == NULL)
+    return;
+  if (env->threads.exists())
+    env->threads.destroy();
+  env->mutex.destroy();
+  delete env;
+}
+
+/*****************************************************************************/
+/* EXTERN                       ska_env_get_error                            */
+/*****************************************************************************/
+
+const char *
+  ska_env_get_error(ska_env *env)
+{
+  return env->error;
+}
+
+/*****************************************************************************/
+/* EXTERN                      ska_encode_defaults                           */
+/*****************************************************************************/
+
+void
+  ska_encode_defaults(ska_encode_params *params)
+{
+  params->rate = 0.0;
+  params->num_layers = 0;
+  params->min = params->max = 0.0;
+  params->pass_prediction = -1;
+  params->kakadu_args = NULL;
+  params->header = NULL;
+}
+
+/*****************************************************************************/
+/* EXTERN                       ska_encode_planes                            */
+/*****************************************************************************/
+
+int
+  ska_encode_planes(ska_env *env, ska_rows_fn rows, void *context,
+                    const ska_layout *layout, const ska_encode_params *params,
+                    const char *fname, void **data, size_t *length)
+{
+  env->begin();
+  ska_memory_target memory;
+  jp2_family_tgt tgt;
+  kdu_codestream codestream;
+  try {
+    ska_layout checked;
+    check_layout(*layout,checked);
+    if ((fname == NULL) && ((data == NULL) || (length == NULL)))
+      { kdu_error e; e << "Neither a file nor a memory target was given."; }
+    if (fname != NULL)
+      tgt.open(fname);
+    else
+      tgt.open(&memory);
+    encode_cube(env,rows,context,checked,*params,tgt,codestream);
+    codestream.destroy();
+    tgt.close();
+  }
+  catch (kdu_exception exc) {
+    env->fail(exc);
+  }
+  catch (std::bad_alloc &) {
+    env->fail("Out of memory.");
+  }
+  if (env->error[0] == '\0')
+    {
+      if (fname == NULL)
+        *data = memory.detach(*length);
+      env->end();
+      return SKA_OK;
+    }
+  if (codestream.exists())
+    codestream.destroy();
+  if (tgt.exists())
+    tgt.close();
+  if (fname != NULL)
+    remove(fname); // Rather than leave part of a cube behind
+  env->end_failed();
+  return SKA_FAILED;
+}
+
+/*****************************************************************************/
+/* EXTERN                        ska_encode_array                            */
+/*****************************************************************************/
+
+int
+  ska_encode_array(ska_env *env, const void *cube, const ska_layout *layout,
+                   const ska_encode_params *params, const char *fname,
+                   void **data, size_t *length)
+{
+  ska_array array;
+  array.base = (const kdu_int32 *) cube;
+  array.layout = *layout;
+  try {
+    check_layout(*layout,array.layout);
+  }
+  catch (kdu_exception exc) {
+    env->begin(); env->fail(exc); env->end_failed();
+    return SKA_FAILED;
+  }
+  return ska_encode_planes(env,array_rows,&array,&array.layout,params,fname,
+                           data,length);
+}
+
+/*****************************************************************************/
+/* EXTERN                            ska_free                                */
+/*****************************************************************************/
+
+void
+  ska_free(void *data)
+{
+  free(data);
+}
+
+/*****************************************************************************/
+/* STATIC                          open_decoder                              */
+/*****************************************************************************/
+
+static ska_decoder *
+  open_decoder(ska_env *env, const char *fname, const void *data,
+               size_t length)
+{
+  env->begin();
+  ska_decoder *dec = new ska_decoder;
+  dec->env = env;
+  try {
+    if (fname != NULL)
+      { // Mapped files are parsed in place, reading only the pages touched
+        // by the regions decoded; fall back to stdio if mapping fails
+        if (dec->mapped.open(fname,true))
+          {
+            dec->mapped.set_access_pattern(false);
+            dec->src.open(&dec->mapped);
+          }
+        else
+          dec->src.open(fname);
+      }
+    else
+      {
+        dec->memory = new ska_memory_source(data,length);
+        dec->src.open(dec->memory);
+      }
+    dec->open();
+  }
+  catch (kdu_exception exc) {
+    env->fail(exc);
+  }
+  catch (std::bad_alloc &) {
+    env->fail("Out of memory.");
+  }
+  if (env->error[0] == '\0')
+    { env->end(); return dec; }
+  delete dec;
+  env->end_failed();
+  return NULL;
+}
+
+/*****************************************************************************/
+/* EXTERN                     ska_decoder_open_file                          */
+/*****************************************************************************/
+
+ska_decoder *
+  ska_decoder_open_file(ska_env *env, const char *fname)
+{
+  return open_decoder(env,fname,NULL,0);
+}
+
+/*****************************************************************************/
+/* EXTERN                    ska_decoder_open_memory                         */
+/*****************************************************************************/
+
+ska_decoder *
+  ska_decoder_open_memory(ska_env *env, const void *data, size_t length)
+{
+  return open_decoder(env,NULL,data,length);
+}
+
+/*****************************************************************************/
+/* EXTERN                       ska_decoder_close                            */
+/*****************************************************************************/
+
+void
+  ska_decoder_close(ska_decoder *dec)
+{
+  delete dec;
+}
+
+/*****************************************************************************/
+/* EXTERN                      ska_decoder_get_size                          */
+/*****************************************************************************/
+
+int
+  ska_decoder_get_size(ska_decoder *dec, int *width, int *height, int *depth,
+                       int *first_stokes, int *num_stokes)
+{
+  if (width != NULL) *width = dec->width;
+  if (height != NULL) *height = dec->height;
+  if (depth != NULL) *depth = dec->depth;
+  if (first_stokes != NULL) *first_stokes = dec->meta.norm.first_stokes;
+  if (num_stokes != NULL) *num_stokes = dec->meta.norm.num_stokes;
+  return SKA_OK;
+}
+
+/*****************************************************************************/
+/* EXTERN                     ska_decoder_get_header                         */
+/*****************************************************************************/
+
+const char *
+  ska_decoder_get_header(ska_decoder *dec)
+{
+  if ((dec->meta.metadata_buffer == NULL) || (dec->meta.metadata_length == 0))
+    return NULL;
+  return (const char *) dec->meta.metadata_buffer;
+}
+
+/*****************************************************************************/
+/* EXTERN                     ska_decoder_fit_region                         */
+/*****************************************************************************/
+
+int
+  ska_decoder_fit_region(ska_decoder *dec, ska_region *region)
+{
+  ska_env *env = dec->env;
+  env->begin();
+  try {
+    dec->fit(*region);
+  }
+  catch (kdu_exception exc) {
+    env->fail(exc);
+    env->end_failed();
+    return SKA_FAILED;
+  }
+  env->end();
+  return SKA_OK;
+}
+
+/*****************************************************************************/
+/* EXTERN                       ska_decode_region                            */
+/*****************************************************************************/
+
+int
+  ska_decode_region(ska_decoder *dec, const ska_region *region, void *buffer,
+                    const ska_layout *layout)
+{
+  ska_env *env = dec->env;
+  env->begin();
+  kdu_codestream codestream;
+  jpx_input_box box;
+  try {
+    ska_region fitted = *region;
+    dec->fit(fitted);
+    ska_layout sized = *layout, checked;
+    sized.width = (sized.width == 0)?fitted.width:sized.width;
+    sized.height = (sized.height == 0)?fitted.height:sized.height;
+    sized.depth = (sized.depth == 0)?fitted.num_planes:sized.depth;
+    if ((sized.width != fitted.width) || (sized.height != fitted.height) ||
+        (sized.depth != fitted.num_planes))
+      { kdu_error e; e << "The buffer is " << sized.width << " x "
+        << sized.height << " x " << sized.depth << ", but the region is "
+        << fitted.width << " x " << fitted.height << " x "
+        << fitted.num_planes << "."; }
+    check_layout(sized,checked);
+    dec->decode(fitted,(kdu_byte *) buffer,checked,codestream,box);
+  }
+  catch (kdu_exception exc) {
+    env->fail(exc);
+  }
+  catch (std::bad_alloc &) {
+    env->fail("Out of memory.");
+  }
+  if (env->error[0] == '\0')
+    { env->end(); return SKA_OK; }
+  if (codestream.exists())
+    codestream.destroy();
+  box.close();
+  env->end_failed();
+  return SKA_FAILED;
+}
@@ -4,9 +4,12 @@
 #include <fstream>
 #include "kdu_args.h"
 #include "jp2.h"
+#include "ska_normalize.h"
 //testing includes
 #include <iostream>
 
+// Sample range assumed for JPX files written before the normalization
+// parameters were recorded, when they carry no DATAMIN/DATAMAX either.
 #define SAMPLES_MIN -.006383
 #define SAMPLES_MAX 0.105909
 
@@ -25,8 +28,11 @@ struct cropping {
   int height;
   int width;
   int depth; // TODO: currently not being used
+  int stokes; // First Stokes parameter (4th axis) selected
+  int num_stokes; // Stokes parameters selected; 0 means all from `stokes'
 };
 
+class kdu_thread_env;
 class ska_source_file;
 class ska_source_file_base;
 class ska_dest_file;
@@ -49,6 +55,11 @@ class ska_source_file_base {
         ska_source_file* const source_file) = 0;
     virtual void read_stripe(int height, float *buf, 
         ska_source_file* const source_file, int component) = 0;
+    /* Same as read_stripe, except the samples are returned exactly as they
+     * appear in the file: they are not normalized and blank samples are
+     * left as NaNs. Used to compare decoded images with their originals. */
+    virtual void read_raw_stripe(int height, float *buf,
+        ska_source_file* const source_file, int component) = 0;
 };
 
 class ska_source_file {
@@ -59,12 +70,22 @@ class ska_source_file {
     ska_source_file() {
       fname=NULL;
       fp=NULL;
+      in=NULL;
       bytes_per_sample=1;
       precision=8;
       is_signed=false;
       reversible=false;
+      metadata_buffer=NULL;
+      metadata_length=0;
+      crop.specified=false;
+      crop.stokes=0;
+      crop.num_stokes=0;
       float_minvals = -0.5;
       float_maxvals = 0.5;
+      range_known=false;
+      raw_access=false;
+      env=NULL;
+      block_height=0;
     }
     ~ska_source_file() {
       if (fname != NULL) delete[] fname;
@@ -73,7 +94,11 @@ class ska_source_file {
       delete[] metadata_buffer;
     }
     void read_header(jp2_family_tgt &tgt, kdu_args &args);
+    /* Components are numbered over all of the selected Stokes parameters:
+     * plane `p' of the `s'th one is component `s'*`crop.depth'+`p'. All
+     * components must be read at the same rows before moving on. */
     void read_stripe(int height, float *buf, int component);
+    void read_raw_stripe(int height, float *buf, int component);
     void write_metadata(jp2_family_tgt &tgt);
   private: // Private functions
     /* Parses generic arguments used by the SKA encoder */
@@ -96,6 +121,13 @@ class ska_source_file {
     int* offset;
     cropping crop;
     double float_minvals, float_maxvals;
+    bool range_known; // True if `float_minvals'/`float_maxvals' were given
+    bool raw_access; // If true, only `read_raw_stripe' will be used, so
+                     // `read_header' does not set up `norm'
+    ska_normalizer norm; // Set up by `read_header'; used by `read_stripe'
+    kdu_thread_env *env; // If non-NULL, readers may share out their work
+    int block_height; // Rows of the file's chunks or tiles, if it has any;
+                      // stripes which end on them are read most efficiently
     int num_unread_rows;
 };
 
@@ -126,19 +158,42 @@ class ska_dest_file {
     ska_dest_file() {
       fname=NULL;
       fp=NULL;
+      out=NULL;
       bytes_per_sample=1;
       precision=8;
       is_signed=false;
       next=NULL;
       reversible=false;
+      renormalize=true;
+      metadata_buffer=NULL;
+      metadata_length=0;
+      crop.stokes=-1;
+      crop.num_stokes=1;
+      crop.x=crop.y=crop.z=0;
+      discard_levels=0;
     }
     ~ska_dest_file() {
       if (fname != NULL) delete[] fname;
       if (fp != NULL) fclose(fp);
       delete out;
+      delete[] metadata_buffer;
     }
+    /* If `fname' is NULL, no file is written; the header is still read so
+     * that stripes can be renormalized, e.g. for quality benchmarking. */
     void write_header(jp2_family_src &src, kdu_args &args);
+    /* Returns the index of the codestream holding Stokes parameter
+     * `crop.stokes' (the first one encoded, if it is -1, in which case
+     * `crop.stokes' is set), so that only that codestream need be opened. */
+    int select_stokes(jp2_family_src &src);
+    /* Renormalizes `buf' in place (unless `renormalize' is false) and then
+     * writes it to the file, if there is one. */
     void write_stripe(int height, float *buf, int component);
+    /* Reads the SKA metadata box written by ska_source_file::write_metadata,
+     * if there is one, into `metadata_buffer' and sets up `norm' from the
+     * normalization parameters box (or, for older files, from DATAMIN and
+     * DATAMAX). If planes have been appended to the file, there is one of
+     * each box for every append; the last ones describe the whole cube. */
+    void read_metadata(jp2_family_src &src);
   private: // Private functions
     /* Parses generic arguments used by the SKA encoder */
     void parse_ska_args(jp2_family_src &src, kdu_args &args);
@@ -154,9 +209,16 @@ class ska_dest_file {
     bool is_signed;
 
     int* dimensions; // JP2 image dimensions
-    cropping crop; // cropping specified of the JP2 dimensions
+    cropping crop; // cropping specified of the JP2 dimensions; `x' and `y'
+                   // (rows counted from the first FITS row) and `z' are in
+                   // pixels at the decoded resolution
+    int discard_levels; // Resolution levels discarded by the decoder
     double samples_min, samples_max; // min/max values of all samples
+    ska_normalizer norm; // How the encoder normalized each plane
     bool reversible; // reversible compression
+    bool renormalize; // false if stripes already hold sample values
+    kdu_byte* metadata_buffer; // Records from the SKA box, '\n' separated
+    int metadata_length;
 
     //TODO
     /* While multiple files can be accepted as arguments, currently the
@@ -0,0 +1,546 @@
+/*****************************************************************************/
+//
+//  @file: ska_normalize.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Implements `ska_normalizer', declared in ska_normalize.h
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+// Core includes
+#include "kdu_messaging.h"
+// SKA includes
+#include "ska_local.h"
+#include "ska_normalize.h"
+#include "ska_stats.h"
+
+// Default stretches; the same as the usual display stretches for images
+#define SKA_NORM_LOG_STRETCH 1000.0
+#define SKA_NORM_ASINH_STRETCH 0.1
+// Scaled samples are limited to this magnitude before a nonlinear curve
+#define SKA_NORM_MAX_T 1.0e6F
+
+static kdu_byte ska_norm_uuid[16] = {0x8A,0x51,0x3C,0x72,
+                                     0x1F,0x6D,0x11,0xE6,
+                                     0x9B,0x2A,0x08,0x00,
+                                     0x20,0x0C,0x9A,0x66};
+
+static const char *mode_names[] = { "global", "plane", "percentile" };
+static const char *domain_names[] = { "linear", "log", "sqrt", "asinh" };
+
+/*****************************************************************************/
+/* STATIC                         domain_curve                               */
+/*****************************************************************************/
+
+static inline float
+  domain_curve(float t, ska_norm_domain domain, float a, float gain)
+  /* Applies the curve of `domain' to `t' >= 0. `gain' is the reciprocal of
+   * the curve at t = 1. */
+{
+  if (domain == SKA_DOMAIN_LOG)
+    return logf(1.0F + a*t) * gain;
+  else if (domain == SKA_DOMAIN_SQRT)
+    return sqrtf(t);
+  else // SKA_DOMAIN_ASINH
+    return asinhf(t*a) * gain; // `a' is passed as 1/stretch here
+}
+
+#if defined(__SSE2__)
+/*****************************************************************************/
+/* STATIC                           sse2_log                                 */
+/*****************************************************************************/
+
+static inline __m128
+  sse2_log(__m128 x)
+  /* Natural logarithm of positive, normal `x'. The mantissa is reduced to
+   * [sqrt(1/2),sqrt(2)), where log(m) = 2*atanh(s), s = (m-1)/(m+1), and the
+   * series for atanh converges to float precision within five terms. */
+{
+  const __m128 one = _mm_set1_ps(1.0F);
+  __m128i bits = _mm_castps_si128(x);
+  __m128i e = _mm_sub_epi32(_mm_srli_epi32(bits,23),_mm_set1_epi32(127));
+  __m128 m = _mm_castsi128_ps(_mm_or_si128(
+        _mm_and_si128(bits,_mm_set1_epi32(0x007FFFFF)),
+        _mm_set1_epi32(0x3F800000))); // In [1,2)
+  __m128 big = _mm_cmpgt_ps(m,_mm_set1_ps(1.41421356F));
+  m = _mm_or_ps(_mm_andnot_ps(big,m),
+      _mm_and_ps(big,_mm_mul_ps(m,_mm_set1_ps(0.5F))));
+  e = _mm_sub_epi32(e,_mm_castps_si128(big)); // `big' lanes are -1
+  __m128 s = _mm_div_ps(_mm_sub_ps(m,one),_mm_add_ps(m,one));
+  __m128 s2 = _mm_mul_ps(s,s);
+  __m128 poly = _mm_add_ps(_mm_set1_ps(1.0F/7.0F),
+      _mm_mul_ps(s2,_mm_set1_ps(1.0F/9.0F)));
+  poly = _mm_add_ps(_mm_set1_ps(1.0F/5.0F),_mm_mul_ps(s2,poly));
+  poly = _mm_add_ps(_mm_set1_ps(1.0F/3.0F),_mm_mul_ps(s2,poly));
+  poly = _mm_add_ps(one,_mm_mul_ps(s2,poly));
+  __m128 log_m = _mm_mul_ps(_mm_add_ps(s,s),poly);
+  // log(2) is split in two, so that large exponents lose no precision
+  __m128 fe = _mm_cvtepi32_ps(e);
+  return _mm_add_ps(_mm_add_ps(_mm_mul_ps(fe,_mm_set1_ps(0.693359375F)),
+        _mm_mul_ps(fe,_mm_set1_ps(-2.12194440e-4F))),log_m);
+}
+
+/*****************************************************************************/
+/* STATIC                        sse2_domain_curve                           */
+/*****************************************************************************/
+
+static inline __m128
+  sse2_domain_curve(__m128 t, ska_norm_domain domain, float a, float gain)
+  /* Vector version of `domain_curve'. */
+{
+  const __m128 one = _mm_set1_ps(1.0F);
+  if (domain == SKA_DOMAIN_LOG)
+    return _mm_mul_ps(sse2_log(_mm_add_ps(one,_mm_mul_ps(t,_mm_set1_ps(a)))),
+        _mm_set1_ps(gain));
+  else if (domain == SKA_DOMAIN_SQRT)
+    return _mm_sqrt_ps(t);
+  // asinh(u) = log(u + sqrt(u*u + 1)) for u >= 0
+  __m128 u = _mm_mul_ps(t,_mm_set1_ps(a));
+  u = _mm_add_ps(u,_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(u,u),one)));
+  return _mm_mul_ps(sse2_log(u),_mm_set1_ps(gain));
+}
+#endif // __SSE2__
+
+/*****************************************************************************/
+/*                        ska_normalizer::ska_normalizer                     */
+/*****************************************************************************/
+
+ska_normalizer::ska_normalizer()
+{
+  mode = SKA_NORM_GLOBAL;
+  domain = SKA_DOMAIN_LINEAR;
+  clip_low = 0.01;
+  clip_high = 99.99;
+  stretch = 0.0;
+  num_planes = 0;
+  first_stokes = 0;
+  num_stokes = 1;
+  minvals = maxvals = NULL;
+  stats_fname = NULL;
+  set_global_range(-0.5,0.5);
+}
+
+/*****************************************************************************/
+/*                       ska_normalizer::~ska_normalizer                     */
+/*****************************************************************************/
+
+ska_normalizer::~ska_normalizer()
+{
+  delete[] minvals;
+  delete[] maxvals;
+  delete[] stats_fname;
+}
+
+/*****************************************************************************/
+/*                          ska_normalizer::allocate                         */
+/*****************************************************************************/
+
+void
+  ska_normalizer::allocate(int planes)
+{
+  delete[] minvals;
+  delete[] maxvals;
+  num_planes = planes;
+  minvals = new double[planes];
+  maxvals = new double[planes];
+}
+
+/*****************************************************************************/
+/*                         ska_normalizer::parse_args                        */
+/*****************************************************************************/
+
+void
+  ska_normalizer::parse_args(kdu_args &args)
+{
+  const char *string;
+  if (args.find("-norm") != NULL) {
+    if ((string = args.advance()) == NULL)
+      { kdu_error e; e << "\"-norm\" argument requires one of \"global\", "
+        "\"plane\" or \"percentile\"."; }
+    if (strcmp(string,"global") == 0)
+      mode = SKA_NORM_GLOBAL;
+    else if (strcmp(string,"plane") == 0)
+      mode = SKA_NORM_PLANE;
+    else if (strcmp(string,"percentile") == 0)
+      mode = SKA_NORM_PERCENTILE;
+    else
+      { kdu_error e; e << "Unrecognized normalization mode, \"" << string
+        << "\", supplied with \"-norm\".  Expected one of \"global\", "
+        "\"plane\" or \"percentile\"."; }
+    args.advance();
+  }
+  if (args.find("-norm_clip") != NULL) {
+    if (((string = args.advance()) == NULL) ||
+        (sscanf(string,"{%lf,%lf}",&clip_low,&clip_high) != 2) ||
+        (clip_low < 0.0) || (clip_high > 100.0) || (clip_low >= clip_high))
+      { kdu_error e; e << "\"-norm_clip\" argument requires two "
+        "percentiles, enclosed by curly braces, with 0 <= low < high <= 100. "
+        "Example: -norm_clip {0.1,99.9}"; }
+    args.advance();
+  }
+  if (args.find("-norm_domain") != NULL) {
+    int d = 0;
+    if ((string = args.advance()) != NULL)
+      for (; d < 4; d++)
+        if (strcmp(string,domain_names[d]) == 0)
+          break;
+    if ((string == NULL) || (d == 4))
+      { kdu_error e; e << "\"-norm_domain\" argument requires one of "
+        "\"linear\", \"log\", \"sqrt\" or \"asinh\"."; }
+    domain = (ska_norm_domain) d;
+    args.advance();
+  }
+  if (args.find("-norm_stretch") != NULL) {
+    if (((string = args.advance()) == NULL) ||
+        (sscanf(string,"%lf",&stretch) != 1) || (stretch <= 0.0))
+      { kdu_error e; e << "\"-norm_stretch\" argument requires a positive "
+        "number."; }
+    args.advance();
+  }
+  if (stretch <= 0.0)
+    stretch = (domain == SKA_DOMAIN_ASINH)?SKA_NORM_ASINH_STRETCH:
+      SKA_NORM_LOG_STRETCH;
+  if (args.find("-stats") != NULL) {
+    if ((string = args.advance()) == NULL)
+      { kdu_error e; e << "\"-stats\" argument requires the name of a file "
+        "written by skuareview-stats."; }
+    delete[] stats_fname;
+    stats_fname = new char[strlen(string)+1];
+    strcpy(stats_fname,string);
+    args.advance();
+  }
+}
+
+/*****************************************************************************/
+/*                      ska_normalizer::set_global_range                     */
+/*****************************************************************************/
+
+void
+  ska_normalizer::set_global_range(double minval, double maxval)
+{
+  mode = SKA_NORM_GLOBAL;
+  allocate(1);
+  minvals[0] = minval;
+  maxvals[0] = maxval;
+}
+
+/*****************************************************************************/
+/*                           ska_normalizer::measure                         */
+/*****************************************************************************/
+
+void
+  ska_normalizer::measure(ska_source_file &cube)
+{
+  ska_cube_stats stats;
+  if (stats_fname != NULL)
+    stats.read(stats_fname);
+  else {
+    // Open the cube a second time, with exactly the same cropping
+    static char prog_name[] = "skuareview-scan";
+    char *no_argv[1] = { prog_name };
+    kdu_args no_args(1,no_argv);
+    jp2_family_tgt no_tgt;
+    ska_source_file scan;
+    scan.raw_access = true;
+    scan.env = cube.env;
+    scan.fname = new char[strlen(cube.fname)+1];
+    strcpy(scan.fname,cube.fname);
+    scan.crop = cube.crop;
+    scan.crop.specified = true;
+    scan.read_header(no_tgt,no_args);
+    std::cout << "Scanning " << cube.crop.depth * cube.crop.num_stokes
+              << " planes for normalization..." << std::endl;
+    double clip[2] = { clip_low, clip_high };
+    if (mode == SKA_NORM_PERCENTILE)
+      stats.set_percentiles(clip,2);
+    stats.gather(scan);
+  }
+
+  // The statistics may cover more planes (and Stokes parameters) than we
+  // are encoding, but must have been gathered over the same region of them
+  if ((stats.x != cube.crop.x) || (stats.y != cube.crop.y) ||
+      (stats.width != cube.crop.width) || (stats.height != cube.crop.height) ||
+      (stats.z > cube.crop.z) ||
+      (stats.z + stats.depth < cube.crop.z + cube.crop.depth) ||
+      (stats.first_stokes > cube.crop.stokes) ||
+      (stats.first_stokes + stats.num_stokes <
+       cube.crop.stokes + cube.crop.num_stokes))
+    { kdu_error e; e << "The statistics in \"" << stats_fname << "\" are "
+      "not of the cube being encoded; run skuareview-stats with the same "
+      "\"-icrop\" (and \"-stokes\") arguments."; }
+  int c, depth = cube.crop.depth * cube.crop.num_stokes;
+  allocate(depth);
+  for (c=0; c < depth; c++) {
+    int s = cube.crop.stokes + c / cube.crop.depth - stats.first_stokes;
+    int p = s * stats.depth + cube.crop.z + c % cube.crop.depth - stats.z;
+    const ska_plane_stats &plane = stats.planes[p];
+    if (plane.num_samples == 0) // Entirely blank plane
+      minvals[c] = maxvals[c] = 0.0;
+    else if (mode != SKA_NORM_PERCENTILE)
+      { minvals[c] = plane.minval; maxvals[c] = plane.maxval; }
+    else if (!stats.get_percentile(p,clip_low,minvals[c]) ||
+             !stats.get_percentile(p,clip_high,maxvals[c]))
+      { kdu_error e; e << "The statistics in \"" << stats_fname << "\" do "
+        "not include the " << clip_low << " and " << clip_high
+        << " percentiles; run skuareview-stats with \"-percentiles\" "
+        "including them."; }
+  }
+
+  if (mode == SKA_NORM_GLOBAL) {
+    double mn, mx;
+    get_range(mn,mx);
+    set_global_range(mn,mx);
+  }
+}
+
+/*****************************************************************************/
+/*                          ska_normalizer::normalize                        */
+/*****************************************************************************/
+
+void
+  ska_normalizer::normalize(float *buf, int num, int plane) const
+{
+  int p = (plane < num_planes)?plane:(num_planes-1);
+  double range = maxvals[p] - minvals[p];
+  float minval = (float) minvals[p];
+  float scale = (range > 0.0)?((float)(1.0/range)):1.0F;
+  const float offset = -0.5F, limmin = -0.75F, limmax = 0.75F;
+  int i = 0;
+  if (domain == SKA_DOMAIN_LINEAR) {
+    for (; i < num; i++) {
+      float v = buf[i];
+      v = (v == v)?v:minval; // Blank samples go to the bottom of the range
+      float fval = (v - minval) * scale + offset;
+      fval = (fval > limmin)?fval:limmin;
+      fval = (fval < limmax)?fval:limmax;
+      buf[i] = fval;
+    }
+    return;
+  }
+
+  // The curve is applied to |t| and the sign put back afterwards
+  float a = (float) stretch, gain = 1.0F;
+  if (domain == SKA_DOMAIN_LOG)
+    gain = (float)(1.0 / log(1.0 + stretch));
+  else if (domain == SKA_DOMAIN_ASINH)
+    { a = (float)(1.0 / stretch); gain = (float)(1.0 / asinh(1.0/stretch)); }
+#if defined(__SSE2__)
+  const __m128 vmin = _mm_set1_ps(minval), vscale = _mm_set1_ps(scale);
+  const __m128 sign_mask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+  const __m128 tmax = _mm_set1_ps(SKA_NORM_MAX_T);
+  for (; i <= num-4; i+=4) {
+    __m128 v = _mm_loadu_ps(buf+i);
+    __m128 defined = _mm_cmpord_ps(v,v);
+    v = _mm_or_ps(_mm_and_ps(defined,v),_mm_andnot_ps(defined,vmin));
+    __m128 t = _mm_mul_ps(_mm_sub_ps(v,vmin),vscale);
+    __m128 sign = _mm_and_ps(t,sign_mask);
+    t = _mm_min_ps(_mm_andnot_ps(sign_mask,t),tmax);
+    t = _mm_or_ps(sse2_domain_curve(t,domain,a,gain),sign);
+    t = _mm_add_ps(t,_mm_set1_ps(offset));
+    t = _mm_max_ps(t,_mm_set1_ps(limmin));
+    _mm_storeu_ps(buf+i,_mm_min_ps(t,_mm_set1_ps(limmax)));
+  }
+#endif // __SSE2__
+  for (; i < num; i++) {
+    float v = buf[i];
+    v = (v == v)?v:minval;
+    float t = (v - minval) * scale;
+    float mag = (t < 0.0F)?-t:t;
+    mag = (mag < SKA_NORM_MAX_T)?mag:SKA_NORM_MAX_T;
+    mag = domain_curve(mag,domain,a,gain);
+    float fval = ((t < 0.0F)?-mag:mag) + offset;
+    fval = (fval > limmin)?fval:limmin;
+    fval = (fval < limmax)?fval:limmax;
+    buf[i] = fval;
+  }
+}
+
+/*****************************************************************************/
+/*                         ska_normalizer::renormalize                       */
+/*****************************************************************************/
+
+void
+  ska_normalizer::renormalize(float *buf, int num, int plane) const
+{
+  int p = (plane < num_planes)?plane:(num_planes-1);
+  double minval = minvals[p], maxval = maxvals[p];
+  float range = (float)(maxval - minval), offset = (float) minval;
+
+  /* The images captured in radio astronomy have extremely dynamic range of
+   * values. As such a linear scaling will often result an over compressed
+   * image, because most of the data will end up being extremely close
+   * together. As such we use a log, sqrt or asinh domain to minimize the
+   * loss in precision; here the curve is inverted. */
+  float a = (float) stretch, span = 1.0F;
+  if (domain == SKA_DOMAIN_LOG)
+    span = (float) log(1.0 + stretch);
+  else if (domain == SKA_DOMAIN_ASINH)
+    span = (float) asinh(1.0/stretch);
+
+  float fmin = (float) minval, fmax = (float) maxval;
+  for (int i=0; i < num; i++) {
+    float t = buf[i] + 0.5F;
+    if (domain != SKA_DOMAIN_LINEAR) {
+      float mag = (t < 0.0F)?-t:t;
+      if (domain == SKA_DOMAIN_LOG)
+        mag = (expf(mag*span) - 1.0F) / a;
+      else if (domain == SKA_DOMAIN_SQRT)
+        mag = mag * mag;
+      else
+        mag = sinhf(mag*span) * a;
+      t = (t < 0.0F)?-mag:mag;
+    }
+    float fval = t * range + offset;
+    fval = (fval > fmin)?fval:fmin;
+    fval = (fval < fmax)?fval:fmax;
+    buf[i] = fval;
+  }
+}
+
+/*****************************************************************************/
+/*                           ska_normalizer::prepend                         */
+/*****************************************************************************/
+
+void
+  ska_normalizer::prepend(const ska_normalizer &earlier)
+{
+  if (mode == SKA_NORM_GLOBAL)
+    return;
+  int old_planes = earlier.num_planes / num_stokes;
+  int new_planes = num_planes / num_stokes;
+  double *old_minvals = minvals, *old_maxvals = maxvals;
+  minvals = maxvals = NULL;
+  allocate((old_planes + new_planes) * num_stokes);
+  double *min_dp = minvals, *max_dp = maxvals;
+  for (int s=0; s < num_stokes; s++) {
+    for (int p=0; p < old_planes; p++) {
+      *(min_dp++) = earlier.minvals[s*old_planes+p];
+      *(max_dp++) = earlier.maxvals[s*old_planes+p];
+    }
+    for (int p=0; p < new_planes; p++) {
+      *(min_dp++) = old_minvals[s*new_planes+p];
+      *(max_dp++) = old_maxvals[s*new_planes+p];
+    }
+  }
+  delete[] old_minvals;
+  delete[] old_maxvals;
+}
+
+/*****************************************************************************/
+/*                          ska_normalizer::get_range                        */
+/*****************************************************************************/
+
+void
+  ska_normalizer::get_range(double &minval, double &maxval) const
+{
+  minval = minvals[0];
+  maxval = maxvals[0];
+  for (int p=1; p < num_planes; p++) {
+    minval = (minvals[p] < minval)?minvals[p]:minval;
+    maxval = (maxvals[p] > maxval)?maxvals[p]:maxval;
+  }
+}
+
+/*****************************************************************************/
+/*                          ska_normalizer::write_box                        */
+/*****************************************************************************/
+
+void
+  ska_normalizer::write_box(jp2_family_tgt &tgt) const
+{
+  /* Plain text, one item per line; "%.17g" reproduces a double exactly.
+   *   SKANORM 3
+   *   mode <global|plane|percentile>
+   *   domain <linear|log|sqrt|asinh> <stretch>
+   *   clip <low> <high>
+   *   planes <n>
+   *   stokes <first> <count>
+   *   <min> <max>   (n lines) */
+  int max_length = 256 + num_planes * 52;
+  char *text = new char[max_length];
+  int length = sprintf(text,"SKANORM 3\nmode %s\ndomain %s %.17g\n"
+      "clip %.17g %.17g\nplanes %d\nstokes %d %d\n",mode_names[mode],
+      domain_names[domain],stretch,clip_low,clip_high,num_planes,
+      first_stokes,num_stokes);
+  for (int p=0; p < num_planes; p++)
+    length += sprintf(text+length,"%.17g %.17g\n",minvals[p],maxvals[p]);
+
+  jp2_output_box out;
+  out.open(&tgt,75756964,false,false); // uuid box
+  out.set_target_size((kdu_long)(16 + length));
+  if (!out.write(ska_norm_uuid,16) || !out.write((kdu_byte *) text,length))
+    { kdu_error e; e << "Unable to write normalization parameters to JPX "
+      "file."; }
+  if (!out.close())
+    { kdu_error e; e << "Could not flush box to header."; }
+  delete[] text;
+}
+
+/*****************************************************************************/
+/*                          ska_normalizer::read_box                         */
+/*****************************************************************************/
+
+bool
+  ska_normalizer::read_box(jp2_input_box &box)
+{
+  kdu_byte uuid[16];
+  int length = (int) box.get_remaining_bytes();
+  if ((length < 16) || (box.read(uuid,16) != 16) ||
+      (memcmp(uuid,ska_norm_uuid,16) != 0))
+    return false;
+  length -= 16;
+  char *text = new char[length+1];
+  length = box.read((kdu_byte *) text,length);
+  text[length] = '\0';
+
+  char mode_name[32], domain_name[32];
+  int version, planes, stokes, count, chars;
+  const char *cp = text;
+  // Version 1 (linear only) had no stretch after the domain
+  if ((sscanf(cp,"SKANORM %d mode %31s domain %31s%n",&version,mode_name,
+              domain_name,&chars) != 3) || (version < 1) || (version > 3))
+    { kdu_error e; e << "Malformed normalization parameters in JPX file."; }
+  cp += chars;
+  if ((version >= 2) && (sscanf(cp,"%lf%n",&stretch,&chars) == 1))
+    cp += chars;
+  if ((sscanf(cp," clip %lf %lf planes %d%n",&clip_low,&clip_high,&planes,
+              &chars) != 3) || (planes < 1))
+    { kdu_error e; e << "Malformed normalization parameters in JPX file."; }
+  cp += chars;
+  stokes = 0; count = 1; // Before version 3 only Stokes I was ever encoded
+  if (version >= 3) {
+    if ((sscanf(cp," stokes %d %d%n",&stokes,&count,&chars) != 2) ||
+        (stokes < 0) || (count < 1))
+      { kdu_error e; e << "Malformed normalization parameters in JPX file."; }
+    cp += chars;
+  }
+  first_stokes = stokes;
+  num_stokes = count;
+  for (int m=0; m < 3; m++)
+    if (strcmp(mode_name,mode_names[m]) == 0)
+      mode = (ska_norm_mode) m;
+  for (int d=0; d < 4; d++)
+    if (strcmp(domain_name,domain_names[d]) == 0)
+      domain = (ska_norm_domain) d;
+  if ((domain != SKA_DOMAIN_LINEAR) && (domain != SKA_DOMAIN_SQRT) &&
+      !(stretch > 0.0))
+    { kdu_error e; e << "Normalization parameters in JPX file have no "
+      "stretch for the \"" << domain_name << "\" domain."; }
+  allocate(planes);
+  for (int p=0; p < planes; p++, cp += chars)
+    if (sscanf(cp,"%lf %lf%n",minvals+p,maxvals+p,&chars) != 2)
+      { kdu_error e; e << "Normalization parameters in JPX file are "
+        "truncated."; }
+  delete[] text;
+  return true;
+}
@@ -0,0 +1,107 @@
+/*****************************************************************************/
+//
+//  @file: ska_normalize.h
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Maps the floating point samples of a cube into the nominal range
+//         (-0.5 to 0.5) expected by Kakadu and back again. The parameters
+//         used by the encoder are stored in the JPX file, so that the decoder
+//         can invert the mapping exactly.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+#ifndef SKA_NORMALIZE_H
+#define SKA_NORMALIZE_H
+
+#include "kdu_elementary.h"
+#include "kdu_args.h"
+#include "jp2.h"
+
+class ska_source_file;
+
+/**
+ * How the range mapped onto -0.5 to 0.5 is chosen.
+ */
+enum ska_norm_mode {
+  SKA_NORM_GLOBAL, // One range for the whole cube; DATAMIN/DATAMAX if known
+  SKA_NORM_PLANE, // Every plane is scaled by its own minimum and maximum
+  SKA_NORM_PERCENTILE // Every plane is clipped to percentiles of its samples
+};
+
+/**
+ * Curve applied to the scaled samples, t (0 at the bottom of the range and 1
+ * at the top), before they are handed to Kakadu. The nonlinear curves spend
+ * more of the nominal range on faint emission. With `a' the stretch:
+ *   LOG:   log(1 + a*t) / log(1 + a)
+ *   SQRT:  sqrt(t)
+ *   ASINH: asinh(t/a) / asinh(1/a)
+ * Each curve is mirrored for t < 0.
+ */
+enum ska_norm_domain {
+  SKA_DOMAIN_LINEAR, SKA_DOMAIN_LOG, SKA_DOMAIN_SQRT, SKA_DOMAIN_ASINH
+};
+
+/*****************************************************************************/
+/*                            class ska_normalizer                           */
+/*****************************************************************************/
+
+class ska_normalizer {
+  public: // Member functions
+    ska_normalizer();
+    ~ska_normalizer();
+    void parse_args(kdu_args &args);
+    /* Parses `-norm <global|plane|percentile>', `-norm_clip {<lo>,<hi>}'
+     * (the percentiles used by the percentile mode),
+     * `-norm_domain <linear|log|sqrt|asinh>', `-norm_stretch <a>' and
+     * `-stats <file>'. */
+    void set_global_range(double minval, double maxval);
+    /* Uses a single range for every plane. */
+    bool needs_scan(bool range_known) const
+      { return (mode != SKA_NORM_GLOBAL) || !range_known; }
+    void measure(ska_source_file &cube);
+    /* Reads the whole of `cube' once (through a second reader, so the
+     * caller's reader is left untouched) and sets the ranges required by
+     * `mode'. Blank (NaN) samples are ignored. If `-stats' was given, the
+     * ranges are taken from the file written by skuareview-stats instead,
+     * without reading the cube. */
+    void normalize(float *buf, int num, int plane) const;
+    /* Maps samples of `plane' (relative to the encoded cube) into the
+     * nominal range. Blank samples are set to the bottom of the range. The
+     * nonlinear domains use SSE2 where available (a polynomial logarithm,
+     * accurate to about 1e-7); the scalar path calls the C library. */
+    void renormalize(float *buf, int num, int plane) const;
+    /* Inverse of `normalize'; results are clipped to the plane's range. */
+    int get_plane(int stokes, int plane) const
+      { return (stokes - first_stokes) * (num_planes / num_stokes) + plane; }
+    /* Index used by `normalize' and `renormalize' for `plane' (relative to
+     * the encoded cube) of Stokes parameter `stokes'; planes are numbered
+     * one Stokes parameter after another. */
+    void prepend(const ska_normalizer &earlier);
+    /* Adds the planes of `earlier', the normalization of the cube to which
+     * our planes are being appended, ahead of our own, so that the planes of
+     * each Stokes parameter follow on from its planes in `earlier'. Both
+     * must use the same mode and Stokes parameters; in the global mode the
+     * range is left alone. */
+    void get_range(double &minval, double &maxval) const;
+    /* Smallest minimum and largest maximum over all planes. */
+    void write_box(jp2_family_tgt &tgt) const;
+    /* Writes the parameters to a uuid box of their own. */
+    bool read_box(jp2_input_box &box);
+    /* Returns false, leaving the object untouched, if `box' (an open uuid
+     * box) was not written by `write_box'. */
+  private: // Helper functions
+    void allocate(int planes);
+  public: // Data
+    ska_norm_mode mode;
+    ska_norm_domain domain;
+    double clip_low, clip_high; // Percentiles used by SKA_NORM_PERCENTILE
+    double stretch; // `a' in the LOG and ASINH curves
+    int num_planes; // 1 for SKA_NORM_GLOBAL
+    int first_stokes, num_stokes; // Stokes parameters (4th axis) encoded
+    double *minvals, *maxvals; // One entry per plane
+    char *stats_fname; // Output of skuareview-stats, or NULL
+};
+
+#endif
@@ -0,0 +1,591 @@
+/*****************************************************************************/
+//
+//  @file: ska_prefetch.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Reads the precincts announced by Kakadu's
+//         `kdu_compressed_source::prefetch' ahead of the decoder. See
+//         `ska_prefetch_source' in ska_prefetch.h.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#if defined(__linux__) && defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    define SKA_IO_URING
+#  endif
+#endif
+#ifdef SKA_IO_URING
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <linux/io_uring.h>
+#endif
+// Core includes
+#include "kdu_messaging.h"
+// SKA includes
+#include "ska_prefetch.h"
+
+// Segments in flight at once through the io_uring
+#define SKA_URING_ENTRIES 64
+// Queued segments which trigger a submission from `prefetch' itself
+#define SKA_PREFETCH_BATCH 32
+
+#define SKA_SEGMENT_QUEUED 0 // Waiting for room in the window
+#define SKA_SEGMENT_IN_FLIGHT 1
+#define SKA_SEGMENT_READY 2
+
+struct ska_prefetch_segment : public ska_io_job {
+  kdu_long start, lim; // File offsets
+  kdu_byte *buf; // NULL until the segment is submitted
+  int valid_bytes; // Bytes actually read, once `SKA_SEGMENT_READY'
+  int state;
+  kdu_long delivered; // Bytes passed to `read'; some may be counted twice
+  struct iovec iov; // Describes `buf' to the io_uring
+  ska_prefetch_segment *next; // In the submission queue
+};
+
+/* ========================================================================= */
+/*                                ska_uring                                  */
+/* ========================================================================= */
+
+#ifdef SKA_IO_URING
+
+/* We talk to the kernel directly, rather than through liburing, so there is
+ * nothing more to install. Reads are issued as IORING_OP_READV, which every
+ * kernel with io_uring (5.1 and later) supports. */
+struct ska_uring {
+  int fd;
+  unsigned num_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_bytes, cq_ring_bytes, sqes_bytes;
+  unsigned unsubmitted; // Entries in the ring not yet taken by the kernel
+};
+
+/*****************************************************************************/
+/* STATIC                         destroy_uring                              */
+/*****************************************************************************/
+
+static void
+  destroy_uring(ska_uring *ring)
+{
+  if (ring->sqes != NULL)
+    munmap(ring->sqes,ring->sqes_bytes);
+  if ((ring->cq_ring != NULL) && (ring->cq_ring != ring->sq_ring))
+    munmap(ring->cq_ring,ring->cq_ring_bytes);
+  if (ring->sq_ring != NULL)
+    munmap(ring->sq_ring,ring->sq_ring_bytes);
+  if (ring->fd >= 0)
+    ::close(ring->fd);
+  delete ring;
+}
+
+/*****************************************************************************/
+/* STATIC                         create_uring                               */
+/*****************************************************************************/
+
+static ska_uring *
+  create_uring(unsigned entries)
+  /* Returns NULL if the kernel will not give us a ring. */
+{
+  struct io_uring_params params;
+  memset(&params,0,sizeof(params));
+  int ring_fd = (int) syscall(__NR_io_uring_setup,entries,&params);
+  if (ring_fd < 0)
+    return NULL; // ENOSYS before 5.1; EPERM where seccomp forbids it
+  ska_uring *ring = new ska_uring;
+  memset(ring,0,sizeof(ska_uring));
+  ring->fd = ring_fd;
+  ring->num_entries = params.sq_entries;
+  ring->sq_ring_bytes = params.sq_off.array +
+    params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_bytes = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap && (ring->cq_ring_bytes > ring->sq_ring_bytes))
+    ring->sq_ring_bytes = ring->cq_ring_bytes;
+  void *ptr = mmap(NULL,ring->sq_ring_bytes,PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQ_RING);
+  if (ptr == MAP_FAILED)
+    { destroy_uring(ring); return NULL; }
+  ring->sq_ring = ptr;
+  if (single_mmap)
+    ring->cq_ring = ring->sq_ring;
+  else
+    {
+      ptr = mmap(NULL,ring->cq_ring_bytes,PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_CQ_RING);
+      if (ptr == MAP_FAILED)
+        { destroy_uring(ring); return NULL; }
+      ring->cq_ring = ptr;
+    }
+  ring->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+  ptr = mmap(NULL,ring->sqes_bytes,PROT_READ|PROT_WRITE,
+             MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQES);
+  if (ptr == MAP_FAILED)
+    { destroy_uring(ring); return NULL; }
+  ring->sqes = (struct io_uring_sqe *) ptr;
+
+  kdu_byte *sq = (kdu_byte *) ring->sq_ring;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  kdu_byte *cq = (kdu_byte *) ring->cq_ring;
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return ring;
+}
+
+/*****************************************************************************/
+/* STATIC                          push_read                                 */
+/*****************************************************************************/
+
+static void
+  push_read(ska_uring *ring, int fd, ska_prefetch_segment *seg)
+  /* The caller makes sure there is room: we never have more than
+   * `num_entries' segments in flight. */
+{
+  unsigned tail = *(ring->sq_tail);
+  unsigned idx = tail & *(ring->sq_mask);
+  struct io_uring_sqe *sqe = ring->sqes + idx;
+  memset(sqe,0,sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->off = (__u64) seg->start;
+  sqe->addr = (__u64)(size_t) &(seg->iov);
+  sqe->len = 1;
+  sqe->user_data = (__u64)(size_t) seg;
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail,tail+1,__ATOMIC_RELEASE);
+  ring->unsubmitted++;
+}
+
+/*****************************************************************************/
+/* STATIC                          enter_uring                               */
+/*****************************************************************************/
+
+static void
+  enter_uring(ska_uring *ring, bool wait)
+  /* Submits whatever has been pushed and, if `wait', blocks until at least
+   * one read completes. */
+{
+  unsigned flags = (wait)?IORING_ENTER_GETEVENTS:0;
+  if ((ring->unsubmitted == 0) && !wait)
+    return;
+  int result = (int) syscall(__NR_io_uring_enter,ring->fd,ring->unsubmitted,
+                             (wait)?1:0,flags,NULL,0);
+  if (result > 0)
+    ring->unsubmitted -= ((unsigned) result > ring->unsubmitted)?
+      ring->unsubmitted:(unsigned) result;
+}
+
+/*****************************************************************************/
+/* STATIC                          reap_uring                                */
+/*****************************************************************************/
+
+static int
+  reap_uring(ska_uring *ring)
+  /* Marks the segments of all completed reads as ready and returns the
+   * number of them. */
+{
+  int count = 0;
+  unsigned head = *(ring->cq_head);
+  while (head != __atomic_load_n(ring->cq_tail,__ATOMIC_ACQUIRE))
+    {
+      struct io_uring_cqe *cqe = ring->cqes + (head & *(ring->cq_mask));
+      ska_prefetch_segment *seg =
+        (ska_prefetch_segment *)(size_t) cqe->user_data;
+      seg->valid_bytes = (cqe->res > 0)?cqe->res:0; // Failures get re-read
+      seg->state = SKA_SEGMENT_READY;
+      head++;  count++;
+    }
+  __atomic_store_n(ring->cq_head,head,__ATOMIC_RELEASE);
+  return count;
+}
+
+#else // !SKA_IO_URING
+
+struct ska_uring { unsigned num_entries; };
+static ska_uring *create_uring(unsigned entries) { return NULL; }
+static void destroy_uring(ska_uring *ring) { delete ring; }
+static void push_read(ska_uring *ring, int fd, ska_prefetch_segment *seg) {}
+static void enter_uring(ska_uring *ring, bool wait) {}
+static int reap_uring(ska_uring *ring) { return 0; }
+
+#endif // !SKA_IO_URING
+
+/* ========================================================================= */
+/*                           ska_prefetch_source                             */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                 ska_prefetch_source::ska_prefetch_source                  */
+/*****************************************************************************/
+
+ska_prefetch_source::ska_prefetch_source()
+{
+  fd = -1;
+  pos = 0;
+  first_queued = last_queued = NULL;
+  num_queued_since_submit = 0;
+  window = SKA_PREFETCH_WINDOW;
+  held_bytes = prefetched_bytes = 0;
+  num_in_flight = 0;
+  read_buf = NULL;
+  read_buf_pos = 0;
+  read_buf_bytes = 0;
+  ring = NULL;
+  num_threads = 0;
+}
+
+/*****************************************************************************/
+/*                        ska_prefetch_source::open                          */
+/*****************************************************************************/
+
+bool
+  ska_prefetch_source::open(const char *fname, bool return_on_failure,
+                            int num_threads, kdu_long window)
+{
+  close();
+  fd = ::open(fname,O_RDONLY);
+  if (fd < 0)
+    {
+      if (return_on_failure)
+        return false;
+      kdu_error e; e << "Unable to open compressed data file, \"" << fname
+        << "\": " << strerror(errno) << ".";
+    }
+  pos = 0;
+  this->window = (window < SKA_PREFETCH_MAX_MERGE)?
+    SKA_PREFETCH_MAX_MERGE:window;
+  held_bytes = prefetched_bytes = 0;
+  read_buf = new kdu_byte[SKA_PREFETCH_READ_BUF];
+  read_buf_pos = read_buf_bytes = 0;
+  if ((ring = create_uring(SKA_URING_ENTRIES)) != NULL)
+    { // We only need the mutex of `readers'
+      readers.start(0,do_read,read_done,this);
+      return true;
+    }
+
+  // No io_uring; read with a pool of threads instead
+  if (num_threads < 1)
+    num_threads = 1;
+  this->num_threads = readers.start(num_threads,do_read,read_done,this);
+  return true; // With no threads at all, we just never prefetch
+}
+
+/*****************************************************************************/
+/*                        ska_prefetch_source::close                         */
+/*****************************************************************************/
+
+bool
+  ska_prefetch_source::close()
+{
+  if (fd < 0)
+    return true;
+  if (ring != NULL)
+    { // The kernel writes into the segments until their reads complete
+      while (num_in_flight > 0)
+        {
+          enter_uring(ring,true);
+          num_in_flight -= reap_uring(ring);
+        }
+      destroy_uring(ring);
+      ring = NULL;
+    }
+  readers.stop(true); // Segments not yet being read are left unread
+  num_threads = 0;
+  while (!segments.empty())
+    release(segments.begin()->second);
+  first_queued = last_queued = NULL;
+  delete[] read_buf;
+  read_buf = NULL;
+  ::close(fd);
+  fd = -1;
+  return true;
+}
+
+/*****************************************************************************/
+/*                      ska_prefetch_source::prefetch                        */
+/*****************************************************************************/
+
+void
+  ska_prefetch_source::prefetch(kdu_long offset, kdu_long length)
+{
+  if ((fd < 0) || (length <= 0) || ((ring == NULL) && (num_threads == 0)))
+    return;
+  kdu_long lim = offset + length;
+  readers.lock();
+  std::map<kdu_long,ska_prefetch_segment *>::iterator it =
+    segments.lower_bound(lim);
+  if ((it != segments.begin()) && ((--it)->second->lim > offset))
+    { readers.unlock(); return; } // Already have (some of) these bytes
+
+  if ((last_queued != NULL) && (last_queued->lim == offset) &&
+      ((lim - last_queued->start) <= SKA_PREFETCH_MAX_MERGE))
+    last_queued->lim = lim; // Next precinct in the codestream
+  else
+    {
+      ska_prefetch_segment *seg = new ska_prefetch_segment;
+      seg->start = offset;  seg->lim = lim;
+      seg->buf = NULL;
+      seg->valid_bytes = 0;
+      seg->state = SKA_SEGMENT_QUEUED;
+      seg->delivered = 0;
+      seg->next = NULL;
+      segments[offset] = seg;
+      if (last_queued == NULL)
+        first_queued = seg;
+      else
+        last_queued->next = seg;
+      last_queued = seg;
+      if (++num_queued_since_submit > SKA_PREFETCH_BATCH)
+        submit();
+    }
+  readers.unlock();
+}
+
+/*****************************************************************************/
+/*                        ska_prefetch_source::seek                          */
+/*****************************************************************************/
+
+bool
+  ska_prefetch_source::seek(kdu_long offset)
+{
+  if (fd < 0)
+    return false;
+  pos = (offset < 0)?0:offset;
+  if (first_queued != NULL)
+    {
+      readers.lock();
+      submit(); // The decoder is about to wait for something
+      readers.unlock();
+    }
+  return true;
+}
+
+/*****************************************************************************/
+/*                        ska_prefetch_source::read                          */
+/*****************************************************************************/
+
+int
+  ska_prefetch_source::read(kdu_byte *buf, int num_bytes)
+{
+  if (fd < 0)
+    return 0;
+  int total = 0;
+  readers.lock();
+  if (first_queued != NULL)
+    submit();
+  while (num_bytes > 0)
+    {
+      ska_prefetch_segment *seg = NULL;
+      kdu_long next_start = -1; // Start of the first segment beyond `pos'
+      std::map<kdu_long,ska_prefetch_segment *>::iterator it =
+        segments.upper_bound(pos);
+      if (it != segments.end())
+        next_start = it->first;
+      if ((it != segments.begin()) && ((--it)->second->lim > pos))
+        seg = it->second;
+      if ((seg != NULL) && (seg->state == SKA_SEGMENT_QUEUED))
+        { // No room for it yet, and reading it ourselves is no slower
+          ska_prefetch_segment *scan, *prev=NULL;
+          for (scan=first_queued; scan != seg; prev=scan, scan=scan->next);
+          if (prev == NULL)
+            first_queued = seg->next;
+          else
+            prev->next = seg->next;
+          if (last_queued == seg)
+            last_queued = prev;
+          next_start = seg->lim;
+          release(seg);
+          seg = NULL;
+        }
+      if (seg != NULL)
+        {
+          wait_for(seg);
+          kdu_long offset = pos - seg->start;
+          if (offset < (kdu_long) seg->valid_bytes)
+            {
+              int xfer = seg->valid_bytes - (int) offset;
+              if (xfer > num_bytes)
+                xfer = num_bytes;
+              memcpy(buf,seg->buf+offset,(size_t) xfer);
+              buf += xfer;  num_bytes -= xfer;  total += xfer;
+              pos += xfer;
+              prefetched_bytes += xfer;
+              seg->delivered += xfer;
+              if (seg->delivered >= (seg->lim - seg->start))
+                { release(seg);  submit(); }
+              continue;
+            }
+          next_start = seg->lim; // Read failed or was cut short
+        }
+
+      // Read the bytes ourselves, stopping at the next segment
+      int xfer = num_bytes;
+      if ((next_start > pos) && ((next_start - pos) < (kdu_long) xfer))
+        xfer = (int)(next_start - pos);
+      readers.unlock();
+      xfer = read_direct(buf,xfer);
+      readers.lock();
+      if (xfer == 0)
+        break; // End of file
+      buf += xfer;  num_bytes -= xfer;  total += xfer;
+      pos += xfer;
+    }
+  readers.unlock();
+  return total;
+}
+
+/*****************************************************************************/
+/*                     ska_prefetch_source::read_direct                      */
+/*****************************************************************************/
+
+int
+  ska_prefetch_source::read_direct(kdu_byte *buf, int num_bytes)
+{
+  if ((pos < read_buf_pos) || (pos >= (read_buf_pos + read_buf_bytes)))
+    {
+      read_buf_pos = pos;
+      read_buf_bytes = ska_pread_fully(fd,read_buf,SKA_PREFETCH_READ_BUF,pos);
+      if (read_buf_bytes <= 0)
+        { read_buf_bytes = 0; return 0; }
+    }
+  int offset = (int)(pos - read_buf_pos);
+  if (num_bytes > (read_buf_bytes - offset))
+    num_bytes = read_buf_bytes - offset;
+  memcpy(buf,read_buf+offset,(size_t) num_bytes);
+  return num_bytes;
+}
+
+/*****************************************************************************/
+/*                       ska_prefetch_source::submit                         */
+/*****************************************************************************/
+
+void
+  ska_prefetch_source::submit()
+{
+  num_queued_since_submit = 0;
+  ska_prefetch_segment *seg;
+  while ((seg = first_queued) != NULL)
+    {
+      kdu_long length = seg->lim - seg->start;
+      if ((held_bytes + length) > window)
+        { // Make room by dropping segments which the decoder has started
+          // reading and moved on from (e.g. when it wants fewer quality
+          // layers than the precincts hold)
+          std::map<kdu_long,ska_prefetch_segment *>::iterator it, next;
+          for (it=segments.begin(); (it != segments.end()) &&
+               ((held_bytes + length) > window); it=next)
+            {
+              next = it;  next++;
+              ska_prefetch_segment *old = it->second;
+              if ((old->state == SKA_SEGMENT_READY) && (old->delivered > 0) &&
+                  ((pos < old->start) || (pos >= old->lim)))
+                release(old);
+            }
+          if ((held_bytes + length) > window)
+            break;
+        }
+      if ((ring != NULL) && (num_in_flight >= (int) ring->num_entries))
+        break; // Carry on once some of the reads have completed
+      seg->buf = (kdu_byte *) malloc((size_t) length);
+      if (seg->buf == NULL)
+        break;
+      if ((first_queued = seg->next) == NULL)
+        last_queued = NULL;
+      seg->next = NULL;
+      held_bytes += length;
+      seg->state = SKA_SEGMENT_IN_FLIGHT;
+      num_in_flight++;
+      if (ring != NULL)
+        {
+          seg->iov.iov_base = seg->buf;
+          seg->iov.iov_len = (size_t) length;
+          push_read(ring,fd,seg);
+        }
+      else
+        readers.push(seg);
+    }
+  if (ring != NULL)
+    enter_uring(ring,false);
+}
+
+/*****************************************************************************/
+/*                      ska_prefetch_source::wait_for                        */
+/*****************************************************************************/
+
+void
+  ska_prefetch_source::wait_for(ska_prefetch_segment *seg)
+{
+  while (seg->state == SKA_SEGMENT_IN_FLIGHT)
+    {
+      if (ring != NULL)
+        {
+          enter_uring(ring,true);
+          num_in_flight -= reap_uring(ring);
+          submit(); // Reuse the ring entries just freed
+        }
+      else
+        readers.wait_done();
+    }
+}
+
+/*****************************************************************************/
+/*                       ska_prefetch_source::release                        */
+/*****************************************************************************/
+
+void
+  ska_prefetch_source::release(ska_prefetch_segment *seg)
+{
+  segments.erase(seg->start);
+  if (seg->buf != NULL)
+    {
+      held_bytes -= seg->lim - seg->start;
+      free(seg->buf);
+    }
+  delete seg;
+}
+
+/*****************************************************************************/
+/* STATIC                   ska_prefetch_source::do_read                     */
+/*****************************************************************************/
+
+int
+  ska_prefetch_source::do_read(void *context, ska_io_job *job)
+{
+  ska_prefetch_source *obj = (ska_prefetch_source *) context;
+  ska_prefetch_segment *seg = (ska_prefetch_segment *) job;
+  seg->valid_bytes = ska_pread_fully(obj->fd,seg->buf,
+                                     (size_t)(seg->lim-seg->start),
+                                     seg->start);
+  return 0; // Short reads are re-read through `read_direct'
+}
+
+/*****************************************************************************/
+/* STATIC                  ska_prefetch_source::read_done                    */
+/*****************************************************************************/
+
+void
+  ska_prefetch_source::read_done(void *context, ska_io_job *job)
+{
+  ska_prefetch_source *obj = (ska_prefetch_source *) context;
+  ska_prefetch_segment *seg = (ska_prefetch_segment *) job;
+  seg->state = SKA_SEGMENT_READY;
+  obj->num_in_flight--;
+}
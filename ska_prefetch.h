@@ -0,0 +1,107 @@
+/*****************************************************************************/
+//
+//  @file: ska_prefetch.h
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Compressed data source which reads the precincts of a region ahead
+//         of the decoder, with batched io_uring reads where the kernel has
+//         them and a small pool of `pread' threads where it does not.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+#ifndef SKA_PREFETCH_H
+#define SKA_PREFETCH_H
+
+#include <map>
+#include "kdu_elementary.h"
+#include "kdu_compressed.h"
+#include "ska_threads.h"
+
+// Adjacent precincts are read with one request, up to this many bytes
+#define SKA_PREFETCH_MAX_MERGE (1<<20)
+// Default limit on the bytes read ahead and not yet consumed
+#define SKA_PREFETCH_WINDOW (64<<20)
+// Bytes read at a time for everything which was not prefetched
+#define SKA_PREFETCH_READ_BUF (64<<10)
+
+struct ska_prefetch_segment;
+struct ska_uring;
+
+/*****************************************************************************/
+/*                          class ska_prefetch_source                        */
+/*****************************************************************************/
+
+class ska_prefetch_source : public kdu_compressed_source {
+  /* A seekable file source advertising `KDU_SOURCE_CAP_PREFETCH'. Opened
+   * with PLT markers in the codestream, Kakadu passes us the address and
+   * length of every precinct within the window set by
+   * `kdu_codestream::apply_input_restrictions' as soon as it knows them
+   * (mostly when each tile is opened), in codestream order. We merge
+   * neighbouring precincts into segments and queue them; the queue is
+   * submitted as one batch when the decoder next calls `seek' or `read'
+   * (or whenever a batch fills), so that all of the reads are in flight
+   * together rather than issued one at a time as the precincts are loaded.
+   *    On Linux, segments are read through an io_uring; if the kernel (or
+   * a seccomp policy) refuses one, or on other systems, they are handed to
+   * an `ska_io_queue' with `num_threads' threads calling `pread'. `read'
+   * copies out of a segment, waiting for it if necessary, and frees it once
+   * all of its bytes have been read; anything not prefetched is read
+   * through an ordinary buffer.
+   * At most `window' bytes are held in segments; later segments wait in
+   * the queue until earlier ones have been consumed.
+   *    Like `jp2_threadsafe_family_src', the object leaves it to its
+   * callers (the codestream or `jp2_family_src') to serialize calls to
+   * its `kdu_compressed_source' functions. */
+  public: // Member functions
+    ska_prefetch_source();
+    ~ska_prefetch_source() { close(); }
+    bool open(const char *fname, bool return_on_failure=false,
+              int num_threads=4, kdu_long window=SKA_PREFETCH_WINDOW);
+    /* Generates an error if the file cannot be opened, unless
+     * `return_on_failure' is true, in which case we return false. */
+    bool uses_io_uring() { return (ring != NULL); }
+    kdu_long get_prefetched_bytes() { return prefetched_bytes; }
+    /* Bytes which `read' has delivered from prefetched segments, rather
+     * than reading them itself. */
+  public: // kdu_compressed_source functions
+    int get_capabilities()
+      { return KDU_SOURCE_CAP_SEQUENTIAL | KDU_SOURCE_CAP_SEEKABLE |
+               KDU_SOURCE_CAP_PREFETCH; }
+    bool seek(kdu_long offset);
+    kdu_long get_pos() { return pos; }
+    int read(kdu_byte *buf, int num_bytes);
+    void prefetch(kdu_long offset, kdu_long length);
+    bool close();
+  private: // Helper functions
+    void submit();
+    /* Moves as many queued segments as the window allows into flight. */
+    void wait_for(ska_prefetch_segment *seg);
+    void release(ska_prefetch_segment *seg);
+    /* Removes `seg' from `segments' and frees it; it must not be in
+     * flight. */
+    int read_direct(kdu_byte *buf, int num_bytes);
+    /* Reads at `pos' through `read_buf', without advancing `pos'. */
+    static int do_read(void *context, ska_io_job *job);
+    static void read_done(void *context, ska_io_job *job);
+    /* Marks the segment ready, whether or not it was read. */
+  private: // Data
+    int fd;
+    kdu_long pos;
+    std::map<kdu_long,ska_prefetch_segment *> segments; // By file offset
+    ska_prefetch_segment *first_queued, *last_queued; // Not yet submitted
+    int num_queued_since_submit;
+    kdu_long window; // Limit on `held_bytes'
+    kdu_long held_bytes; // In segments in flight or waiting to be read
+    kdu_long prefetched_bytes;
+    int num_in_flight;
+    kdu_byte *read_buf; // Holds `read_buf_bytes' from `read_buf_pos'
+    kdu_long read_buf_pos;
+    int read_buf_bytes;
+    ska_uring *ring; // NULL if we are using the threads instead
+    int num_threads; // Started by `readers'
+    ska_io_queue readers; // Its mutex guards everything above
+};
+
+#endif
@@ -0,0 +1,560 @@
+/*****************************************************************************/
+//
+//  @file: ska_quality.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Implements the decode-time quality benchmarking declared in
+//         ska_quality.h
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+// SKA includes
+#include "ska_quality.h"
+
+/*****************************************************************************/
+/* STATIC                        count_bits                                  */
+/*****************************************************************************/
+
+static inline int
+  count_bits(int mask)
+{ // Number of lanes set in a 4-bit `_mm_movemask_ps' result
+  return (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + (mask >> 3);
+}
+
+/*****************************************************************************/
+/*                        init_quality_benchmark_info                        */
+/*****************************************************************************/
+
+void
+  init_quality_benchmark_info(quality_benchmark_info &info)
+{
+  memset(&info,0,sizeof(info));
+}
+
+/*****************************************************************************/
+/*                       parse_quality_benchmark_args                        */
+/*****************************************************************************/
+
+void
+  parse_quality_benchmark_args(kdu_args &args, quality_benchmark_info &info)
+{
+  if (args.find("-K") != NULL){ // All benchmarks, with intermediate values
+    // Main benchmarks
+    info.fidelity = true;
+    info.maximumAbsoluteDistortion = true;
+    info.meanAbsoluteError = true;
+    info.meanSquaredError = true;
+    info.peakSignalToNoiseRatio = true;
+    info.rootMeanSquaredError = true;
+    info.performQualityBenchmarking = true;
+
+    // Intermediate values
+    info.squaredError = true;
+    info.absoluteError = true;
+    info.squaredIntensitySum = true;
+    args.advance();
+  }
+  if (args.find("-N") != NULL){ /* Should all quality benchmark tests be
+                                 * performed - but no intermediate results
+                                 * shown? This is the same as the above
+                                 * case, but without the intermediate
+                                 * values printed.
+                                 */
+    info.fidelity = true;
+    info.maximumAbsoluteDistortion = true;
+    info.meanAbsoluteError = true;
+    info.meanSquaredError = true;
+    info.peakSignalToNoiseRatio = true;
+    info.rootMeanSquaredError = true;
+    info.performQualityBenchmarking = true;
+    args.advance();
+  }
+  if (args.find("-B") != NULL){ // Fidelity benchmarking
+    info.fidelity = true;
+    info.performQualityBenchmarking = true;
+    args.advance();
+  }
+  if (args.find("-D") != NULL){ // PSNR benchmarking
+    info.peakSignalToNoiseRatio = true;
+    info.performQualityBenchmarking = true;
+    args.advance();
+  }
+  if (args.find("-G") != NULL){ // Maximum absolute distortion
+    info.maximumAbsoluteDistortion = true;
+    info.performQualityBenchmarking = true;
+    args.advance();
+  }
+  if (args.find("-H") != NULL){ // Mean squared error
+    info.meanSquaredError = true;
+    info.performQualityBenchmarking = true;
+    args.advance();
+  }
+  if (args.find("-L") != NULL){ // Root mean squared error
+    info.rootMeanSquaredError = true;
+    info.performQualityBenchmarking = true;
+    args.advance();
+  }
+  if (args.find("-U") != NULL){ // Mean absolute error
+    info.meanAbsoluteError = true;
+    info.performQualityBenchmarking = true;
+    args.advance();
+  }
+  if (args.find("-V") != NULL){ // Squared error
+    info.squaredError = true;
+    info.performQualityBenchmarking = true;
+    args.advance();
+  }
+  if (args.find("-Y") != NULL){ // Absolute error
+    info.absoluteError = true;
+    info.performQualityBenchmarking = true;
+    args.advance();
+  }
+  if (args.find("-X") != NULL){ // Squared uncompressed image intensity sum
+    info.squaredIntensitySum = true;
+    info.performQualityBenchmarking = true;
+    args.advance();
+  }
+}
+
+/* ========================================================================= */
+/*                             ska_quality_stats                             */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                          ska_quality_stats::reset                         */
+/*****************************************************************************/
+
+void
+  ska_quality_stats::reset()
+{
+  squared_error = absolute_error = squared_intensity = 0.0;
+  max_abs_distortion = 0.0F;
+  min_intensity = FLT_MAX;
+  max_intensity = -FLT_MAX;
+  samples = lost_samples = 0;
+}
+
+/*****************************************************************************/
+/*                          ska_quality_stats::merge                         */
+/*****************************************************************************/
+
+void
+  ska_quality_stats::merge(const ska_quality_stats &src)
+{
+  squared_error += src.squared_error;
+  absolute_error += src.absolute_error;
+  squared_intensity += src.squared_intensity;
+  if (src.max_abs_distortion > max_abs_distortion)
+    max_abs_distortion = src.max_abs_distortion;
+  if (src.min_intensity < min_intensity)
+    min_intensity = src.min_intensity;
+  if (src.max_intensity > max_intensity)
+    max_intensity = src.max_intensity;
+  samples += src.samples;
+  lost_samples += src.lost_samples;
+}
+
+/*****************************************************************************/
+/*                       ska_quality_stats::accumulate                       */
+/*****************************************************************************/
+
+void
+  ska_quality_stats::accumulate(const float *original, const float *decoded,
+      int num, float *residual)
+{
+  int i = 0;
+#if defined(__SSE2__)
+  /* Four samples at a time. Differences are formed in single precision
+   * (exact for nearby values), but all sums are kept in double precision
+   * since a cube can easily have 10^10 samples. Blank samples are removed
+   * by masking rather than branching. */
+  __m128d se_lo = _mm_setzero_pd(), se_hi = _mm_setzero_pd();
+  __m128d ae_lo = _mm_setzero_pd(), ae_hi = _mm_setzero_pd();
+  __m128d si_lo = _mm_setzero_pd(), si_hi = _mm_setzero_pd();
+  __m128 vmax_abs = _mm_set1_ps(max_abs_distortion);
+  __m128 vmin = _mm_set1_ps(min_intensity);
+  __m128 vmax = _mm_set1_ps(max_intensity);
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+  const __m128 big = _mm_set1_ps(FLT_MAX);
+  kdu_long count = 0, lost = 0;
+  for (; i+4 <= num; i+=4) {
+    __m128 orig = _mm_loadu_ps(original+i);
+    __m128 dec = _mm_loadu_ps(decoded+i);
+    __m128 diff = _mm_sub_ps(dec,orig);
+    if (residual != NULL)
+      _mm_storeu_ps(residual+i,diff);
+    __m128 defined = _mm_cmpord_ps(orig,orig);
+    __m128 valid = _mm_and_ps(defined,_mm_cmpord_ps(dec,dec));
+    count += count_bits(_mm_movemask_ps(valid));
+    lost += count_bits(_mm_movemask_ps(_mm_andnot_ps(valid,defined)));
+
+    diff = _mm_and_ps(diff,valid);
+    __m128 abs_diff = _mm_and_ps(diff,abs_mask);
+    vmax_abs = _mm_max_ps(vmax_abs,abs_diff);
+    __m128 v_orig = _mm_and_ps(orig,valid);
+    vmin = _mm_min_ps(vmin,_mm_or_ps(v_orig,_mm_andnot_ps(valid,big)));
+    vmax = _mm_max_ps(vmax,_mm_or_ps(v_orig,
+          _mm_andnot_ps(valid,_mm_sub_ps(_mm_setzero_ps(),big))));
+
+    __m128d d_lo = _mm_cvtps_pd(diff);
+    __m128d d_hi = _mm_cvtps_pd(_mm_movehl_ps(diff,diff));
+    se_lo = _mm_add_pd(se_lo,_mm_mul_pd(d_lo,d_lo));
+    se_hi = _mm_add_pd(se_hi,_mm_mul_pd(d_hi,d_hi));
+    d_lo = _mm_cvtps_pd(abs_diff);
+    d_hi = _mm_cvtps_pd(_mm_movehl_ps(abs_diff,abs_diff));
+    ae_lo = _mm_add_pd(ae_lo,d_lo);
+    ae_hi = _mm_add_pd(ae_hi,d_hi);
+    d_lo = _mm_cvtps_pd(v_orig);
+    d_hi = _mm_cvtps_pd(_mm_movehl_ps(v_orig,v_orig));
+    si_lo = _mm_add_pd(si_lo,_mm_mul_pd(d_lo,d_lo));
+    si_hi = _mm_add_pd(si_hi,_mm_mul_pd(d_hi,d_hi));
+  }
+  double tmp[2];
+  _mm_storeu_pd(tmp,_mm_add_pd(se_lo,se_hi));
+  squared_error += tmp[0] + tmp[1];
+  _mm_storeu_pd(tmp,_mm_add_pd(ae_lo,ae_hi));
+  absolute_error += tmp[0] + tmp[1];
+  _mm_storeu_pd(tmp,_mm_add_pd(si_lo,si_hi));
+  squared_intensity += tmp[0] + tmp[1];
+  float ftmp[4];
+  _mm_storeu_ps(ftmp,vmax_abs);
+  for (int k=0; k < 4; k++)
+    max_abs_distortion = (ftmp[k] > max_abs_distortion)?ftmp[k]:
+      max_abs_distortion;
+  _mm_storeu_ps(ftmp,vmin);
+  for (int k=0; k < 4; k++)
+    min_intensity = (ftmp[k] < min_intensity)?ftmp[k]:min_intensity;
+  _mm_storeu_ps(ftmp,vmax);
+  for (int k=0; k < 4; k++)
+    max_intensity = (ftmp[k] > max_intensity)?ftmp[k]:max_intensity;
+  samples += count;
+  lost_samples += lost;
+#endif // __SSE2__
+
+  for (; i < num; i++) {
+    float orig = original[i], dec = decoded[i];
+    float diff = dec - orig;
+    if (residual != NULL)
+      residual[i] = diff;
+    if (orig != orig)
+      continue; // Blank in the original
+    if (dec != dec)
+      { lost_samples++; continue; }
+    float abs_diff = fabsf(diff);
+    squared_error += ((double) diff) * diff;
+    absolute_error += abs_diff;
+    squared_intensity += ((double) orig) * orig;
+    max_abs_distortion = (abs_diff > max_abs_distortion)?abs_diff:
+      max_abs_distortion;
+    min_intensity = (orig < min_intensity)?orig:min_intensity;
+    max_intensity = (orig > max_intensity)?orig:max_intensity;
+    samples++;
+  }
+}
+
+/*****************************************************************************/
+/*                        ska_quality_stats::get_psnr                        */
+/*****************************************************************************/
+
+double
+  ska_quality_stats::get_psnr() const
+{
+  double mse = get_mse();
+  if (mse <= 0.0)
+    return HUGE_VAL;
+  double range = (double) max_intensity - min_intensity;
+  return 10.0*log10(range*range/mse);
+}
+
+/* ========================================================================= */
+/*                            ska_quality_checker                            */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                   ska_quality_checker::ska_quality_checker                */
+/*****************************************************************************/
+
+ska_quality_checker::ska_quality_checker()
+{
+  original_fname = residual_fname = NULL;
+  init_quality_benchmark_info(info);
+  original = NULL;
+  residual = NULL;
+  num_components = width = buf_rows = 0;
+  stats = NULL;
+  original_bufs = residual_bufs = decoded_bufs = NULL;
+  heights = NULL;
+}
+
+/*****************************************************************************/
+/*                  ska_quality_checker::~ska_quality_checker                */
+/*****************************************************************************/
+
+ska_quality_checker::~ska_quality_checker()
+{
+  delete[] original_fname;
+  delete[] residual_fname;
+  delete original;
+  delete residual;
+  delete[] stats;
+  for (int n=0; n < num_components; n++) {
+    if (original_bufs != NULL) delete[] original_bufs[n];
+    if (residual_bufs != NULL) delete[] residual_bufs[n];
+  }
+  delete[] original_bufs;
+  delete[] residual_bufs;
+}
+
+/*****************************************************************************/
+/*                      ska_quality_checker::parse_args                      */
+/*****************************************************************************/
+
+bool
+  ska_quality_checker::parse_args(kdu_args &args)
+{
+  const char *string;
+  if (args.find("-verify") != NULL) {
+    if ((string = args.advance()) == NULL)
+      { kdu_error e; e << "\"-verify\" argument requires the file name of "
+        "the original cube."; }
+    original_fname = new char[strlen(string)+1];
+    strcpy(original_fname,string);
+    args.advance();
+  }
+  if (args.find("-Z") != NULL) {
+    if ((string = args.advance()) == NULL)
+      { kdu_error e; e << "\"-Z\" argument requires a file name for the "
+        "residual cube."; }
+    residual_fname = new char[strlen(string)+1];
+    strcpy(residual_fname,string);
+    info.writeResidual = true;
+    args.advance();
+  }
+  parse_quality_benchmark_args(args,info);
+
+  if (original_fname == NULL) {
+    if (info.performQualityBenchmarking || info.writeResidual)
+      { kdu_error e; e << "Quality benchmarks and residual cubes can only "
+        "be produced when the original cube is given with \"-verify\"."; }
+    return false;
+  }
+  if (!(info.performQualityBenchmarking || info.writeResidual)) {
+    info.fidelity = info.maximumAbsoluteDistortion = true;
+    info.meanAbsoluteError = info.meanSquaredError = true;
+    info.peakSignalToNoiseRatio = info.rootMeanSquaredError = true;
+    info.performQualityBenchmarking = true;
+  }
+  return true;
+}
+
+/*****************************************************************************/
+/*                        ska_quality_checker::start                         */
+/*****************************************************************************/
+
+void
+  ska_quality_checker::start(jp2_family_src &src, kdu_args &args,
+      ska_dest_file * const decoded, kdu_dims image_dims, kdu_dims region)
+{
+  num_components = decoded->crop.depth;
+  width = decoded->crop.width;
+
+  // The original is opened without any of the decoder's arguments, so that
+  // format readers do not consume (or choke on) them.
+  static char prog_name[] = "skuareview-verify";
+  char *no_argv[1] = { prog_name };
+  kdu_args no_args(1,no_argv);
+  jp2_family_tgt no_tgt; // Readers only collect metadata here
+  original = new ska_source_file;
+  original->raw_access = true;
+  original->fname = new char[strlen(original_fname)+1];
+  strcpy(original->fname,original_fname);
+  if (!region)
+    region = image_dims;
+  region.pos -= image_dims.pos;
+  original->crop.specified = true;
+  original->crop.x = region.pos.x;
+  // Both the encoder and the decoder flip the image vertically, so the
+  // region's rows are counted from the bottom of the codestream.
+  original->crop.y = image_dims.size.y - region.pos.y - region.size.y;
+  original->crop.z = decoded->crop.z;
+  original->crop.width = decoded->crop.width;
+  original->crop.height = decoded->crop.height;
+  original->crop.depth = decoded->crop.depth;
+  original->crop.stokes = decoded->crop.stokes;
+  original->crop.num_stokes = 1;
+  original->read_header(no_tgt,no_args);
+
+  stats = new ska_quality_stats[num_components];
+  original_bufs = new float *[num_components];
+  memset(original_bufs,0,sizeof(float *)*num_components);
+  if (info.writeResidual) {
+    residual_bufs = new float *[num_components];
+    memset(residual_bufs,0,sizeof(float *)*num_components);
+    residual = new ska_dest_file;
+    residual->fname = new char[strlen(residual_fname)+1];
+    strcpy(residual->fname,residual_fname);
+    residual->crop = decoded->crop;
+    residual->renormalize = false; // Residuals are already sample values
+    residual->write_header(src,args);
+  }
+}
+
+/*****************************************************************************/
+/*                    ska_quality_checker::process_stripe                    */
+/*****************************************************************************/
+
+void
+  ska_quality_checker::process_stripe(float **stripe_bufs,
+      int *stripe_heights, kdu_thread_env *env)
+{
+  int n, max_rows = 0;
+  for (n=0; n < num_components; n++)
+    max_rows = (stripe_heights[n] > max_rows)?stripe_heights[n]:max_rows;
+  if (max_rows > buf_rows) {
+    buf_rows = max_rows;
+    for (n=0; n < num_components; n++) {
+      delete[] original_bufs[n];
+      original_bufs[n] = new float[width*buf_rows];
+      if (residual_bufs != NULL) {
+        delete[] residual_bufs[n];
+        residual_bufs[n] = new float[width*buf_rows];
+      }
+    }
+  }
+
+  for (n=0; n < num_components; n++)
+    if (stripe_heights[n] > 0)
+      original->read_raw_stripe(stripe_heights[n],original_bufs[n],n);
+
+  decoded_bufs = stripe_bufs;
+  heights = stripe_heights;
+  batch.run(num_components,compare_component,this,env);
+
+  if (residual != NULL)
+    for (n=0; n < num_components; n++)
+      if (stripe_heights[n] > 0)
+        residual->write_stripe(stripe_heights[n],residual_bufs[n],n);
+}
+
+/*****************************************************************************/
+/* STATIC             ska_quality_checker::compare_component                 */
+/*****************************************************************************/
+
+void
+  ska_quality_checker::compare_component(void *context, int component,
+      kdu_thread_env *env)
+{
+  ska_quality_checker *obj = (ska_quality_checker *) context;
+  int num = obj->width * obj->heights[component];
+  if (num <= 0)
+    return;
+  obj->stats[component].accumulate(obj->original_bufs[component],
+      obj->decoded_bufs[component],num,
+      (obj->residual_bufs==NULL)?NULL:obj->residual_bufs[component]);
+}
+
+/*****************************************************************************/
+/*                        ska_quality_checker::report                        */
+/*****************************************************************************/
+
+void
+  ska_quality_checker::report(kdu_message &out)
+{
+  if (!info.performQualityBenchmarking)
+    return;
+  ska_quality_stats total;
+  get_totals(total);
+
+  char line[128];
+  sprintf(line," (%lld samples compared):\n",(long long) total.samples);
+  out << "\nQuality benchmarks against \"" << original_fname << "\"" << line;
+  if (total.samples == 0)
+    { out << "    No defined samples to compare!\n"; return; }
+  double mse = total.get_mse();
+  if (info.meanSquaredError)
+    { sprintf(line,"    MSE = %.9g\n",mse); out << line; }
+  if (info.rootMeanSquaredError)
+    { sprintf(line,"    RMSE = %.9g\n",sqrt(mse)); out << line; }
+  if (info.peakSignalToNoiseRatio) {
+    if (mse > 0.0)
+      sprintf(line,"    PSNR = %.4f dB\n",total.get_psnr());
+    else
+      sprintf(line,"    PSNR = inf (lossless)\n");
+    out << line;
+  }
+  if (info.meanAbsoluteError)
+    { sprintf(line,"    MAE = %.9g\n",total.get_mae());
+      out << line; }
+  if (info.fidelity && (total.squared_intensity > 0.0))
+    { sprintf(line,"    Fidelity = %.9f\n",total.get_fidelity());
+      out << line; }
+  if (info.maximumAbsoluteDistortion)
+    { sprintf(line,"    Maximum absolute distortion = %.9g\n",
+          (double) total.max_abs_distortion);
+      out << line; }
+  if (info.squaredError)
+    { sprintf(line,"    Squared error = %.9g\n",total.squared_error);
+      out << line; }
+  if (info.absoluteError)
+    { sprintf(line,"    Absolute error = %.9g\n",total.absolute_error);
+      out << line; }
+  if (info.squaredIntensitySum)
+    { sprintf(line,"    Squared intensity sum = %.9g\n",
+          total.squared_intensity);
+      out << line; }
+  if (total.lost_samples > 0)
+    { sprintf(line,"%lld",(long long) total.lost_samples);
+      kdu_warning w; w << line << " samples which are defined in the "
+      "original cube were blank (NaN) after decoding; they are excluded "
+      "from the benchmarks above."; }
+}
+
+/*****************************************************************************/
+/*                        ska_quality_checker::restart                       */
+/*****************************************************************************/
+
+void
+  ska_quality_checker::restart()
+{
+  if (original == NULL)
+    return;
+  delete residual;
+  residual = NULL;
+  // Format readers only move forwards through the cube, so the simplest way
+  // to rewind is to open it again with the same cropping.
+  static char prog_name[] = "skuareview-verify";
+  char *no_argv[1] = { prog_name };
+  kdu_args no_args(1,no_argv);
+  jp2_family_tgt no_tgt;
+  ska_source_file *fresh = new ska_source_file;
+  fresh->raw_access = true;
+  fresh->fname = new char[strlen(original_fname)+1];
+  strcpy(fresh->fname,original_fname);
+  fresh->crop = original->crop;
+  delete original;
+  original = fresh;
+  original->read_header(no_tgt,no_args);
+  for (int n=0; n < num_components; n++)
+    stats[n].reset();
+}
+
+/*****************************************************************************/
+/*                      ska_quality_checker::get_totals                      */
+/*****************************************************************************/
+
+void
+  ska_quality_checker::get_totals(ska_quality_stats &total)
+{
+  total.reset();
+  for (int n=0; n < num_components; n++)
+    total.merge(stats[n]);
+}
@@ -0,0 +1,160 @@
+/*****************************************************************************/
+//
+//  @file: ska_quality.h
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Decode-time quality benchmarking. The original cube is streamed
+//         alongside the decompressed stripes and all of the quality metrics
+//         are accumulated in a single pass, so the decoded cube never has to
+//         be written to disk in order to be measured.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+#ifndef SKA_QUALITY_H
+#define SKA_QUALITY_H
+
+#include "kdu_elementary.h"
+#include "kdu_messaging.h"
+#include "kdu_args.h"
+#include "ska_local.h"
+#include "ska_threads.h"
+
+/**
+ * Structure allowing parameters for quality benchmarking to be specified
+ * by the user.  Currently, numerous different quality benchmarks can be
+ * specified by the user at the command line and information on these is
+ * recorded in here.
+ *
+ * The last three metrics are not really of interest in their own right, but
+ * are integer intermediate building blocks of some of the other metrics that
+ * might be useful if integer, rather than floating point, raw data is desired.
+ *
+ * The last field specifies whether a residual iamge should be written to a
+ * file.  This can be used even if no other quality benchmarks are specified.
+ */
+
+typedef struct {
+  bool meanSquaredError; // Mean squared error
+  bool rootMeanSquaredError; // Root mean squared error
+  bool peakSignalToNoiseRatio; // Peak signal to noise ratio
+  bool meanAbsoluteError; // Mean absolute error
+  bool fidelity; // Fidelity
+  bool maximumAbsoluteDistortion; // Maximum absolute distortion
+  bool squaredError; // Squared error
+  bool absoluteError; // Absolute error
+  bool squaredIntensitySum; // Sum of squared uncompressed image intensities
+  bool performQualityBenchmarking; // Is at least one quality benchmark
+  // selected?  Intended to provide a quick check.
+  // Client code must keep this up to date
+  bool writeResidual; // Should the residual image be written to a file?
+} quality_benchmark_info;
+
+/* Clears every benchmark selection in `info'. */
+void init_quality_benchmark_info(quality_benchmark_info &info);
+
+/* Parses the quality benchmark flags (-K, -N, -B, -D, -G, -H, -L, -U, -V,
+ * -Y and -X) shared by the FITS reader and the decoder's verification
+ * mode. Flags which are not present leave `info' untouched. `-Z' is left to
+ * the caller, since its argument differs between the two. */
+void parse_quality_benchmark_args(kdu_args &args,
+    quality_benchmark_info &info);
+
+/*****************************************************************************/
+/*                          struct ska_quality_stats                         */
+/*****************************************************************************/
+
+struct ska_quality_stats {
+  /* Running sums from which every metric in `quality_benchmark_info' is
+   * derived. Samples which are blank (NaN) in the original are ignored;
+   * samples which are defined in the original but blank after decoding are
+   * counted in `lost_samples' and excluded from the sums. */
+  public: // Member functions
+    ska_quality_stats() { reset(); }
+    void reset();
+    void merge(const ska_quality_stats &src);
+    void accumulate(const float *original, const float *decoded, int num,
+        float *residual=NULL);
+    /* Adds `num' samples to the sums. If `residual' is non-NULL, it
+     * receives `decoded' - `original' (NaN wherever either is blank). Uses
+     * SSE2 where available; the scalar path gives the same results. */
+    double get_mse() const
+      { return (samples > 0)?(squared_error / samples):0.0; }
+    double get_mae() const
+      { return (samples > 0)?(absolute_error / samples):0.0; }
+    double get_psnr() const;
+    /* Peak is the range of the original samples. Returns HUGE_VAL if the
+     * cube was reproduced exactly. */
+    double get_fidelity() const
+      { return (squared_intensity > 0.0)?
+          (1.0 - squared_error/squared_intensity):0.0; }
+  public: // Data
+    double squared_error;
+    double absolute_error;
+    double squared_intensity;
+    float max_abs_distortion;
+    float min_intensity, max_intensity; // Range of the original samples
+    kdu_long samples;
+    kdu_long lost_samples;
+};
+
+/*****************************************************************************/
+/*                         class ska_quality_checker                         */
+/*****************************************************************************/
+
+class ska_quality_checker {
+  /* Compares decompressed stripes against the original cube as they come
+   * out of `kdu_stripe_decompressor::pull_stripe'. The original is read
+   * stripe by stripe through `ska_source_file::read_raw_stripe' (format
+   * readers are not thread safe, so this part is serial) and the metrics
+   * for each component are then accumulated in parallel on the decoder's
+   * multi-threaded environment. */
+  public: // Member functions
+    ska_quality_checker();
+    ~ska_quality_checker();
+    bool parse_args(kdu_args &args);
+    /* Parses `-verify <original cube>', `-Z <residual cube>' and the metric
+     * selection flags. Returns false if `-verify' was not supplied, in
+     * which case the object should not be used further. If no metrics are
+     * selected, the main metrics (as for -N) are reported. */
+    void start(jp2_family_src &src, kdu_args &args,
+        ska_dest_file * const decoded, kdu_dims image_dims, kdu_dims region);
+    /* Opens the original cube, selecting the same components as `decoded'
+     * and the same spatial region. `image_dims' are the dimensions of the
+     * full image and `region' the part of it which was decoded, or an empty
+     * region if the whole image was decoded. If a residual cube was
+     * requested it is created here, from `src' and `args' in the same way
+     * as the decoded output. */
+    void process_stripe(float **stripe_bufs, int *stripe_heights,
+        kdu_thread_env *env);
+    /* Call once for every `pull_stripe', after the stripes have been
+     * renormalized to the original sample values. */
+    void report(kdu_message &out);
+    void restart();
+    /* Rewinds the original cube and clears all of the sums, so that a
+     * further decompression of the same region (e.g. with fewer quality
+     * layers) can be benchmarked. Any residual cube is closed; it only ever
+     * holds the residual of the first decompression. */
+    void get_totals(ska_quality_stats &total);
+    /* Sets `total' to the sums over all components compared so far. */
+  private: // Helper functions
+    static void compare_component(void *context, int component,
+        kdu_thread_env *env);
+  private: // Data
+    char *original_fname;
+    char *residual_fname;
+    quality_benchmark_info info;
+    ska_source_file *original;
+    ska_dest_file *residual;
+    int num_components, width;
+    int buf_rows; // Rows allocated in each entry of `original_bufs'
+    ska_quality_stats *stats; // One entry per component
+    float **original_bufs; // Stripe of the original, for each component
+    float **residual_bufs; // NULL unless a residual cube is being written
+    int *heights; // Heights of the stripes currently being compared
+    float **decoded_bufs;
+    ska_job_batch batch;
+};
+
+#endif
@@ -22,15 +22,34 @@ void
     }
     if ((strcmp(suffix+1,"fits")==0 || (strcmp(suffix+1,"FITS")==0)) ||
         (strcmp(suffix+1,"imfits")==0 || (strcmp(suffix+1,"IMFITS")==0)) ||
-        (strcmp(suffix+1,"fit")==0 || (strcmp(suffix+1,"FIT")==0))) {
+        (strcmp(suffix+1,"fit")==0 || (strcmp(suffix+1,"FIT")==0)) ||
+        (strcmp(suffix+1,"fz")==0 || (strcmp(suffix+1,"FZ")==0)) ||
+        (strcmp(suffix+1,"fits.fz")==0 || (strcmp(suffix+1,"FITS.FZ")==0))) {
       in = new fits_in();
       in->read_header(tgt, args, this);
     }
   }
   if (in == NULL)
   { kdu_error e; e << "Image file, \"" << fname << ", does not have a "
-      "recognized suffix.  Valid suffices are currently: h5 and fits. "
+      "recognized suffix.  Valid suffices are currently: h5, fits and fz. "
       "Upper or lower case may be used, but must be used consistently."; }
+  if (crop.num_stokes < 1)
+    crop.num_stokes = 1; // Readers without a Stokes axis
+  if (raw_access)
+    return;
+
+  // Readers leave `range_known' set if the file (e.g. DATAMIN/DATAMAX) or
+  // the command line gave us the range of the whole cube.
+  if (norm.needs_scan(range_known))
+    norm.measure(*this);
+  else
+    norm.set_global_range(float_minvals, float_maxvals);
+  norm.first_stokes = crop.stokes;
+  norm.num_stokes = crop.num_stokes;
+  norm.get_range(float_minvals, float_maxvals);
+  std::cout << "\nThe following values of MIN and MAX will be used:\n";
+  std::cout << "DATAMIN = " << float_minvals << "\n";
+  std::cout << "DATAMAX = " << float_maxvals << "\n";
 }
 
 /*****************************************************************************/
@@ -48,6 +67,16 @@ void
   in->read_stripe(height, buf, this, component);
 }
 
+/*****************************************************************************/
+/*                      ska_source_file::read_raw_stripe                     */
+/*****************************************************************************/
+
+void
+  ska_source_file::read_raw_stripe(int height, float *buf, int component)
+{
+  in->read_raw_stripe(height, buf, this, component);
+}
+
 /*****************************************************************************/
 /*                      ska_source_file::parse_ska_args                      */
 /*****************************************************************************/
@@ -85,7 +114,7 @@ void
     }
     args.advance();
   }
-  else {
+  else if (!crop.specified) { // Cropping may also be set up by the caller
     crop.x = 0;
     crop.y = 0;
     crop.z = 0;
@@ -108,70 +137,35 @@ void
 
   if (args.find("-minmax") != NULL)
   {
-    for (int i = 0; i < 2; ++i) {
-      const char *string = args.advance();
-      bool succ = true;
-      for (int j = 0; j < strlen(string); ++j) {
-        if (! (std::isdigit(string[j]) || 
-              string[j] == '.' || string[j] == '-'))
-          succ = false;
-      }
-      if (!succ || (i == 0 && (sscanf(string, "%f", &float_minvals) != 1)))
-        succ = false;
-      else if (!succ || (i == 1 && 
-            (sscanf(string, "%f", &float_maxvals) != 1)))
-        succ = false;
-
-      if (!succ)
+    const char *string = args.advance();
+    if ((string == NULL) ||
+        (sscanf(string, "{%lf,%lf}", &float_minvals, &float_maxvals) != 2) ||
+        (float_minvals > float_maxvals))
       { kdu_error e; e << "\"-minmax\" argument contains "
         "malformed specification. Expected to find two comma-"
           "separated float numbers, enclosed by curly braces. "
           "Example: -minmax {-1.0,1.0}"; }
-    }
+    range_known = true;
     args.advance();
   }
-  else {
-    // TODO: these values were just grabbed from the HDF5 1TB cube. A beter
-    // soln. would include including these values in the metadata of files.
-    // Also, because this data represents real values captured from the sky,
-    // we could come up with our own more general minval and maxval with
-    // respect to radio astronomy.
-    float_minvals = SAMPLES_MIN;
-    float_maxvals = SAMPLES_MAX;
-
-    /* Put important parameter details into JPX header as a reference */
-    /* TODO: this is actually DONE - but i'm going to exclude it until I have
-     * time to test it.
-    kdu_byte h5_uuid[16] = {0x72,0xF7,0x1C,0x30,
-                            0x70,0x09,0x11,0xE2,
-                            0xBC,0xFD,0x08,0x00,
-                            0x20,0x0C,0x9A,0x66};
-
-    std::cout << "copying over min and max" << std::endl;
-    kdu_byte* contents = new kdu_byte [BUFSIZ]; // Should be plenty
-    int contents_idx = 0, len = 0;
-    char* tmp = new char [128];
-    len = sprintf(tmp, "minfloat:%f,", float_minvals);
-    for (int i = 0; i < len; ++i, ++contents_idx)
-      contents[contents_idx] = tmp[i];
-    len = sprintf(tmp, "maxfloat:%f,", float_maxvals);
-    for (int i = 0; i < len; ++i, ++contents_idx)
-      contents[contents_idx] = tmp[i];
-    len = --contents_idx;
-    std::cout << "copying complete" << std::endl;
-
-    jp2_output_box out = jp2_output_box();
-    out.open(&tgt, 75756964, false, false); 
-    std::cout << out.get_box_type() << std::endl;
-    out.set_target_size(16 + len);
-    out.write(h5_uuid, 16); // unique identifier
-    out.write(contents, len);
-    if (!out.close())
-    { kdu_error e; e << "Could not flush box to header."; }
-    delete[] contents;
-    delete[] tmp;
-    */
+
+  if (args.find("-stokes") != NULL)
+  {
+    const char *string = args.advance();
+    int first, last;
+    if ((string != NULL) && (sscanf(string, "{%d,%d}", &first, &last) != 2))
+      last = first = (sscanf(string, "%d", &first) == 1)?first:-1;
+    if ((string == NULL) || (first < 0) || (last < first))
+      { kdu_error e; e << "\"-stokes\" argument contains malformed "
+        "specification. Expected a single Stokes parameter, counting from "
+          "0, or the first and last ones, enclosed by curly braces. "
+          "Example: -stokes {0,3}"; }
+    crop.stokes = first;
+    crop.num_stokes = last - first + 1;
+    args.advance();
   }
+
+  norm.parse_args(args);
 }
 
 /*****************************************************************************/
@@ -193,4 +187,6 @@ void
     { kdu_error e; e << "Unable to write metadata to JPX file"; }
   if (!out.close())
   { kdu_error e; e << "Could not flush box to header."; }
+
+  norm.write_box(tgt);
 }
@@ -0,0 +1,527 @@
+/*****************************************************************************/
+//
+//  @file: ska_stats.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Implements `ska_cube_stats', shared by the encoder's normalization
+//         pre-scan and by skuareview-stats.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+// Core includes
+#include "kdu_messaging.h"
+// SKA includes
+#include "ska_local.h"
+#include "ska_stats.h"
+
+// Upper bound on the samples kept (over all planes) for percentiles and
+// histograms, and the fewest kept from each plane
+#define SKA_STATS_MAX_SAMPLES (1<<24)
+#define SKA_STATS_MIN_PLANE_SAMPLES 4096
+// Rows read at a time, before rounding up to whole chunks or tiles
+#define SKA_STATS_ROWS 64
+// Upper bound on the stripes of a group of planes measured together
+#define SKA_STATS_GROUP_BYTES (64<<20)
+// Longest line of a statistics file we will read
+#define SKA_STATS_MAX_LINE (1<<20)
+
+/*****************************************************************************/
+/*                       struct ska_cube_stats::plane_work                   */
+/*****************************************************************************/
+
+struct ska_cube_stats::plane_work {
+  kdu_long count, blank;
+  float minval, maxval;
+  double sum, sum_sq;
+  kdu_long next_sample; // Position of the next sample to be kept
+  std::vector<float> samples; // Evenly spaced subset, if needed
+};
+
+/*****************************************************************************/
+/* STATIC                        find_percentile                             */
+/*****************************************************************************/
+
+static float
+  find_percentile(std::vector<float> &samples, double percentile)
+{
+  size_t idx = (size_t)(percentile * 0.01 * (samples.size()-1) + 0.5);
+  std::nth_element(samples.begin(),samples.begin()+idx,samples.end());
+  return samples[idx];
+}
+
+/*****************************************************************************/
+/* STATIC                         read_numbers                               */
+/*****************************************************************************/
+
+static bool
+  read_numbers(char * &string, double *vals, int num)
+  /* Reads `num' numbers from `string', which is advanced past them. NaNs
+   * are written as "nan" (or "-nan"), which `strtod' accepts. */
+{
+  for (int n=0; n < num; n++) {
+    char *end;
+    vals[n] = strtod(string,&end);
+    if (end == string)
+      return false;
+    string = end;
+  }
+  return true;
+}
+
+/* ========================================================================= */
+/*                              ska_cube_stats                               */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                       ska_cube_stats::ska_cube_stats                      */
+/*****************************************************************************/
+
+ska_cube_stats::ska_cube_stats()
+{
+  num_percentiles = 0;
+  percentiles = NULL;
+  num_bins = 0;
+  num_planes = 0;
+  planes = NULL;
+  memset(&global,0,sizeof(global));
+  work = NULL;
+  group_buf = NULL;
+  stride = 1;
+  x = y = z = width = height = depth = 0;
+  first_stokes = 0;
+  num_stokes = 1;
+}
+
+/*****************************************************************************/
+/*                      ska_cube_stats::~ska_cube_stats                      */
+/*****************************************************************************/
+
+ska_cube_stats::~ska_cube_stats()
+{
+  reset();
+  delete[] percentiles;
+}
+
+/*****************************************************************************/
+/*                           ska_cube_stats::reset                           */
+/*****************************************************************************/
+
+void
+  ska_cube_stats::reset()
+{
+  for (int c=0; c < num_planes; c++)
+    { delete[] planes[c].percentiles; delete[] planes[c].histogram; }
+  delete[] planes;
+  planes = NULL;
+  num_planes = 0;
+  delete[] global.percentiles;
+  delete[] global.histogram;
+  memset(&global,0,sizeof(global));
+  delete[] work;
+  work = NULL;
+  delete[] group_buf;
+  group_buf = NULL;
+}
+
+/*****************************************************************************/
+/*                          ska_cube_stats::allocate                         */
+/*****************************************************************************/
+
+void
+  ska_cube_stats::allocate(int planes)
+{
+  reset();
+  num_planes = planes;
+  this->planes = new ska_plane_stats[planes+1];
+  for (int c=0; c <= planes; c++) {
+    ska_plane_stats *stats = (c < planes)?(this->planes+c):&global;
+    memset(stats,0,sizeof(ska_plane_stats));
+    if (num_percentiles > 0)
+      stats->percentiles = new double[num_percentiles];
+    if (num_bins > 0) {
+      stats->histogram = new kdu_long[num_bins];
+      memset(stats->histogram,0,sizeof(kdu_long)*num_bins);
+    }
+  }
+}
+
+/*****************************************************************************/
+/*                      ska_cube_stats::set_percentiles                      */
+/*****************************************************************************/
+
+void
+  ska_cube_stats::set_percentiles(const double *values, int num)
+{
+  delete[] percentiles;
+  percentiles = NULL;
+  num_percentiles = num;
+  if (num > 0) {
+    percentiles = new double[num];
+    memcpy(percentiles,values,sizeof(double)*num);
+  }
+}
+
+/*****************************************************************************/
+/*                           ska_cube_stats::gather                          */
+/*****************************************************************************/
+
+void
+  ska_cube_stats::gather(ska_source_file &cube)
+{
+  x = cube.crop.x;  y = cube.crop.y;  z = cube.crop.z;
+  width = cube.crop.width;  height = cube.crop.height;
+  depth = cube.crop.depth;
+  first_stokes = cube.crop.stokes;
+  num_stokes = cube.crop.num_stokes;
+  allocate(depth * num_stokes);
+  work = new plane_work[num_planes];
+  int c;
+  for (c=0; c < num_planes; c++) {
+    plane_work &w = work[c];
+    w.count = w.blank = w.next_sample = 0;
+    w.minval = FLT_MAX;  w.maxval = -FLT_MAX;
+    w.sum = w.sum_sq = 0.0;
+  }
+
+  // For percentiles and histograms we keep an evenly spaced subset of every
+  // plane
+  kdu_long plane_samples = ((kdu_long) width) * height;
+  stride = 0;
+  if ((num_percentiles > 0) || (num_bins > 0)) {
+    kdu_long keep = SKA_STATS_MAX_SAMPLES / num_planes;
+    if (keep < SKA_STATS_MIN_PLANE_SAMPLES)
+      keep = SKA_STATS_MIN_PLANE_SAMPLES;
+    stride = (plane_samples + keep - 1) / keep;
+    for (c=0; c < num_planes; c++)
+      work[c].samples.reserve((size_t)(plane_samples / stride + 1));
+  }
+
+  // Stripes end on whole chunks (or tiles) of the file, and as many planes
+  // are read before measuring them as fit in our budget. Readers expect
+  // every component of a stripe before moving on.
+  int block = (cube.block_height > 0)?cube.block_height:1;
+  int rows = ((SKA_STATS_ROWS + block - 1) / block) * block;
+  kdu_long stripe_samples = ((kdu_long) width) * rows;
+  kdu_long group = SKA_STATS_GROUP_BYTES / (sizeof(float) * stripe_samples);
+  group = (group < 1)?1:((group > num_planes)?num_planes:group);
+  group_stride = stripe_samples;
+  group_buf = new float[group * stripe_samples];
+  for (int r=0; r < height; r += group_rows) {
+    group_rows = rows - ((y + r) % block);
+    group_rows = (group_rows < height - r)?group_rows:(height - r);
+    group_y = r;
+    for (c=0; c < num_planes; c += (int) group) {
+      int n = (num_planes - c < group)?(num_planes - c):(int) group;
+      for (int k=0; k < n; k++)
+        cube.read_raw_stripe(group_rows,group_buf + k*stripe_samples,c+k);
+      group_first = c;
+      batch.run(n,measure_plane,this,cube.env,"SKA statistics");
+    }
+  }
+  delete[] group_buf;
+  group_buf = NULL;
+
+  // Put the subsets of every plane together for the global percentiles
+  // before they are reordered
+  std::vector<float> all;
+  if (stride > 0) {
+    size_t total = 0;
+    for (c=0; c < num_planes; c++)
+      total += work[c].samples.size();
+    all.reserve(total);
+    for (c=0; c < num_planes; c++)
+      all.insert(all.end(),work[c].samples.begin(),work[c].samples.end());
+  }
+
+  batch.run(num_planes,finish_task,this,cube.env,"SKA statistics");
+
+  global.minval = FLT_MAX;  global.maxval = -FLT_MAX;
+  double sum = 0.0, sum_sq = 0.0;
+  for (c=0; c < num_planes; c++) {
+    plane_work &w = work[c];
+    global.num_samples += w.count;
+    global.num_blank += w.blank;
+    if (w.count > 0) {
+      global.minval = (w.minval < global.minval)?w.minval:global.minval;
+      global.maxval = (w.maxval > global.maxval)?w.maxval:global.maxval;
+    }
+    sum += w.sum;  sum_sq += w.sum_sq;
+  }
+  if (global.num_samples > 0) {
+    global.mean = sum / global.num_samples;
+    global.rms = sqrt(sum_sq / global.num_samples);
+  }
+  finish_plane(global,all);
+  delete[] work;
+  work = NULL;
+}
+
+/*****************************************************************************/
+/* STATIC                   ska_cube_stats::measure_plane                    */
+/*****************************************************************************/
+
+void
+  ska_cube_stats::measure_plane(void *context, int task_idx,
+      kdu_thread_env *env)
+{
+  ska_cube_stats *obj = (ska_cube_stats *) context;
+  plane_work &w = obj->work[obj->group_first + task_idx];
+  const float *buf = obj->group_buf + task_idx * obj->group_stride;
+  int num = obj->group_rows * obj->width;
+  kdu_long base = ((kdu_long) obj->group_y) * obj->width;
+  float mn = w.minval, mx = w.maxval;
+  double sum = 0.0, sum_sq = 0.0;
+  kdu_long count = 0;
+  for (int i=0; i < num; i++) {
+    float v = buf[i];
+    if (v != v)
+      continue; // Blank
+    mn = (v < mn)?v:mn;
+    mx = (v > mx)?v:mx;
+    sum += v;
+    sum_sq += ((double) v) * v;
+    count++;
+    if ((obj->stride > 0) && ((base+i) >= w.next_sample)) {
+      w.samples.push_back(v);
+      w.next_sample += obj->stride;
+    }
+  }
+  w.minval = mn;  w.maxval = mx;
+  w.sum += sum;  w.sum_sq += sum_sq;
+  w.count += count;
+  w.blank += num - count;
+}
+
+/*****************************************************************************/
+/* STATIC                   ska_cube_stats::finish_task                      */
+/*****************************************************************************/
+
+void
+  ska_cube_stats::finish_task(void *context, int task_idx,
+      kdu_thread_env *env)
+{
+  ska_cube_stats *obj = (ska_cube_stats *) context;
+  plane_work &w = obj->work[task_idx];
+  ska_plane_stats &stats = obj->planes[task_idx];
+  stats.num_samples = w.count;
+  stats.num_blank = w.blank;
+  if (w.count > 0) {
+    stats.minval = w.minval;  stats.maxval = w.maxval;
+    stats.mean = w.sum / w.count;
+    stats.rms = sqrt(w.sum_sq / w.count);
+  }
+  obj->finish_plane(stats,w.samples);
+}
+
+/*****************************************************************************/
+/*                        ska_cube_stats::finish_plane                       */
+/*****************************************************************************/
+
+void
+  ska_cube_stats::finish_plane(ska_plane_stats &stats,
+      std::vector<float> &samples)
+  /* Fills in the percentiles and histogram of `stats', whose range has been
+   * found, from `samples', which are reordered. */
+{
+  if (stats.num_samples == 0) {
+    stats.minval = stats.maxval = stats.mean = stats.rms = NAN;
+    for (int p=0; p < num_percentiles; p++)
+      stats.percentiles[p] = NAN;
+    return;
+  }
+  if (samples.empty())
+    return;
+  if (num_bins > 0) {
+    double range = stats.maxval - stats.minval;
+    double scale = (range > 0.0)?(num_bins / range):0.0;
+    for (size_t i=0; i < samples.size(); i++) {
+      int bin = (int)((samples[i] - stats.minval) * scale);
+      bin = (bin < num_bins)?bin:(num_bins-1);
+      stats.histogram[bin]++;
+    }
+  }
+  for (int p=0; p < num_percentiles; p++)
+    stats.percentiles[p] = find_percentile(samples,percentiles[p]);
+}
+
+/*****************************************************************************/
+/*                           ska_cube_stats::write                           */
+/*****************************************************************************/
+
+void
+  ska_cube_stats::write(const char *fname, const char *source) const
+{
+  FILE *fp = fopen(fname,"w");
+  if (fp == NULL)
+    { kdu_error e; e << "Unable to open statistics file, \"" << fname
+      << "\", for writing."; }
+  fprintf(fp,"# SkuareView cube statistics\n");
+  fprintf(fp,"source %s\n",source);
+  fprintf(fp,"region %d %d %d %d %d %d %d %d\n",x,y,z,width,height,depth,
+      first_stokes,num_stokes);
+  fprintf(fp,"sample_stride %lld\n",(long long) stride);
+  fprintf(fp,"percentiles %d",num_percentiles);
+  int p, c;
+  for (p=0; p < num_percentiles; p++)
+    fprintf(fp," %.17g",percentiles[p]);
+  fprintf(fp,"\nbins %d\n",num_bins);
+  fprintf(fp,"# plane samples blank min max mean rms [percentiles]\n");
+  for (c=0; c <= num_planes; c++) {
+    const ska_plane_stats &stats = (c < num_planes)?planes[c]:global;
+    if (c < num_planes)
+      fprintf(fp,"plane %d",c);
+    else
+      fprintf(fp,"global");
+    fprintf(fp," %lld %lld %.17g %.17g %.17g %.17g",
+        (long long) stats.num_samples,(long long) stats.num_blank,
+        stats.minval,stats.maxval,stats.mean,stats.rms);
+    for (p=0; p < num_percentiles; p++)
+      fprintf(fp," %.17g",stats.percentiles[p]);
+    fprintf(fp,"\n");
+  }
+  if (num_bins > 0) {
+    fprintf(fp,"# histogram <plane|global> <counts>, with bins spanning min "
+        "to max\n");
+    for (c=0; c <= num_planes; c++) {
+      const ska_plane_stats &stats = (c < num_planes)?planes[c]:global;
+      if (c < num_planes)
+        fprintf(fp,"histogram %d",c);
+      else
+        fprintf(fp,"histogram global");
+      for (int b=0; b < num_bins; b++)
+        fprintf(fp," %lld",(long long) stats.histogram[b]);
+      fprintf(fp,"\n");
+    }
+  }
+  if (fclose(fp) != 0)
+    { kdu_error e; e << "Unable to write statistics file, \"" << fname
+      << "\"."; }
+}
+
+/*****************************************************************************/
+/*                           ska_cube_stats::read                            */
+/*****************************************************************************/
+
+void
+  ska_cube_stats::read(const char *fname)
+{
+  FILE *fp = fopen(fname,"r");
+  if (fp == NULL)
+    { kdu_error e; e << "Unable to open statistics file, \"" << fname
+      << "\"."; }
+  char *line = new char[SKA_STATS_MAX_LINE];
+  bool have_region = false, have_planes = false;
+  int line_no = 0;
+  double *vals = NULL;
+  reset();
+  while (fgets(line,SKA_STATS_MAX_LINE,fp) != NULL) {
+    line_no++;
+    char *string = line;
+    bool ok = true;
+    if ((line[0] == '#') || (line[0] == '\n') ||
+        (strncmp(line,"source ",7) == 0))
+      continue;
+    else if (strncmp(line,"region ",7) == 0) {
+      ok = (sscanf(line+7,"%d %d %d %d %d %d %d %d",&x,&y,&z,&width,&height,
+            &depth,&first_stokes,&num_stokes) == 8) && !have_planes &&
+        (width > 0) && (height > 0) && (depth > 0) && (num_stokes > 0);
+      have_region = ok;
+    }
+    else if (strncmp(line,"sample_stride ",14) == 0) {
+      long long val = 0;
+      ok = (sscanf(line+14,"%lld",&val) == 1) && (val >= 0);
+      stride = (kdu_long) val;
+    }
+    else if (strncmp(line,"percentiles ",12) == 0) {
+      string = line + 12;
+      int num = (int) strtol(string,&string,10);
+      ok = (num >= 0) && !have_planes;
+      double *values = (ok && (num > 0))?(new double[num]):NULL;
+      ok = ok && read_numbers(string,values,num);
+      if (ok)
+        set_percentiles(values,num);
+      delete[] values;
+    }
+    else if (strncmp(line,"bins ",5) == 0)
+      ok = (sscanf(line+5,"%d",&num_bins) == 1) && (num_bins >= 0) &&
+        !have_planes;
+    else if ((strncmp(line,"plane ",6) == 0) ||
+             (strncmp(line,"global ",7) == 0) ||
+             (strncmp(line,"histogram ",10) == 0)) {
+      if (!have_planes) {
+        if (!have_region)
+          break;
+        allocate(depth * num_stokes);
+        vals = new double[6 + num_percentiles];
+        have_planes = true;
+      }
+      bool histogram = (line[0] == 'h');
+      string = line + ((histogram)?10:0);
+      int c = num_planes;
+      if (strncmp(string,"global",6) == 0)
+        string += 6;
+      else {
+        if (!histogram)
+          string += 6;
+        c = (int) strtol(string,&string,10);
+        ok = (c >= 0) && (c < num_planes);
+      }
+      ska_plane_stats &stats = (c < num_planes)?planes[c]:global;
+      if (ok && histogram) {
+        for (int b=0; ok && (b < num_bins); b++) {
+          char *end;
+          stats.histogram[b] = (kdu_long) strtoll(string,&end,10);
+          ok = (end != string);
+          string = end;
+        }
+      }
+      else if (ok && (ok = read_numbers(string,vals,6+num_percentiles))) {
+        stats.num_samples = (kdu_long) vals[0];
+        stats.num_blank = (kdu_long) vals[1];
+        stats.minval = vals[2];  stats.maxval = vals[3];
+        stats.mean = vals[4];  stats.rms = vals[5];
+        for (int p=0; p < num_percentiles; p++)
+          stats.percentiles[p] = vals[6+p];
+      }
+    }
+    if (!ok) {
+      delete[] line;
+      delete[] vals;
+      fclose(fp);
+      { kdu_error e; e << "Malformed statistics file, \"" << fname
+        << "\", at line " << line_no << "."; }
+    }
+  }
+  delete[] line;
+  delete[] vals;
+  fclose(fp);
+  if (!have_planes)
+    { kdu_error e; e << "\"" << fname << "\" is not a statistics file "
+      "written by skuareview-stats."; }
+}
+
+/*****************************************************************************/
+/*                       ska_cube_stats::get_percentile                      */
+/*****************************************************************************/
+
+bool
+  ska_cube_stats::get_percentile(int plane, double value,
+      double &result) const
+{
+  const ska_plane_stats &stats = (plane < 0)?global:planes[plane];
+  for (int p=0; p < num_percentiles; p++)
+    if (fabs(percentiles[p] - value) < 1.0E-9) {
+      result = stats.percentiles[p];
+      return true;
+    }
+  return false;
+}
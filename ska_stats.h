@@ -0,0 +1,99 @@
+/*****************************************************************************/
+//
+//  @file: ska_stats.h
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Statistics of the planes of a cube (ranges, blank counts,
+//         percentiles and histograms), gathered in one pass by the encoder's
+//         normalization pre-scan and by skuareview-stats, whose output the
+//         encoder can read back instead of scanning the cube again.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+#ifndef SKA_STATS_H
+#define SKA_STATS_H
+
+#include <vector>
+#include "kdu_elementary.h"
+#include "ska_threads.h"
+
+class ska_source_file;
+
+/**
+ * Statistics of one plane, or of the whole cube. Blank (NaN) samples are
+ * only counted; everything else is over the remaining samples, and is NaN
+ * if there are none.
+ */
+struct ska_plane_stats {
+  kdu_long num_samples; // Samples which are not blank
+  kdu_long num_blank;
+  double minval, maxval;
+  double mean, rms;
+  double *percentiles; // One for each of `ska_cube_stats::percentiles'
+  kdu_long *histogram; // `ska_cube_stats::num_bins' bins over min to max
+};
+
+/*****************************************************************************/
+/*                            class ska_cube_stats                           */
+/*****************************************************************************/
+
+class ska_cube_stats {
+  /* Planes are numbered as the components of `ska_source_file' are: those of
+   * each selected Stokes parameter, one after another. Ranges, counts and
+   * moments are exact. Percentiles and histograms are found from an evenly
+   * spaced subset of the samples of every plane (all of them, for cubes of
+   * up to 2^24 samples), which is the subset the percentile normalization
+   * has always used, so that reading the ranges back from a file changes
+   * nothing. The global percentiles and histogram use the subsets of every
+   * plane together. */
+  public: // Member functions
+    ska_cube_stats();
+    ~ska_cube_stats();
+    void set_percentiles(const double *values, int num);
+    /* Percentiles (0 to 100) to find; none by default. */
+    void set_histogram(int bins) { num_bins = bins; }
+    /* Number of histogram bins; 0 (the default) for no histograms. */
+    void gather(ska_source_file &cube);
+    /* Reads the whole of `cube', which must have been opened with
+     * `raw_access', once. Each stripe is read for a group of planes, at a
+     * height which is a multiple of the reader's `block_height', and the
+     * planes of the group are then measured in parallel on `cube.env'. */
+    void write(const char *fname, const char *source) const;
+    /* Writes the statistics as text; `source' names the cube. */
+    void read(const char *fname);
+    /* Reads a file written by `write', generating an error if it is
+     * malformed. */
+    bool get_percentile(int plane, double value, double &result) const;
+    /* Returns false if `value' is not one of `percentiles'. `plane' may be
+     * -1 for the whole cube. */
+  private: // Helper functions
+    void reset();
+    void allocate(int planes);
+    static void measure_plane(void *context, int task_idx,
+        kdu_thread_env *env);
+    static void finish_task(void *context, int task_idx,
+        kdu_thread_env *env);
+    void finish_plane(ska_plane_stats &stats, std::vector<float> &samples);
+  public: // Data
+    int x, y, z; // Position of the cube in the file
+    int width, height, depth; // `depth' planes of each Stokes parameter
+    int first_stokes, num_stokes;
+    int num_planes; // `depth' * `num_stokes'
+    int num_percentiles;
+    double *percentiles;
+    int num_bins;
+    ska_plane_stats *planes;
+    ska_plane_stats global;
+  private: // Used by `gather'
+    struct plane_work; // Partial sums of a plane
+    plane_work *work;
+    float *group_buf; // Stripes of the planes being measured
+    kdu_long group_stride; // Samples from one stripe to the next
+    int group_first, group_rows, group_y; // First plane, rows and first row
+    kdu_long stride; // Distance between the samples kept
+    ska_job_batch batch;
+};
+
+#endif
@@ -0,0 +1,242 @@
+/*****************************************************************************/
+//
+//  @file: ska_stats_app.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief skuareview-stats: measures every plane of a FITS or HDF5 cube
+//         (range, blank samples, mean, rms, percentiles and histogram) in one
+//         parallel pass, and writes a statistics file which skuareview-encode
+//         reads with `-stats' instead of scanning the cube itself.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <iostream>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// Core includes
+#include "kdu_elementary.h"
+#include "kdu_messaging.h"
+#include "kdu_sample_processing.h"
+// Application includes
+#include "kdu_args.h"
+#include "jp2.h"
+// SKA includes
+#include "ska_local.h"
+#include "ska_stats.h"
+
+// Percentiles found unless `-percentiles' says otherwise; they include the
+// default `-norm_clip' of the encoder
+static const double default_percentiles[] =
+  { 0.01, 0.1, 1.0, 5.0, 50.0, 95.0, 99.0, 99.9, 99.99 };
+
+/* ========================================================================= */
+/*                         Set up messaging services                         */
+/* ========================================================================= */
+
+class kdu_stream_message : public kdu_thread_safe_message {
+  public: // Member classes
+    kdu_stream_message(std::ostream *stream)
+      { this->stream = stream; }
+    void put_text(const char *string)
+      { (*stream) << string; }
+    void flush(bool end_of_message=false)
+      { stream->flush();
+        kdu_thread_safe_message::flush(end_of_message); }
+  private: // Data
+    std::ostream *stream;
+};
+
+static kdu_stream_message cout_message(&std::cout);
+static kdu_stream_message cerr_message(&std::cerr);
+static kdu_message_formatter pretty_cout(&cout_message);
+static kdu_message_formatter pretty_cerr(&cerr_message);
+
+/* ========================================================================= */
+/*                            Internal Functions                             */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/* STATIC                        print_usage                                 */
+/*****************************************************************************/
+
+static void
+  print_usage(char *prog, bool comprehensive=false)
+{
+  kdu_message_formatter out(&cout_message);
+
+  out << "Usage:\n  \"" << prog << " ...\n";
+  out.set_master_indent(3);
+  out << "-i <cube (.fits, .fz or .h5)>\n";
+  out << "-o <statistics file>\n";
+  if (comprehensive)
+    out << "\tPass the file to skuareview-encode with `-stats' (along with "
+      "the same `-icrop' and `-stokes' arguments, or a subset of the planes "
+      "and Stokes parameters) and it will take the ranges of its "
+      "normalization from the file rather than scanning the cube.\n";
+  out << "-icrop {<x>,<y>,<z>,<width>,<height>,<depth>}\n";
+  out << "-stokes <s> or {<first>,<last>}\n";
+  if (comprehensive)
+    out << "\tAs for skuareview-encode.  Every Stokes parameter is measured "
+      "by default.\n";
+  out << "-percentiles <percentile>[,...]\n";
+  if (comprehensive)
+    out << "\tPercentiles (0 to 100) of every plane and of the whole cube.  "
+      "Default is 0.01,0.1,1,5,50,95,99,99.9,99.99.  skuareview-encode's "
+      "`-norm percentile' needs those given by its `-norm_clip'.\n";
+  out << "-bins <number of histogram bins>\n";
+  if (comprehensive)
+    out << "\tHistograms span the range of each plane, and of the whole "
+      "cube.  Default is 64; 0 writes no histograms.  Percentiles and "
+      "histograms are found from an evenly spaced subset of at most 2^24 "
+      "samples of the cube (recorded as `sample_stride').\n";
+  out << "-num_threads <0, or number of parallel threads to use>\n";
+  if (comprehensive)
+    out << "\tThreads which decompress chunks or tiles of the cube and "
+      "measure its planes.  Default is the number of CPUs.\n";
+  out << "-usage -- print a comprehensive usage statement.\n";
+  out << "-u -- print a brief usage statement.\"\n\n";
+  out.flush();
+  exit(0);
+}
+
+/*****************************************************************************/
+/* STATIC                      parse_stats_args                              */
+/*****************************************************************************/
+
+static void
+  parse_stats_args(kdu_args &args, ska_source_file &cube,
+                   ska_cube_stats &stats, char * &ofname, int &num_threads)
+{
+  if ((args.get_first() == NULL) || (args.find("-u") != NULL))
+    print_usage(args.get_prog_name());
+  if (args.find("-usage") != NULL)
+    print_usage(args.get_prog_name(),true);
+
+  const char *string;
+  if (args.find("-i") != NULL)
+    {
+      if ((string = args.advance()) == NULL)
+        { kdu_error e; e << "\"-i\" argument requires a file name!"; }
+      cube.fname = new char[strlen(string)+1];
+      strcpy(cube.fname,string);
+      args.advance();
+    }
+  else
+    { kdu_error e; e << "You must supply an input file."; }
+
+  if (args.find("-o") != NULL)
+    {
+      if ((string = args.advance()) == NULL)
+        { kdu_error e; e << "\"-o\" argument requires a file name!"; }
+      ofname = new char[strlen(string)+1];
+      strcpy(ofname,string);
+      args.advance();
+    }
+  else
+    { kdu_error e; e << "You must supply an output file name."; }
+
+  std::vector<double> percentiles(default_percentiles,default_percentiles +
+      sizeof(default_percentiles)/sizeof(default_percentiles[0]));
+  if (args.find("-percentiles") != NULL)
+    {
+      if ((string = args.advance()) == NULL)
+        { kdu_error e; e << "\"-percentiles\" argument requires a list!"; }
+      percentiles.clear();
+      while (*string != '\0')
+        {
+          char *end;
+          double val = strtod(string,&end);
+          if ((end == string) || (val < 0.0) || (val > 100.0) ||
+              ((*end != ',') && (*end != '\0')))
+            { kdu_error e; e << "\"-percentiles\" argument requires a "
+              "comma-separated list of percentiles, from 0 to 100."; }
+          percentiles.push_back(val);
+          string = (*end == ',')?(end+1):end;
+        }
+      args.advance();
+    }
+  stats.set_percentiles(percentiles.empty()?NULL:&percentiles[0],
+                        (int) percentiles.size());
+
+  int bins = 64;
+  if (args.find("-bins") != NULL)
+    {
+      if (((string = args.advance()) == NULL) ||
+          (sscanf(string,"%d",&bins) != 1) || (bins < 0))
+        { kdu_error e; e << "\"-bins\" argument requires a non-negative "
+          "integer."; }
+      args.advance();
+    }
+  stats.set_histogram(bins);
+
+  if ((num_threads = kdu_get_num_processors()) < 2)
+    num_threads = 0;
+  if (args.find("-num_threads") != NULL)
+    {
+      if (((string = args.advance()) == NULL) ||
+          (sscanf(string,"%d",&num_threads) != 1) || (num_threads < 0))
+        { kdu_error e; e << "\"-num_threads\" argument requires a "
+          "non-negative integer."; }
+      args.advance();
+    }
+}
+
+/* ========================================================================= */
+/*                             External Functions                            */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                                   main                                    */
+/*****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+  kdu_customize_warnings(&pretty_cout);
+  kdu_customize_errors(&pretty_cerr);
+  kdu_args args(argc,argv,"-s");
+
+  ska_source_file cube;
+  ska_cube_stats stats;
+  char *ofname;
+  int num_threads;
+  parse_stats_args(args,cube,stats,ofname,num_threads);
+
+  kdu_thread_env env, *env_ref=NULL;
+  if (num_threads > 0) {
+    env.create();
+    for (int nt=1; nt < num_threads; nt++)
+      if (!env.add_thread())
+        num_threads = nt; // Unable to create all the threads requested
+    env_ref = &env;
+  }
+
+  // The cube is read exactly as the encoder's pre-scan reads it; its own
+  // arguments (`-icrop', `-stokes') are parsed by `read_header'
+  jp2_family_tgt no_tgt;
+  cube.raw_access = true;
+  cube.env = env_ref;
+  cube.read_header(no_tgt,args);
+  if (args.show_unrecognized(pretty_cout) != 0)
+    { kdu_error e; e << "There were unrecognized command line arguments!"; }
+
+  std::cout << "Measuring " << cube.crop.depth * cube.crop.num_stokes
+            << " planes of " << cube.crop.width << " x " << cube.crop.height
+            << " samples..." << std::endl;
+  stats.gather(cube);
+  stats.write(ofname,cube.fname);
+
+  const ska_plane_stats &all = stats.global;
+  std::cout << "Samples: " << all.num_samples << " (" << all.num_blank
+            << " blank)\nDATAMIN = " << all.minval << "\nDATAMAX = "
+            << all.maxval << std::endl;
+
+  delete[] ofname;
+  if (env.exists())
+    env.destroy();
+  return 0;
+}
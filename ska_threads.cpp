@@ -0,0 +1,319 @@
+/*****************************************************************************/
+//
+//  @file: ska_threads.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Implements `ska_job_batch' and `ska_io_queue', declared in
+//         ska_threads.h
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <errno.h>
+#include <unistd.h>
+// Core includes
+#include "kdu_arch.h"
+#include "kdu_messaging.h"
+// SKA includes
+#include "ska_threads.h"
+
+/* ========================================================================= */
+/*                                ska_job_batch                              */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                         ska_job_batch::ska_job_batch                      */
+/*****************************************************************************/
+
+ska_job_batch::ska_job_batch()
+{
+  num_jobs = max_jobs = 0;
+  jobs = NULL;
+  job_refs = NULL;
+  func = NULL;
+  context = NULL;
+  num_tasks = 0;
+  next_task.set(0);
+  active_jobs.set(0);
+}
+
+/*****************************************************************************/
+/*                        ska_job_batch::~ska_job_batch                      */
+/*****************************************************************************/
+
+ska_job_batch::~ska_job_batch()
+{
+  delete[] jobs;
+  delete[] job_refs;
+}
+
+/*****************************************************************************/
+/*                             ska_job_batch::run                            */
+/*****************************************************************************/
+
+void
+  ska_job_batch::run(int num_tasks, ska_task_func func, void *context,
+      kdu_thread_env *env, const char *domain_name)
+{
+  if (num_tasks <= 0)
+    return;
+  int num_threads = (env == NULL)?1:env->get_num_threads();
+  if ((num_threads < 2) || (num_tasks == 1)) {
+    for (int t=0; t < num_tasks; t++)
+      func(context,t,env);
+    return;
+  }
+
+  this->func = func;
+  this->context = context;
+  this->num_tasks = num_tasks;
+  num_jobs = (num_tasks < num_threads)?num_tasks:num_threads;
+  if (num_jobs > max_jobs) {
+    delete[] jobs;
+    delete[] job_refs;
+    max_jobs = num_jobs;
+    jobs = new ska_batch_job[max_jobs];
+    job_refs = new kdu_thread_job *[max_jobs];
+  }
+  for (int j=0; j < num_jobs; j++) {
+    jobs[j].set_job_func(do_tasks);
+    jobs[j].owner = this;
+    job_refs[j] = jobs + j;
+  }
+  next_task.set(0);
+  active_jobs.set(num_jobs);
+
+  if (!env->attach_queue(this,NULL,domain_name))
+    { kdu_error e; e << "Unable to attach SkuareView job queue to the "
+      "multi-threaded environment."; }
+  bind_jobs(job_refs,num_jobs);
+  schedule_jobs(job_refs,num_jobs,env,true);
+  env->join(this); // Caller's thread does work while it waits
+}
+
+/*****************************************************************************/
+/* STATIC                    ska_job_batch::do_tasks                         */
+/*****************************************************************************/
+
+void
+  ska_job_batch::do_tasks(kdu_thread_job *job, kdu_thread_entity *caller)
+{
+  ska_job_batch *batch = ((ska_batch_job *) job)->owner;
+  kdu_thread_env *env = (kdu_thread_env *) caller;
+  int t;
+  while ((t = batch->next_task.exchange_add(1)) < batch->num_tasks)
+    batch->func(batch->context,t,env);
+  if (batch->active_jobs.exchange_add(-1) == 1)
+    batch->all_done(caller); // Must be the last thing we touch
+}
+
+/* ========================================================================= */
+/*                                ska_io_queue                               */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                          ska_io_queue::ska_io_queue                       */
+/*****************************************************************************/
+
+ska_io_queue::ska_io_queue()
+{
+  io = NULL;
+  done = NULL;
+  context = NULL;
+  num_threads = 0;
+  threads = NULL;
+  first_pending = last_pending = NULL;
+  closing = false;
+  error = 0;
+}
+
+/*****************************************************************************/
+/*                             ska_io_queue::start                           */
+/*****************************************************************************/
+
+int
+  ska_io_queue::start(int num_threads, ska_io_func io, ska_io_done_func done,
+                      void *context)
+{
+  stop();
+  this->io = io;
+  this->done = done;
+  this->context = context;
+  first_pending = last_pending = NULL;
+  closing = false;
+  error = 0;
+  if (!(mutex.create() && work_ready.create(true) && work_done.create(true)))
+    { kdu_error e; e << "Unable to create synchronization objects for "
+      "SkuareView I/O threads."; }
+  if (num_threads > 0)
+    {
+      threads = new kdu_thread[num_threads];
+      for (this->num_threads=0; this->num_threads < num_threads;
+           this->num_threads++)
+        if (!threads[this->num_threads].create(run_thread,this))
+          break;
+    }
+  return this->num_threads;
+}
+
+/*****************************************************************************/
+/*                             ska_io_queue::stop                            */
+/*****************************************************************************/
+
+void
+  ska_io_queue::stop(bool discard_pending)
+{
+  if (!mutex.exists())
+    return;
+  mutex.lock();
+  if (discard_pending)
+    while (first_pending != NULL)
+      {
+        ska_io_job *job = first_pending;
+        first_pending = job->queue_next;
+        done(context,job);
+      }
+  closing = true;
+  work_ready.set();
+  mutex.unlock();
+  for (int t=0; t < num_threads; t++)
+    threads[t].destroy(); // Waits for the thread to exit
+  delete[] threads;
+  threads = NULL;
+  num_threads = 0;
+  first_pending = last_pending = NULL;
+  mutex.destroy();
+  work_ready.destroy();
+  work_done.destroy();
+}
+
+/*****************************************************************************/
+/*                             ska_io_queue::push                            */
+/*****************************************************************************/
+
+void
+  ska_io_queue::push(ska_io_job *job)
+{
+  job->queue_next = NULL;
+  if (last_pending == NULL)
+    first_pending = job;
+  else
+    last_pending->queue_next = job;
+  last_pending = job;
+  work_ready.set();
+}
+
+/*****************************************************************************/
+/*                          ska_io_queue::wait_done                          */
+/*****************************************************************************/
+
+void
+  ska_io_queue::wait_done()
+{
+  work_done.reset();
+  work_done.wait(mutex);
+}
+
+/*****************************************************************************/
+/* STATIC                     ska_io_queue::run_thread                       */
+/*****************************************************************************/
+
+kdu_thread_startproc_result KDU_THREAD_STARTPROC_CALL_CONVENTION
+  ska_io_queue::run_thread(void *param)
+{
+  ska_io_queue *obj = (ska_io_queue *) param;
+  obj->mutex.lock();
+  while (true)
+    {
+      ska_io_job *job = obj->first_pending;
+      if (job == NULL)
+        {
+          if (obj->closing)
+            break;
+          obj->work_ready.reset();
+          obj->work_ready.wait(obj->mutex);
+          continue;
+        }
+      if ((obj->first_pending = job->queue_next) == NULL)
+        obj->last_pending = NULL;
+      if (obj->error == 0)
+        {
+          obj->mutex.unlock();
+          int err = obj->io(obj->context,job);
+          obj->mutex.lock();
+          obj->set_error(err);
+        }
+      obj->done(obj->context,job);
+      obj->work_done.set();
+    }
+  obj->mutex.unlock();
+  return KDU_THREAD_STARTPROC_ZERO_RESULT;
+}
+
+/*****************************************************************************/
+/* EXTERN                        ska_pread_fully                             */
+/*****************************************************************************/
+
+int
+  ska_pread_fully(int fd, void *data, size_t num_bytes, kdu_long offset)
+{
+  char *cp = (char *) data;
+  size_t total = 0;
+  while (total < num_bytes)
+    {
+      ssize_t got = pread(fd,cp+total,num_bytes-total,(off_t)(offset+total));
+      if (got < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+      if (got == 0)
+        break;
+      total += (size_t) got;
+    }
+  return (int) total;
+}
+
+/*****************************************************************************/
+/* EXTERN                        ska_pwrite_fully                            */
+/*****************************************************************************/
+
+int
+  ska_pwrite_fully(int fd, const void *data, size_t num_bytes,
+                   kdu_long offset)
+{
+  const char *cp = (const char *) data;
+  while (num_bytes > 0)
+    {
+      ssize_t written = pwrite(fd,cp,num_bytes,(off_t) offset);
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return errno;
+        }
+      cp += written;  offset += written;  num_bytes -= (size_t) written;
+    }
+  return 0;
+}
+
+/*****************************************************************************/
+/* EXTERN                      ska_create_threads                            */
+/*****************************************************************************/
+
+int
+  ska_create_threads(kdu_thread_env &env, int num_threads, bool numa)
+{
+  kdu_long node_affinity[64];
+  int num_nodes = (numa)?kdu_get_numa_nodes(node_affinity,64):0;
+  env.create(); // The caller's thread stays where it is
+  for (int nt=1; nt < num_threads; nt++) {
+    int node = (num_nodes > 1)?(nt % num_nodes):-1;
+    if (!env.add_thread(NULL,(node < 0)?0:node_affinity[node],node))
+      return nt; // Unable to create all the threads requested
+  }
+  return num_threads;
+}
@@ -0,0 +1,164 @@
+/*****************************************************************************/
+//
+//  @file: ska_threads.h
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Runs batches of independent SkuareView tasks (one per component,
+//         chunk, etc.) on the threads of a Kakadu multi-threaded environment,
+//         and blocking file I/O on a few threads of its own.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+#ifndef SKA_THREADS_H
+#define SKA_THREADS_H
+
+#include "kdu_elementary.h"
+#include "kdu_sample_processing.h" // For `kdu_thread_env'
+
+/* Function run once for every task of a batch. `task_idx' lies in the range
+ * 0 to `num_tasks'-1 and `env' is the thread executing the task, or NULL if
+ * the batch is being run without a multi-threaded environment. */
+typedef void (*ska_task_func)(void *context, int task_idx,
+    kdu_thread_env *env);
+
+class ska_job_batch;
+
+/*****************************************************************************/
+/*                             class ska_job_batch                           */
+/*****************************************************************************/
+
+class ska_job_batch : public kdu_thread_queue {
+  /* Runs a number of independent tasks across the threads of a
+   * `kdu_thread_env', sharing them with whatever Kakadu is already doing on
+   * that environment (e.g. the stripe compressor). We schedule one job per
+   * thread, rather than one per task, and each job pulls task indices from
+   * a shared counter until there are none left, so that a batch of thousands
+   * of planes costs only a handful of scheduling operations. The object may
+   * be reused for any number of batches. */
+  public: // Member functions
+    ska_job_batch();
+    ~ska_job_batch();
+    void run(int num_tasks, ska_task_func func, void *context,
+        kdu_thread_env *env, const char *domain_name="SkuareView");
+    /* Runs `func' for every task and returns once all of them have
+     * completed. If `env' is NULL, or has only one thread, the tasks are
+     * simply run in order on the caller's thread. The caller's thread also
+     * participates in the work while it waits. Kakadu requires queues which
+     * schedule jobs to name a thread domain; threads added to `env' without
+     * a domain will still pick up work from `domain_name'. */
+    int get_max_jobs() { return num_jobs; }
+  private: // Helper functions
+    static void do_tasks(kdu_thread_job *job, kdu_thread_entity *caller);
+  private: // Declarations
+    struct ska_batch_job : public kdu_thread_job {
+      ska_job_batch *owner;
+    };
+  private: // Data
+    int num_jobs; // Jobs scheduled for the current batch
+    int max_jobs; // Number of entries allocated in `jobs'
+    ska_batch_job *jobs;
+    kdu_thread_job **job_refs;
+    ska_task_func func;
+    void *context;
+    int num_tasks;
+    kdu_interlocked_int32 next_task;
+    kdu_interlocked_int32 active_jobs;
+};
+
+/*****************************************************************************/
+/*                             class ska_io_queue                            */
+/*****************************************************************************/
+
+struct ska_io_job {
+  /* Base of the requests queued by the owners of an `ska_io_queue', which
+   * derive their own requests from it. */
+  ska_io_job *queue_next; // Used by the queue while the job is pending
+};
+
+/* Performs the I/O of `job' on one of the threads of an `ska_io_queue',
+ * without its mutex held. Returns 0 or the `errno' of the failure. */
+typedef int (*ska_io_func)(void *context, ska_io_job *job);
+
+/* Called with the mutex held once `job' has been performed, or skipped. */
+typedef void (*ska_io_done_func)(void *context, ska_io_job *job);
+
+class ska_io_queue {
+  /* A first-in first-out queue of I/O requests, served by a few threads of
+   * its own, so that `pread', `pwrite' and `fdatasync' calls never hold up
+   * the threads of the Kakadu environment. The owner pushes jobs with the
+   * mutex held and waits, with the mutex held, for `done' to have updated
+   * whatever it is waiting on. With one thread the jobs are performed in
+   * the order they were pushed. Once a job fails, later ones are only
+   * passed to `done'; the error is reported by the owner, since errors can
+   * only be generated on its own thread. */
+  public: // Member functions
+    ska_io_queue();
+    ~ska_io_queue() { stop(); }
+    int start(int num_threads, ska_io_func io, ska_io_done_func done,
+              void *context);
+    /* Returns the number of threads actually started. With `num_threads'
+     * equal to 0 the object only provides its mutex, and `push' must not be
+     * called. Generates an error if the synchronization objects cannot be
+     * created. */
+    void stop(bool discard_pending=false);
+    /* Waits for the threads to finish every pending job (or, with
+     * `discard_pending', passes the jobs nobody has started straight to
+     * `done') and to exit. The object may then be started again. */
+    bool exists() { return mutex.exists(); }
+    void lock() { mutex.lock(); }
+    void unlock() { mutex.unlock(); }
+    void push(ska_io_job *job);
+    /* Call with the mutex held. */
+    void wait_done();
+    /* Call with the mutex held; returns after some job has been passed to
+     * `done', or spuriously. */
+    int get_error() { return error; }
+    /* The `errno' from the first job to fail, or from `set_error'. */
+    void set_error(int err) { if (error == 0) error = err; }
+  private: // Helper functions
+    static kdu_thread_startproc_result KDU_THREAD_STARTPROC_CALL_CONVENTION
+      run_thread(void *param);
+  private: // Data
+    ska_io_func io;
+    ska_io_done_func done;
+    void *context;
+    int num_threads;
+    kdu_thread *threads;
+    ska_io_job *first_pending, *last_pending;
+    bool closing; // Threads exit once `first_pending' is empty
+    int error;
+    kdu_mutex mutex;
+    kdu_event work_ready; // Something was pushed, or `closing' was set
+    kdu_event work_done; // A job was passed to `done'
+};
+
+/*****************************************************************************/
+/*                         ska_pread_fully / ska_pwrite_fully                */
+/*****************************************************************************/
+
+int ska_pread_fully(int fd, void *data, size_t num_bytes, kdu_long offset);
+/* Reads `num_bytes' at `offset' with `pread', retrying short reads and
+ * interrupted calls. Returns the number of bytes read, which is smaller
+ * than `num_bytes' only at the end of the file or on error. */
+
+int ska_pwrite_fully(int fd, const void *data, size_t num_bytes,
+                     kdu_long offset);
+/* Writes `num_bytes' at `offset' with `pwrite', in as many calls as it
+ * takes. Returns 0 or the `errno' of the failed write. */
+
+/*****************************************************************************/
+/*                             ska_create_threads                            */
+/*****************************************************************************/
+
+int ska_create_threads(kdu_thread_env &env, int num_threads, bool numa);
+/* Creates `env' with `num_threads' threads, the caller's being the first,
+ * and returns the number actually created. With `numa', on a machine with
+ * more than one NUMA node, the other threads are dealt out to the nodes in
+ * turn, each bound to the processors of its node and preferring the jobs of
+ * queues attached with that node (see `kdu_thread_queue::set_numa_node').
+ * The stripe compressors and decompressors then spread their tiles over the
+ * nodes, so that the buffers of a tile are allocated and used on one node. */
+
+#endif
@@ -0,0 +1,450 @@
+/*****************************************************************************/
+//
+//  @file: ska_wcs.cpp
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief Implements `ska_wcs', declared in ska_wcs.h. The projections
+//         follow Calabretta & Greisen (2002), "Representations of celestial
+//         coordinates in FITS".
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+// System includes
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+// SKA includes
+#include "ska_wcs.h"
+
+#define SKA_PROJ_LINEAR 0 // No projection; degrees along each axis
+#define SKA_PROJ_TAN 1
+#define SKA_PROJ_SIN 2
+#define SKA_PROJ_ARC 3
+#define SKA_PROJ_STG 4
+#define SKA_PROJ_ZEA 5
+
+// Points along each edge of a sky box mapped to find its pixel bounds
+#define SKA_WCS_EDGE_SAMPLES 64
+
+static const double deg = 180.0 / M_PI;
+
+/*****************************************************************************/
+/* STATIC                          read_record                               */
+/*****************************************************************************/
+
+static bool
+  read_record(const char *record, int length, char *keyword, char *value)
+  /* Splits a FITS record into its keyword (without trailing spaces) and
+   * value (without quotes or the comment). Returns false if the record has
+   * no value. */
+{
+  int k;
+  if ((length < 10) || (record[8] != '=') || (record[9] != ' '))
+    return false;
+  for (k=0; (k < 8) && (record[k] != ' '); k++)
+    keyword[k] = record[k];
+  keyword[k] = '\0';
+  const char *cp = record+10, *end = record+length;
+  while ((cp < end) && (*cp == ' '))
+    cp++;
+  k = 0;
+  if ((cp < end) && (*cp == '\''))
+    for (cp++; (cp < end) && (*cp != '\'') && (k < 70); cp++)
+      value[k++] = *cp;
+  else
+    for (; (cp < end) && (*cp != '/') && (*cp != ' ') && (k < 70); cp++)
+      value[k++] = *cp;
+  value[k] = '\0';
+  return true;
+}
+
+/*****************************************************************************/
+/* STATIC                          axis_index                                */
+/*****************************************************************************/
+
+static int
+  axis_index(const char *keyword, const char *prefix, int &j)
+  /* Returns i if `keyword' is `prefix'i (or `prefix'i_j, in which case `j'
+   * is set), for axes 1 to 3, else 0. */
+{
+  int len = (int) strlen(prefix);
+  if (strncmp(keyword,prefix,len) != 0)
+    return 0;
+  const char *cp = keyword+len;
+  if ((*cp < '1') || (*cp > '3'))
+    return 0;
+  int i = *cp - '0';
+  if (cp[1] == '\0')
+    { j = 0; return i; }
+  if ((cp[1] != '_') || (cp[2] < '1') || (cp[2] > '3') || (cp[3] != '\0'))
+    return 0;
+  j = cp[2] - '0';
+  return i;
+}
+
+/* ========================================================================= */
+/*                                  ska_wcs                                  */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                              ska_wcs::ska_wcs                             */
+/*****************************************************************************/
+
+ska_wcs::ska_wcs()
+{
+  problem = "No FITS header was found in the file.";
+  lon_axis = 0;  lat_axis = 1;
+  projection = SKA_PROJ_LINEAR;
+  for (int i=0; i < 3; i++)
+    crpix[i] = crval[i] = 0.0;
+  inverse[0][0] = inverse[1][1] = 1.0;
+  inverse[0][1] = inverse[1][0] = 0.0;
+  spec_delta = 1.0;
+  has_spectral = false;
+  native_pole_lon = 180.0;
+  ncp_eta = 0.0;
+}
+
+/*****************************************************************************/
+/*                                ska_wcs::init                              */
+/*****************************************************************************/
+
+bool
+  ska_wcs::init(const char *records)
+{
+  char ctype[3][71];
+  double cdelt[3] = {1.0,1.0,1.0}, pc[3][3], cd[3][3];
+  double crota = 0.0, lonpole = 0.0;
+  bool have_cd = false, have_pc = false, have_crota = false;
+  bool have_lonpole = false;
+  int i, j;
+  for (i=0; i < 3; i++)
+    {
+      ctype[i][0] = '\0';
+      for (j=0; j < 3; j++)
+        { pc[i][j] = (i == j)?1.0:0.0;  cd[i][j] = 0.0; }
+    }
+  has_spectral = false;
+  if (records == NULL)
+    { problem = "The file holds no FITS header."; return false; }
+
+  const char *record = records;
+  while ((record != NULL) && (*record != '\0'))
+    {
+      const char *next = strchr(record,'\n');
+      int length = (next == NULL)?(int)strlen(record):(int)(next-record);
+      char keyword[9], value[71];
+      if (read_record(record,length,keyword,value))
+        {
+          double v = atof(value);
+          if ((i = axis_index(keyword,"CTYPE",j)) && (j == 0))
+            { strcpy(ctype[i-1],value);  has_spectral |= (i == 3); }
+          else if ((i = axis_index(keyword,"CRPIX",j)) && (j == 0))
+            { crpix[i-1] = v;  has_spectral |= (i == 3); }
+          else if ((i = axis_index(keyword,"CRVAL",j)) && (j == 0))
+            { crval[i-1] = v;  has_spectral |= (i == 3); }
+          else if ((i = axis_index(keyword,"CDELT",j)) && (j == 0))
+            { cdelt[i-1] = v;  has_spectral |= (i == 3); }
+          else if ((i = axis_index(keyword,"CD",j)) && (j != 0))
+            { cd[i-1][j-1] = v;  have_cd |= (i < 3) && (j < 3); }
+          else if ((i = axis_index(keyword,"PC",j)) && (j != 0))
+            { pc[i-1][j-1] = v;  have_pc |= (i < 3) && (j < 3); }
+          else if (strcmp(keyword,"CROTA2") == 0)
+            { crota = v / deg;  have_crota = true; }
+          else if (strcmp(keyword,"LONPOLE") == 0)
+            { lonpole = v;  have_lonpole = true; }
+        }
+      record = (next == NULL)?NULL:(next+1);
+    }
+
+  // Celestial axes are named by the first 4 characters of CTYPEi, padded
+  // with '-', and the projection by characters 6 to 8
+  int proj_axis = -1;
+  lon_axis = lat_axis = -1;
+  for (i=0; i < 2; i++)
+    {
+      char name[5];
+      for (j=0; (j < 4) && (ctype[i][j] != '\0') && (ctype[i][j] != '-'); j++)
+        name[j] = ctype[i][j];
+      name[j] = '\0';
+      if (!strcmp(name,"RA") || !strcmp(name,"GLON") ||
+          !strcmp(name,"ELON") || !strcmp(name,"SLON"))
+        lon_axis = proj_axis = i;
+      else if (!strcmp(name,"DEC") || !strcmp(name,"GLAT") ||
+               !strcmp(name,"ELAT") || !strcmp(name,"SLAT"))
+        lat_axis = i;
+    }
+  if ((lon_axis < 0) || (lat_axis < 0))
+    { problem = "Axes 1 and 2 of the cube are not celestial (CTYPE1 and "
+      "CTYPE2 should be RA/DEC, GLON/GLAT or the like)."; return false; }
+  const char *code = (strlen(ctype[proj_axis]) >= 8)?
+    (ctype[proj_axis]+5):"";
+  ncp_eta = 0.0;
+  if (*code == '\0')
+    projection = SKA_PROJ_LINEAR;
+  else if (!strncmp(code,"TAN",3))
+    projection = SKA_PROJ_TAN;
+  else if (!strncmp(code,"SIN",3))
+    projection = SKA_PROJ_SIN;
+  else if (!strncmp(code,"NCP",3))
+    { // SIN, with the obliqueness fixed by the reference declination
+      projection = SKA_PROJ_SIN;
+      double lat0 = crval[lat_axis] / deg;
+      if (sin(lat0) == 0.0)
+        { problem = "The NCP projection is undefined at the equator.";
+          return false; }
+      ncp_eta = cos(lat0) / sin(lat0);
+    }
+  else if (!strncmp(code,"ARC",3))
+    projection = SKA_PROJ_ARC;
+  else if (!strncmp(code,"STG",3))
+    projection = SKA_PROJ_STG;
+  else if (!strncmp(code,"ZEA",3))
+    projection = SKA_PROJ_ZEA;
+  else
+    { problem = "Only the TAN, SIN, NCP, ARC, STG and ZEA projections are "
+      "supported."; return false; }
+  native_pole_lon = (have_lonpole)?lonpole:
+    ((crval[lat_axis] >= 90.0)?0.0:180.0);
+
+  // Pixel offsets to intermediate world coordinates
+  double m[2][2];
+  for (i=0; i < 2; i++)
+    for (j=0; j < 2; j++)
+      if (have_cd)
+        m[i][j] = cd[i][j];
+      else if (have_pc || !have_crota)
+        m[i][j] = cdelt[i] * pc[i][j];
+  if (have_crota && !(have_cd || have_pc))
+    {
+      m[0][0] = cdelt[0] * cos(crota);  m[0][1] = -cdelt[1] * sin(crota);
+      m[1][0] = cdelt[0] * sin(crota);  m[1][1] = cdelt[1] * cos(crota);
+    }
+  double det = m[0][0]*m[1][1] - m[0][1]*m[1][0];
+  if (det == 0.0)
+    { problem = "The pixel scale of the celestial axes is singular.";
+      return false; }
+  inverse[0][0] = m[1][1] / det;  inverse[0][1] = -m[0][1] / det;
+  inverse[1][0] = -m[1][0] / det;  inverse[1][1] = m[0][0] / det;
+
+  spec_delta = (cd[2][2] != 0.0)?cd[2][2]:(cdelt[2]*pc[2][2]);
+  if (spec_delta == 0.0)
+    has_spectral = false;
+  problem = NULL;
+  return true;
+}
+
+/*****************************************************************************/
+/*                          ska_wcs::world_to_pixel                          */
+/*****************************************************************************/
+
+bool
+  ska_wcs::world_to_pixel(double lon, double lat, double &x, double &y) const
+{
+  double w[2]; // Intermediate world coordinates, in degrees
+  if (projection == SKA_PROJ_LINEAR)
+    {
+      double dlon = fmod(lon - crval[lon_axis],360.0);
+      if (dlon >= 180.0)
+        dlon -= 360.0;
+      else if (dlon < -180.0)
+        dlon += 360.0;
+      w[lon_axis] = dlon;
+      w[lat_axis] = lat - crval[lat_axis];
+    }
+  else
+    { // Celestial to native spherical coordinates; for the zenithal
+      // projections the reference point is the native pole
+      double a = lon / deg, d = lat / deg;
+      double ap = crval[lon_axis] / deg, dp = crval[lat_axis] / deg;
+      double phi = native_pole_lon / deg +
+        atan2(-cos(d)*sin(a-ap), sin(d)*cos(dp) - cos(d)*sin(dp)*cos(a-ap));
+      double s = sin(d)*sin(dp) + cos(d)*cos(dp)*cos(a-ap);
+      double theta = asin((s > 1.0)?1.0:((s < -1.0)?-1.0:s));
+      double r;
+      switch (projection) {
+        case SKA_PROJ_TAN:
+          if (theta <= 0.0)
+            return false;
+          r = deg * cos(theta) / sin(theta);
+          break;
+        case SKA_PROJ_SIN:
+          if (theta < 0.0)
+            return false;
+          w[lon_axis] = deg * cos(theta) * sin(phi);
+          w[lat_axis] = -deg * (cos(theta)*cos(phi) -
+                                ncp_eta*(1.0 - sin(theta)));
+          break;
+        case SKA_PROJ_ARC:
+          r = 90.0 - theta*deg;
+          break;
+        case SKA_PROJ_STG:
+          if (sin(theta) <= -1.0)
+            return false;
+          r = deg * 2.0 * cos(theta) / (1.0 + sin(theta));
+          break;
+        default: // SKA_PROJ_ZEA
+          r = deg * sqrt(2.0 * (1.0 - sin(theta)));
+          break;
+      }
+      if (projection != SKA_PROJ_SIN)
+        {
+          w[lon_axis] = r * sin(phi);
+          w[lat_axis] = -r * cos(phi);
+        }
+    }
+  x = crpix[0] + inverse[0][0]*w[0] + inverse[0][1]*w[1];
+  y = crpix[1] + inverse[1][0]*w[0] + inverse[1][1]*w[1];
+  return true;
+}
+
+/*****************************************************************************/
+/*                        ska_wcs::spectral_to_pixel                         */
+/*****************************************************************************/
+
+bool
+  ska_wcs::spectral_to_pixel(double value, double &z) const
+{
+  if (!has_spectral)
+    return false;
+  z = crpix[2] + (value - crval[2]) / spec_delta;
+  return true;
+}
+
+/*****************************************************************************/
+/*                           ska_wcs::find_cutout                            */
+/*****************************************************************************/
+
+bool
+  ska_wcs::find_cutout(const double *sky, const double *spectral, int width,
+                       int height, int depth, ska_cutout &cutout)
+{
+  // Pixel n (counting from 1) covers n-0.5 to n+0.5
+  double lo[3] = {0.5,0.5,0.5};
+  double hi[3] = {width+0.5,height+0.5,depth+0.5};
+  if (sky != NULL)
+    { // The bounds of the mapped box are those of its mapped edges
+      double lon1 = sky[0], lon2 = sky[1];
+      double lat1 = (sky[2] < sky[3])?sky[2]:sky[3];
+      double lat2 = (sky[2] < sky[3])?sky[3]:sky[2];
+      while (lon2 < lon1)
+        lon2 += 360.0;
+      bool found = false;
+      for (int n=0; n <= SKA_WCS_EDGE_SAMPLES; n++)
+        {
+          double t = ((double) n) / SKA_WCS_EDGE_SAMPLES;
+          double edge[4][2] = {{lon1+t*(lon2-lon1),lat1},
+                               {lon1+t*(lon2-lon1),lat2},
+                               {lon1,lat1+t*(lat2-lat1)},
+                               {lon2,lat1+t*(lat2-lat1)}};
+          for (int e=0; e < 4; e++)
+            {
+              double x, y;
+              if (!world_to_pixel(edge[e][0],edge[e][1],x,y))
+                continue;
+              if (!found)
+                { lo[0] = hi[0] = x;  lo[1] = hi[1] = y;  found = true; }
+              lo[0] = (x < lo[0])?x:lo[0];  hi[0] = (x > hi[0])?x:hi[0];
+              lo[1] = (y < lo[1])?y:lo[1];  hi[1] = (y > hi[1])?y:hi[1];
+            }
+        }
+      if (!found)
+        { problem = "The sky region cannot be shown by the projection of "
+          "the cube."; return false; }
+    }
+  if (spectral != NULL)
+    {
+      if (!(spectral_to_pixel(spectral[0],lo[2]) &&
+            spectral_to_pixel(spectral[1],hi[2])))
+        { problem = "The cube has no spectral axis (axis 3)."; return false; }
+      if (lo[2] > hi[2])
+        { double tmp = lo[2]; lo[2] = hi[2]; hi[2] = tmp; }
+    }
+
+  int first[3], last[3], size[3] = {width,height,depth};
+  for (int i=0; i < 3; i++)
+    {
+      first[i] = (int) floor(lo[i] + 0.5) - 1;
+      last[i] = (int) ceil(hi[i] - 0.5) - 1;
+      first[i] = (first[i] < 0)?0:first[i];
+      last[i] = (last[i] >= size[i])?(size[i]-1):last[i];
+      if (first[i] > last[i])
+        { problem = "The cutout does not overlap the cube."; return false; }
+    }
+  cutout.x = first[0];  cutout.width = last[0] - first[0] + 1;
+  cutout.y = first[1];  cutout.height = last[1] - first[1] + 1;
+  cutout.first_plane = first[2];  cutout.num_planes = last[2] - first[2] + 1;
+  return true;
+}
+
+/*****************************************************************************/
+/* STATIC                      ska_wcs::shift_records                        */
+/*****************************************************************************/
+
+void
+  ska_wcs::shift_records(kdu_byte * &records, int &length, int x0, int y0,
+                         int z0, int discard_levels)
+{
+  if ((records == NULL) ||
+      ((x0 == 0) && (y0 == 0) && (z0 == 0) && (discard_levels == 0)))
+    return;
+  double scale = (double)(1 << discard_levels);
+  int num_records = 1;
+  for (const char *cp=(const char *) records; *cp != '\0'; cp++)
+    num_records += (*cp == '\n')?1:0;
+  char *buffer = new char[length+80*num_records+1]; // Records may grow
+  int new_length = 0;
+  const char *record = (const char *) records;
+  while (*record != '\0')
+    {
+      const char *next = strchr(record,'\n');
+      int record_length = (next == NULL)?(int)strlen(record):
+        (int)(next-record);
+      char keyword[9], value[71];
+      int i, j = 0, written = 0;
+      if (read_record(record,record_length,keyword,value))
+        {
+          double v = atof(value), updated = v;
+          if ((i = axis_index(keyword,"CRPIX",j)) && (j == 0))
+            { // Pixel 1 of the reduced cube is centred on pixel 1
+              if (i == 3)
+                updated = v - z0;
+              else
+                updated = (v - 1.0)/scale + 1.0 - ((i == 1)?x0:y0);
+            }
+          else if ((i = axis_index(keyword,"CDELT",j)) && (j == 0) && (i < 3))
+            updated = v * scale;
+          else if ((i = axis_index(keyword,"CD",j)) && (j != 0) && (j < 3))
+            updated = v * scale;
+          if (updated != v)
+            { // Keep the comment, if it still fits
+              const char *comment = (const char *)
+                memchr(record+10,'/',(size_t)(record_length-10));
+              char card[81];
+              int n = sprintf(card,"%-8s= %20.13G",keyword,updated);
+              if (comment != NULL)
+                n += snprintf(card+n,(size_t)(81-n)," %.*s",
+                              (int)(record+record_length-comment),comment);
+              written = (n > 80)?80:n;
+              memcpy(buffer+new_length,card,(size_t) written);
+            }
+        }
+      if (written == 0)
+        {
+          memcpy(buffer+new_length,record,(size_t) record_length);
+          written = record_length;
+        }
+      new_length += written;
+      if (next == NULL)
+        break;
+      buffer[new_length++] = '\n';
+      record = next+1;
+    }
+  buffer[new_length] = '\0';
+  delete[] records;
+  records = (kdu_byte *) buffer;
+  length = new_length;
+}
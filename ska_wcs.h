@@ -0,0 +1,84 @@
+/*****************************************************************************/
+//
+//  @file: ska_wcs.h
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief World coordinates of an encoded cube, parsed from the FITS records
+//         carried in the SKA metadata box, so that cutouts can be requested
+//         in sky and spectral coordinates rather than in pixels.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+#ifndef SKA_WCS_H
+#define SKA_WCS_H
+
+#include "kdu_elementary.h"
+#include "kdu_compressed.h"
+
+/**
+ * A pixel cutout of a cube: a region of every plane (0-based, with rows
+ * counted from the first FITS row, as in the original cube) and a range of
+ * planes.
+ */
+struct ska_cutout {
+  int x, y, width, height;
+  int first_plane, num_planes;
+};
+
+/*****************************************************************************/
+/*                              class ska_wcs                                */
+/*****************************************************************************/
+
+class ska_wcs {
+  /* Axes 1 and 2 of the cube must be the celestial ones (in either order),
+   * with one of the zenithal projections TAN, SIN (including the legacy
+   * NCP), ARC, STG or ZEA, or no projection at all, in which case the axes
+   * are taken to be linear in degrees. Axis 3, if there is one, is the
+   * spectral axis and is taken to be linear in its own units (CUNIT3), which
+   * is how the FREQ, VRAD and VELO axes of radio cubes are written. The
+   * linear transformation may be given by CDi_j, PCi_j with CDELTi, or
+   * CDELTi with the older CROTA2. */
+  public: // Member functions
+    ska_wcs();
+    bool init(const char *records);
+    /* Parses the '\n' separated FITS records of the SKA metadata box.
+     * Returns false if they do not describe celestial axes we can handle;
+     * `get_problem' then says why. */
+    const char *get_problem() const { return problem; }
+    bool world_to_pixel(double lon, double lat, double &x, double &y) const;
+    /* Converts celestial coordinates (degrees, in the system of the axes,
+     * e.g. RA and Dec) to FITS pixel coordinates, in which the centre of the
+     * first pixel is 1. Returns false for points the projection cannot show
+     * (e.g. the far hemisphere of TAN or SIN). */
+    bool spectral_to_pixel(double value, double &z) const;
+    /* As above, for the spectral axis. Returns false if there is none. */
+    bool find_cutout(const double *sky, const double *spectral, int width,
+                     int height, int depth, ska_cutout &cutout);
+    /* Finds the smallest cutout of a `width' x `height' x `depth' cube
+     * which holds the pixels (and planes) overlapping the box given by
+     * `sky' (lon1, lon2, lat1, lat2) and `spectral' (first, last). Either
+     * may be NULL to take the whole of the corresponding axes. Longitudes
+     * run from lon1 eastward to lon2, so the box may straddle 0. Returns
+     * false, with `get_problem' saying why, if the cutout would be empty. */
+    static void shift_records(kdu_byte * &records, int &length, int x0,
+                              int y0, int z0, int discard_levels);
+    /* Updates the CRPIXi (and, if resolution levels were discarded, the
+     * CDELTi and CDi_j) of the '\n' separated FITS `records' for a cube
+     * which starts at pixel (x0,y0,z0) of the cube they described, at a
+     * resolution reduced `discard_levels' times. `records' is reallocated
+     * (with new[]) if it changes. */
+  private: // Data
+    const char *problem;
+    int lon_axis, lat_axis; // 0 or 1
+    int projection; // One of the `SKA_PROJ_' values in ska_wcs.cpp
+    double crpix[3], crval[3];
+    double inverse[2][2]; // Intermediate world coordinates to pixel offsets
+    double spec_delta; // Spectral units per plane
+    bool has_spectral;
+    double native_pole_lon; // LONPOLE, in degrees
+    double ncp_eta; // Obliqueness of the NCP projection, else 0
+};
+
+#endif
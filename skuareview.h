@@ -0,0 +1,192 @@
+/*****************************************************************************/
+//
+//  @file: skuareview.h
+//  Project: SkuareView-NGAS-plugin
+//
+//  @date 19/10/26
+//  @brief C interface to libskuareview, which encodes cubes held in memory
+//         (or produced plane by plane by the caller) and decodes regions of
+//         encoded cubes straight into the caller's buffers, without going
+//         through files or the skuareview-encode/decode applications.
+//  Copyright (c) 2012 University of Western Australia. All rights reserved.
+//
+/*****************************************************************************/
+
+#ifndef SKUAREVIEW_H
+#define SKUAREVIEW_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Processing environment: a pool of threads shared by every call made with
+ * it, so that they are not created and destroyed for each cube. Calls made
+ * with the same environment are serialized; use one environment per thread
+ * of the application to encode or decode several cubes at once.
+ */
+typedef struct ska_env ska_env;
+
+/**
+ * An open JP2/JPX cube, from which any number of regions may be decoded.
+ */
+typedef struct ska_decoder ska_decoder;
+
+typedef enum ska_sample_type {
+  SKA_SAMPLES_FLOAT32, /* float */
+  SKA_SAMPLES_INT32    /* int; decoded values are rounded */
+} ska_sample_type;
+
+/**
+ * Layout of a cube in memory. Gaps are measured in samples, so the sample
+ * at column x, row y of plane z is found at
+ *   base[z*plane_gap + y*row_gap + x*sample_gap].
+ * Rows are in FITS order: row 0 is the first row of the FITS image (the
+ * bottom one, when displayed). Gaps of 0 are taken to mean a contiguous
+ * cube (1, width, width*height); otherwise they must be positive.
+ */
+typedef struct ska_layout {
+  ska_sample_type type;
+  int width, height, depth;
+  ptrdiff_t sample_gap, row_gap, plane_gap;
+} ska_layout;
+
+/**
+ * Supplies rows `first_row' to `first_row'+`num_rows'-1 of `plane' to the
+ * encoder, returning a pointer to the first sample of the first of them
+ * and setting `*row_gap' (in samples) to the distance between rows. The
+ * samples of a row are `sample_gap' apart, as given by the layout passed
+ * to `ska_encode_planes'. The rows must remain valid until the next call.
+ * Rows of every plane are requested together, from the top of the cube to
+ * the bottom, a stripe at a time; if the range of the samples is not given
+ * in the encoding parameters, every row is first requested once to find
+ * it. Returning NULL abandons the encoding.
+ */
+typedef const void *(*ska_rows_fn)(void *context, int plane, int first_row,
+                                   int num_rows, ptrdiff_t *row_gap);
+
+typedef struct ska_encode_params {
+  double rate;       /* Bits per sample for the whole cube; 0 keeps all */
+  int num_layers;    /* Quality layers, spaced logarithmically up to `rate';
+                        0 for one */
+  double min, max;   /* Range of the samples; found by scanning the cube if
+                        `min' >= `max' */
+  int pass_prediction; /* With `rate', code each code-block only down to
+                          this many bit-planes below those found useful in
+                          its neighbours (see skuareview-encode
+                          -pass_prediction); -1 codes every bit-plane */
+  const char *kakadu_args; /* Extra Kakadu parameters, separated by spaces,
+                              as given to skuareview-encode, e.g.
+                              "Clevels=6 Cblk={32,32}"; or NULL */
+  const char *header; /* FITS header records to be kept with the cube, one
+                         per line, or NULL */
+} ska_encode_params;
+
+/**
+ * A region to be decoded, in pixels at the decoded resolution (see
+ * `discard_levels'), with rows counted from the first FITS row. A width or
+ * height of 0 runs to the edge of the image, and `num_planes' of 0 to the
+ * last plane.
+ */
+typedef struct ska_region {
+  int x, y, width, height;
+  int first_plane, num_planes;
+  int stokes;         /* Stokes parameter; -1 for the first one encoded */
+  int discard_levels; /* Resolution is halved this many times */
+  int max_layers;     /* Quality layers decoded; 0 for all of them */
+} ska_region;
+
+/* Return values; the message of the last failure is kept by the
+   environment (see `ska_env_get_error'). */
+#define SKA_OK 0
+#define SKA_FAILED -1
+
+/* ========================================================================= */
+/*                             Environments                                  */
+/* ========================================================================= */
+
+ska_env *ska_env_create(int num_threads);
+  /* Creates an environment with `num_threads' threads, or one which does all
+     of the work on the caller's thread, if `num_threads' is 0. A negative
+     value picks the number of CPUs. Returns NULL on failure. Also installs
+     the library's handler for Kakadu's errors, which throws exceptions
+     rather than ending the process; applications which install their own
+     should make it throw `kdu_exception's too. */
+
+void ska_env_destroy(ska_env *env);
+
+const char *ska_env_get_error(ska_env *env);
+  /* Message of the last call which failed, or an empty string. */
+
+/* ========================================================================= */
+/*                               Encoding                                    */
+/* ========================================================================= */
+
+void ska_encode_defaults(ska_encode_params *params);
+
+int ska_encode_array(ska_env *env, const void *cube, const ska_layout *layout,
+                     const ska_encode_params *params, const char *fname,
+                     void **data, size_t *length);
+  /* Encodes `cube', laid out as in `layout', to a JPX file holding a single
+     Stokes parameter, which skuareview-decode can read. It is written to the
+     file `fname' if that is not NULL, or else to memory, in which case
+     `*data' (to be released with `ska_free') and `*length' receive it.
+        Samples are handed to Kakadu where they lie, without being copied or
+     normalized, so the cube must hold no blank (NaN) samples. To allow
+     this, the nominal range is the smallest power of two which covers
+     [`min',`max'] either side of zero, and is recorded as the global range
+     of the cube, exactly as if skuareview-encode had been run with
+     "-norm global" and that range. */
+
+int ska_encode_planes(ska_env *env, ska_rows_fn rows, void *context,
+                      const ska_layout *layout,
+                      const ska_encode_params *params, const char *fname,
+                      void **data, size_t *length);
+  /* As above, with the rows of the cube supplied by `rows'; `plane_gap' and
+     `row_gap' of the layout are not used. */
+
+void ska_free(void *data);
+
+/* ========================================================================= */
+/*                               Decoding                                    */
+/* ========================================================================= */
+
+ska_decoder *ska_decoder_open_file(ska_env *env, const char *fname);
+ska_decoder *ska_decoder_open_memory(ska_env *env, const void *data,
+                                     size_t length);
+  /* Open a JP2/JPX cube written by skuareview-encode or `ska_encode_array',
+     including one to which planes have been appended. The memory must
+     remain valid until the decoder is closed. Return NULL on failure. */
+
+void ska_decoder_close(ska_decoder *dec);
+
+int ska_decoder_get_size(ska_decoder *dec, int *width, int *height,
+                         int *depth, int *first_stokes, int *num_stokes);
+  /* Size of every plane at full resolution, the number of planes of each
+     Stokes parameter and the Stokes parameters which were encoded. */
+
+const char *ska_decoder_get_header(ska_decoder *dec);
+  /* FITS header records kept with the cube, one per line, or NULL. */
+
+int ska_decoder_fit_region(ska_decoder *dec, ska_region *region);
+  /* Clips `region' to the cube, at the resolution it asks for, replacing
+     sizes of 0, so that the caller knows how big a buffer to provide. Fails
+     if nothing is left. */
+
+int ska_decode_region(ska_decoder *dec, const ska_region *region,
+                      void *buffer, const ska_layout *layout);
+  /* Decodes `region', as clipped by `ska_decoder_fit_region', into
+     `buffer', whose layout gives the sample type and gaps; its width,
+     height and depth must be those of the clipped region, or 0. The
+     decompressed samples are written straight into `buffer' and turned
+     back into sample values there. If the cube was normalized with a
+     power of two range either side of zero, as `ska_encode_array' does,
+     Kakadu writes the sample values directly. */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
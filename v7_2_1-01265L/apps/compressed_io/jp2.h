@@ -502,7 +502,8 @@ class jp2_family_src {
       { fp_name=NULL; fp=NULL; indirect=NULL; cache=NULL; last_bin_class=-1;
         last_read_pos=last_bin_id=-1; last_bin_codestream=-1;
         last_bin_length=0; last_bin_complete=false;
-        last_id = 0; seekable = false;
+        last_id = 0; seekable = false; mem_block = NULL; mem_bytes = 0;
+        prefetchable = false; positional = false;
       }
       /* [SYNOPSIS]
            You must use one of the `open' functions to create a legitimate
@@ -566,6 +567,19 @@ class jp2_family_src {
            capability.  It is seekable if and only if it also supports the
            `KDU_SOURCE_CAP_SEEKABLE' capability, as returned by
            `indirect->get_capabilities'.
+           [//]
+           If `indirect' also advertises `KDU_SOURCE_CAP_IN_MEMORY' (e.g., a
+           `kdu_mapped_file_source'), every box opened from the present
+           object has its contents in memory, so that boxes and the
+           code-streams which they contain advertise the same capability and
+           are read directly from `indirect's memory block, without copying.
+           In this case, `indirect' must not be closed or moved until the
+           present object has been closed.
+           [//]
+           If `indirect' is seekable and advertises `KDU_SOURCE_CAP_PREFETCH',
+           so do the boxes opened from the present object; their `prefetch'
+           function translates box-relative locations into locations within
+           `indirect'.
       */
     KDU_AUX_EXPORT virtual void open(kdu_cache *cache);
       /* [SYNOPSIS]
@@ -673,6 +687,7 @@ class jp2_family_src {
   private: // Data
     friend class jp2_input_box;
     friend class jpx_input_box;
+    friend class jp2_pread_family_src;
     char *fp_name; // Name of file associated with `fp', else NULL
     FILE *fp; // For file-based sources
     kdu_compressed_source *indirect; // When using another Kakadu source object
@@ -691,6 +706,10 @@ class jp2_family_src {
 
     bool seekable; // True if the source is seekable, or cached
     int last_id;
+    kdu_byte *mem_block; // Non-NULL if `indirect' is an in-memory source
+    kdu_long mem_bytes; // Length of `mem_block'
+    bool prefetchable; // If `indirect' offers `KDU_SOURCE_CAP_PREFETCH'
+    bool positional; // If boxes read `fp' with positional reads, unlocked
   };
 
 /*****************************************************************************/
@@ -720,6 +739,51 @@ class jp2_threadsafe_family_src : public jp2_family_src {
     kdu_mutex mutex;
   };
 
+/*****************************************************************************/
+/*                          jp2_pread_family_src                             */
+/*****************************************************************************/
+
+class jp2_pread_family_src : public jp2_threadsafe_family_src {
+  /* [BIND: reference]
+     [SYNOPSIS]
+       Derived version of `jp2_threadsafe_family_src' for seekable files
+       opened by name, whose `jp2_input_box' objects read the file with
+       positional reads (`pread'), each at its own box's read position.
+       Small reads (the codestream machinery reads 512 bytes at a time) are
+       served from a read-ahead buffer belonging to the box, which takes
+       the place of the buffer `FILE' would otherwise share between all
+       boxes.  Since no box depends upon state shared with the others,
+       `jp2_input_box::read' neither seeks nor takes the lock, so that
+       boxes read from different threads -- e.g., the contiguous
+       codestream boxes of several codestreams of a JPX file, which are
+       being decompressed at once -- read the file concurrently, rather
+       than queueing for the lock.
+       [//]
+       The lock is still taken for the few operations which need the
+       shared file position (discovering the length of a box which extends
+       to the end of the file), and for everything else, exactly as in
+       `jp2_threadsafe_family_src'.  On systems without `pread' (Windows),
+       and for sources opened with `allow_seeks'=false or from a
+       `kdu_compressed_source' or `kdu_cache', the object behaves exactly
+       like `jp2_threadsafe_family_src'.
+  */
+  public: // Member functions
+    KDU_AUX_EXPORT virtual void open(const char *fname, bool allow_seeks=true);
+      /* [SYNOPSIS]
+           Same as `jp2_family_src::open', but also arranges for positional
+           reads, if `allow_seeks' is true and the system supports them.
+      */
+    virtual void open(kdu_compressed_source *indirect)
+      { jp2_family_src::open(indirect); }
+    virtual void open(kdu_cache *cache)
+      { jp2_family_src::open(cache); }
+    bool uses_positional_reads() const { return positional; }
+      /* [SYNOPSIS]
+           Returns true if boxes opened from the object read the file with
+           positional reads, without taking the lock.
+      */
+  };
+
 /*****************************************************************************/
 /*                               jp2_locator                                 */
 /*****************************************************************************/
@@ -1324,6 +1388,16 @@ class jp2_input_box : public kdu_compressed_source {
            Note that the returned value identifies the location of the next
            byte to be read, relative to the start of the box contents.
       */
+    KDU_AUX_EXPORT virtual void prefetch(kdu_long offset, kdu_long length);
+      /* [SYNOPSIS]
+           See `kdu_compressed_source::prefetch' for an explanation.  Does
+           nothing unless `get_capabilities' reports
+           `KDU_SOURCE_CAP_PREFETCH'; otherwise, `offset' is expressed
+           relative to the first byte in the contents of the box, and the
+           range is clipped to the box before being passed to the
+           `kdu_compressed_source' object from which the `jp2_family_src'
+           was opened.
+      */
   // --------------------------------------------------------------------------
   public: // Read functions
     KDU_AUX_EXPORT virtual bool load_in_memory(int max_bytes);
@@ -1549,6 +1623,10 @@ class jp2_input_box : public kdu_compressed_source {
 #   define J2_INPUT_MAX_BUFFER_BYTES 24
     kdu_byte buffer[J2_INPUT_MAX_BUFFER_BYTES];
     int partial_word_bytes; // If part way through reading a word.
+#   define J2_INPUT_READ_AHEAD_BYTES 16384
+    kdu_byte *ahead_buf; // Only for positional reads; allocated on first use
+    kdu_long ahead_pos; // File location of `ahead_buf[0]'
+    int ahead_bytes; // Number of valid bytes in `ahead_buf'
   };
   /* Notes:
        The `original_pos_offset' member holds the amount which should be
@@ -46,7 +46,9 @@
 Description:
    Defines classes derived from "kdu_compressed_source" and
 "kdu_compressed_target" which may be used by applications to realize
-simple file-oriented compressed data I/O.  Also defines inline functions,
+simple file-oriented compressed data I/O, including a memory-mapped source
+which exposes the file through `kdu_compressed_source::access_memory'.
+Also defines inline functions,
 "kdu_ftell" and "kdu_fseek" which behave similarly to "ftell" and "fseek",
 except that they work with file position arguments of type "kdu_long", which
 may be a 64-bit data type even on 32-bit machines.  Implementation of these
@@ -66,6 +68,14 @@ architectures are considered.
 #include <io.h>
 #endif // WIN32_64 || _WIN64
 
+#ifndef KDU_WINDOWS_OS
+#  include <string.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/stat.h>
+#  include <sys/mman.h>
+#endif // !KDU_WINDOWS_OS
+
 /* Note Carefully:
       If you want to be able to use the "kdu_text_extractor" tool to
    extract text from calls to `kdu_error' and `kdu_warning' so that it
@@ -105,6 +115,7 @@ architectures are considered.
 
 // Classes defined here:
 class kdu_simple_file_source;
+class kdu_mapped_file_source;
 class kdu_simple_file_target;
 
 /* ========================================================================= */
@@ -300,6 +311,158 @@ class kdu_simple_file_source : public kdu_compressed_source {
     FILE *file;
   };
 
+/*****************************************************************************/
+/*                          kdu_mapped_file_source                           */
+/*****************************************************************************/
+
+class kdu_mapped_file_source : public kdu_compressed_source {
+  /* [BIND: reference]
+     [SYNOPSIS]
+       Maps an entire file into the address space of the process and
+       advertises the `KDU_SOURCE_CAP_IN_MEMORY' capability, so that a
+       `kdu_codestream' created from the object (or from a `jp2_family_src'
+       which is opened on it) parses code-block bytes straight out of the
+       mapping, rather than copying them through `read' and the C library's
+       buffers.  Pages are brought in by the kernel only when they are
+       touched, so decompressing a small region of a large file reads
+       little more than the headers and the precincts of interest, without
+       a system call for each of them.
+       [//]
+       Only POSIX platforms are supported at present; elsewhere `open'
+       fails, as if the file could not be opened.
+  */
+  public: // Member functions
+    kdu_mapped_file_source() { mem = NULL; mem_bytes = pos = 0; }
+    kdu_mapped_file_source(const char *fname)
+      { mem = NULL; mem_bytes = pos = 0; open(fname); }
+      /* [SYNOPSIS] Convenience constructor, which also calls `open'. */
+    ~kdu_mapped_file_source() { close(); }
+      /* [SYNOPSIS] Automatically calls `close'. */
+    bool exists() { return (mem != NULL); }
+      /* [SYNOPSIS]
+           Returns true if there is a mapped file associated with the object.
+      */
+    bool operator!() { return (mem == NULL); }
+      /* [SYNOPSIS]
+           Opposite of `exists'.
+      */
+    bool open(const char *fname, bool return_on_failure=false)
+      {
+      /* [SYNOPSIS]
+           Closes any currently open file and attempts to map a new one, in
+           its entirety and for reading only.  If the file cannot be opened
+           or mapped (including when it is empty, or too large for the
+           address space), the function either returns false
+           (`return_on_failure'=true) or generates an appropriate error
+           through `kdu_error'.
+      */
+        close();
+#ifndef KDU_WINDOWS_OS
+        int fd = ::open(fname,O_RDONLY);
+        if (fd >= 0)
+          {
+            struct stat st;
+            if ((fstat(fd,&st) == 0) && (st.st_size > 0) &&
+                (((kdu_long)(size_t) st.st_size) == (kdu_long) st.st_size))
+              {
+                void *addr = mmap(NULL,(size_t) st.st_size,PROT_READ,
+                                  MAP_SHARED,fd,0);
+                if (addr != MAP_FAILED)
+                  { mem = (kdu_byte *) addr;  mem_bytes = st.st_size; }
+              }
+            ::close(fd); // The mapping keeps its own reference to the file
+          }
+#endif // !KDU_WINDOWS_OS
+        if (mem == NULL)
+          {
+            if (return_on_failure) return false;
+            KDU_ERROR(e,2); e <<
+              KDU_TXT("Unable to map compressed data file")
+              << ", \"" << fname << "\"!";
+          }
+        pos = 0;
+        return true;
+      }
+    void set_access_pattern(bool sequential)
+      {
+      /* [SYNOPSIS]
+           Tells the kernel how the mapping is about to be read, so that it
+           can choose how far to read ahead.  Pass true before decompressing
+           the whole of a codestream, whose bytes are then read more or less
+           in order; read-ahead is extended and pages are dropped soon after
+           use.  Pass false before decompressing a region, or a subset of the
+           components or resolutions, of a large file; read-ahead is then
+           disabled, so that only the pages which are actually touched are
+           read from disk.  Until this function is called, the kernel's
+           default policy applies.
+      */
+#ifndef KDU_WINDOWS_OS
+        if (mem != NULL)
+          madvise(mem,(size_t) mem_bytes,
+                  (sequential)?MADV_SEQUENTIAL:MADV_RANDOM);
+#endif // !KDU_WINDOWS_OS
+      }
+    kdu_long get_size() { return mem_bytes; }
+      /* [SYNOPSIS] Returns the length of the mapped file, in bytes. */
+    virtual int get_capabilities()
+      { return (KDU_SOURCE_CAP_SEQUENTIAL | KDU_SOURCE_CAP_SEEKABLE |
+                KDU_SOURCE_CAP_IN_MEMORY); }
+      /* [SYNOPSIS]
+           See `kdu_compressed_source::get_capabilities' for an explanation
+           of capabilities.
+      */
+    virtual bool seek(kdu_long offset)
+      { /* [SYNOPSIS] See `kdu_compressed_source::seek' for an explanation. */
+        assert(mem != NULL);
+        pos = (offset < 0)?0:((offset > mem_bytes)?mem_bytes:offset);
+        return true;
+      }
+    virtual kdu_long get_pos()
+      { /* [SYNOPSIS]
+           See `kdu_compressed_source::get_pos' for an explanation. */
+        return (mem==NULL)?-1:pos;
+      }
+    virtual int read(kdu_byte *buf, int num_bytes)
+      { /* [SYNOPSIS] See `kdu_compressed_source::read' for an explanation. */
+        assert(mem != NULL);
+        if ((kdu_long) num_bytes > (mem_bytes-pos))
+          num_bytes = (int)(mem_bytes-pos);
+        if (num_bytes <= 0)
+          return 0;
+        memcpy(buf,mem+pos,(size_t) num_bytes);
+        pos += num_bytes;
+        return num_bytes;
+      }
+    virtual kdu_byte *access_memory(kdu_long &pos, kdu_byte * &lim)
+      { /* [SYNOPSIS]
+           See `kdu_compressed_source::access_memory' for an explanation. */
+        if (mem == NULL)
+          return NULL;
+        pos = this->pos;
+        lim = mem + mem_bytes;
+        return mem + this->pos;
+      }
+    virtual bool close()
+      { /* [SYNOPSIS]
+             It is safe to call this function, even if no file has been opened.
+             The return value has no meaning here.  Any `kdu_codestream' or
+             `jp2_family_src' which reads from the object must be destroyed
+             (or closed) first, since they may hold pointers into the
+             mapping.
+        */
+#ifndef KDU_WINDOWS_OS
+        if (mem != NULL)
+          munmap(mem,(size_t) mem_bytes);
+#endif // !KDU_WINDOWS_OS
+        mem = NULL;  mem_bytes = pos = 0;
+        return true;
+      }
+  private: // Data
+    kdu_byte *mem;
+    kdu_long mem_bytes;
+    kdu_long pos;
+  };
+
 /*****************************************************************************/
 /*                          kdu_simple_file_target                           */
 /*****************************************************************************/
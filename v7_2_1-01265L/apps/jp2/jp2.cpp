@@ -61,6 +61,10 @@ in the compressed-io header file, "jp2.h".
 #include "jp2_shared.h"
 #include "jp2_local.h"
 #include "kdu_file_io.h"
+#ifndef KDU_WINDOWS_OS
+#  include <errno.h>
+#  include <unistd.h> // For `pread', used by `jp2_pread_family_src'
+#endif
 
 /* Note Carefully:
       If you want to be able to use the "kdu_text_extractor" tool to
@@ -308,6 +312,34 @@ static inline kdu_long
   return val;
 }
 
+/*****************************************************************************/
+/* STATIC                        read_positional                             */
+/*****************************************************************************/
+
+static int
+  read_positional(FILE *fp, kdu_byte *buf, int num_bytes, kdu_long pos)
+  /* Reads up to `num_bytes' from location `pos' in the file, without
+     using or disturbing its file position, returning the number of bytes
+     actually read.  Only used if `jp2_pread_family_src::open' found
+     positional reads to be available. */
+{
+  int total = 0;
+#ifndef KDU_WINDOWS_OS
+  int fd = fileno(fp);
+  while (total < num_bytes)
+    {
+      ssize_t got = pread(fd,buf+total,(size_t)(num_bytes-total),
+                          (off_t)(pos+total));
+      if ((got < 0) && (errno == EINTR))
+        continue;
+      if (got <= 0)
+        break;
+      total += (int) got;
+    }
+#endif // !KDU_WINDOWS_OS
+  return total;
+}
+
 /*****************************************************************************/
 /* STATIC                 get_rational_pels_per_metre                        */
 /*****************************************************************************/
@@ -1025,6 +1057,16 @@ void
         "`jp2_family_src::open' must support sequential reading.");
     }
   this->indirect = indirect;
+  if (capabilities & KDU_SOURCE_CAP_IN_MEMORY)
+    { // Make the memory block available to `jp2_input_box::read_box_header'
+      kdu_long mem_pos;
+      kdu_byte *mem_lim, *mem = indirect->access_memory(mem_pos,mem_lim);
+      if (mem != NULL)
+        { mem_block = mem - mem_pos;  mem_bytes = mem_lim - mem_block; }
+    }
+  else if ((capabilities & KDU_SOURCE_CAP_PREFETCH) &&
+           (capabilities & KDU_SOURCE_CAP_SEEKABLE))
+    prefetchable = true;
   last_read_pos = 0;
   last_bin_id = -1;
   last_bin_class = -1;
@@ -1073,6 +1115,9 @@ void
   fp_name = NULL;
   indirect = NULL;
   cache = NULL;
+  mem_block = NULL;  mem_bytes = 0;
+  prefetchable = false;
+  positional = false;
   last_read_pos = last_bin_id = last_bin_codestream = -1;
   last_bin_class = -1; last_bin_length = 0; last_bin_complete = false;
 }
@@ -1131,6 +1176,24 @@ bool
 }
 
 
+/* ========================================================================= */
+/*                           jp2_pread_family_src                            */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                       jp2_pread_family_src::open                          */
+/*****************************************************************************/
+
+void
+  jp2_pread_family_src::open(const char *filename, bool allow_seeks)
+{
+  jp2_family_src::open(filename,allow_seeks);
+#ifndef KDU_WINDOWS_OS
+  positional = seekable;
+#endif
+}
+
+
 /* ========================================================================= */
 /*                               jp2_input_box                               */
 /* ========================================================================= */
@@ -1159,6 +1222,9 @@ jp2_input_box::jp2_input_box()
   pos = 0;
   codestream_id = -1;
   partial_word_bytes = 0;
+  ahead_buf = NULL;
+  ahead_pos = 0;
+  ahead_bytes = 0;
 }
 
 /*****************************************************************************/
@@ -1171,6 +1237,7 @@ bool
   if (src_unsafe)
     return false;
   reset_header_reading_state();
+  ahead_bytes = 0; // May be left by a failed open, perhaps of another file
   can_dereference_contents = (locator.file_pos >= 0);
   if (src->cache == NULL)
     { pos=locator.file_pos; bin_id=-1; bin_class=-1; }
@@ -1194,6 +1261,14 @@ bool
       if (!super_box->rubber_length)
         contents_lim = super_box->contents_lim; // Temporary limit
     }
+  else if (src->mem_block != NULL)
+    { // Top-level box of an in-memory source; read it in place
+      assert(this->contents_handle == NULL);
+      this->contents_block = NULL;
+      if (pos < src->mem_bytes)
+        this->contents_block = src->mem_block + pos;
+      contents_lim = src->mem_bytes; // Temporary limit
+    }
 
   partial_word_bytes = 0;
 
@@ -1234,10 +1309,10 @@ bool
     }
   rubber_length = (original_box_length == 0);
   if (rubber_length && (contents_block != NULL))
-    { // We have already read and buffered the entire contents in super_box
-      assert(super_box != NULL);
-      original_box_length =
-        (super_box->contents_lim - pos) + original_header_length;
+    { // We have already read and buffered the entire contents in super_box,
+      // or the source is in memory
+      kdu_long lim = (super_box != NULL)?super_box->contents_lim:contents_lim;
+      original_box_length = (lim - pos) + original_header_length;
       rubber_length = false;
     }
   contents_length = original_box_length - original_header_length;
@@ -1255,6 +1330,9 @@ bool
       contents_lim = contents_start + contents_length;
       if (contents_length < 0)
         contents_lim = KDU_LONG_MAX;
+      if ((super_box == NULL) && (contents_block != NULL) &&
+          (contents_lim > src->mem_bytes))
+        contents_lim = src->mem_bytes; // Truncated file
       if (contents_block != NULL)
         contents_block += original_header_length;
       return true; // All done
@@ -1448,6 +1526,8 @@ bool
     capabilities = KDU_SOURCE_CAP_SEQUENTIAL;
   if (src->seekable)
     capabilities |= KDU_SOURCE_CAP_SEEKABLE;
+  if (src->prefetchable)
+    capabilities |= KDU_SOURCE_CAP_PREFETCH;
   if (contents_block != NULL)
     capabilities = KDU_SOURCE_CAP_SEQUENTIAL |
                    KDU_SOURCE_CAP_SEEKABLE |
@@ -1513,6 +1593,8 @@ bool
     capabilities = KDU_SOURCE_CAP_SEQUENTIAL;
   if (src->seekable)
     capabilities |= KDU_SOURCE_CAP_SEEKABLE;
+  if (src->prefetchable)
+    capabilities |= KDU_SOURCE_CAP_PREFETCH;
   if (contents_block != NULL)
     capabilities = KDU_SOURCE_CAP_SEQUENTIAL |
                    KDU_SOURCE_CAP_SEEKABLE |
@@ -1559,6 +1641,8 @@ bool
     capabilities = KDU_SOURCE_CAP_SEQUENTIAL;
   if (src->seekable)
     capabilities |= KDU_SOURCE_CAP_SEEKABLE;
+  if (src->prefetchable)
+    capabilities |= KDU_SOURCE_CAP_PREFETCH;
   if (contents_block != NULL)
     capabilities = KDU_SOURCE_CAP_SEQUENTIAL |
                    KDU_SOURCE_CAP_SEEKABLE |
@@ -1621,6 +1705,8 @@ bool
       this->capabilities = KDU_SOURCE_CAP_SEQUENTIAL;
       if (src->seekable)
         capabilities |= KDU_SOURCE_CAP_SEEKABLE;
+      if (src->prefetchable)
+        capabilities |= KDU_SOURCE_CAP_PREFETCH;
       this->pos = contents_start;
       this->partial_word_bytes = 0;
     }
@@ -1634,6 +1720,12 @@ bool
 bool
   jp2_input_box::close()
 {
+  if (ahead_buf != NULL)
+    { // Freed even if not open: a box which fails to open may have used it
+      free(ahead_buf);
+      ahead_buf = NULL;
+    }
+  ahead_bytes = 0;
   if (!is_open)
     return true;
   if ((src != NULL) && (!src_unsafe) && (src->cache != NULL))
@@ -1768,6 +1860,12 @@ void
           this->capabilities |= KDU_SOURCE_CAP_IN_MEMORY;
         }
     }
+  else if ((src.contents_block != NULL) && (this->src != NULL) &&
+           (this->src->mem_block != NULL))
+    { // Contents lie within the in-memory source, which outlives the box
+      this->contents_block = src.contents_block;
+      this->capabilities |= KDU_SOURCE_CAP_IN_MEMORY;
+    }
 }
 
 /*****************************************************************************/
@@ -1873,6 +1971,29 @@ bool
   return true;
 }
 
+/*****************************************************************************/
+/*                         jp2_input_box::prefetch                           */
+/*****************************************************************************/
+
+void
+  jp2_input_box::prefetch(kdu_long offset, kdu_long length)
+{
+  if ((!is_open) || (src == NULL) || src_unsafe || (contents_block != NULL) ||
+      !(capabilities & KDU_SOURCE_CAP_PREFETCH))
+    return;
+  kdu_long start = contents_start + offset;
+  kdu_long lim = start + length;
+  if (start < contents_start)
+    start = contents_start;
+  if ((!rubber_length) && (lim > contents_lim))
+    lim = contents_lim;
+  if (lim <= start)
+    return;
+  src->acquire_lock();
+  src->indirect->prefetch(start,lim-start);
+  src->release_lock();
+}
+
 /*****************************************************************************/
 /*                   jp2_input_box::set_tileheader_scope                     */
 /*****************************************************************************/
@@ -2073,6 +2194,43 @@ int
       return num_bytes;
     }
 
+  if (src->positional)
+    { // Each box reads at its own `pos', through a read-ahead buffer of its
+      // own, so there is no shared state to protect; boxes read from
+      // different threads proceed in parallel.
+      num_bytes = 0;
+      if ((pos >= ahead_pos) && (pos < (ahead_pos+ahead_bytes)))
+        {
+          num_bytes = (int)(ahead_pos+ahead_bytes-pos);
+          if (num_bytes > requested_bytes)
+            num_bytes = requested_bytes;
+          memcpy(buf,ahead_buf+(pos-ahead_pos),(size_t) num_bytes);
+        }
+      int remaining = requested_bytes - num_bytes;
+      kdu_long next_pos = pos + num_bytes;
+      if ((remaining > 0) && (ahead_buf == NULL) &&
+          (remaining < J2_INPUT_READ_AHEAD_BYTES))
+        ahead_buf = (kdu_byte *) malloc(J2_INPUT_READ_AHEAD_BYTES);
+      if ((remaining >= J2_INPUT_READ_AHEAD_BYTES) || (ahead_buf == NULL))
+        num_bytes += read_positional(src->fp,buf+num_bytes,remaining,next_pos);
+      else if (remaining > 0)
+        { // Refill the read-ahead buffer, stopping at the end of the box
+          int ahead_max = J2_INPUT_READ_AHEAD_BYTES;
+          if ((!rubber_length) && ((contents_lim-next_pos) < ahead_max))
+            ahead_max = (int)(contents_lim-next_pos);
+          ahead_pos = next_pos;
+          ahead_bytes = read_positional(src->fp,ahead_buf,ahead_max,next_pos);
+          if (remaining > ahead_bytes)
+            remaining = ahead_bytes;
+          memcpy(buf+num_bytes,ahead_buf,(size_t) remaining);
+          num_bytes += remaining;
+        }
+      pos += num_bytes;
+      if ((num_bytes < requested_bytes) && rubber_length)
+        { contents_lim = pos; rubber_length = false; }
+      return num_bytes;
+    }
+
   src->acquire_lock();
   if (src->cache != NULL)
     { // See if we must open a new data-bin, or seek within the existing one.
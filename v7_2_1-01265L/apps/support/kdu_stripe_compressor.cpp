@@ -49,6 +49,7 @@ Description:
 
 #include <assert.h>
 #include <math.h>
+#include <string.h>
 #include "kdu_messaging.h"
 #include "stripe_compressor_local.h"
 
@@ -327,6 +328,12 @@ static inline void
           for (; num_samples > 0; num_samples--, src+=sample_gap, dp++)
             dp->ival = (kdu_int32) floor(((*src) * scale) + offset);
         }
+      else if ((src_scale == 1.0F) && is_signed && (sample_gap == 1))
+        { // Source samples already occupy the nominal range of the line
+          // buffer (signed, with a precision of 0), so they are copied as is
+          assert(sizeof(kdu_sample32) == sizeof(float));
+          memcpy(dp,src,sizeof(float)*(size_t)num_samples);
+        }
       else
         {
           float offset = (!is_signed)?(-0.5F):0.0F;
@@ -385,7 +392,14 @@ void
       tile = codestream.open_tile(idx,env);
       tile.set_components_of_interest(num_components);
       if (env != NULL)
-        env->attach_queue(&tile_queue,env_queue,NULL);
+        { // Spread the tiles of a row over the NUMA nodes, unless all the
+          // work of `env_queue' already belongs to one node
+          int num_nodes = env->get_num_numa_nodes();
+          tile_queue.set_numa_node(((num_nodes > 1) &&
+                                    (env_queue->get_numa_node() < 0))?
+                                   (idx.x % num_nodes):-1);
+          env->attach_queue(&tile_queue,env_queue,NULL);
+        }
       bool double_buffering = (env != NULL) && (env_dbuf_height != 0);
       engine.create(codestream,tile,force_precise,NULL,want_fastest,
                     (double_buffering)?env_dbuf_height:1,env,&tile_queue,
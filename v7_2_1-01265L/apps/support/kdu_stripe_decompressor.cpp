@@ -48,6 +48,7 @@ Description:
 ******************************************************************************/
 
 #include <assert.h>
+#include <string.h>
 #include "kdu_messaging.h"
 #include "stripe_decompressor_local.h"
 
@@ -572,6 +573,12 @@ static inline void
           for (; num_samples > 0; num_samples--, dst+=sample_gap, sp++)
             *dst = sp->ival * scale + offset;
         }
+      else if ((dst_scale == 1.0F) && is_signed && (sample_gap == 1))
+        { // Line samples are already in the nominal range requested
+          // (signed, with a precision of 0), so they are copied as is
+          assert(sizeof(kdu_sample32) == sizeof(float));
+          memcpy(dst,sp,sizeof(float)*(size_t)num_samples);
+        }
       else
         for (; num_samples > 0; num_samples--, dst+=sample_gap, sp++)
           *dst = sp->fval * dst_scale + offset;
@@ -626,7 +633,14 @@ void
     {
       tile = codestream.open_tile(idx,env);
       if (env != NULL)
-        env->attach_queue(&tile_queue,env_queue,NULL);
+        { // Spread the tiles of a row over the NUMA nodes, unless all the
+          // work of `env_queue' already belongs to one node
+          int num_nodes = env->get_num_numa_nodes();
+          tile_queue.set_numa_node(((num_nodes > 1) &&
+                                    (env_queue->get_numa_node() < 0))?
+                                   (idx.x % num_nodes):-1);
+          env->attach_queue(&tile_queue,env_queue,NULL);
+        }
       bool double_buffering = (env != NULL) && (env_dbuf_height != 0);
       engine.create(codestream,tile,force_precise,false,want_fastest,
                     (double_buffering)?env_dbuf_height:1,env,&tile_queue,
@@ -1263,6 +1263,7 @@ void
       if ((quanta_per_stripe > 1) && (num_stripes > 2) && !is_top)
         this->lines_per_scheduled_quantum = (kdu_int16)
           (1 + ((nominal_block_height-1) / quanta_per_stripe));
+      set_trace_name("block decoder");
       if (!env->attach_queue(this,env_queue,KDU_CODING_THREAD_DOMAIN))
         { 
           KDU_ERROR_DEV(e,0x22081102); e <<
@@ -148,6 +148,9 @@ void
   kdu_block *block;
   kdu_uint16 estimated_slope_threshold =
     job->band.get_conservative_slope_threshold();
+  int prediction_margin = -1; // Code every pass unless set below
+  if ((estimated_slope_threshold > 1) && (job->K_max == job->K_max_prime))
+    prediction_margin = job->band.get_pass_prediction_margin();
   for (; blocks_remaining > 0; blocks_remaining--,
        idx.x++, offset+=xfer_size.x)
     { 
@@ -463,10 +466,42 @@ void
           K -= block->missing_msbs;
           block->num_passes = 3*K-2;
         }
+      bool predict = ((prediction_margin >= 0) && (block->num_passes > 0) &&
+                      (block->orientation != LL_BAND));
+      int top_plane = K-1; // Bit-plane coded by the first pass
+      int coded_passes = block->num_passes;
+      if (predict)
+        { // Stop `prediction_margin' bit-planes below the neighbour's last
+          // useful one; the LL band is excluded as in the block encoder.
+          int floor_plane = job->useful_plane - prediction_margin;
+          if (floor_plane > top_plane)
+            coded_passes = 1;
+          else if (floor_plane > 0)
+            coded_passes = 3*(top_plane-floor_plane) + 1;
+          if (coded_passes < block->num_passes)
+            block->num_passes = coded_passes;
+          else
+            coded_passes = block->num_passes;
+        }
       double block_msb_wmse =
         (scale_wmse)?(job->msb_wmse*job->roi_weight):job->msb_wmse;
       block_encoder->encode(block,reversible,block_msb_wmse,
                             estimated_slope_threshold);
+      if (predict)
+        { // Record the lowest bit-plane with a pass above the threshold
+          int z = block->num_passes-1;
+          while ((z >= 0) &&
+                 (block->pass_slopes[z] < estimated_slope_threshold))
+            z--;
+          if (z < 0)
+            job->useful_plane = top_plane;
+          else
+            { 
+              job->useful_plane = top_plane - (z+2)/3;
+              if (z == (coded_passes-1))
+                job->useful_plane--; // Passes we did not code may be useful
+            }
+        }
       job->band.close_block(block,env);
     }
 
@@ -1391,6 +1426,7 @@ kd_encoder::init(kdu_subband band, kdu_sample_allocator *allocator,
       if ((quanta_per_stripe > 1) && (num_stripes > 2) && !is_top)
         this->lines_per_scheduled_quantum = (kdu_int16)
           (1 + ((nominal_block_height-1) / quanta_per_stripe));      
+      set_trace_name("block encoder");
       if (!env->attach_queue(this,env_queue,KDU_CODING_THREAD_DOMAIN))
         { 
           KDU_ERROR_DEV(e,0x22081103); e <<
@@ -1629,6 +1665,7 @@ void
           job->grp_width = width;
           job->grp_blocks = blocks;
           job->first_block_idx = first_block_idx;
+          job->useful_plane = -1;
           job->pending_stripe_jobs = pending_stripe_jobs[s];
           job->roi_weight = roi_weight;
           assert(job->lines16 != NULL);
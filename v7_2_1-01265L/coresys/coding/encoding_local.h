@@ -161,6 +161,7 @@ class kd_encoder_job : public kdu_thread_job {
     int grp_width; // Number of valid samples on each row of the group buffer
     int grp_blocks; // Number of horizontally adjacent code-blocks in group
     kdu_coords first_block_idx; // Absolute index of first code-block in group
+    int useful_plane; // See below
   public: // Pointer to shared synchronization variable
     kdu_interlocked_int32 *pending_stripe_jobs; // See below
     union {
@@ -194,6 +195,14 @@ class kd_encoder_job : public kdu_thread_job {
      is a multiple of 8, the first sample of the block is octet aligned
      within each of the `lines16'/`lines32' buffers.
      [//]
+     If `kdu_codestream::set_pass_prediction' has been called, the
+     `useful_plane' member holds the lowest magnitude bit-plane (0 for the
+     least significant of the `K_max' bit-planes) which held a coding pass
+     above the slope threshold in the last code-block coded by the job (its
+     first bit-plane, if none did), or -1 until the job has coded one.
+     Coding of the next code-block stops
+     `kdu_subband::get_pass_prediction_margin' bit-planes below it.
+     [//]
      Ideally, jobs should have a `grp_width' that corresponds to a whole
      number of assumed L2 cache lines (`KDU_MAX_L2_CACHE_LINE' bytes) and
      the `lines16'/`lines32' buffers are aligned so that the subband samples
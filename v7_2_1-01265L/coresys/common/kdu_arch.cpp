@@ -239,6 +239,30 @@ Description:
           if ((eax_val & 6) == 6)
             result = 6; // Operating System preserves YMM registers
         }
+#ifndef KDU_NO_AVX2
+      if ((result == 6) && (ecx_val & 0x00001000))
+        { // FMA exists; look for AVX2 among the extended features (EAX=7)
+          int max_eax=0, ebx_val=0;
+          __asm__ volatile ("mov %%rbx,%%rsi\n\t" // Save PIC register in RSI
+                            "xor %%rax,%%rax\n\t"
+                            "cpuid\n\t"
+                            "mov %%eax,%0\n\t"
+                            "mov %%rsi,%%rbx" // Restore the PIC register
+                            : "=m" (max_eax) : /* no input */
+                            : "%rax","%rsi","%rcx","%rdx");
+          if (max_eax >= 7)
+            __asm__ volatile ("mov %%rbx,%%rsi\n\t" // Save PIC register
+                              "mov $7,%%rax\n\t"
+                              "xor %%rcx,%%rcx\n\t" // Sub-leaf 0
+                              "cpuid\n\t"
+                              "mov %%ebx,%0\n\t"
+                              "mov %%rsi,%%rbx" // Restore the PIC register
+                              : "=m" (ebx_val) : /* no input */
+                              : "%rax","%rsi","%rcx","%rdx");
+          if (ebx_val & 0x00000020)
+            result = 7; // AVX2 support exists
+        }
+#endif // !KDU_NO_AVX2
       return result;
     }
 
@@ -463,6 +487,9 @@ Description:
 # include <sys/param.h>
 # include <sys/sysctl.h>
 #endif // __APPLE__
+#ifdef __linux__
+# include <stdio.h>
+#endif // __linux__
 
 /*****************************************************************************/
 /* EXTERN                    kdu_get_num_processors                          */
@@ -501,3 +528,45 @@ int
   return 0;
 #endif
 }
+
+/*****************************************************************************/
+/* EXTERN                      kdu_get_numa_nodes                            */
+/*****************************************************************************/
+
+int
+  kdu_get_numa_nodes(kdu_long node_affinity[], int max_nodes)
+{
+  int num_nodes = 0;
+#ifdef __linux__
+  // Node directories are numbered from 0, but the numbers need not be
+  // contiguous (e.g., after memory hot-unplug), so we look a little way
+  // beyond any gap.
+  for (int node=0, misses=0; (num_nodes < max_nodes) && (misses < 8); node++)
+    { 
+      char path[80];
+      sprintf(path,"/sys/devices/system/node/node%d/cpulist",node);
+      FILE *fp = fopen(path,"r");
+      if (fp == NULL)
+        { misses++; continue; }
+      misses = 0;
+      kdu_long mask = 0;
+      int first, last;
+      while (fscanf(fp,"%d",&first) == 1)
+        { // The list looks like "0-7,16-23"
+          last = first;
+          int c = getc(fp);
+          if ((c == '-') && (fscanf(fp,"%d",&last) == 1))
+            c = getc(fp);
+          for (; (first <= last) && (first < 64); first++)
+            if (first >= 0)
+              mask |= ((kdu_long) 1) << first;
+          if (c != ',')
+            break;
+        }
+      fclose(fp);
+      if (mask != 0)
+        node_affinity[num_nodes++] = mask;
+    }
+#endif // __linux__
+  return num_nodes;
+}
@@ -72,6 +72,9 @@ KDU_EXPORT extern
      [>>] 4 if the architecture supports MMX, SSE, SSE2, SSE3 and SSSE3.
      [>>] 5 if the architecture supports MMX, SSE, SSE2, SSE3, SSSE3 & SSE4.1.
      [>>] 6 if the architecture supports MMX through to AVX.
+     [>>] 7 if the architecture supports MMX through to AVX2, along with
+          FMA (fused multiply-add).  This level is currently detected only
+          by 64-bit GCC builds.
   */
 
 KDU_EXPORT extern
@@ -151,6 +154,10 @@ KDU_EXPORT extern
 #  endif
 #endif // KDU_MAC_SPEEDUPS
 
+#if ((defined KDU_NO_AVX) && !(defined KDU_NO_AVX2))
+#  define KDU_NO_AVX2 // AVX2 instructions are vex-encoded extensions of AVX
+#endif
+
 #ifndef KDU_MIN_MMX_LEVEL
 #  if ((defined KDU_MAC_SPEEDUPS) && !(defined KDU_NO_SSSE3))
 #    define KDU_MIN_MMX_LEVEL 4
@@ -190,4 +197,20 @@ KDU_EXPORT extern int
        function returns 0.
   */
 
+KDU_EXPORT extern int
+  kdu_get_numa_nodes(kdu_long node_affinity[], int max_nodes);
+  /* [SYNOPSIS]
+       Discovers the NUMA (non-uniform memory access) nodes of the machine,
+       writing to `node_affinity'[n] the set of logical processors which
+       belong to node n, as a bit mask of the form passed to
+       `kdu_thread_entity::create' and `kdu_thread_entity::add_thread', so
+       that only the first 64 processors can be represented.  Nodes with no
+       such processors are skipped.  Under Linux the topology is read from
+       "/sys/devices/system/node"; elsewhere it is not yet discovered.
+     [RETURNS]
+       The number of nodes written to `node_affinity', at most `max_nodes'.
+       The function returns 0 if the topology cannot be discovered and 1 on
+       machines (or virtual machines) with uniform memory access.
+  */
+
 #endif // KDU_ARCH_H
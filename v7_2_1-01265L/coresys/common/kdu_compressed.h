@@ -703,6 +703,7 @@ class kdu_codestream_comment {
 #define KDU_SOURCE_CAP_SEEKABLE     ((int) 0x0002)
 #define KDU_SOURCE_CAP_CACHED       ((int) 0x0004)
 #define KDU_SOURCE_CAP_IN_MEMORY    ((int) 0x0008)
+#define KDU_SOURCE_CAP_PREFETCH     ((int) 0x0010)
 
 class kdu_compressed_source {
   /* [BIND: reference]
@@ -741,9 +742,9 @@ class kdu_compressed_source {
       /* [SYNOPSIS]
            Returns the logical OR of one or more capability flags, whose
            values are identified by the macros, `KDU_SOURCE_CAP_SEQUENTIAL',
-           `KDU_SOURCE_CAP_SEEKABLE' `KDU_SOURCE_CAP_IN_MEMORY' and
-           `KDU_SOURCE_CAP_CACHED'.  These flags have the following
-           interpretation:
+           `KDU_SOURCE_CAP_SEEKABLE' `KDU_SOURCE_CAP_IN_MEMORY',
+           `KDU_SOURCE_CAP_PREFETCH' and `KDU_SOURCE_CAP_CACHED'.  These
+           flags have the following interpretation:
            [>>] `KDU_SOURCE_CAP_SEQUENTIAL': If this flag is set, the source
                 supports sequential reading of data in the order expected
                 of a valid JPEG2000 code-stream.  If this flag is not set,
@@ -769,6 +770,13 @@ class kdu_compressed_source {
                 increases the efficiency of high performance applications.
                 If this flag is set, `KDU_SOURCE_CAP_SEQUENTIAL' and
                 `KDU_SOURCE_CAP_SEEKABLE' must also be set.
+           [>>] `KDU_SOURCE_CAP_PREFETCH': If this flag is set, the source
+                can begin fetching byte ranges ahead of the `seek' and
+                `read' calls which will consume them; the code-stream
+                machinery then passes the location of each precinct it
+                will need to the `prefetch' function, as soon as that
+                location is known from PLT marker segments.  The flag is
+                meaningful only together with `KDU_SOURCE_CAP_SEEKABLE'.
            [>>] `KDU_SOURCE_CAP_CACHED': If this flag is set, the source is a
                 client cache, which does not guarantee to support regular
                 sequential reading of the code-stream beyond the end of
@@ -876,6 +884,26 @@ class kdu_compressed_source {
            where `ptr' is the address returned by the function and
            `idx' lies in the range -`pos' <= `idx' < `lim'-`ptr'.
       */
+    virtual void prefetch(kdu_long offset, kdu_long length) { return; }
+      /* [SYNOPSIS]
+           This function is called only for sources which advertise the
+           `KDU_SOURCE_CAP_PREFETCH' capability.  It announces that the
+           `length' bytes which start `offset' bytes beyond the seek origin
+           (see `seek') are likely to be read soon, so that the source can
+           start transferring them (e.g., with asynchronous reads) without
+           waiting for the `seek' and `read' calls themselves.
+           [//]
+           The function must not block and must not move the read pointer.
+           It is a hint only: a source may ignore any or all of these calls,
+           and the code-stream machinery may never read some of the bytes it
+           announces, so `read' must continue to work for any location,
+           whether or not it has been prefetched.
+           [//]
+           The code-stream machinery announces precincts in the order in
+           which their packets appear in the code-stream, and only those
+           which intersect the region, components and resolutions
+           identified by `kdu_codestream::apply_input_restrictions'.
+      */
     virtual bool set_tileheader_scope(int tnum, int num_tiles)
       { return false; }
       /* [SYNOPSIS]
@@ -2125,6 +2153,46 @@ class kdu_codestream {
            and supplies the optional `kdu_thread_env' reference to all
            Kakadu functions which can accept it.
       */
+    KDU_EXPORT void
+      set_huge_page_buffers(bool enable=true);
+      /* [SYNOPSIS]
+           Compressed data is held in small code buffers, carved from larger
+           blocks of memory which the internal buffering service allocates
+           from the heap as it needs them.  If `enable' is true, these blocks
+           are allocated as 2 MB slabs, each aligned to a 2 MB boundary, and
+           under Linux the kernel is asked to back each slab with a single
+           (transparent) huge page.  Encoding a large image can touch many
+           thousands of code buffers spread over hundreds of megabytes; with
+           huge pages far fewer TLB entries are needed to reach them.  The
+           slabs are larger than the normal allocations, so small images may
+           take a little more memory.
+           [//]
+           The setting applies to the buffering service, which might be
+           shared with other codestreams (see `share_buffering'), and affects
+           only memory allocated from then on, so it is best called right
+           after `create'.
+      */
+    KDU_EXPORT void
+      get_buffer_stats(kdu_long &heap_allocations, kdu_long &transactions,
+                       kdu_long &contended_transactions);
+      /* [SYNOPSIS]
+           Reports the work done by the internal buffering service, which
+           serves code buffers to each thread from a cache (or magazine) of
+           its own, visiting the shared service only to exchange whole
+           blocks of buffers, in batches.
+         [ARG: heap_allocations]
+           Number of times that memory has been allocated from the heap.
+         [ARG: transactions]
+           Number of times that a thread has fetched blocks from, or
+           returned them to, the shared service.
+         [ARG: contended_transactions]
+           Number of those transactions that were delayed because another
+           thread was accessing the shared service at the same time.
+           [//]
+           If `share_buffering' has been used, the counts include the work
+           done for other codestreams that have finished with the service
+           (or with their threads), as well as that of the present one.
+      */
     KDU_EXPORT void
       destroy();
       /* [SYNOPSIS]
@@ -2973,6 +3041,46 @@ class kdu_codestream {
            Unlike `set_max_bytes', the effects of the present function are
            preserved across multiple calls to `restart'.
       */
+    KDU_EXPORT void
+      set_pass_prediction(int margin);
+      /* [SYNOPSIS]
+           This function has no impact on input or interchange codestreams.
+           When applied to an `output codestream' whose rate is limited by
+           `set_max_bytes', it makes block encoders predict, before coding a
+           code-block, the last bit-plane which is worth coding, rather than
+           coding passes until they can see that their distortion-length
+           slopes have fallen below the conservative threshold returned by
+           `kdu_subband::get_conservative_slope_threshold'.  Two things
+           change:
+           [>>] That threshold becomes an estimate of the one PCRD-opt will
+                use, rather than a lower bound to it: the bytes generated so
+                far in each DWT level are scaled up by the share of that
+                level's samples still to be coded, so that the delay through
+                the wavelet transform (which codes the high frequency
+                subbands first) no longer drags the estimate down.  The
+                conservative bound is used while it is larger.
+           [>>] Each code-block is coded no further than `margin' bit-planes
+                below the lowest bit-plane which held a coding pass above
+                the threshold in the code-block last coded by the same job
+                -- i.e., its neighbour to the left, or the one above at the
+                start of a row.
+           [//]
+           Since the slopes of successive bit-planes fall by a factor of
+           about 4, a `margin' of 1 rarely discards a pass which rate
+           allocation would have kept; the error is confined to code-blocks
+           whose contents differ sharply from those of their neighbours,
+           and is corrected by the next code-block.  Code-blocks of the LL
+           band, and any coded before threshold statistics are available,
+           are coded as usual.
+           [//]
+           A negative `margin' (the default) disables prediction.  As with
+           `set_min_slope_threshold', the effects of the function are
+           preserved across multiple calls to `restart'.  Prediction may
+           only be turned on or off before `set_max_bytes' is called: the
+           per-level statistics it relies upon are collected only if it is
+           on by then, so that rate control without prediction costs no
+           more than before.
+      */
     KDU_EXPORT void
       set_resilient(bool expect_ubiquitous_sops=false);
       /* [SYNOPSIS]
@@ -4338,6 +4446,26 @@ class kdu_tile {
            Returns the coordinates of this tile, using the same coordinate
            system as that used by `kdu_codestream::open_tile'.
       */
+    KDU_EXPORT kdu_long
+      get_structure_memory(kdu_long *arena_bytes=NULL);
+      /* [SYNOPSIS]
+           Returns the number of bytes occupied by the tile's structural
+           state -- its tile-components, resolutions, subbands and precinct
+           reference arrays, along with the packet sequencer.  This is the
+           amount which the tile contributes to the structure memory
+           reported by `kdu_codestream::get_compressed_data_memory' and
+           used in cache threshold calculations.  It excludes precincts
+           and code-block bit-streams, which are drawn from pools shared
+           by all tiles of the codestream.
+           [//]
+           The tile's arrays are carved out of a private arena, which is
+           returned to the heap in one go when the tile is destroyed (or
+           rebuilt from scratch).
+         [ARG: arena_bytes]
+           If non-NULL, this argument is used to return the number of heap
+           bytes currently held by the tile's arena, which includes slack
+           at the end of the arena's chunks.
+      */
   // --------------------------------------------------------------------------
   public: // Data processing/access member functions
     KDU_EXPORT bool
@@ -6860,6 +6988,17 @@ class kdu_subband {
            information will be available only if
            `kdu_codestream::set_max_bytes' or
            `kdu_codestream::set_min_slope_threshold' has been called.
+           [//]
+           If `kdu_codestream::set_pass_prediction' has been called, the
+           result is instead an estimate of the threshold, whenever this is
+           larger than the lower bound.
+      */
+    KDU_EXPORT int
+      get_pass_prediction_margin();
+      /* [SYNOPSIS]
+           Returns the `margin' supplied to
+           `kdu_codestream::set_pass_prediction', or -1 if block encoders
+           are not to predict the number of coding passes they process.
       */
   // --------------------------------------------------------------------------
   private: // Interface state
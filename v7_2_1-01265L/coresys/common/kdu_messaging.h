@@ -67,6 +67,14 @@ to port the system to different application environments.
   class kdu_error;
   class kdu_warning;
 
+// Destructors are implicitly `noexcept' under C++11, which would turn the
+// exception thrown by an error handler's `flush' into `std::terminate'.
+#if defined(__cplusplus) && (__cplusplus >= 201103L)
+#  define KDU_DESTRUCTOR_MAY_THROW noexcept(false)
+#else
+#  define KDU_DESTRUCTOR_MAY_THROW
+#endif
+
 
 /* ========================================================================= */
 /*                       Messaging Setup Functions                           */
@@ -215,7 +223,7 @@ class kdu_message {
   */
   public: // Member functions
     kdu_message() { mode_hex = false; }
-    virtual ~kdu_message() { return; };
+    virtual ~kdu_message() KDU_DESTRUCTOR_MAY_THROW { return; };
     virtual void put_text(const char *string) { return; }
       /* [BIND: callback]
          [SYNOPSIS]
@@ -827,7 +835,7 @@ class kdu_error : public kdu_message {
            for internationalization.  See any of the source files to
            understand how this is achieved.
       */
-    KDU_EXPORT ~kdu_error();
+    KDU_EXPORT ~kdu_error() KDU_DESTRUCTOR_MAY_THROW;
       /* [SYNOPSIS]
            The destructor terminates the process through `exit', unless a
            custom error handling `kdu_message'-derived object has been
@@ -78,6 +78,7 @@ struct kd_thread_palette_ref;
 struct kd_thread_group;
 struct kd_thread_domain;
 struct kd_thread_domain_sequence;
+class kd_thread_tracer;
 
 /*===========================================================================*/
 /*       Design Constants for the Kakadu Multi-Threading Architecture        */
@@ -519,6 +520,13 @@ class kdu_thread_entity {
            for this argument and there will be no need ever to call this
            function, although it does not matter if you do.
       */
+    KDU_EXPORT int get_num_numa_nodes();
+      /* [SYNOPSIS]
+           Returns 1 more than the largest `numa_node' passed to `add_thread',
+           or 0 if no thread has been given a node.  Objects which process
+           several tiles or codestreams at once (e.g., `kdu_stripe_compressor')
+           use this to spread their queues over the nodes.
+      */
     KDU_EXPORT int get_num_threads(const char *domain_name=NULL);
       /* [SYNOPSIS]
            You may use this function to determine the total number of
@@ -553,7 +561,8 @@ class kdu_thread_entity {
            is always at least one (group owner), unless the `create'
            function has not yet been called.
       */
-    KDU_EXPORT bool add_thread(const char *domain_name=NULL);
+    KDU_EXPORT bool add_thread(const char *domain_name=NULL,
+                               kdu_long cpu_affinity=0, int numa_node=-1);
       /* [SYNOPSIS]
            This function is used to add worker threads to the group owned
            by the current thread.  The caller, therefore, is usually the
@@ -582,6 +591,16 @@ class kdu_thread_entity {
            this call only assigns the thread a preference to do work in
            the identified domain.
            [//]
+           On machines with more than one NUMA node (see
+           `kdu_get_numa_nodes'), threads can also be bound to the processors
+           of a node and told which node they belong to, via the
+           `cpu_affinity' and `numa_node' arguments.  Such a thread looks
+           first for jobs scheduled by queues of the same node (see
+           `kdu_thread_queue::set_numa_node') before looking at the rest,
+           so that the code and line buffers of a codestream or tile tend to
+           be first touched, and then used, by the processors closest to the
+           memory on which they were placed.
+           [//]
            This function should not throw any exceptions.  If another thread
            in the thread group has already passed into `handle_exception',
            the current call will just return false immediately.
@@ -591,6 +610,11 @@ class kdu_thread_entity {
            for an existing domain with the same name (full string compare, not
            just string address check), creating one if necessary, and adds
            a new thread to that domain.
+         [ARG: cpu_affinity]
+           If non-zero, the new thread is bound to these processors in place
+           of any `cpu_affinity' passed to `create'.
+         [ARG: numa_node]
+           If non-negative, the NUMA node whose jobs the thread prefers.
          [RETURNS]
            False if insufficient resources are available to offer a new thread
            of execution, or if a multi-threading implementation for the
@@ -784,6 +808,57 @@ class kdu_thread_entity {
            too high for systems with lots of threads or which require
            frequent attention to other work.
       */
+    KDU_EXPORT bool start_trace(int max_events_per_thread=65536);
+      /* [SYNOPSIS]
+           Starts (or restarts) recording the activity of every thread in
+           the group, for later export by `write_trace'.  Each thread
+           records the jobs it executes (named after the queue which
+           scheduled them -- see `kdu_thread_queue::set_trace_name' -- or
+           else after the queue's work domain), the periods it spends in
+           `wait_for_condition' (named after the `debug_text' supplied
+           there), the periods it spends idle, waiting to be woken, and the
+           points at which it schedules jobs.
+           [//]
+           Each thread writes only to its own ring buffer, so recording
+           takes no locks and has no effect on scheduling beyond reading the
+           clock twice per job.  Once a thread's ring buffer is full, its
+           oldest events are overwritten.  While tracing is not started, the
+           only cost is a test of one flag per job.
+           [//]
+           Tracing can also be started without changing the application, by
+           setting the "KDU_THREAD_TRACE" environment variable to the name
+           of a file before the thread group is created; the trace is then
+           written to that file by `destroy'.  This is the mechanism to use
+           to find scheduling gaps in production runs.
+           [//]
+           Only the group owner may call this function, and only when no
+           jobs are running -- e.g., straight after `create' or after a
+           global `join'.  Threads added to the group later are traced as
+           they are added.
+         [RETURNS]
+           False if the object has not been created.
+         [ARG: max_events_per_thread]
+           Capacity of each thread's ring buffer; rounded up to a power of
+           2.  Each event occupies 32 bytes.
+      */
+    KDU_EXPORT bool write_trace(const char *fname);
+      /* [SYNOPSIS]
+           Stops any trace started by `start_trace' and writes the recorded
+           events to the file `fname' in the Chrome trace-event format
+           (JSON), which can be loaded by "chrome://tracing" or by the
+           Perfetto UI.  Jobs, waits and idle periods are complete ("X")
+           events on the track of the thread which performed them, with
+           microsecond time stamps measured from the call to `start_trace';
+           job scheduling appears as instant events.  The track of each
+           thread is named after its index and work domain, and the number
+           of events lost to ring buffer overflow is recorded with it.
+           [//]
+           As with `start_trace', only the group owner may call this
+           function, and only when no jobs are running.  The recorded
+           events are retained, so the function may be called again.
+         [RETURNS]
+           False if nothing has been traced or the file cannot be written.
+      */
     KDU_EXPORT kdu_long
       get_job_count_stats(kdu_long &group_owner_job_count);
       /* [SYNOPSIS]
@@ -1630,6 +1705,7 @@ class kdu_thread_entity {
     friend class kdu_thread_queue;
     friend struct kd_thread_group;
     friend struct kd_thread_domain;
+    friend class kd_thread_tracer;
     int thread_idx; // Index within `group->threads'
     kdu_thread thread;
     kd_thread_group *group; // Created by the owning thread entity.
@@ -1647,6 +1723,7 @@ class kdu_thread_entity {
     bool in_process_jobs; // True if the thread is executing in `process_jobs'
     bool in_process_jobs_with_cond; // As above with non-NULL `cond' argument
     int group_mutex_lock_count; // Allows safe recursive locking of group mutex
+    int numa_node; // -1 unless set by `add_thread'
   private: // Thread-specific palette heap
     int next_palette_idx;
     kd_thread_palette *palette_heap[KD_THREAD_PALETTES];
@@ -1844,6 +1921,35 @@ class kdu_thread_queue {
            resort.  See the description of that function for a more
            complete explanation.
       */
+    void set_trace_name(const char *name) { this->trace_name = name; }
+      /* [SYNOPSIS]
+           Names the jobs scheduled by this queue in thread activity traces
+           (see `kdu_thread_entity::start_trace').  Jobs of unnamed queues
+           take the name of the queue's work domain.  Only the pointer is
+           kept, so `name' should be a string constant, or at least outlive
+           the call to `kdu_thread_entity::write_trace'.
+      */
+    const char *get_trace_name() { return trace_name; }
+      /* [SYNOPSIS]
+           Returns the name installed by `set_trace_name', or NULL.
+      */
+    void set_numa_node(int node) { this->numa_node = node; }
+      /* [SYNOPSIS]
+           Call this function before the queue is attached, to have its jobs
+           preferred by the threads that `kdu_thread_entity::add_thread'
+           assigned to NUMA node `node'.  Jobs of the queue are kept in a
+           work domain of their own for the node.  Queues which are attached
+           with a node of -1 (the default) take the node of their
+           `super_queue', so it is enough to set the node of the queue passed
+           as `env_queue' to the stripe compressor, or of a tile's queue, to
+           route all of its block coding and DWT jobs.
+      */
+    int get_numa_node() { return attached_numa_node; }
+      /* [SYNOPSIS]
+           Returns the node to which the jobs of the queue were routed when
+           it was last attached -- i.e., the node given to `set_numa_node',
+           or else that of its `super_queue' -- or -1 if there is none.
+      */
     bool is_attached() { return (this->group != NULL); }
       /* [SYNOPSIS]
            Returns true if the this object has been attached to a thread
@@ -2625,6 +2731,9 @@ class kdu_thread_queue {
     kdu_long sequence_idx;
     kd_thread_domain_sequence *domain_sequence;
     const char *last_domain_name; // Used for debugging strange conditions
+    const char *trace_name; // See `set_trace_name'
+    int numa_node; // See `set_numa_node'
+    int attached_numa_node; // `numa_node', or that of the `super_queue'
     int registered_max_jobs; // Non-zero if queue can schedule jobs
     kd_thread_palette_ref *palette_refs; // List of `registered_max_jobs' refs
   private: // Synchronization variables
@@ -2734,7 +2843,10 @@ class kdu_thread_job {
   */
   public: // Member functions
     void set_job_func(kdu_thread_job_func func)
-      { this->job_func = func; this->palette_ref = NULL; }
+      { 
+        this->job_func = func; this->palette_ref = NULL;
+        this->trace_queue = NULL;
+      }
       /* [SYNOPSIS]
            Be sure to call this function before passing a reference to this
            object to the `kdu_thread_queue::bind_jobs' function.  Note
@@ -2754,7 +2866,9 @@ class kdu_thread_job {
   private: // Data
       kdu_thread_job_func job_func;
       kd_thread_palette_ref *palette_ref; // NULL until job is bound
+      kdu_thread_queue *trace_queue; // Queue which last scheduled the job
       friend class kdu_thread_queue;
+      friend class kdu_thread_entity;
       friend struct kd_thread_group;
   };
 
@@ -53,6 +53,9 @@ codestream objects.
 #include <string.h>
 #include <limits.h>
 #include <assert.h>
+#ifdef __linux__
+#  include <sys/mman.h>
+#endif // __linux__
 #include "kdu_elementary.h"
 #include "kdu_utils.h"
 #include "kdu_messaging.h"
@@ -556,7 +559,12 @@ kd_compressed_input::kd_compressed_input(kdu_compressed_source *source)
   suspend_ptr = alt_first_unwritten = NULL;
   suspended_bytes = last_loaded_bytes = 0;
   special_scope = false;
-  if (source->get_capabilities() & KDU_SOURCE_CAP_IN_MEMORY)
+  int caps = source->get_capabilities();
+  prefetch_enabled = ((caps & KDU_SOURCE_CAP_PREFETCH) &&
+                      (caps & KDU_SOURCE_CAP_SEEKABLE) &&
+                      !(caps & (KDU_SOURCE_CAP_CACHED |
+                                KDU_SOURCE_CAP_IN_MEMORY)));
+  if (caps & KDU_SOURCE_CAP_IN_MEMORY)
     { 
       kdu_long mem_pos;
       kdu_byte *mem, *mem_lim;
@@ -1806,7 +1814,7 @@ void
 /*****************************************************************************/
 
 kdu_long
-  kd_precinct_pointer_server::pop_address()
+  kd_precinct_pointer_server::pop_address(kdu_long &length)
 {
   if (buf_server == NULL)
     return 0;
@@ -1837,6 +1845,7 @@ kdu_long
       something_served = true;
       kdu_long result = next_address;
       next_address += new_length;
+      length = new_length;
       return result;
     }
 
@@ -1856,6 +1865,7 @@ kdu_long
   something_served = true;
   kdu_long result = next_address;
   next_address += new_length;
+  length = new_length;
   return result;
 }
 
@@ -1888,6 +1898,8 @@ kd_buf_master::kd_buf_master()
   num_partial_block_bufs = 0;
   total_alloc_blocks = 0;
   num_blocks_per_ccb_entry = 0;
+  use_huge_pages = false;
+  num_heap_allocations = retired_transfers = retired_contended = 0;
   for (int n=0; n < KD_BUF_MASTER_CCB_SPAN; n++)
     ccb_entries[n].set(NULL);
 }
@@ -1926,7 +1938,7 @@ void
 /*****************************************************************************/
 
 kd_code_buffer *
-  kd_buf_master::get_blocks(kdu_int32 &num_blocks)
+  kd_buf_master::get_blocks(kdu_int32 &num_blocks, kdu_int32 *contended)
 {
   kd_code_buffer *list = NULL;
   if (!mutex.exists())
@@ -1952,12 +1964,15 @@ kd_code_buffer *
     { // Use atomic interlocked operations for mostly lock-less queueing
       kdu_int32 pos = ccb_get_pos.exchange_add(1);
       pos &= (kdu_int32)(KD_BUF_MASTER_CCB_SPAN-1);
+      bool retry = false;
       do { 
+        if (retry && (contended != NULL))
+          (*contended)++;
         list = (kd_code_buffer *) ccb_entries[pos].get();
         if (list == NULL)
           service_lists();
-      } while ((list == NULL) ||
-               !ccb_entries[pos].compare_and_set(list,NULL));
+      } while ((retry = ((list == NULL) ||
+                         !ccb_entries[pos].compare_and_set(list,NULL))));
       num_blocks = list->get_buf_val32();
       int val = num_allocated_blocks.exchange_add(num_blocks) + num_blocks;
       if (val > peak_allocated_blocks)
@@ -1972,7 +1987,7 @@ kd_code_buffer *
 
 void
   kd_buf_master::release_blocks(kd_code_buffer *head, kd_code_buffer *tail,
-                                kdu_int32 num_blocks)
+                                kdu_int32 num_blocks, kdu_int32 *contended)
 {
   if ((num_blocks <= 0) || (head == NULL) || (tail == NULL))
     return;
@@ -1993,10 +2008,13 @@ void
   else
     { // Atomically move the new blocks to the head of the release list
       kd_code_buffer *old_head;
+      bool retry = false;
       do { 
+        if (retry && (contended != NULL))
+          (*contended)++;
         old_head = (kd_code_buffer *) release_list.get();
         tail->set_buf_link(old_head);
-      } while (!release_list.compare_and_set(old_head,head));
+      } while ((retry = !release_list.compare_and_set(old_head,head)));
       num_release_blocks.exchange_add(num_blocks);
       num_allocated_blocks.exchange_add(-num_blocks);
     }
@@ -2110,17 +2128,41 @@ void
               // memory consumption of the application would not be
               // affected by any blocks that may have been released while
               // this function is running.
-              kd_code_alloc *new_alloc = (kd_code_alloc *)
-                malloc(sizeof(kd_code_alloc *) + KDU_CODE_BUFFER_ALIGN +
-                       KD_CODEBUF_BLOCK_BYTES*KD_BUF_MASTER_CCB_SPAN);
+              int n, new_blocks = KD_BUF_MASTER_CCB_SPAN;
+              kd_code_alloc *new_alloc = NULL;
+              if (use_huge_pages)
+                { // Fill a whole huge page, the first code buffer's worth
+                  // of which holds the `kd_code_alloc' header
+                  new_blocks = (KD_CODEBUF_HUGE_SLAB_BYTES -
+                                KDU_CODE_BUFFER_ALIGN) /
+                    KD_CODEBUF_BLOCK_BYTES;
+#if (defined __linux__) && (defined MADV_HUGEPAGE)
+                  void *slab = NULL;
+                  if (posix_memalign(&slab,KD_CODEBUF_HUGE_SLAB_BYTES,
+                                     KD_CODEBUF_HUGE_SLAB_BYTES) != 0)
+                    slab = NULL;
+                  else
+                    madvise(slab,KD_CODEBUF_HUGE_SLAB_BYTES,MADV_HUGEPAGE);
+                  new_alloc = (kd_code_alloc *) slab;
+#else // Huge pages cannot be requested; allocate the same slab anyway
+                  new_alloc = (kd_code_alloc *)
+                    malloc(sizeof(kd_code_alloc *) + KDU_CODE_BUFFER_ALIGN +
+                           KD_CODEBUF_BLOCK_BYTES*new_blocks);
+#endif
+                }
+              else
+                new_alloc = (kd_code_alloc *)
+                  malloc(sizeof(kd_code_alloc *) + KDU_CODE_BUFFER_ALIGN +
+                         KD_CODEBUF_BLOCK_BYTES*new_blocks);
               if (new_alloc == NULL)
                 throw std::bad_alloc();
               new_alloc->next = alloc;
               alloc = new_alloc;
+              num_heap_allocations++;
+              total_alloc_blocks += new_blocks;
               int align_off = ((-_addr_to_kdu_int32(new_alloc->block)) &
                                (KDU_CODE_BUFFER_ALIGN-1));
               blk = (kd_code_buffer *)(new_alloc->block+align_off);
-              int n, new_blocks = KD_BUF_MASTER_CCB_SPAN;
               delta_num_release_blocks += new_blocks-1;
               num_free_blocks += new_blocks-1;
               for (; new_blocks > 0; new_blocks--)
@@ -2168,6 +2210,7 @@ void
   free_blocks = strip_bufs = first_free_buf = last_free_buf = NULL;
   num_free_blocks = num_strip_bufs = num_free_bufs = 0;
   surplus_structure_bytes = 0;
+  num_transfers = num_contended = 0;
   this->master = tgt;
   tgt->attach_buf_server(this);
 }
@@ -2202,11 +2245,33 @@ void
       master->release_blocks(free_blocks,scan,num_free_blocks);
       free_blocks = NULL; num_free_blocks = 0;
     }
+  master->add_server_stats(num_transfers,num_contended);
+  num_transfers = num_contended = 0;
   master->detach_buf_server(this);
   master = NULL;
   surplus_structure_bytes = 0;
 }
 
+/*****************************************************************************/
+/*                     kd_buf_server::release_magazine                       */
+/*****************************************************************************/
+
+void
+  kd_buf_server::release_magazine()
+{
+  assert(num_free_blocks > KD_BUF_SERVER_MAGAZINE_BLOCKS);
+  kd_code_buffer *head = free_blocks->get_buf_link();
+  kd_code_buffer *tail = head;
+  for (int n=KD_BUF_SERVER_MAGAZINE_BLOCKS-1; n > 0; n--)
+    tail = tail->get_buf_link();
+  free_blocks->set_buf_link(tail->get_buf_link());
+  tail->set_buf_link(NULL);
+  num_free_blocks -= KD_BUF_SERVER_MAGAZINE_BLOCKS;
+  kdu_int32 contended = 0;
+  master->release_blocks(head,tail,KD_BUF_SERVER_MAGAZINE_BLOCKS,&contended);
+  num_transfers++;  num_contended += contended;
+}
+
 /*****************************************************************************/
 /*                      kd_buf_server::get_from_block                        */
 /*****************************************************************************/
@@ -2218,7 +2283,9 @@ kd_code_buffer *
   if (num_free_blocks == 0)
     { 
       assert(free_blocks == NULL);
-      free_blocks = master->get_blocks(num_free_blocks);
+      kdu_int32 contended = 0;
+      free_blocks = master->get_blocks(num_free_blocks,&contended);
+      num_transfers++;  num_contended += contended;
     }
   kd_code_buffer *buf = free_blocks;
   free_blocks = buf->get_buf_link();
@@ -2543,13 +2610,14 @@ kd_precinct_ref *
   if ((tile->codestream->in != NULL) &&
       ((precinct == NULL) || (precinct->next_layer_idx == 0)))
     { // See if we can recover a seek address.
+      kdu_long seek_length;
       kdu_long seek_address =
-        tile->precinct_pointer_server.get_precinct_address();
+        tile->precinct_pointer_server.get_precinct_address(seek_length);
       if (seek_address < 0)
         return NULL; // Need a new tile-part.
       if (seek_address > 0)
         {
-          if (!result->set_address(res,idx,seek_address))
+          if (!result->set_address(res,idx,seek_address,seek_length))
             result = NULL; // Tile has been destroyed
         }
     }
@@ -7384,6 +7452,8 @@ void
       new_state->cached_target = state->cached_target;
       new_state->in_memory_source = state->in_memory_source;
       new_state->min_slope_threshold = state->min_slope_threshold;
+      new_state->predict_passes = state->predict_passes;
+      new_state->pass_prediction_margin = state->pass_prediction_margin;
       
       // Now we can swap the contents of `new_state' with those of `state',
       // being careful to adjust ownership of any resources that reference
@@ -7435,6 +7505,39 @@ void
   state = NULL;
 }
 
+/*****************************************************************************/
+/*                   kdu_codestream::set_huge_page_buffers                   */
+/*****************************************************************************/
+
+void
+  kdu_codestream::set_huge_page_buffers(bool enable)
+{
+  state->buf_master->set_huge_pages(enable);
+}
+
+/*****************************************************************************/
+/*                     kdu_codestream::get_buffer_stats                      */
+/*****************************************************************************/
+
+void
+  kdu_codestream::get_buffer_stats(kdu_long &heap_allocations,
+                                   kdu_long &transactions,
+                                   kdu_long &contended_transactions)
+{
+  state->buf_master->get_stats(heap_allocations,transactions,
+                               contended_transactions);
+  int t, num_threads = 0;
+  if (state->thread_context != NULL)
+    num_threads = state->thread_context->get_num_buf_servers();
+  for (t=0; t <= num_threads; t++)
+    { 
+      kdu_long server_transactions, server_contended;
+      state->buf_servers[t].get_stats(server_transactions,server_contended);
+      transactions += server_transactions;
+      contended_transactions += server_contended;
+    }
+}
+
 /*****************************************************************************/
 /*                      kdu_codestream::share_buffering                      */
 /*****************************************************************************/
@@ -7603,13 +7706,34 @@ void
             "called multiple times.");
         }
       kdu_long total_samples = 0;
+      double level_fractions[KD_STATS_LEVELS];
+      int d;
+      for (d=0; d < KD_STATS_LEVELS; d++)
+        level_fractions[d] = 0.0;
+      kdu_params *cod = state->siz->access_cluster(COD_params);
       for (int c=0; c < state->num_components; c++)
         {
           kdu_dims comp_dims; get_dims(c,comp_dims);
           total_samples += comp_dims.area();
-        }
-      state->rate_stats[0] = new kd_compressed_stats(total_samples,max_bytes,
-                                                     enable_periodic_trimming);
+          // Share out the samples among DWT levels, from the main header
+          // `Clevels' of the component (tile-specific values are ignored)
+          int levels = 5;
+          kdu_params *coc = cod->access_relation(-1,c,0,true);
+          if (coc != NULL)
+            coc->get(Clevels,0,0,levels);
+          double area = (double) comp_dims.area();
+          for (d=1; d <= levels; d++)
+            level_fractions[(d<KD_STATS_LEVELS)?d:(KD_STATS_LEVELS-1)] +=
+              area*3.0*pow(0.25,d);
+          level_fractions[(levels<KD_STATS_LEVELS)?levels:
+                          (KD_STATS_LEVELS-1)] += area*pow(0.25,levels);
+        }
+      for (d=0; d < KD_STATS_LEVELS; d++)
+        level_fractions[d] /= (total_samples > 0)?total_samples:1;
+      state->rate_stats[0] =
+        new kd_compressed_stats(total_samples,max_bytes,
+                                enable_periodic_trimming,
+                                (state->predict_passes)?level_fractions:NULL);
       if (state->thread_context != NULL)
         state->thread_context->manage_compressed_stats(state->rate_stats);
     }
@@ -7625,6 +7749,23 @@ void
   state->min_slope_threshold = threshold;
 }
 
+/*****************************************************************************/
+/*                     kdu_codestream::set_pass_prediction                   */
+/*****************************************************************************/
+
+void
+  kdu_codestream::set_pass_prediction(int margin)
+{
+  if ((state->rate_stats[0] != NULL) && (state->predict_passes != (margin>=0)))
+    { KDU_ERROR_DEV(e,61); e <<
+        KDU_TXT("\"kdu_codestream::set_pass_prediction\" may not turn "
+        "pass prediction on or off after \"set_max_bytes\" has been "
+        "called.");
+    }
+  state->predict_passes = (margin >= 0);
+  state->pass_prediction_margin = (margin >= 0)?margin:0;
+}
+
 /*****************************************************************************/
 /*                        kdu_codestream::set_resilient                      */
 /*****************************************************************************/
@@ -476,6 +476,58 @@ static inline void
 }
 
 
+/* ========================================================================= */
+/*                               kd_tile_arena                               */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                        kd_tile_arena::release_all                         */
+/*****************************************************************************/
+
+void
+  kd_tile_arena::release_all()
+{
+  kd_tile_arena_chunk *chunk;
+  while ((chunk=chunks) != NULL)
+    { chunks = chunk->next; free(chunk); }
+  free_ptr = NULL;  free_bytes = 0;  total_bytes = 0;
+}
+
+/*****************************************************************************/
+/*                          kd_tile_arena::augment                           */
+/*****************************************************************************/
+
+void *
+  kd_tile_arena::augment(size_t num_bytes)
+{
+  size_t header_bytes = sizeof(kd_tile_arena_chunk);
+  header_bytes += (-header_bytes) & 15;
+  bool dedicated = (num_bytes > (KD_TILE_ARENA_CHUNK_BYTES >> 2));
+  size_t chunk_bytes = header_bytes +
+    ((dedicated)?num_bytes:(KD_TILE_ARENA_CHUNK_BYTES-header_bytes));
+  kd_tile_arena_chunk *chunk = (kd_tile_arena_chunk *) malloc(chunk_bytes);
+  if (chunk == NULL)
+    throw std::bad_alloc();
+  chunk->num_bytes = chunk_bytes;
+  total_bytes += (kdu_long) chunk_bytes;
+  kdu_byte *payload = ((kdu_byte *) chunk) + header_bytes;
+  if (dedicated && (chunks != NULL))
+    { // Keep the current chunk (and its free space) at the head of the list
+      chunk->next = chunks->next;
+      chunks->next = chunk;
+      return payload;
+    }
+  chunk->next = chunks;
+  chunks = chunk;
+  if (dedicated)
+    { free_ptr = NULL;  free_bytes = 0; }
+  else
+    { free_ptr = payload + num_bytes;
+      free_bytes = chunk_bytes - header_bytes - num_bytes; }
+  return payload;
+}
+
+
 /* ========================================================================= */
 /*                                    kd_tile                                */
 /* ========================================================================= */
@@ -562,8 +614,7 @@ kd_tile::~kd_tile()
 
   if (sequencer != NULL)
     delete sequencer;
-  if (comps != NULL)
-    delete[] comps;
+  destroy_comps();
   while ((mct_tail=mct_head) != NULL)
     {
       mct_head = mct_tail->next_stage;
@@ -590,6 +641,20 @@ kd_tile::~kd_tile()
     codestream->buf_servers->augment_structure_bytes(-structure_bytes);
 }
 
+/*****************************************************************************/
+/*                           kd_tile::destroy_comps                          */
+/*****************************************************************************/
+
+void
+  kd_tile::destroy_comps()
+{
+  if (comps == NULL)
+    return;
+  for (int c=0; c < num_components; c++)
+    comps[c].~kd_tile_comp();
+  comps = NULL;
+}
+
 /*****************************************************************************/
 /*                              kd_tile::release                             */
 /*****************************************************************************/
@@ -780,7 +845,12 @@ void
   num_apparent_layers = num_layers;
 
   // Build tile-components.
-  kd_tile_comp *tc = comps = new kd_tile_comp[num_components];
+  assert(arena.get_total_bytes() == 0);
+  comps = (kd_tile_comp *)
+    arena.alloc(sizeof(kd_tile_comp) * (size_t) num_components);
+  for (c=0; c < num_components; c++)
+    new(comps+c) kd_tile_comp;
+  kd_tile_comp *tc = comps;
   this->total_precincts = 0;
   for (c=0; c < num_components; c++, tc++)
     { 
@@ -906,7 +976,10 @@ void
       
       // Now build the resolution level structure.
       int r, b;
-      tc->resolutions = new kd_resolution[tc->dwt_levels+1];
+      tc->resolutions = (kd_resolution *)
+        arena.alloc(sizeof(kd_resolution) * (size_t)(tc->dwt_levels+1));
+      for (r=0; r <= tc->dwt_levels; r++)
+        new(tc->resolutions+r) kd_resolution;
       for (r=tc->dwt_levels; r >= 0; r--)
         {
           kd_resolution *res = tc->resolutions + r;
@@ -969,7 +1042,7 @@ void
                       "each precinct will exceed the memory on most "
                       "machines.");
             }
-          res->precinct_refs = new kd_precinct_ref[(size_t)num_precincts];
+          res->allocate_precinct_refs(num_precincts);
           this->total_precincts += num_precincts;
           new_structure_bytes += num_precincts * sizeof(kd_precinct_ref);
 
@@ -1284,9 +1357,8 @@ void
                                               (QCD_params ":" RGN_params));
       if (!is_typical)
         { // Need to initialize from scratch
-          if (comps != NULL)
-            delete[] comps;
-          comps = NULL;
+          destroy_comps();
+          arena.release_all();
           while ((mct_tail = mct_head) != NULL)
             {
               mct_head = mct_tail->next_stage;
@@ -1343,14 +1415,11 @@ void
           res->rescomp = NULL;
 
           // Check precinct allocation
-          kdu_long old_num_precincts = res->precinct_indices.area();
           res->precinct_indices = res->region_indices =
             get_partition_indices(res->precinct_partition,res->node.dims);
           kdu_long num_precincts = res->precinct_indices.area();
-          if (num_precincts != old_num_precincts)
+          if (num_precincts > res->max_precinct_refs)
             { // Reallocate precinct references array
-              if (res->precinct_refs != NULL)
-                { delete[] res->precinct_refs; res->precinct_refs = NULL; }
               if (num_precincts > (1<<30))
                 { KDU_ERROR(e,0x07110801); e <<
                   KDU_TXT("Tile-component-resolution encountered in the "
@@ -1361,7 +1430,7 @@ void
                           "each precinct will exceed the memory on most "
                           "machines.");
                 }
-              res->precinct_refs = new kd_precinct_ref[(size_t) num_precincts];
+              res->allocate_precinct_refs(num_precincts);
             }
           this->total_precincts += num_precincts;
           new_structure_bytes += num_precincts * sizeof(kd_precinct_ref);
@@ -1661,9 +1730,8 @@ void
       if (sequencer != NULL)
         delete sequencer;
       sequencer = NULL;
-      if (comps != NULL)
-        delete[] comps;
-      comps = NULL;
+      destroy_comps();
+      arena.release_all();
       while ((mct_tail=mct_head) != NULL)
         {
           mct_head = mct_tail->next_stage;
@@ -1825,6 +1893,19 @@ void
   is_open = true;
   adjust_unloadability();
   codestream->num_open_tiles++;
+
+  if ((codestream->in != NULL) && is_addressable && (!exhausted) &&
+      (sequencer != NULL) && codestream->in->can_prefetch())
+    { // Recover the seek addresses of all precincts in the tile-parts read
+      // so far, so that the source can start fetching those which are of
+      // interest now, rather than one by one as they are loaded.  We stop at
+      // the first precinct which cannot be desequenced from its address.
+      kd_resolution *seq_res;
+      kdu_coords seq_idx;
+      kd_precinct_ref *seq_ref;
+      while (((seq_ref = sequencer->next_in_sequence(seq_res,seq_idx)) !=
+              NULL) && seq_ref->is_desequenced());
+    }
 }
 
 /*****************************************************************************/
@@ -3023,6 +3104,18 @@ kdu_coords
   return idx;
 }
 
+/*****************************************************************************/
+/*                       kdu_tile::get_structure_memory                      */
+/*****************************************************************************/
+
+kdu_long
+  kdu_tile::get_structure_memory(kdu_long *arena_bytes)
+{
+  if (arena_bytes != NULL)
+    *arena_bytes = state->arena.get_total_bytes();
+  return state->structure_bytes;
+}
+
 /*****************************************************************************/
 /*                             kdu_tile::get_ycc                             */
 /*****************************************************************************/
@@ -3918,7 +4011,8 @@ kd_tile_comp::~kd_tile_comp()
       (kernel_coefficients_flipped != kernel_coefficients))
     delete[] kernel_coefficients_flipped;
   if (resolutions != NULL)
-    delete[] resolutions;
+    for (int r=0; r <= dwt_levels; r++)
+      resolutions[r].~kd_resolution();
   if (layer_stats != NULL)
     delete[] layer_stats;
 }
@@ -4086,6 +4180,24 @@ kdu_resolution
 /*                                kd_resolution                              */
 /* ========================================================================= */
 
+/*****************************************************************************/
+/*                  kd_resolution::allocate_precinct_refs                    */
+/*****************************************************************************/
+
+void
+  kd_resolution::allocate_precinct_refs(kdu_long num_precincts)
+{
+  if (num_precincts <= max_precinct_refs)
+    return;
+  destroy_precinct_refs();
+  precinct_refs = (kd_precinct_ref *)
+    tile_comp->tile->arena.alloc(sizeof(kd_precinct_ref) *
+                                 (size_t) num_precincts);
+  for (kdu_long p=0; p < num_precincts; p++)
+    new(precinct_refs+p) kd_precinct_ref;
+  max_precinct_refs = num_precincts;
+}
+
 /*****************************************************************************/
 /*                kd_resolution::build_decomposition_structure               */
 /*****************************************************************************/
@@ -4118,7 +4230,12 @@ void
   if (num_subbands <= 3)
     subbands = subband_store;
   else
-    subbands = subband_handle = new kd_subband[num_subbands];
+    { 
+      subbands = subband_handle = (kd_subband *)
+        tile_comp->tile->arena.alloc(sizeof(kd_subband)*(size_t)num_subbands);
+      for (b=0; b < num_subbands; b++)
+        new(subbands+b) kd_subband;
+    }
   for (b=0; b < num_subbands; b++)
     {
       kd_subband *band = subbands + b;
@@ -4157,7 +4274,13 @@ void
     if ((decomp >> n) & 3)
       num_intermediate_nodes++;
   if (num_intermediate_nodes != 0)
-    intermediate_nodes = new kd_node[num_intermediate_nodes];
+    { 
+      intermediate_nodes = (kd_node *)
+        tile_comp->tile->arena.alloc(sizeof(kd_node) *
+                                     (size_t) num_intermediate_nodes);
+      for (n=0; n < (int) num_intermediate_nodes; n++)
+        new(intermediate_nodes+n) kd_node;
+    }
 
   node.resolution = this;
   node.is_leaf = false;
@@ -5758,7 +5881,8 @@ void
           if (master_stats != NULL)
             {
               kd_compressed_stats *local_stats=cs->get_thread_rate_stats(env);
-              local_stats->update_stats(result);
+              local_stats->update_stats(result,
+                                        state->resolution->dwt_level);
               if (local_stats->need_transcribe() && master_stats->try_lock())
                 { 
                   trim_storage = (master_stats->transcribe(local_stats) &&
@@ -5797,7 +5921,8 @@ void
           kd_compressed_stats *stats = cs->rate_stats[0];
           if (stats != NULL)
             {
-              trim_storage = (stats->update_stats(result) &&
+              int level = state->resolution->dwt_level;
+              trim_storage = (stats->update_stats(result,level) &&
                               !cs->header_generated);
               stats->update_quant_slope_thresholds();
             }
@@ -5826,12 +5951,32 @@ kdu_uint16
   kd_codestream *codestream = state->resolution->codestream;
   kdu_uint16 result = 1;
   if (codestream->rate_stats[0] != NULL)
-    result = codestream->rate_stats[0]->get_conservative_slope_threshold();
+    { 
+      result = codestream->rate_stats[0]->get_conservative_slope_threshold();
+      if (codestream->predict_passes)
+        { // Use the estimate once it rises above the conservative bound
+          kdu_uint16 predicted =
+            codestream->rate_stats[0]->get_predicted_slope_threshold();
+          if (predicted > result)
+            result = predicted;
+        }
+    }
   if (codestream->min_slope_threshold > result)
     result = codestream->min_slope_threshold;
   return result;
 }
 
+/*****************************************************************************/
+/*                 kdu_subband::get_pass_prediction_margin                   */
+/*****************************************************************************/
+
+int
+  kdu_subband::get_pass_prediction_margin()
+{
+  kd_codestream *codestream = state->resolution->codestream;
+  return (codestream->predict_passes)?codestream->pass_prediction_margin:-1;
+}
+
 
 /* ========================================================================= */
 /*                                kd_precinct                                */
@@ -7205,14 +7350,28 @@ void
 void
   kd_precinct_size_class::augment_free_list()
 {
-  kd_precinct *elt = (kd_precinct *) malloc((size_t) alloc_bytes);
-  if (elt == NULL)
+  kdu_long num_elts = (total_precincts < 1)?1:total_precincts;
+  kdu_long max_elts = (KD_PRECINCT_SLAB_BYTES - sizeof(kd_precinct_slab)) /
+    slab_stride;
+  if (num_elts > max_elts)
+    num_elts = (max_elts < 1)?1:max_elts;
+  size_t slab_bytes = sizeof(kd_precinct_slab) +
+    ((size_t) num_elts) * (size_t) slab_stride;
+  kd_precinct_slab *slab = (kd_precinct_slab *) malloc(slab_bytes);
+  if (slab == NULL)
     throw std::bad_alloc();
-  elt->size_class = this;
-  elt->next = free_list;
-  free_list = elt;
-  this->total_precincts++;
-  server->total_allocated_bytes += (kdu_long) alloc_bytes;
+  slab->next = slabs;
+  slabs = slab;
+  kdu_byte *bp = ((kdu_byte *) slab) + sizeof(kd_precinct_slab);
+  for (kdu_long n=0; n < num_elts; n++, bp+=slab_stride)
+    {
+      kd_precinct *elt = (kd_precinct *) bp;
+      elt->size_class = this;
+      elt->next = free_list;
+      free_list = elt;
+    }
+  this->total_precincts += num_elts;
+  server->total_allocated_bytes += (kdu_long) slab_bytes;
 }
 
 /*****************************************************************************/
@@ -7392,12 +7551,21 @@ void
 
 bool
   kd_precinct_ref::set_address(kd_resolution *res, kdu_coords pos_idx,
-                               kdu_long seek_address)
+                               kdu_long seek_address, kdu_long seek_length)
 { 
   assert(seek_address > 0);
   kd_tile_comp *comp = res->tile_comp;
   kd_tile *tile = comp->tile;
   kd_codestream *codestream = tile->codestream;
+  pos_idx += res->precinct_indices.pos;
+  bool in_window =
+    !((res->res_level > comp->apparent_dwt_levels) || (!comp->enabled) ||
+      (pos_idx.x < res->region_indices.pos.x) ||
+      (pos_idx.y < res->region_indices.pos.y) ||
+      (pos_idx.x >= (res->region_indices.pos.x +
+                     res->region_indices.size.x)) ||
+      (pos_idx.y >= (res->region_indices.pos.y +
+                     res->region_indices.size.y)));
   kd_precinct *precinct = deref();
   if (precinct != NULL)
     {
@@ -7412,20 +7580,11 @@ bool
   else
     {
       state = (seek_address<<2) + 1;
-      bool is_relevant = true;
-      pos_idx += res->precinct_indices.pos;
-      if ((!codestream->persistent) &&
-          ((res->res_level > comp->apparent_dwt_levels) || (!comp->enabled) ||
-           (pos_idx.x < res->region_indices.pos.x) ||
-           (pos_idx.y < res->region_indices.pos.y) ||
-           (pos_idx.x >= (res->region_indices.pos.x +
-                          res->region_indices.size.x)) ||
-           (pos_idx.y >= (res->region_indices.pos.y +
-                          res->region_indices.size.y))))
-        is_relevant = false;
-      if (is_relevant)
+      if (codestream->persistent || in_window)
         tile->sequenced_relevant_packets += tile->max_relevant_layers;
     }
+  if (in_window)
+    codestream->in->prefetch(seek_address,seek_length);
   if (tile->sequenced_relevant_packets == tile->max_relevant_packets)
     {
       if (tile->finished_reading())
@@ -220,6 +220,7 @@ struct kd_code_buffer { // Chunks code bytes to minimize heap transactions
 #define KD_CODE_BUFFERS_PER_BLOCK 31
 #define KD_CODEBUF_BLOCK_BYTES (KD_CODE_BUFFERS_PER_BLOCK * \
                                 KDU_CODE_BUFFER_ALIGN)
+#define KD_CODEBUF_HUGE_SLAB_BYTES (1<<21) // 2 MB; see `set_huge_pages'
 
 class kd_buf_master {
   public: // Lifecycle functions
@@ -257,7 +258,35 @@ class kd_buf_master {
          to be used within a multi-threaded environment.  This causes the
          internal mutex to be created and also ensures that interlocked
          operations are performed where appropriate. */
-    kd_code_buffer *get_blocks(kdu_int32 &num_blocks);
+    void set_huge_pages(bool enable)
+      { mutex.lock(); use_huge_pages = enable; mutex.unlock(); }
+      /* If `enable' is true, memory allocated from the heap from now on
+         comes in `KD_CODEBUF_HUGE_SLAB_BYTES' slabs, aligned so that the
+         operating system can back each one with a single huge page (under
+         Linux, transparent huge pages are requested with `madvise'). */
+    void add_server_stats(kdu_long transfers, kdu_long contended)
+      { 
+        mutex.lock();
+        retired_transfers += transfers;  retired_contended += contended;
+        mutex.unlock();
+      }
+      /* Called by `kd_buf_server::cleanup_and_detach' to keep the counts
+         of a detaching server; see `get_stats'. */
+    void get_stats(kdu_long &heap_allocations, kdu_long &transfers,
+                   kdu_long &contended)
+      { 
+        mutex.lock();
+        heap_allocations = num_heap_allocations;
+        transfers = retired_transfers;  contended = retired_contended;
+        mutex.unlock();
+      }
+      /* Retrieves the number of times memory has been allocated from the
+         heap, and the numbers of `get_blocks' and `release_blocks'
+         transactions, and of contended transactions, made by servers that
+         have detached.  The caller adds the counts of the servers which
+         are still attached. */
+    kd_code_buffer *get_blocks(kdu_int32 &num_blocks,
+                               kdu_int32 *contended=NULL);
       /* This function is used only by client `kd_buf_server' objects to
          obtain a list of code buffers that can be split up and distributed
          in response to their own `kd_buf_server::get' calls.  Buffers are
@@ -274,9 +303,13 @@ class kd_buf_master {
          head of the returned list.  The code buffers within each block are
          traversed using the `kd_code_buffer::next' member, but the list
          connected via these pointers terminates (with NULL) at the end of
-         each block. */
+         each block.
+         [//]
+         If `contended' is non-NULL, it is incremented each time the
+         transaction has to be retried or the lists serviced because another
+         thread got there first. */
     void release_blocks(kd_code_buffer *head, kd_code_buffer *tail,
-                        kdu_int32 num_blocks);
+                        kdu_int32 num_blocks, kdu_int32 *contended=NULL);
       /* This function is used only by client `kd_buf_server' objects to
          return memory for shared re-allocation.  Rather than returning
          individual code-buffers, the memory is returned in "blocks".  A
@@ -290,7 +323,8 @@ class kd_buf_master {
          [//]
          The `tail' argument refers to the head of the last block, rather
          than the last code buffer in the last block. Thus, if `num_blocks'
-         is 1, `tail' should be equal to `head'.
+         is 1, `tail' should be equal to `head'.  `contended' is as for
+         `get_blocks'.
       */
     void release_partial_blocks(kd_code_buffer *head, kd_code_buffer *tail,
                                   int num_bufs);
@@ -427,6 +461,10 @@ class kd_buf_master {
     int num_partial_block_bufs; // Total code buffers in partial blocks list
     int total_alloc_blocks; // Total number of blocks allocated from the heap
     int num_blocks_per_ccb_entry; // Goes to 0 when we reconsult the free lists
+    bool use_huge_pages; // See `set_huge_pages'
+    kdu_long num_heap_allocations; // The remaining members serve `get_stats'
+    kdu_long retired_transfers; // Transactions of detached `kd_buf_server's
+    kdu_long retired_contended;
     kdu_byte _trailer[KDU_MAX_L2_CACHE_LINE];
   };
   /* Notes:
@@ -514,6 +552,8 @@ class kd_buf_master {
 /*                               kd_buf_server                               */
 /*****************************************************************************/
 
+#define KD_BUF_SERVER_MAGAZINE_BLOCKS 4
+
 class kd_buf_server {
   public: // Member functions
     void attach_and_init(kd_buf_master *tgt);
@@ -547,12 +587,13 @@ class kd_buf_server {
           { assert(num_free_bufs == 0); last_free_buf = buf; }
         first_free_buf = buf;  num_free_bufs++;
         if (num_free_bufs == KD_CODE_BUFFERS_PER_BLOCK)
-          {
-            master->release_blocks(first_free_buf,first_free_buf,1);
-                // Note: `first_free_buf' points to the last full "block" in
-                // the list headed by `first_free_buf'.  `last_free_buf'
-                // points to the last buffer, not the last block.
+          { // Keep the whole block for our own `get' calls, returning
+            // blocks to the `master' only in batches; see below.
+            first_free_buf->set_buf_link(free_blocks);
+            free_blocks = first_free_buf;
             first_free_buf = last_free_buf = NULL; num_free_bufs = 0;
+            if ((++num_free_blocks) > 2*KD_BUF_SERVER_MAGAZINE_BLOCKS)
+              release_magazine();
           }
       }
     kdu_long get_current_buf_bytes()
@@ -612,7 +653,19 @@ class kd_buf_server {
             The function is also called whenever a new tile-part is started,
          to determine whether there are unloadable tiles which should be
          unloaded to bring memory consumption below the cache threshold. */
+    void get_stats(kdu_long &transfers, kdu_long &contended)
+      { transfers = num_transfers;  contended = num_contended; }
+      /* Retrieves the number of `kd_buf_master::get_blocks' and
+         `kd_buf_master::release_blocks' transactions made by the object
+         since it was attached, and the number of them which were
+         contended.  These are for statistics only; they are read without
+         synchronization from threads other than the one using the object. */
   private: // Helper functions
+    void release_magazine();
+      /* Called from `release' once more than 2*KD_BUF_SERVER_MAGAZINE_BLOCKS
+         blocks are held in `free_blocks'; returns the
+         `KD_BUF_SERVER_MAGAZINE_BLOCKS' blocks following the first (most
+         recently freed) one to the `master' in a single transaction. */
     kd_code_buffer *get_from_block();
       /* This function is called from within `get' if both the `strip_bufs'
          and `first_free_bufs' lists are empty.  The function strips the
@@ -631,12 +684,23 @@ class kd_buf_server {
     kd_code_buffer *last_free_buf; // Tail of above list
     int num_free_bufs; // Number of buffers in above list
     kdu_long surplus_structure_bytes; // -KD_CODEBUF_BLOCK_BYTES < value <= 0
+    kdu_long num_transfers; // See `get_stats'
+    kdu_long num_contended;
     //------------------------------------------------------------------------
     // kdu_byte _trailer[KDU_MAX_L2_CACHE_LINE];
     /* Don't need a leadout because we allocate the `kd_buf_server'
        objects in a contiguous array, so the next object's leadin keeps
        threads separated. */
   };
+  /* Notes:
+        Each thread of a codestream has its own `kd_buf_server', so `get'
+     and `release' involve no synchronization at all; only whole blocks pass
+     through the `kd_buf_master'.  Whole blocks freed by `release' go back
+     onto the `free_blocks' list, from which `get' takes them again, acting
+     as a magazine in front of the master: a thread which alternately frees
+     and needs a block's worth of buffers never visits the master, and
+     surplus blocks are returned `KD_BUF_SERVER_MAGAZINE_BLOCKS' at a time,
+     each batch costing a single interlocked transaction. */
 
 /*****************************************************************************/
 /*                             kd_compressed_output                          */
@@ -903,6 +967,15 @@ class kd_compressed_input : public kd_input {
     kd_compressed_input(kdu_compressed_source *source);
     int get_capabilities()
       { return source->get_capabilities(); }
+    bool can_prefetch() { return prefetch_enabled; }
+      /* True if the source advertises `KDU_SOURCE_CAP_PREFETCH' as well as
+         `KDU_SOURCE_CAP_SEEKABLE', and is not a cached source. */
+    void prefetch(kdu_long address, kdu_long length)
+      { /* Passes a precinct's code-stream address and length on to the
+           source's `prefetch' function, if `can_prefetch' is true. */
+        if (prefetch_enabled && (length > 0))
+          source->prefetch(address,length);
+      }
     bool set_tileheader_scope(int tnum, int num_tiles);
       /* Generates an error through `kdu_error' if the embedded source does
          not support the `KDU_SOURCE_CAP_CACHED' capability.  This function
@@ -1001,6 +1074,7 @@ class kd_compressed_input : public kd_input {
     kdu_byte *suspend_ptr; // Points into the buffer
     kdu_byte *alt_first_unwritten; // See below
     bool special_scope; // True for anything other than code-stream scope.
+    bool prefetch_enabled; // See `can_prefetch'
   };
   /* Notes:
         The `cur_offset' member holds the offset from the start of the
@@ -1461,8 +1535,9 @@ class kd_precinct_pointer_server {
          Otherwise, a terminal error is generated.  In this event, the
          code-stream might need to be opened again with seeking disabled
          so that the present object will never be initialized. */
-    kdu_long get_precinct_address()
-      { return ((buf_server==NULL)?((kdu_long) 0):pop_address()); }
+    kdu_long get_precinct_address(kdu_long &length)
+      { length = 0;
+        return ((buf_server==NULL)?((kdu_long) 0):pop_address(length)); }
       /* Returns the address of the next precinct (in the sequence determined
          by the current progression order) in the tile.  This address may be
          used to seek to the relevant location when reading the precinct's
@@ -1477,9 +1552,12 @@ class kd_precinct_pointer_server {
          packet of the precinct belongs to a tile-part which has not yet been
          opened.  In this event, the `kd_tile::read_tile_part_header' member
          function will have to be called until the information becomes
-         available. */
+         available.
+            If an address is returned, `length' is set to the number of
+         bytes occupied by all packets of the precinct, starting from that
+         address; otherwise, it is set to 0. */
   private: // Helper functions
-    kdu_long pop_address();
+    kdu_long pop_address(kdu_long &length);
       /* Does all the work of `get_precinct_address'. */
     void disable()
       { // Call to discard contents and cease recording new PLT info.
@@ -1528,6 +1606,9 @@ class kd_precinct_pointer_server {
 /*                             kd_compressed_stats                           */
 /*****************************************************************************/
 
+#define KD_STATS_LEVELS 8 // DWT levels distinguished by slope prediction
+#define KD_STATS_BIN_SHIFT 3 // Coarse slope bins used for slope prediction
+
 class kd_compressed_stats {
   /* An object of this class is used to monitor statistics of the compression
      process.  One application of these statistics is the provision of feedback
@@ -1552,8 +1633,10 @@ class kd_compressed_stats {
      renders the prediction excessively conservative for most images.  A
      good fix for this would be to keep track of the percentage of subband
      samples which have been compressed in each resolution level and use this
-     information to form a more reliable predictor.  This improvement might
-     be included in a future version.
+     information to form a more reliable predictor.  This is done by
+     `get_predicted_slope_threshold', which is used only if
+     `kdu_codestream::set_pass_prediction' has been called; otherwise the
+     per-level statistics it needs are not collected at all.
         In multi-threaded applications, the system maintains one object of
      this class for each thread, in addition to a master object that is
      interpreted as the global statistics manager.  Threads update their
@@ -1564,9 +1647,17 @@ class kd_compressed_stats {
   */
   public: // Member functions
     kd_compressed_stats(kdu_long total_samples, kdu_long target_bytes,
-                        bool enable_trimming)
-      { 
+                        bool enable_trimming, const double *level_fractions)
+      { /* `level_fractions' holds the share of `total_samples' which
+           belongs to each of the `KD_STATS_LEVELS' DWT levels, as
+           passed to `update_stats'.  If it is NULL, no per-level
+           statistics are kept and `get_predicted_slope_threshold' must
+           not be used. */
         this->total_samples = total_samples;
+        this->keep_level_stats = (level_fractions != NULL);
+        if (keep_level_stats)
+          memcpy(this->level_fractions,level_fractions,
+                 sizeof(double)*KD_STATS_LEVELS);
         this->trimming_enabled = enable_trimming;
         this->next_trim = (total_samples+7)>>3;
         this->conservative_extra_samples = 4096 + (total_samples>>4);
@@ -1575,7 +1666,13 @@ class kd_compressed_stats {
         num_coded_samples = 0;
         min_quant_slope = 2047;  max_quant_slope = 0;
         block_slope_threshold = remaining_slope_threshold = 0;
+        predicted_slope_threshold = 0;
         memset(quant_slope_rates,0,sizeof(quant_slope_rates[0])*2048);
+        if (keep_level_stats)
+          { 
+            memset(level_samples,0,sizeof(level_samples));
+            memset(level_rates,0,sizeof(level_rates));
+          }
         transcribe_counter = 0;
         next_transcribe_interval = 2;
         lock.set(0);
@@ -1587,6 +1684,10 @@ class kd_compressed_stats {
            same way that `copy' was initialized.  The information drawn from
            `copy' never gets modified by any of the other member functions. */
         this->total_samples = copy->total_samples;
+        this->keep_level_stats = copy->keep_level_stats;
+        if (keep_level_stats)
+          memcpy(this->level_fractions,copy->level_fractions,
+                 sizeof(double)*KD_STATS_LEVELS);
         this->trimming_enabled = copy->trimming_enabled;
         this->next_trim = (total_samples+7)>>3;
         this->conservative_extra_samples = 4096 + (total_samples>>4);
@@ -1594,7 +1695,13 @@ class kd_compressed_stats {
         num_coded_samples = 0;
         min_quant_slope = 2047;  max_quant_slope = 0;
         block_slope_threshold = remaining_slope_threshold = 0;
+        predicted_slope_threshold = 0;
         memset(quant_slope_rates,0,sizeof(quant_slope_rates[0])*2048);
+        if (keep_level_stats)
+          { 
+            memset(level_samples,0,sizeof(level_samples));
+            memset(level_rates,0,sizeof(level_rates));
+          }
         transcribe_counter = 0;
         next_transcribe_interval = 2;
         lock.set(0);
@@ -1602,13 +1709,23 @@ class kd_compressed_stats {
     bool is_empty() const { return (num_coded_samples == 0); }
       /* Returns true if some information has been entered via the
          `update_stats' function. */
-    bool update_stats(kdu_block *block)
+    bool update_stats(kdu_block *block, int level)
       { /* Invoked by `kdu_subband::close_block'.  If the function returns
            true, it is recommended that the compressed data be trimmed back
            to a size consistent with the target compressed length at this
            point.  Remember to invoke `update_quant_slope_thresholds' once
-           this function returns. */
+           this function returns.  `level' is the block's DWT level (see
+           `kd_resolution::dwt_level'), with those from `KD_STATS_LEVELS'-1
+           up counted together. */
         num_coded_samples += block->size.x*block->size.y;
+        kdu_long *block_level_rates = NULL;
+        if (keep_level_stats)
+          { 
+            if (level >= KD_STATS_LEVELS)
+              level = KD_STATS_LEVELS-1;
+            level_samples[level] += block->size.x*block->size.y;
+            block_level_rates = level_rates[level];
+          }
         int quant_slope, length = 0;
         for (int n=0; n < block->num_passes; n++)
           {
@@ -1626,6 +1743,8 @@ class kd_compressed_stats {
             if (quant_slope > max_quant_slope) max_quant_slope = quant_slope;
             assert((quant_slope >= 0) && (quant_slope < 2048));
             quant_slope_rates[quant_slope] += length;
+            if (block_level_rates != NULL)
+              block_level_rates[quant_slope>>KD_STATS_BIN_SHIFT] += length;
             length = 0;
           }
         if (trimming_enabled && (num_coded_samples > next_trim))
@@ -1652,6 +1771,24 @@ class kd_compressed_stats {
           if ((cumulative_bytes += quant_slope_rates[n]) >= max_bytes)
             break;
         block_slope_threshold = n;
+        if (keep_level_stats)
+          { // Adjust `predicted_slope_threshold'
+            predicted_slope_threshold = 0;
+            double level_scale[KD_STATS_LEVELS];
+            double target = target_rate*total_samples;
+            for (n=0; n < KD_STATS_LEVELS; n++)
+              level_scale[n] = (level_samples[n] == 0)?0.0:
+                (level_fractions[n] * total_samples / level_samples[n]);
+            double cumulative_estimate = 0.0;
+            for (n=max_quant_slope>>KD_STATS_BIN_SHIFT;
+                 n >= (min_quant_slope>>KD_STATS_BIN_SHIFT); n--)
+              { 
+                for (int d=0; d < KD_STATS_LEVELS; d++)
+                  cumulative_estimate += level_scale[d] * level_rates[d][n];
+                if (cumulative_estimate >= target)
+                  { predicted_slope_threshold = n<<KD_STATS_BIN_SHIFT; break; }
+              }
+          }
         // Adjust `remaining_slope_threshold'
         max_bytes = total_samples;
         max_bytes = 1 + (kdu_long)(max_bytes * target_rate);
@@ -1678,6 +1815,18 @@ class kd_compressed_stats {
           (assume_all_coded)?remaining_slope_threshold:block_slope_threshold;
         return (val <= 0)?1:((val<<4)+(2048<<4)-1);
       }
+    kdu_uint16 get_predicted_slope_threshold() const
+      { /* Similar to `get_conservative_slope_threshold', except that the
+           bytes generated so far in each DWT level are scaled up by the
+           share of that level's samples which remain to be coded, as
+           suggested above, so the result is an estimate of the threshold
+           PCRD-opt will use rather than a lower bound to it.  It is used
+           only when block encoders predict how many passes to code -- see
+           `kdu_codestream::set_pass_prediction'. */
+        assert(keep_level_stats);
+        int val = predicted_slope_threshold;
+        return (val <= 0)?1:((val<<4)+(2048<<4)-1);
+      }
    kdu_uint16 get_pcrd_opt_min_threshold()
      { /* Returns the minimum slope threshold that is worth considering
           when the `pcrd_opt' function is invoked.  Essentially, this is
@@ -1744,6 +1893,15 @@ class kd_compressed_stats {
         for (int n=src->min_quant_slope; n <= src->max_quant_slope; n++)
           { quant_slope_rates[n] += src->quant_slope_rates[n];
             src->quant_slope_rates[n] = 0; }
+        for (int d=0; keep_level_stats && (d < KD_STATS_LEVELS); d++)
+          { 
+            level_samples[d] += src->level_samples[d];
+            src->level_samples[d] = 0;
+            for (int n=src->min_quant_slope>>KD_STATS_BIN_SHIFT;
+                 n <= (src->max_quant_slope>>KD_STATS_BIN_SHIFT); n++)
+              { level_rates[d][n] += src->level_rates[d][n];
+                src->level_rates[d][n] = 0; }
+          }
         src->min_quant_slope = 2047;  src->max_quant_slope = 0;
         assert(src->transcribe_counter <= 0);
         src->transcribe_counter = src->next_transcribe_interval;
@@ -1764,6 +1922,11 @@ class kd_compressed_stats {
     int min_quant_slope, max_quant_slope; // See below
     int block_slope_threshold; // See below
     int remaining_slope_threshold; // See below
+    int predicted_slope_threshold; // See below
+    bool keep_level_stats; // If false, the three members below are unused
+    double level_fractions[KD_STATS_LEVELS]; // See below
+    kdu_long level_samples[KD_STATS_LEVELS];
+    kdu_long level_rates[KD_STATS_LEVELS][2048>>KD_STATS_BIN_SHIFT];
     bool trimming_enabled;
   private: // State information for thread-specific versions of the function
     int transcribe_counter;       // These two vars are used to implement
@@ -1808,7 +1971,19 @@ class kd_compressed_stats {
      used to trim already generated coding passes from their respective
      code-blocks.  This value is used to generate the return value from
      `get_conservative_slope_threshold' when its `assume_all_coded' argument
-     is set to true. */
+     is set to true.
+        The `level_rates' array is a coarser version of `quant_slope_rates'
+     (each bin spans 2^`KD_STATS_BIN_SHIFT' of its bins) kept separately
+     for each DWT level, and `level_samples' counts the samples coded in
+     each level; `level_fractions' holds the share of all samples which
+     each level will eventually contribute.  `predicted_slope_threshold' is
+     the smallest `quant_slope_rates' index (a multiple of the coarse bin
+     size) for which the bytes of each level, scaled by the ratio of its
+     eventual samples to those coded so far, sum to the target for the
+     whole image.  It is returned by `get_predicted_slope_threshold'.
+     None of these are maintained unless `keep_level_stats' is true, which
+     is the case only when the codestream predicts coding passes, so that
+     rate control without prediction costs no more than it used to. */
 
 /*****************************************************************************/
 /*                            kd_codestream_comment                          */
@@ -2676,6 +2851,7 @@ class kd_cs_thread_context :
         thread_buf_servers=NULL;  thread_stats=NULL;
         job_state.set(0);
         job.init(this);
+        set_trace_name("codestream background");
         res_head.set(NULL);
         res_tail.set(NULL);
         mutex.create(1000);
@@ -2734,6 +2910,16 @@ class kd_cs_thread_context :
          A non-NULL `stats' array should not be supplied unless its first
          entry is non-NULL and all remaining `KDU_MAX_THREADS' entries are
          NULL. */
+    int get_num_buf_servers()
+      { 
+        mutex.lock();
+        int result = (thread_buf_servers == NULL)?0:cur_threads;
+        mutex.unlock();
+        return result;
+      }
+      /* Returns the number of objects, after the first, which have been
+         initialized in the array passed to `manage_buf_servers', or 0 if
+         none is being managed. */
   public: // Overridden functions from `kdu_thread_context'
     virtual void enter_group(kdu_thread_entity *caller)
       { 
@@ -3444,6 +3630,8 @@ struct kd_codestream { // State structure for the "kdu_codestream" interface
     int next_tnum; // Negative, except while scanning 1'st tparts in Profile-0
     int num_completed_tparts; // Number of tile-parts actually read or written.
     kdu_uint16 min_slope_threshold; // 0 until `set_min_slope_threshold' called
+    bool predict_passes; // See `kdu_codestream::set_pass_prediction'
+    int pass_prediction_margin;
     kdu_clock timer; // Used by `report_cpu_time'
   //---------------------------------------------------------------------------
   public: // Tile cache management
@@ -3534,6 +3722,61 @@ struct kd_codestream { // State structure for the "kdu_codestream" interface
      involved in the reconstruction of any visible output components within
      the relevant tile (this may vary from tile to tile). */
 
+/*****************************************************************************/
+/*                             kd_tile_arena                                 */
+/*****************************************************************************/
+
+#define KD_TILE_ARENA_CHUNK_BYTES 32768
+
+struct kd_tile_arena_chunk {
+    kd_tile_arena_chunk *next;
+    size_t num_bytes; // Total bytes in the chunk, including this header
+    kdu_long align_pad; // Keeps the chunk's payload 16-byte aligned
+  };
+
+class kd_tile_arena {
+  public: // Member functions
+    kd_tile_arena()
+      { chunks = NULL; free_ptr = NULL; free_bytes = 0; total_bytes = 0; }
+    ~kd_tile_arena() { release_all(); }
+    void *alloc(size_t num_bytes)
+      {
+        num_bytes = (num_bytes + 15) & ~((size_t) 15);
+        if (num_bytes > free_bytes)
+          return augment(num_bytes);
+        void *result = free_ptr;
+        free_ptr += num_bytes;  free_bytes -= num_bytes;
+        return result;
+      }
+      /* Returns 16-byte aligned storage which remains valid until
+         `release_all' is called.  Nothing is freed individually; objects
+         constructed in the storage (with placement new) must be destroyed
+         explicitly before `release_all' is called. */
+    void release_all();
+      /* Returns all chunks to the heap in one go. */
+    kdu_long get_total_bytes() { return total_bytes; }
+      /* Returns the number of heap bytes currently held by the arena. */
+  private: // Helper functions
+    void *augment(size_t num_bytes);
+  private: // Data
+    kd_tile_arena_chunk *chunks; // Most recently allocated chunk first
+    kdu_byte *free_ptr; // Start of the unused part of the current chunk
+    size_t free_bytes;
+    kdu_long total_bytes;
+  };
+  /* Notes:
+        This object holds the structural state of a tile -- the arrays of
+     `kd_tile_comp', `kd_resolution', `kd_subband', `kd_node' and
+     `kd_precinct_ref' objects built by `kd_tile::initialize' -- in a small
+     number of `KD_TILE_ARENA_CHUNK_BYTES'-sized chunks, rather than the
+     hundreds of separate heap blocks which these arrays would otherwise
+     occupy for a tile with many components.  Allocation is a pointer bump
+     and the whole structure goes back to the heap when the tile is deleted
+     (or is reinitialized from scratch).  Requests too large for a chunk
+     get a chunk of their own, leaving the current chunk's free space
+     available for the next request.  Typical tiles which are recycled
+     keep their arena, along with the structures it holds. */
+
 /*****************************************************************************/
 /*                                kd_tile                                    */
 /*****************************************************************************/
@@ -3655,6 +3898,9 @@ struct kd_tile { // State structure for the "kdu_tile" interface
          required coding parameter marker segments, except that no SOT
          marker segment or SOD marker is written to a structured cache; nor
          are PPT marker segments written to cached compressed data targets. */
+    void destroy_comps();
+      /* Destroys the `comps' array, which lives in `arena'; the storage
+         itself is returned only by `arena.release_all' (or the destructor). */
     void remove_from_in_progress_list();
       /* This function is called after the last tile-part of a tile has been
          generated.  It is also called when destroying or restarting a tile,
@@ -3764,6 +4010,7 @@ struct kd_tile { // State structure for the "kdu_tile" interface
         // cache threshold calculations.  This enables precinct and tile
         // unloading decisions to be made in a wholistic way, based on
         // total memory consumption.
+    kd_tile_arena arena; // Holds `comps' and the arrays built beneath it
 
   public: // Flags and other State Variables
     bool use_sop, use_eph, use_ycc;
@@ -4116,7 +4363,7 @@ class kd_precinct_ref {
          0 (see below), from which we deduce that the precinct has not yet
          been sequenced. */
     bool set_address(kd_resolution *res, kdu_coords pos_idx,
-                     kdu_long seek_address);
+                     kdu_long seek_address, kdu_long seek_length);
       /* Called from within `kd_packet_sequencer::next_in_sequence', this
          function installs a seek address for a precinct whose packets are
          contiguous within the code-stream and have valid pointer information
@@ -4126,6 +4373,11 @@ class kd_precinct_ref {
          for computing the relevance of this precinct to the application.  It
          holds a relative precinct index, having the same interpretation as
          that passed to `kd_precinct::initialize' and `kdu_precinct_ref::open'.
+            `seek_length' is the number of bytes occupied by the precinct's
+         packets.  If the precinct lies within the current region, components
+         and resolutions of interest and the source can prefetch, the
+         function passes its address and length to
+         `kd_compressed_input::prefetch'.
             It can happen that this function causes the tile, and hence the
          precinct reference, to be destroyed.  This happens if the call to
          this function renders the resolution or tile completely parsed,
@@ -4400,7 +4652,8 @@ struct kd_resolution { // State structure for the "kdu_resolution" interface
     kd_resolution()
       { 
         codestream = NULL; tile_comp = NULL; rescomp = NULL;
-        precinct_refs = NULL; subbands = subband_handle = NULL; num_subbands=0;
+        precinct_refs = NULL; max_precinct_refs = 0;
+        subbands = subband_handle = NULL; num_subbands=0;
         num_intermediate_nodes = 0; intermediate_nodes = NULL;
         can_flip = true;  node.bibo_gains = NULL;
         precinct_rows_available=0; bkgnd_state.set(0); bkgnd_next.set(NULL);
@@ -4412,10 +4665,27 @@ struct kd_resolution { // State structure for the "kdu_resolution" interface
         for (int n=0; n < (int) num_intermediate_nodes; n++)
           if (intermediate_nodes[n].bibo_gains != NULL)
             delete[] intermediate_nodes[n].bibo_gains;
-        if (precinct_refs != NULL) delete[] precinct_refs;
-        if (subband_handle != NULL) delete[] subband_handle;
-        if (intermediate_nodes != NULL) delete[] intermediate_nodes;
+        destroy_precinct_refs();
+        if (subband_handle != NULL)
+          for (int b=0; b < (int) num_subbands; b++)
+            subband_handle[b].~kd_subband();
+        for (int n=0; n < (int) num_intermediate_nodes; n++)
+          intermediate_nodes[n].~kd_node();
       }
+      /* The `precinct_refs', `subband_handle' and `intermediate_nodes'
+         arrays live in the owning tile's `kd_tile_arena', so their
+         elements are destroyed here but the storage is returned only when
+         the arena is released. */
+    void destroy_precinct_refs()
+      {
+        for (kdu_long p=0; p < max_precinct_refs; p++)
+          precinct_refs[p].~kd_precinct_ref();
+        precinct_refs = NULL; max_precinct_refs = 0;
+      }
+    void allocate_precinct_refs(kdu_long num_precincts);
+      /* Builds a `precinct_refs' array with room for `num_precincts'
+         references in the owning tile's arena, unless the existing array
+         is already large enough, in which case it is reused as is. */
     void build_decomposition_structure(kdu_params *coc, kdu_kernels &kernels);
       /* This function creates the `subbands' and `intermediate_nodes'
          arrays and fills in all the relevant pointers.  It uses `kernels'
@@ -4584,6 +4854,7 @@ struct kd_resolution { // State structure for the "kdu_resolution" interface
                                  // from the primary node in this object.
     kd_node *intermediate_nodes; // Array with `num_intermediate_nodes' entries
     kd_precinct_ref *precinct_refs;
+    kdu_long max_precinct_refs; // Capacity of the `precinct_refs' array
     kd_subband *subbands; // Points to `subband_store' or `subband_handle'.
     kd_subband *subband_handle; // For dynamically allocated subbands
     kd_subband subband_store[3]; // Avoid dynamic allocation for common case
@@ -5673,6 +5944,13 @@ struct kd_precinct {
   /* For an explanation of the role played by precinct size classes, see
      the discussion appearing below the declaration of `kd_precinct_server'. */
 
+#define KD_PRECINCT_SLAB_BYTES 65536
+
+struct kd_precinct_slab {
+    kd_precinct_slab *next;
+    kdu_long align_pad; // Keeps the precincts which follow 8-byte aligned
+  };
+
 class kd_precinct_size_class {
   public: // Member functions
     kd_precinct_size_class(int max_blocks, int num_subbands,
@@ -5691,12 +5969,17 @@ class kd_precinct_size_class {
         alloc_bytes += num_subbands * (int) sizeof(kd_precinct_band);
         alloc_bytes += (-alloc_bytes) & 7; // Round up to 8-byte boundary
         alloc_bytes += 4 + max_blocks * (int) sizeof(kd_block);
+        slab_stride = alloc_bytes + ((-alloc_bytes) & 7);
+        slabs = NULL;
       }
     ~kd_precinct_size_class()
       { kd_precinct *tmp;
         while ((tmp=free_list) != NULL)
-          { free_list = tmp->next; free(tmp); total_precincts--; }
+          { free_list = tmp->next; total_precincts--; }
         assert(total_precincts == 0);
+        kd_precinct_slab *slab;
+        while ((slab=slabs) != NULL)
+          { slabs = slab->next; free(slab); }
       }
     kd_precinct *get()
       {
@@ -5730,10 +6013,20 @@ class kd_precinct_size_class {
     int num_subbands;
     int max_layers; // 0 if no `packet_bytes' array is to be allocated
     int alloc_bytes; // Num bytes to allocate per precinct.
+    int slab_stride; // `alloc_bytes' rounded up to a multiple of 8
     kdu_long total_precincts; // Number of precincts allocated with this size
     kd_precinct *free_list; // List of precincts which have been released
+    kd_precinct_slab *slabs; // Blocks of storage which back all precincts
     kd_precinct_size_class *next; // Next size class
   };
+  /* Notes:
+        Precincts are never returned to the heap individually; once
+     allocated, they circulate between the `free_list' and the tiles which
+     use them until the codestream is destroyed.  `augment_free_list'
+     therefore carves them out of `slabs' -- each slab holds as many
+     precincts as have been allocated so far in this size class (so the
+     number of heap allocations grows only logarithmically), subject to the
+     `KD_PRECINCT_SLAB_BYTES' limit. */
 
 /*****************************************************************************/
 /*                           kd_precinct_server                              */
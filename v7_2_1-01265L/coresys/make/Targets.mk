@@ -1,11 +1,11 @@
 clean:
 	rm -f *.o *.so *.a *.dll
 
-$(STATIC_LIB_NAME) :: block_coding_common.o block_decoder.o block_encoder.o decoder.o encoder.o mq_decoder.o mq_encoder.o blocks.o codestream.o compressed.o kernels.o messaging.o params.o colour.o analysis.o synthesis.o multi_transform.o roi.o kdu_arch.o kdu_threads.o avx_coder_local.o avx_colour_local.o
+$(STATIC_LIB_NAME) :: block_coding_common.o block_decoder.o block_encoder.o decoder.o encoder.o mq_decoder.o mq_encoder.o blocks.o codestream.o compressed.o kernels.o messaging.o params.o colour.o analysis.o synthesis.o multi_transform.o roi.o kdu_arch.o kdu_threads.o avx_coder_local.o avx_colour_local.o avx2_dwt_local.o
 	ar -rv $(LIB_DIR)/$(STATIC_LIB_NAME) *.o
 	ranlib $(LIB_DIR)/$(STATIC_LIB_NAME)
 
-$(SHARED_LIB_NAME) :: block_coding_common.o block_decoder.o block_encoder.o decoder.o encoder.o mq_decoder.o mq_encoder.o blocks.o codestream.o compressed.o kernels.o messaging.o params.o colour.o analysis.o synthesis.o multi_transform.o roi.o kdu_arch.o kdu_threads.o avx_coder_local.o avx_colour_local.o $(LIB_RESOURCES)
+$(SHARED_LIB_NAME) :: block_coding_common.o block_decoder.o block_encoder.o decoder.o encoder.o mq_decoder.o mq_encoder.o blocks.o codestream.o compressed.o kernels.o messaging.o params.o colour.o analysis.o synthesis.o multi_transform.o roi.o kdu_arch.o kdu_threads.o avx_coder_local.o avx_colour_local.o avx2_dwt_local.o $(LIB_RESOURCES)
 	$(CC) $(CFLAGS) -shared -o $(LIB_DIR)/$(SHARED_LIB_NAME) *.o
 
 kdu_arch.o :: ../common/kdu_arch.cpp
@@ -71,6 +71,9 @@ colour.o :: ../transform/colour.cpp
 avx_colour_local.o :: ../transform/avx_colour_local.cpp
 	$(CC) $(CFLAGS) $(AVXFLAGS) -c ../transform/avx_colour_local.cpp \
 	      -o avx_colour_local.o
+avx2_dwt_local.o :: ../transform/avx2_dwt_local.cpp
+	$(CC) $(CFLAGS) $(AVX2FLAGS) -c ../transform/avx2_dwt_local.cpp \
+	      -o avx2_dwt_local.o
 analysis.o :: ../transform/analysis.cpp
 	$(CC) $(CFLAGS) -c ../transform/analysis.cpp \
 	      -o analysis.o
@@ -773,7 +773,7 @@ kdu_error::kdu_error(const char *context, kdu_uint32 id)
 /*                           kdu_error::~kdu_error                           */
 /*****************************************************************************/
 
-kdu_error::~kdu_error()
+kdu_error::~kdu_error() KDU_DESTRUCTOR_MAY_THROW
 {
   if (handler != NULL)
     handler->flush(true);
@@ -47,6 +47,7 @@ Description:
    Implements the multi-threaded architecture described in "kdu_threads.h".
 ******************************************************************************/
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <assert.h>
@@ -419,6 +420,45 @@ static void
 }
 #endif // .NET debug compilation
 
+/*****************************************************************************/
+/* STATIC                      kd_trace_job_name                             */
+/*****************************************************************************/
+
+static inline const char *
+  kd_trace_job_name(kdu_thread_queue *queue, kd_thread_domain *domain)
+  /* Returns the name under which jobs scheduled by `queue' within `domain'
+     appear in thread activity traces. */
+{
+  const char *name = (queue == NULL)?NULL:queue->get_trace_name();
+  if (name == NULL)
+    name = domain->name;
+  if ((name == NULL) || (*name == '\0'))
+    name = "default domain";
+  return name;
+}
+
+/*****************************************************************************/
+/* STATIC                    kd_write_json_string                            */
+/*****************************************************************************/
+
+static void
+  kd_write_json_string(FILE *fp, const char *string)
+  /* Writes `string' in quotes, escaping anything JSON does not allow. */
+{
+  putc('"',fp);
+  for (; *string != '\0'; string++)
+    { 
+      unsigned char c = (unsigned char) *string;
+      if ((c == '"') || (c == '\\'))
+        { putc('\\',fp); putc(c,fp); }
+      else if (c < 0x20)
+        fprintf(fp,"\\u%04x",c);
+      else
+        putc(c,fp);
+    }
+  putc('"',fp);
+}
+
 /*****************************************************************************/
 /*                             worker_startproc                              */
 /*****************************************************************************/
@@ -438,8 +478,11 @@ kdu_thread_startproc_result
     domain_name = "Kakadu default thread domain";
   kd_set_threadname(domain_name);
 #endif // .NET debug compilation
-  if (ent->group->cpu_affinity != 0)
-    ent->thread.set_cpu_affinity(ent->group->cpu_affinity);  
+  kdu_long affinity = ent->group->thread_affinity[ent->thread_idx];
+  if (affinity == 0)
+    affinity = ent->group->cpu_affinity;
+  if (affinity != 0)
+    ent->thread.set_cpu_affinity(affinity);
   ent->pre_launch();
   kdu_byte stack_block[KD_DONATED_STACK_BLOCK_BYTES];
   ent->donate_stack_block(stack_block,KD_DONATED_STACK_BLOCK_BYTES);
@@ -684,6 +727,7 @@ kd_thread_group::kd_thread_group()
   num_threads = 0;
   worker_thread_yield_freq = 100; // Default value
   memset(saved_job_counts,0,sizeof(int)*KDU_MAX_THREADS);
+  memset(thread_affinity,0,sizeof(kdu_long)*KDU_MAX_THREADS);
   memset(threads,0,sizeof(void *)*KDU_MAX_THREADS);
   memset(thread_job_hzps,0,sizeof(kd_thread_job_hzp)*KDU_MAX_THREADS);
   num_domains = 0;
@@ -729,15 +773,19 @@ kd_thread_group::~kd_thread_group()
 /*****************************************************************************/
 
 kd_thread_domain *
-  kd_thread_group::get_domain(const char *domain_name)
+  kd_thread_group::get_domain(const char *domain_name, int node)
 {
   kd_thread_domain *last_domain=NULL, *domain=this->domain_list;
   for (; domain != NULL; last_domain=domain, domain=domain->next)
-    if (domain->check_match(domain_name))
+    if (domain->check_match(domain_name,node))
       break;
   if (domain == NULL)
     { // Create new domain
-      domain = new kd_thread_domain(domain_name,this);
+      domain = new kd_thread_domain(domain_name,this,node);
+      if (node >= 0)
+        for (int n=0; n < num_threads; n++)
+          if ((threads[n] != NULL) && (threads[n]->numa_node == node))
+            domain->node_threads |= ((kd_thread_flags) 1) << n;
       if (last_domain == NULL)
         this->domain_list = domain;
       else
@@ -834,6 +882,137 @@ kd_thread_palette_ref *kd_thread_group::augment_free_palettes()
 }
 
 
+/* ========================================================================= */
+/*                             kd_thread_tracer                              */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/*                          kd_thread_tracer::start                          */
+/*****************************************************************************/
+
+void
+  kd_thread_tracer::start(int max_events, int num_threads)
+{
+  active.set(0);
+  if (max_events < 16)
+    max_events = 16;
+  for (capacity=16; (capacity < max_events) && (capacity < (1<<26)); )
+    capacity <<= 1;
+  for (int n=0; n < KDU_MAX_THREADS; n++)
+    { 
+      kd_thread_trace_ring *ring = rings + n;
+      if ((ring->events != NULL) && (ring->mask+1 != (kdu_long) capacity))
+        { delete[] ring->events; ring->events = NULL; }
+      if ((ring->events != NULL) || (n < num_threads))
+        init_ring(ring);
+    }
+  origin = 0;
+  origin = get_time();
+  active.exchange(1); // Publishes the rings to all threads
+}
+
+/*****************************************************************************/
+/*                        kd_thread_tracer::init_ring                        */
+/*****************************************************************************/
+
+void
+  kd_thread_tracer::init_ring(kd_thread_trace_ring *ring)
+{
+  if (ring->events == NULL)
+    ring->events = new kd_thread_trace_event[capacity];
+  ring->mask = capacity-1;
+  ring->count = 0;
+}
+
+/*****************************************************************************/
+/*                        kd_thread_tracer::get_time                         */
+/*****************************************************************************/
+
+kdu_long
+  kd_thread_tracer::get_time()
+{
+  kdu_long ns;
+#if (defined KDU_WINDOWS_OS)
+  LARGE_INTEGER count, freq;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  ns = (kdu_long)(count.QuadPart * (1.0E9 / (double) freq.QuadPart));
+#elif (defined CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  ns = ((kdu_long) ts.tv_sec) * 1000000000 + (kdu_long) ts.tv_nsec;
+#else
+  kdu_timespec ts;
+  ts.get_time();
+  ns = ((kdu_long) ts.tv_sec) * 1000000000 + (kdu_long) ts.tv_nsec;
+#endif
+  return ns - origin;
+}
+
+/*****************************************************************************/
+/*                          kd_thread_tracer::write                          */
+/*****************************************************************************/
+
+bool
+  kd_thread_tracer::write(const char *fname, kd_thread_group *group)
+{
+  stop();
+  if (capacity == 0)
+    return false;
+  FILE *fp = fopen(fname,"w");
+  if (fp == NULL)
+    return false;
+  fprintf(fp,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  bool first = true;
+  for (int t=0; t < group->num_threads; t++)
+    { 
+      kd_thread_trace_ring *ring = rings + t;
+      if (ring->events == NULL)
+        continue;
+      kdu_long num = ring->count, lost = 0;
+      if (num > ring->mask+1)
+        { lost = num - (ring->mask+1);  num = ring->mask+1; }
+      const char *domain_name = group->threads[t]->thread_domain->name;
+      char label[80];
+      if ((domain_name != NULL) && (*domain_name != '\0'))
+        sprintf(label,"Thread %d (%.40s)",t,domain_name);
+      else
+        sprintf(label,(t==0)?"Thread %d (owner)":"Thread %d",t);
+      fprintf(fp,"%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+              "\"tid\":%d,\"args\":{\"name\":",(first)?"":",\n",t);
+      kd_write_json_string(fp,label);
+      fprintf(fp,",\"events_lost\":%lld}}",(long long) lost);
+      fprintf(fp,",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\","
+              "\"pid\":1,\"tid\":%d,\"args\":{\"sort_index\":%d}}",t,t);
+      first = false;
+      for (kdu_long e=ring->count-num; e < ring->count; e++)
+        { 
+          kd_thread_trace_event *ev = ring->events + (e & ring->mask);
+          fprintf(fp,",\n{\"name\":");
+          kd_write_json_string(fp,ev->name);
+          double ts = 0.001 * (double) ev->start;
+          double dur = 0.001 * (double)(ev->end - ev->start);
+          if (ev->type == KD_TRACE_SCHEDULE)
+            fprintf(fp,",\"cat\":\"schedule\",\"ph\":\"i\",\"s\":\"t\","
+                    "\"ts\":%.3f,\"pid\":1,\"tid\":%d,"
+                    "\"args\":{\"jobs\":%d}}",ts,t,ev->arg);
+          else if (ev->type == KD_TRACE_JOB)
+            fprintf(fp,",\"cat\":\"job\",\"ph\":\"X\",\"ts\":%.3f,"
+                    "\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+                    "\"args\":{\"sequence\":%d}}",ts,dur,t,ev->arg);
+          else
+            fprintf(fp,",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                    "\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+                    (ev->type==KD_TRACE_IDLE)?"idle":"wait",ts,dur,t);
+        }
+    }
+  fprintf(fp,"\n]}\n");
+  bool success = (ferror(fp) == 0);
+  fclose(fp);
+  return success;
+}
+
+
 /* ========================================================================= */
 /*                             kdu_thread_queue                              */
 /* ========================================================================= */
@@ -854,6 +1033,8 @@ kdu_thread_queue::kdu_thread_queue()
   sequence_idx = 0;
   domain_sequence = NULL;
   last_domain_name = NULL;
+  trace_name = NULL;
+  numa_node = attached_numa_node = -1;
   registered_max_jobs = 0;
   palette_refs = NULL;
   completion_state.set(0); 
@@ -1232,11 +1413,14 @@ void
   // faults.
   kd_thread_domain_sequence *seq = domain_sequence;
   assert(seq != NULL);
+  const char *job_name = kd_trace_job_name(this,seq->domain);
   kd_thread_palette *plt_head, *plt_tail;
+  jobs[0]->trace_queue = this;
   plt_head = plt_tail = group->get_palette_to_schedule(jobs[0],caller);
   int n, s;
   for (s=1, n=1; n < num_jobs; n++, s++)
     { 
+      jobs[n]->trace_queue = this;
       if (s == KD_PLT_SLOTS)
         { 
           kd_thread_palette *plt =
@@ -1250,6 +1434,13 @@ void
     }
   seq->append_jobs(plt_head,plt_tail,s,caller->hzp);
   caller->group->wake_idle_threads_for_domain(num_jobs,seq->domain);
+  kd_thread_tracer *tracer = &(caller->group->tracer);
+  if (tracer->is_active())
+    { 
+      kdu_long now = tracer->get_time();
+      tracer->add_event(caller->thread_idx,KD_TRACE_SCHEDULE,job_name,
+                        now,now,num_jobs);
+    }
   
 #ifdef KDU_THREAD_TRACE_RECORDS
   kdu_int32 old_cnt = seq->trace_add.exchange_add(num_jobs);
@@ -1366,9 +1557,18 @@ void
   kd_thread_domain_sequence *seq = domain_sequence;
   assert(seq != NULL);
 
+  const char *job_name = kd_trace_job_name(this,seq->domain);
+  job->trace_queue = this;
   kd_thread_palette *plt = group->get_palette_to_schedule(job,caller);
   seq->append_jobs(plt,plt,1,caller->hzp);
   caller->group->wake_idle_threads_for_domain(1,seq->domain);
+  kd_thread_tracer *tracer = &(caller->group->tracer);
+  if (tracer->is_active())
+    { 
+      kdu_long now = tracer->get_time();
+      tracer->add_event(caller->thread_idx,KD_TRACE_SCHEDULE,job_name,
+                        now,now,1);
+    }
 
 #ifdef KDU_THREAD_TRACE_RECORDS
   kdu_int32 old_cnt = seq->trace_add.exchange_add(1);
@@ -1436,6 +1636,7 @@ kdu_thread_entity::kdu_thread_entity()
   first_wait_safe = false;
   in_process_jobs = in_process_jobs_with_cond = false;
   group_mutex_lock_count = 0;
+  numa_node = -1;
   next_palette_idx = 0;
   memset(palette_heap,0,sizeof(void *)*KD_THREAD_PALETTES);
   free_conditions = cur_condition = NULL;
@@ -1532,6 +1733,7 @@ void
   this->group = new kd_thread_group;
   group->cpu_affinity = cpu_affinity;
   this->thread_domain = group->get_domain(NULL);
+  this->numa_node = -1;
   thread_domain->num_member_threads++;
   thread_domain->member_threads |= (kd_thread_flags) 1;
 
@@ -1556,6 +1758,15 @@ void
   while (cur_condition != NULL)
     pop_condition();
   push_condition();
+
+  // Start tracing if asked to by the environment
+  const char *trace_fname = getenv("KDU_THREAD_TRACE");
+  if ((trace_fname != NULL) && (*trace_fname != '\0'))
+    { 
+      group->tracer.fname = new char[strlen(trace_fname)+1];
+      strcpy(group->tracer.fname,trace_fname);
+      start_trace();
+    }
 }
 
 /*****************************************************************************/
@@ -1586,6 +1797,8 @@ bool kdu_thread_entity::destroy()
     group->thread_semaphores[n].destroy();
   while (group->contexts != NULL)
     group->contexts->leave_group();
+  if (group->tracer.fname != NULL)
+    group->tracer.write(group->tracer.fname,group);
   
 #ifdef KDU_THREAD_TRACE_RECORDS
   const char *job_domain_names[KDU_MAX_THREADS];
@@ -1701,6 +1914,23 @@ void kdu_thread_entity::set_min_thread_concurrency(int min_concurrency)
     group->min_thread_concurrency = min_concurrency;
 }
 
+/*****************************************************************************/
+/*                  kdu_thread_entity::get_num_numa_nodes                    */
+/*****************************************************************************/
+
+int
+  kdu_thread_entity::get_num_numa_nodes()
+{
+  if (!exists())
+    return 0;
+  int n, num_nodes=0;
+  for (n=0; n < group->num_threads; n++)
+    if ((group->threads[n] != NULL) &&
+        (group->threads[n]->numa_node >= num_nodes))
+      num_nodes = group->threads[n]->numa_node+1;
+  return num_nodes;
+}
+
 /*****************************************************************************/
 /*                    kdu_thread_entity::get_num_threads                     */
 /*****************************************************************************/
@@ -1728,7 +1958,8 @@ int
 /*****************************************************************************/
 
 bool
-  kdu_thread_entity::add_thread(const char *domain_name)
+  kdu_thread_entity::add_thread(const char *domain_name,
+                                kdu_long cpu_affinity, int numa_node)
 {
   if (!exists())
     return false;
@@ -1765,9 +1996,12 @@ bool
           group->num_threads = thrd_idx+1;
           thrd->thread_idx = thrd_idx;
           thrd->group = this->group;
+          group->tracer.add_thread(thrd_idx);
           thrd->grouperr = this->grouperr;
           thrd->hzp = &(group->thread_job_hzps[thrd_idx]);
           thrd->thread_domain = domain;
+          thrd->numa_node = (numa_node < 0)?-1:numa_node;
+          group->thread_affinity[thrd_idx] = cpu_affinity;
           thrd->num_work_domains = 0;
           thrd->alt_work_idx = 0;
           thrd->job_counter = thrd->yield_counter = 0;
@@ -1787,6 +2021,11 @@ bool
           kd_thread_flags thrd_flag = ((kd_thread_flags) 1) << thrd_idx;
           thrd->thread_domain->num_member_threads++;
           thrd->thread_domain->member_threads |= thrd_flag;
+          if (thrd->numa_node >= 0)
+            for (domain=group->domain_list; domain != NULL;
+                 domain=domain->next)
+              if (domain->numa_node == thrd->numa_node)
+                domain->node_threads |= thrd_flag;
           if (seq != NULL)
             {
               thrd->work_domains[thrd->num_work_domains++]=seq->add_consumer();
@@ -1808,6 +2047,10 @@ bool
               group->num_threads--;
               thrd->thread_domain->num_member_threads--;
               thrd->thread_domain->member_threads &= ~thrd_flag;
+              for (domain=group->domain_list; domain != NULL;
+                   domain=domain->next)
+                domain->node_threads &= ~thrd_flag;
+              group->thread_affinity[thrd_idx] = 0;
 
               // Remove domain sequence references from the thread
               while (thrd->num_work_domains > 0)
@@ -1873,6 +2116,35 @@ void
     group->threads[t]->yield_freq = worker_yield_freq;
 }
 
+/*****************************************************************************/
+/*                      kdu_thread_entity::start_trace                       */
+/*****************************************************************************/
+
+bool
+  kdu_thread_entity::start_trace(int max_events_per_thread)
+{
+  if (!exists())
+    return false;
+  assert(is_group_owner() && check_current_thread());
+  lock_group_mutex(); // Keeps `add_thread' out while the rings are set up
+  group->tracer.start(max_events_per_thread,group->num_threads);
+  unlock_group_mutex();
+  return true;
+}
+
+/*****************************************************************************/
+/*                      kdu_thread_entity::write_trace                       */
+/*****************************************************************************/
+
+bool
+  kdu_thread_entity::write_trace(const char *fname)
+{
+  if (!exists())
+    return false;
+  assert(is_group_owner() && check_current_thread());
+  return group->tracer.write(fname,group);
+}
+
 /*****************************************************************************/
 /*                kdu_thread_entity::get_job_count_stats                     */
 /*****************************************************************************/
@@ -1949,6 +2221,9 @@ bool
     queue->sequence_idx = super_queue->sequence_idx;
   queue->domain_sequence = NULL;  // These values may be changed later
   queue->last_domain_name = domain_name;
+  queue->attached_numa_node = queue->numa_node;
+  if ((queue->attached_numa_node < 0) && (super_queue != NULL))
+    queue->attached_numa_node = super_queue->attached_numa_node;
   queue->registered_max_jobs = 0; // if all goes according to plan.
   queue->completion_state.set(0);
   queue->completion_waiter = NULL;
@@ -1958,7 +2233,7 @@ bool
   kd_thread_domain *domain=NULL;
   if (max_jobs > 0)
     { 
-      domain = group->get_domain(domain_name);
+      domain = group->get_domain(domain_name,queue->attached_numa_node);
       queue->last_domain_name = domain->name;
       if (queue_flags & KDU_THREAD_QUEUE_BACKGROUND)
         domain->set_background_domain(queue_flags);
@@ -2058,7 +2333,16 @@ void
     { 
       assert(cond->thread_idx == this->thread_idx);
       cond->debug_text = debug_text;
-      process_jobs(cond);
+      if (group->tracer.is_active())
+        { 
+          kdu_long start = group->tracer.get_time();
+          process_jobs(cond);
+          group->tracer.add_event(thread_idx,KD_TRACE_WAIT,
+                                  (debug_text==NULL)?"wait":debug_text,
+                                  start,group->tracer.get_time(),0);
+        }
+      else
+        process_jobs(cond);
       if (grouperr->failed)
         {
           lock_group_mutex();
@@ -2299,7 +2583,16 @@ bool
             if (!local_cond->signalled)
               { 
                 local_cond->debug_text = "join/terminate";
-                process_jobs(local_cond);
+                if (group->tracer.is_active())
+                  { 
+                    kdu_long start = group->tracer.get_time();
+                    process_jobs(local_cond);
+                    group->tracer.add_event(thread_idx,KD_TRACE_WAIT,
+                                            local_cond->debug_text,
+                                            start,group->tracer.get_time(),0);
+                  }
+                else
+                  process_jobs(local_cond);
               }
             lock_group_mutex();
             assert(queue->completion_waiter == NULL);
@@ -2461,6 +2754,28 @@ void
       // current one.
       int next_iteration=0;
       int d_next, d=(is_default)?alt_work_idx:0;
+      bool node_job=false; // If job comes from our own NUMA node's domains
+      for (int nd=0; (numa_node >= 0) && (job == NULL) &&
+           (nd < KDU_MAX_DOMAINS) && ((seq=work_domains[nd]) != NULL); nd++)
+        { // Look first in the domains which hold our own node's jobs
+          if ((seq->domain->numa_node != numa_node) ||
+              ((cond != NULL) && seq->domain->background))
+            continue; // Background jobs are left to the full search below
+          if ((job = seq->get_job(this->hzp)) == KD_JOB_TERMINATOR)
+            { // Advance to next domain sequence
+              job = NULL;
+              kd_thread_domain *domain = seq->domain;
+              assert(seq->next != NULL);
+              work_domains[nd] = seq->next->add_consumer();
+              if (seq->remove_consumer())
+                { 
+                  lock_group_mutex();
+                  domain->remove_unused_sequences();
+                  unlock_group_mutex();
+                }
+            }
+          node_job = (job != NULL);
+        }
       for (; (next_iteration < 2) && (job == NULL); d=d_next)
         { 
           bool consider_next_seq = (next_iteration > 0);
@@ -2587,7 +2902,7 @@ void
         }
       
       // If we get here, we have a job to perform
-      if ((d != 0) || !is_default)
+      if (((d != 0) || !is_default) && !node_job)
         { // The job does not come from the thread's preferred work domain
           alt_work_idx = d+1;
           if ((alt_work_idx >= KDU_MAX_DOMAINS) ||
@@ -2605,7 +2920,19 @@ void
                                       seq->trace_get.exchange_add(1),
                                       seq->trace_add.get());
 #endif // KDU_THREAD_TRACE_RECORDS
-        job->do_job(this);
+        if (group->tracer.is_active())
+          { // Capture everything we need before the job can complete its
+            // queue, which might then be cleaned up.
+            const char *job_name =
+              kd_trace_job_name(job->trace_queue,seq->domain);
+            int seq_idx = (int) seq->sequence_idx;
+            kdu_long start = group->tracer.get_time();
+            job->do_job(this);
+            group->tracer.add_event(thread_idx,KD_TRACE_JOB,job_name,start,
+                                    group->tracer.get_time(),seq_idx);
+          }
+        else
+          job->do_job(this);
         assert((this->group != NULL) &&
                (this->grouperr == &group->grouperr) &&
                (this == group->threads[thread_idx]) &&
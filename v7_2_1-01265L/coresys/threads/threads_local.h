@@ -63,6 +63,7 @@ struct kd_thread_domain_sequence;
 struct kd_thread_domain;
 struct kd_thread_group;
 class kd_thread_trace; // This object is used only if thread tracing is enabled
+class kd_thread_tracer;
 
 // The following macros identify the structure of the
 // `kdu_thread_queue::completion_state' member.
@@ -77,7 +78,8 @@ class kd_thread_trace; // This object is used only if thread tracing is enabled
 // Defining the following macro enables recording of thread activity, a record
 // of which is printed to stdout when `kdu_thread_entity::destroy' is invoked
 // on a created multi-processing environment.  The macro supplies the
-// maximum number of entries to record.
+// maximum number of entries to record.  Tracing that needs no rebuild is
+// offered by `kdu_thread_entity::start_trace' (see `kd_thread_tracer').
 //#define KDU_THREAD_TRACE_RECORDS 10000000
 
 // The following definitions facilitate the implementation of Kakadu's
@@ -456,11 +458,13 @@ struct kd_thread_domain_sequence {
 
 struct kd_thread_domain {
   public: // Member functions
-    kd_thread_domain(const char *domain_name, kd_thread_group *grp)
+    kd_thread_domain(const char *domain_name, kd_thread_group *grp,
+                     int node=-1)
       { 
-        this->group=grp;  next = NULL; name = NULL;
+        this->group=grp;  next = NULL; name = NULL; numa_node = node;
         background=false; safe_context=false;
         num_member_threads=0; member_threads = (kd_thread_flags) 0;
+        node_threads = (kd_thread_flags) 0;
         sequence_head = sequence_tail = free_sequences = NULL;
         if ((domain_name != NULL) && (*domain_name != '\0'))
           { 
@@ -483,14 +487,16 @@ struct kd_thread_domain {
         if (queue_flags & KDU_THREAD_QUEUE_SAFE_CONTEXT)
           this->safe_context = true;
       }
-    bool check_match(const char *ref_name)
+    bool check_match(const char *ref_name, int node=-1)
       { 
+        if (node != numa_node)
+          return false;
         if ((ref_name == NULL) || (*ref_name == '\0'))
           return (name == NULL);
         else
           return ((name != NULL) && (strcmp(name,ref_name) == 0));
       }
-    bool is_default() { return (name == NULL); }
+    bool is_default() { return (name == NULL) && (numa_node < 0); }
     kd_thread_domain_sequence *add_domain_sequence(kdu_long sequence_idx,
                                                    kdu_thread_entity *caller);
       /* This function is always called from a context in which the group
@@ -568,6 +574,8 @@ struct kd_thread_domain {
     bool safe_context; // For thread domains that perform safe-context jobs
     int num_member_threads; // Num threads that prefer to work in this domain
     kd_thread_flags member_threads; // Set bits represent the threads
+    int numa_node; // -1 unless the domain holds the jobs of one NUMA node
+    kd_thread_flags node_threads; // Threads whose `numa_node' matches
     kd_thread_domain_sequence *sequence_head; // See below
     kd_thread_domain_sequence *sequence_tail;
     kd_thread_domain_sequence *free_sequences; // Recycled domain sequences
@@ -579,6 +587,10 @@ struct kd_thread_domain {
      first time, it is added to every thread's `work_domains' array.  The
      `sequence_tail' member points to the last element of the sequence list
      headed by `sequence_head'.
+        Queues attached with a NUMA node (see
+     `kdu_thread_queue::set_numa_node') go to a separate domain for each
+     node, having the same `name'; the threads of that node look in such
+     domains first and are the first to be woken for their jobs.
   */
 
 /*****************************************************************************/
@@ -658,6 +670,95 @@ class kd_thread_trace {
     kd_thread_trace_entry *entries;
   };
 
+/*****************************************************************************/
+/*                             kd_thread_tracer                              */
+/*****************************************************************************/
+
+// The following values identify `kd_thread_trace_event::type'
+#define KD_TRACE_JOB      0 // Execution of a job
+#define KD_TRACE_WAIT     1 // Time spent in `wait_for_condition'
+#define KD_TRACE_IDLE     2 // Time spent waiting on the thread's semaphore
+#define KD_TRACE_SCHEDULE 3 // Jobs scheduled (`start'=`end')
+
+struct kd_thread_trace_event {
+    kdu_long start, end; // Nanoseconds since `kd_thread_tracer::start'
+    const char *name; // Queue or domain name, or wait condition text
+    kdu_int32 type; // One of the `KD_TRACE_...' values
+    kdu_int32 arg; // Domain sequence index for jobs; job count for schedule
+  };
+
+struct kd_thread_trace_ring {
+    kd_thread_trace_event *events; // Holds `mask'+1 events
+    kdu_long mask;
+    kdu_long count; // Events ever written, only by the owning thread
+    kdu_byte _trailer[KDU_MAX_L2_CACHE_LINE]; // Keeps threads' counts apart
+  };
+
+class kd_thread_tracer {
+  public: // Member functions
+    kd_thread_tracer()
+      {
+        active.set(0); capacity = 0; origin = 0; fname = NULL;
+        memset(rings,0,sizeof(kd_thread_trace_ring)*KDU_MAX_THREADS);
+      }
+    ~kd_thread_tracer()
+      {
+        for (int n=0; n < KDU_MAX_THREADS; n++)
+          if (rings[n].events != NULL)
+            delete[] rings[n].events;
+        if (fname != NULL)
+          delete[] fname;
+      }
+    bool is_active() const { return (active.get() != 0); }
+    void start(int max_events, int num_threads);
+      /* Allocates (or empties) the ring buffers of the first `num_threads'
+         threads, with capacity `max_events' rounded up to a power of 2,
+         resets the time origin and activates tracing. */
+    void stop() { active.set(0); }
+    void add_thread(int thread_idx)
+      { // Called as a thread joins the group, before it can do any work
+        if (is_active() && (rings[thread_idx].events == NULL))
+          init_ring(rings+thread_idx);
+      }
+    kdu_long get_time();
+      /* Returns nanoseconds since the last call to `start'. */
+    void add_event(int thread_idx, int type, const char *name,
+                   kdu_long start, kdu_long end, int arg)
+      { /* Called only by the thread with index `thread_idx', so the ring
+           needs no synchronization. */
+        kd_thread_trace_ring *ring = rings + thread_idx;
+        if ((ring->events == NULL) || !is_active())
+          return;
+        kd_thread_trace_event *ev = ring->events + (ring->count & ring->mask);
+        ev->start = start;  ev->end = end;  ev->name = name;
+        ev->type = type;  ev->arg = arg;
+        ring->count++;
+      }
+    bool write(const char *fname, kd_thread_group *group);
+      /* Stops tracing and writes the retained events of every thread as
+         Chrome trace-event JSON, returning false if nothing was traced or
+         the file could not be opened. */
+  private: // Helper functions
+    void init_ring(kd_thread_trace_ring *ring);
+  public: // Data
+    char *fname; // Set from "KDU_THREAD_TRACE"; `destroy' writes the trace
+  private: // Data
+    kdu_interlocked_int32 active;
+    int capacity; // Power of 2
+    kdu_long origin; // Absolute time of the last `start' call
+    kd_thread_trace_ring rings[KDU_MAX_THREADS];
+  };
+  /* Notes:
+        This object implements the runtime thread activity tracing offered
+     by `kdu_thread_entity::start_trace' and `kdu_thread_entity::write_trace'.
+     Unlike `kd_thread_trace', which exists only if `KDU_THREAD_TRACE_RECORDS'
+     is defined and shares a single interlocked entry counter between all
+     threads, each thread writes complete events (with both start and end
+     times) into a ring buffer of its own, so that nothing is shared between
+     threads while tracing and a wrapped ring never leaves an unmatched
+     begin or end event behind.  Rings are only read by `write', which must
+     be called while no jobs are running. */
+
 /*****************************************************************************/
 /*                              kd_thread_group                              */
 /*****************************************************************************/
@@ -666,11 +767,13 @@ struct kd_thread_group {
   public: // Data
     kd_thread_group();
     ~kd_thread_group();
-    kd_thread_domain *get_domain(const char *domain_name);
+    kd_thread_domain *get_domain(const char *domain_name, int node=-1);
       /* This function must be called from a context in which the group
          mutex is locked (unless the thread group is just being created).
          The function searches for a domain whose name matches `domain_name'
-         (may be NULL or an empty string for the default domain).  If the
+         (may be NULL or an empty string for the default domain) and
+         `node' (-1 unless the domain is to hold the jobs of queues which
+         were attached with a NUMA node).  If the
          domain does not exist, it is created.  Newly created domains are
          not initially assigned any `kd_thread_domain_sequence' object --
          that is done by `kd_thread_domain::get_initial_domain_sequence' or
@@ -680,7 +783,8 @@ struct kd_thread_group {
       { // Wake up to `num' threads from the idle pool, based upon the
         // preferences associated with `domain' (if non-NULL).
         if (!idle_pool.test((kd_thread_flags)(-1))) return;
-        kd_thread_flags members = (domain!=NULL)?(domain->member_threads):0;
+        kd_thread_flags members = (domain==NULL)?0:
+          (domain->member_threads | domain->node_threads);
         kd_thread_flags non_waiting = non_waiting_worker_flags.get();
         kd_thread_flags non_waiting_members = members & non_waiting;
         kd_thread_flags all = (kd_thread_flags) -1;
@@ -710,7 +814,15 @@ struct kd_thread_group {
 #ifdef KDU_THREAD_TRACE_RECORDS
         thread_trace.add_entry(idx,NULL,1,0,0); // State=1, idle=0
 #endif
-        thread_semaphores[idx].wait();
+        if (tracer.is_active())
+          { 
+            kdu_long start = tracer.get_time();
+            thread_semaphores[idx].wait();
+            tracer.add_event(idx,KD_TRACE_IDLE,"idle",
+                             start,tracer.get_time(),0);
+          }
+        else
+          thread_semaphores[idx].wait();
 #ifdef KDU_THREAD_TRACE_RECORDS
         thread_trace.add_entry(idx,NULL,1,1,0); // State=1, wake=1
 #endif
@@ -818,6 +930,7 @@ struct kd_thread_group {
     kdu_byte _leadin[KDU_MAX_L2_CACHE_LINE];
   public: // Threads and their properties
     kdu_long cpu_affinity; // Provided by `kdu_thread_entity::create'
+    kdu_long thread_affinity[KDU_MAX_THREADS]; // Overrides `cpu_affinity'
     int min_thread_concurrency;
     int num_threads; // All threads, regardless of domain
     int worker_thread_yield_freq; // Used by `add_thread'
@@ -832,6 +945,7 @@ struct kd_thread_group {
     kdu_thread_queue *top_queues; // Maintained to facilitate safe cleanup
     kdu_thread_context *contexts;
     kd_thread_trace thread_trace; // Initialized only if thread tracing enabled
+    kd_thread_tracer tracer; // See `kdu_thread_entity::start_trace'
   //---------------------------------------------------------------------------
   public: // Job palette resource management
     kd_palette_block *palette_blocks; // List holds all the job palette memory
@@ -0,0 +1,163 @@
+/*****************************************************************************/
+// File: avx2_dwt_local.cpp [scope = CORESYS/TRANSFORMS]
+// Version: Kakadu, V7.2.1 (SkuareView addition)
+// Last Revised: 19 October, 2026
+/*****************************************************************************/
+/******************************************************************************
+Description:
+   Provides AVX2/FMA implementations of the irreversible lifting steps for
+32-bit floating point samples, used by "x86_dwt_local.h" when `kdu_mmx_level'
+is at least 7.  As with "avx_colour_local.cpp", the code lives in a separate
+file so that the compiler can be instructed to use vex-prefixed instructions
+exclusively (here, `-mavx2 -mfma'), which avoids processor state transition
+costs.  There is no harm in including this source file with all builds, so
+long as you globally define the `KDU_NO_AVX2' compilation directive where
+the compiler does not support AVX2.
+   Each function writes exactly the samples written by the corresponding
+SSE function in "x86_dwt_local.h" -- i.e., the width is rounded up to a
+multiple of 4, not 8 -- so that the two can be used interchangeably.  The
+SSE functions need only 16-byte alignment, so no more is assumed here and
+all accesses are unaligned.  The lifting coefficients are passed in already
+negated for synthesis.
+******************************************************************************/
+#include "kdu_arch.h"
+
+#if ((!defined KDU_NO_AVX2) && (defined KDU_X86_INTRINSICS))
+
+#ifdef _MSC_VER
+#  include <intrin.h>
+#else
+#  include <immintrin.h>
+#endif // !_MSC_VER
+
+/* ========================================================================= */
+/*                         Now for the SIMD functions                        */
+/* ========================================================================= */
+
+/*****************************************************************************/
+/* EXTERN                    avx2_2tap_h_irrev32                             */
+/*****************************************************************************/
+
+void avx2_2tap_h_irrev32(float *src, float *dst, int samples,
+                         float lambda0, float lambda1)
+{
+  int quads = (samples+3)>>2;
+  __m256 vec_lambda0 = _mm256_set1_ps(lambda0);
+  __m256 vec_lambda1 = _mm256_set1_ps(lambda1);
+  for (; quads >= 2; quads-=2, src+=8, dst+=8)
+    {
+      __m256 acc = _mm256_mul_ps(_mm256_loadu_ps(src),vec_lambda0);
+      acc = _mm256_fmadd_ps(_mm256_loadu_ps(src+1),vec_lambda1,acc);
+      _mm256_storeu_ps(dst,_mm256_add_ps(_mm256_loadu_ps(dst),acc));
+    }
+  if (quads > 0)
+    { // Last 1-4 samples
+      __m128 acc = _mm_mul_ps(_mm_loadu_ps(src),
+                              _mm256_castps256_ps128(vec_lambda0));
+      acc = _mm_fmadd_ps(_mm_loadu_ps(src+1),
+                         _mm256_castps256_ps128(vec_lambda1),acc);
+      _mm_storeu_ps(dst,_mm_add_ps(_mm_loadu_ps(dst),acc));
+    }
+}
+
+/*****************************************************************************/
+/* EXTERN                    avx2_4tap_h_irrev32                             */
+/*****************************************************************************/
+
+void avx2_4tap_h_irrev32(float *src, float *dst, int samples,
+                         float lambda0, float lambda1, float lambda2,
+                         float lambda3)
+{
+  int quads = (samples+3)>>2;
+  __m256 vec_lambda0 = _mm256_set1_ps(lambda0);
+  __m256 vec_lambda1 = _mm256_set1_ps(lambda1);
+  __m256 vec_lambda2 = _mm256_set1_ps(lambda2);
+  __m256 vec_lambda3 = _mm256_set1_ps(lambda3);
+  for (; quads >= 2; quads-=2, src+=8, dst+=8)
+    {
+      __m256 acc = _mm256_mul_ps(_mm256_loadu_ps(src),vec_lambda0);
+      acc = _mm256_fmadd_ps(_mm256_loadu_ps(src+1),vec_lambda1,acc);
+      acc = _mm256_fmadd_ps(_mm256_loadu_ps(src+2),vec_lambda2,acc);
+      acc = _mm256_fmadd_ps(_mm256_loadu_ps(src+3),vec_lambda3,acc);
+      _mm256_storeu_ps(dst,_mm256_add_ps(_mm256_loadu_ps(dst),acc));
+    }
+  if (quads > 0)
+    { // Last 1-4 samples
+      __m128 acc = _mm_mul_ps(_mm_loadu_ps(src),
+                              _mm256_castps256_ps128(vec_lambda0));
+      acc = _mm_fmadd_ps(_mm_loadu_ps(src+1),
+                         _mm256_castps256_ps128(vec_lambda1),acc);
+      acc = _mm_fmadd_ps(_mm_loadu_ps(src+2),
+                         _mm256_castps256_ps128(vec_lambda2),acc);
+      acc = _mm_fmadd_ps(_mm_loadu_ps(src+3),
+                         _mm256_castps256_ps128(vec_lambda3),acc);
+      _mm_storeu_ps(dst,_mm_add_ps(_mm_loadu_ps(dst),acc));
+    }
+}
+
+/*****************************************************************************/
+/* EXTERN                    avx2_2tap_v_irrev32                             */
+/*****************************************************************************/
+
+void avx2_2tap_v_irrev32(float *src0, float *src1, float *dst_in,
+                         float *dst_out, int samples,
+                         float lambda0, float lambda1)
+{
+  int quads = (samples+3)>>2;
+  __m256 vec_lambda0 = _mm256_set1_ps(lambda0);
+  __m256 vec_lambda1 = _mm256_set1_ps(lambda1);
+  int c=0;
+  for (; quads >= 2; quads-=2, c+=8)
+    {
+      __m256 acc = _mm256_mul_ps(_mm256_loadu_ps(src0+c),vec_lambda0);
+      acc = _mm256_fmadd_ps(_mm256_loadu_ps(src1+c),vec_lambda1,acc);
+      _mm256_storeu_ps(dst_out+c,_mm256_add_ps(_mm256_loadu_ps(dst_in+c),acc));
+    }
+  if (quads > 0)
+    { // Last 1-4 samples
+      __m128 acc = _mm_mul_ps(_mm_loadu_ps(src0+c),
+                              _mm256_castps256_ps128(vec_lambda0));
+      acc = _mm_fmadd_ps(_mm_loadu_ps(src1+c),
+                         _mm256_castps256_ps128(vec_lambda1),acc);
+      _mm_storeu_ps(dst_out+c,_mm_add_ps(_mm_loadu_ps(dst_in+c),acc));
+    }
+}
+
+/*****************************************************************************/
+/* EXTERN                    avx2_4tap_v_irrev32                             */
+/*****************************************************************************/
+
+void avx2_4tap_v_irrev32(float *src0, float *src1, float *src2, float *src3,
+                         float *dst_in, float *dst_out, int samples,
+                         float lambda0, float lambda1, float lambda2,
+                         float lambda3)
+{
+  int quads = (samples+3)>>2;
+  __m256 vec_lambda0 = _mm256_set1_ps(lambda0);
+  __m256 vec_lambda1 = _mm256_set1_ps(lambda1);
+  __m256 vec_lambda2 = _mm256_set1_ps(lambda2);
+  __m256 vec_lambda3 = _mm256_set1_ps(lambda3);
+  int c=0;
+  for (; quads >= 2; quads-=2, c+=8)
+    {
+      __m256 acc = _mm256_mul_ps(_mm256_loadu_ps(src0+c),vec_lambda0);
+      acc = _mm256_fmadd_ps(_mm256_loadu_ps(src1+c),vec_lambda1,acc);
+      acc = _mm256_fmadd_ps(_mm256_loadu_ps(src2+c),vec_lambda2,acc);
+      acc = _mm256_fmadd_ps(_mm256_loadu_ps(src3+c),vec_lambda3,acc);
+      _mm256_storeu_ps(dst_out+c,_mm256_add_ps(_mm256_loadu_ps(dst_in+c),acc));
+    }
+  if (quads > 0)
+    { // Last 1-4 samples
+      __m128 acc = _mm_mul_ps(_mm_loadu_ps(src0+c),
+                              _mm256_castps256_ps128(vec_lambda0));
+      acc = _mm_fmadd_ps(_mm_loadu_ps(src1+c),
+                         _mm256_castps256_ps128(vec_lambda1),acc);
+      acc = _mm_fmadd_ps(_mm_loadu_ps(src2+c),
+                         _mm256_castps256_ps128(vec_lambda2),acc);
+      acc = _mm_fmadd_ps(_mm_loadu_ps(src3+c),
+                         _mm256_castps256_ps128(vec_lambda3),acc);
+      _mm_storeu_ps(dst_out+c,_mm_add_ps(_mm_loadu_ps(dst_in+c),acc));
+    }
+}
+
+#endif // !KDU_NO_AVX2
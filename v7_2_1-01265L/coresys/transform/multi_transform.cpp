@@ -1317,6 +1317,7 @@ void
       comp->rows_left_in_component = dims.size.y;
       comp->tmp_buffer =
         new kdu_line_buf[comp->num_stripes*comp->max_stripe_rows];
+      comp->queue.set_trace_name("component DWT");
       if ((env != NULL) &&
           !env->attach_queue(&(comp->queue),env_queue,
                              (comp->num_stripes==1)?NULL:
@@ -1782,6 +1782,18 @@ static inline bool
 /*                  MMX/SSE functions for 32-bit samples                     */
 /* ========================================================================= */
 
+#ifndef KDU_NO_AVX2
+// AVX2/FMA versions of the irreversible functions below, selected when
+// `kdu_mmx_level' is at least 7; they are in "avx2_dwt_local.cpp".
+extern void avx2_2tap_h_irrev32(float *, float *, int, float, float);
+extern void avx2_4tap_h_irrev32(float *, float *, int, float, float, float,
+                                float);
+extern void avx2_2tap_v_irrev32(float *, float *, float *, float *, int,
+                                float, float);
+extern void avx2_4tap_v_irrev32(float *, float *, float *, float *, float *,
+                                float *, int, float, float, float, float);
+#endif // !KDU_NO_AVX2
+
 /*****************************************************************************/
 /* INLINE                    simd_2tap_h_irrev32                             */
 /*****************************************************************************/
@@ -1804,6 +1816,16 @@ static inline bool
   int quad_bytes = ((samples+3) & ~3)<<2;
   float lambda0 = step->coeffs[0];
   float lambda1 = (step->support_length==2)?(step->coeffs[1]):0.0F;
+#ifndef KDU_NO_AVX2
+  if (kdu_mmx_level >= 7)
+    { // 256-bit implementation, using AVX2 and FMA instructions
+      if (synthesis)
+        avx2_2tap_h_irrev32(src,dst,samples,-lambda0,-lambda1);
+      else
+        avx2_2tap_h_irrev32(src,dst,samples,lambda0,lambda1);
+      return true;
+    }
+#endif // !KDU_NO_AVX2
   register __m128 *dp = (__m128 *) dst; // Always aligned
   register __m128 *dp_lim = (__m128 *)(((kdu_byte *) dp)+quad_bytes);
   __m128 val0=_mm_loadu_ps(src); // Pre-load first operand
@@ -1851,6 +1873,17 @@ static inline bool
   float lambda1 = step->coeffs[1];
   float lambda2 = step->coeffs[2];
   float lambda3 = (step->support_length==4)?(step->coeffs[3]):0.0F;
+#ifndef KDU_NO_AVX2
+  if (kdu_mmx_level >= 7)
+    { // 256-bit implementation, using AVX2 and FMA instructions
+      if (synthesis)
+        avx2_4tap_h_irrev32(src,dst,samples,-lambda0,-lambda1,-lambda2,
+                            -lambda3);
+      else
+        avx2_4tap_h_irrev32(src,dst,samples,lambda0,lambda1,lambda2,lambda3);
+      return true;
+    }
+#endif // !KDU_NO_AVX2
   register __m128 *dp = (__m128 *) dst; // Always aligned
   register __m128 *dp_lim = (__m128 *)(((kdu_byte *) dp)+quad_bytes);
   __m128 val0=_mm_loadu_ps(src); // Pre-load first operand
@@ -1904,6 +1937,18 @@ static inline bool
     return false;
   float lambda0 = step->coeffs[0];
   float lambda1 = (step->support_length==2)?(step->coeffs[1]):0.0F;
+#ifndef KDU_NO_AVX2
+  if (kdu_mmx_level >= 7)
+    { // 256-bit implementation, using AVX2 and FMA instructions
+      if (synthesis)
+        avx2_2tap_v_irrev32(src0,src1,dst_in,dst_out,samples,
+                            -lambda0,-lambda1);
+      else
+        avx2_2tap_v_irrev32(src0,src1,dst_in,dst_out,samples,
+                            lambda0,lambda1);
+      return true;
+    }
+#endif // !KDU_NO_AVX2
   __m128 *sp0 = (__m128 *) src0;
   __m128 *sp1 = (__m128 *) src1;
   __m128 *dp_in = (__m128 *) dst_in;
@@ -1953,6 +1998,18 @@ static inline bool
   float lambda1 = step->coeffs[1];
   float lambda2 = step->coeffs[2];
   float lambda3 = (step->support_length==4)?(step->coeffs[3]):0.0F;
+#ifndef KDU_NO_AVX2
+  if (kdu_mmx_level >= 7)
+    { // 256-bit implementation, using AVX2 and FMA instructions
+      if (synthesis)
+        avx2_4tap_v_irrev32(src0,src1,src2,src3,dst_in,dst_out,samples,
+                            -lambda0,-lambda1,-lambda2,-lambda3);
+      else
+        avx2_4tap_v_irrev32(src0,src1,src2,src3,dst_in,dst_out,samples,
+                            lambda0,lambda1,lambda2,lambda3);
+      return true;
+    }
+#endif // !KDU_NO_AVX2
   __m128 *sp0 = (__m128 *) src0;
   __m128 *sp1 = (__m128 *) src1;
   __m128 *sp2 = (__m128 *) src2;